@@ -0,0 +1,169 @@
+/*
+ * Output throughput of .ass Dialogue lines: the old snprintf()/fprintf() per tag and line,
+ * against the outbuf formatters with one write() per flush.
+ *
+ *   make bench && ./bench/outbuf_bench [lines] [output file]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../src/outbuf.h"
+
+struct line {
+    int64_t start_ms, end_ms;
+    int x, y;
+    uint32_t color;
+    float scale_x, spacing;
+    int fs;
+    bool bold;
+    const char *text[12];
+};
+
+static const char *chars[] = { "あ", "い", "う", "え", "お", "か", "き", "く", "漢", "字", "A", "1" };
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* What ass.c did before: a float through "%.02f" with the zeros trimmed */
+static int old_float(char *out, size_t size, float f)
+{
+    int w = snprintf(out, size, "%.02f", f);
+    while (out[w - 1] == '0')
+        w--;
+    if (out[w - 1] == '.')
+        w--;
+    out[w] = '\0';
+    return w;
+}
+
+static void old_time(int64_t t, char out[32])
+{
+    int64_t h = t / 3600000, m = t / 60000 % 60, s = t / 1000 % 60, cs = t % 1000 / 10;
+    snprintf(out, 32, "%"PRId64":%02"PRId64":%02"PRId64".%02"PRId64, h, m, s, cs);
+}
+
+static void write_old(FILE *f, const struct line *lines, int count)
+{
+    for (int i = 0; i < count; i++) {
+        const struct line *l = &lines[i];
+        char text[16 * 1024], start[32], end[32], fbuf[2][32];
+        int w;
+
+        old_time(l->start_ms, start);
+        old_time(l->end_ms, end);
+        w = snprintf(text, sizeof(text), "{\\pos(%d,%d)", l->x, l->y);
+        w += snprintf(&text[w], sizeof(text) - w, "\\c&H%02X%02X%02X&\\1a&H%02X",
+                l->color & 0xff, l->color >> 8 & 0xff, l->color >> 16 & 0xff, 0);
+        old_float(fbuf[0], sizeof(fbuf[0]), l->scale_x * 100);
+        old_float(fbuf[1], sizeof(fbuf[1]), l->spacing);
+        w += snprintf(&text[w], sizeof(text) - w, "\\fscx%s", fbuf[0]);
+        w += snprintf(&text[w], sizeof(text) - w, "\\fsp%s", fbuf[1]);
+        w += snprintf(&text[w], sizeof(text) - w, "\\fs%u", l->fs);
+        w += snprintf(&text[w], sizeof(text) - w, "\\b%d}", l->bold);
+        for (int c = 0; c < 12; c++)
+            w += snprintf(&text[w], sizeof(text) - w, "%s", l->text[c]);
+        fprintf(f, "Dialogue: %d,%s,%s,Default,,0000,0000,0000,,%s\n", 0, start, end, text);
+    }
+    fflush(f);
+}
+
+/* Returns the bytes written, ftell() doesn't know them for /dev/null */
+static size_t write_new(struct outbuf *ob, const struct line *lines, int count)
+{
+    size_t bytes = 0;
+
+    for (int i = 0; i < count; i++) {
+        const struct line *l = &lines[i];
+
+        outbuf_puts(ob, "Dialogue: 0,");
+        outbuf_time(ob, l->start_ms, 1, '.', 2);
+        outbuf_putc(ob, ',');
+        outbuf_time(ob, l->end_ms, 1, '.', 2);
+        outbuf_puts(ob, ",Default,,0000,0000,0000,,{\\pos(");
+        outbuf_int(ob, l->x, 0);
+        outbuf_putc(ob, ',');
+        outbuf_int(ob, l->y, 0);
+        outbuf_puts(ob, ")\\c&H");
+        outbuf_hex(ob, l->color & 0xff, 2, false);
+        outbuf_hex(ob, l->color >> 8 & 0xff, 2, false);
+        outbuf_hex(ob, l->color >> 16 & 0xff, 2, false);
+        outbuf_puts(ob, "&\\1a&H00\\fscx");
+        outbuf_float2(ob, l->scale_x * 100);
+        outbuf_puts(ob, "\\fsp");
+        outbuf_float2(ob, l->spacing);
+        outbuf_puts(ob, "\\fs");
+        outbuf_int(ob, l->fs, 0);
+        outbuf_puts(ob, l->bold ? "\\b1}" : "\\b0}");
+        for (int c = 0; c < 12; c++)
+            outbuf_puts(ob, l->text[c]);
+        outbuf_putc(ob, '\n');
+        if (ob->len >= OUTBUF_FLUSH_SIZE) {
+            bytes += ob->len;
+            outbuf_flush(ob);
+        }
+    }
+    bytes += ob->len;
+    outbuf_flush(ob);
+    return bytes;
+}
+
+int main(int argc, char **argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 1000000;
+    const char *path = argc > 2 ? argv[2] : "/dev/null";
+    struct line *lines = calloc(count, sizeof(*lines));
+    unsigned seed = 1;
+    double t0, t_old, t_new;
+    size_t bytes;
+
+    for (int i = 0; i < count; i++) {
+        struct line *l = &lines[i];
+        seed = seed * 1103515245 + 12345;
+        *l = (struct line){
+            .start_ms = i * 1500LL, .end_ms = i * 1500LL + 1200 + seed % 800,
+            .x = seed % 960, .y = (seed >> 10) % 540,
+            .color = seed % 3 ? 0xffffff : 0x00ffff,
+            .scale_x = seed % 4 ? 1.0f : 0.5f, .spacing = (seed >> 5) % 100 / 4.0f,
+            .fs = seed % 5 ? 36 : 18, .bold = seed % 7 == 0,
+        };
+        for (int c = 0; c < 12; c++)
+            l->text[c] = chars[(seed >> c) % 12];
+    }
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+    t0 = now();
+    write_old(f, lines, count);
+    t_old = now() - t0;
+    fclose(f);
+
+    struct outbuf ob = { .fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) };
+    if (ob.fd < 0) {
+        perror(path);
+        return 1;
+    }
+    t0 = now();
+    bytes = write_new(&ob, lines, count);
+    t_new = now() - t0;
+    close(ob.fd);
+    outbuf_free(&ob);
+
+    printf("%d lines, %.1f MB\n", count, bytes / 1e6);
+    printf("snprintf + fprintf: %7.3f s  %8.1f MB/s\n", t_old, bytes / 1e6 / t_old);
+    printf("outbuf:             %7.3f s  %8.1f MB/s  (%.2fx)\n", t_new, bytes / 1e6 / t_new, t_old / t_new);
+    free(lines);
+    return 0;
+}
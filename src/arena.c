@@ -0,0 +1,111 @@
+#include "arena.h"
+
+#include <assert.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size, used;
+    alignas(max_align_t) unsigned char data[];
+};
+
+#define ARENA_ALIGN(n) (((n) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1))
+
+static struct arena_block *arena_block_new(size_t size)
+{
+    struct arena_block *b = malloc(sizeof(*b) + size);
+    assert(b);
+    b->next = NULL;
+    b->size = size;
+    b->used = 0;
+    return b;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    size_t block_size = a->block_size ? a->block_size : ARENA_DEFAULT_BLOCK_SIZE;
+    struct arena_block *b = a->head;
+    void *p;
+
+    size = ARENA_ALIGN(MAX(size, 1));
+    if (b == NULL || b->size - b->used < size) {
+        if (size > block_size / 4 && b != NULL) {
+            /* Big allocations get their own block behind the current one,
+             * so the rest of the current block is not wasted */
+            struct arena_block *big = arena_block_new(size);
+            big->used = size;
+            big->next = b->next;
+            b->next = big;
+            a->used += size;
+            return big->data;
+        }
+        b = arena_block_new(MAX(block_size, size));
+        b->next = a->head;
+        a->head = b;
+    }
+
+    p = &b->data[b->used];
+    b->used += size;
+    a->used += size;
+    return p;
+}
+
+void arena_reset(struct arena *a)
+{
+    size_t block_size = a->block_size ? a->block_size : ARENA_DEFAULT_BLOCK_SIZE;
+    struct arena_block *b = a->head, *keep = NULL;
+
+    /* Keep one normal sized block, and free the rest */
+    while (b) {
+        struct arena_block *next = b->next;
+        if (keep == NULL && b->size == block_size)
+            keep = b;
+        else
+            free(b);
+        b = next;
+    }
+    if (keep) {
+        keep->used = 0;
+        keep->next = NULL;
+    }
+    a->head = keep;
+    a->used = 0;
+}
+
+void arena_free(struct arena *a)
+{
+    struct arena_block *b = a->head;
+
+    while (b) {
+        struct arena_block *next = b->next;
+        free(b);
+        b = next;
+    }
+    a->head = NULL;
+    a->used = 0;
+}
+
+void *arena_arrgrowf(struct arena *ar, void *a, size_t elemsize, size_t min_cap)
+{
+    size_t cap = a ? stbds_header(a)->capacity : 0;
+    size_t len = a ? stbds_header(a)->length : 0;
+    stbds_array_header *h;
+
+    if (a && cap >= min_cap)
+        return a;
+
+    cap = MAX(MAX(min_cap, cap * 2), 4);
+    h = arena_alloc(ar, sizeof(*h) + elemsize * cap);
+    *h = (stbds_array_header){
+        .length = len,
+        .capacity = cap,
+    };
+    if (len)
+        memcpy(h + 1, a, elemsize * len);
+    return h + 1;
+}
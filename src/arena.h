@@ -0,0 +1,42 @@
+#ifndef ARIB2ASS_ARENA_H
+#define ARIB2ASS_ARENA_H
+#include <stddef.h>
+
+#include "stb_ds.h"
+
+/*
+ * Bump allocator for many small allocations with the same lifetime.
+ * Memory is taken from big blocks, and the pointers stay valid until
+ * arena_reset() or arena_free(). A zeroed struct arena is ready to use.
+ */
+struct arena {
+    struct arena_block *head;
+    /* Size of new blocks, 0 for ARENA_DEFAULT_BLOCK_SIZE */
+    size_t block_size;
+    /* Bytes given out since the last reset */
+    size_t used;
+};
+
+#define ARENA_DEFAULT_BLOCK_SIZE (256 * 1024)
+
+/* Returns memory aligned for any type. Never fails */
+void *arena_alloc(struct arena *a, size_t size);
+/* Free everything allocated, but keep the first block for reuse */
+void  arena_reset(struct arena *a);
+void  arena_free(struct arena *a);
+
+/*
+ * stb_ds arrays with their memory in an arena. They can be used with arrlen() and the other
+ * stb_ds macros that don't change the capacity, but must only be grown with these,
+ * and never freed with arrfree(). Growing leaves the old copy in the arena until it is reset.
+ */
+#define arena_arrsetcap(ar, a, n)    ((a) = arena_arrgrowf((ar), (a), sizeof(*(a)), (n)))
+#define arena_arrmaybegrow(ar, a, n) ((!(a) || stbds_header(a)->length + (n) > stbds_header(a)->capacity) \
+        ? (void)arena_arrsetcap((ar), (a), arrlenu(a) + (n)) : (void)0)
+#define arena_arrput(ar, a, v)       (arena_arrmaybegrow((ar), (a), 1), (a)[stbds_header(a)->length++] = (v))
+#define arena_arraddnptr(ar, a, n)   (arena_arrmaybegrow((ar), (a), (n)), stbds_header(a)->length += (n), \
+        &(a)[stbds_header(a)->length - (n)])
+
+void *arena_arrgrowf(struct arena *ar, void *a, size_t elemsize, size_t min_cap);
+
+#endif /* ARIB2ASS_ARENA_H */
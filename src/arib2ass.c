@@ -12,6 +12,8 @@
 #include "srt.h"
 #include "font.h"
 #include "ass.h"
+#include "webvtt.h"
+#include "writer.h"
 #include "error.h"
 #include "tsdecode.h"
 #include "subobj.h"
@@ -26,16 +28,24 @@ struct decode_ctx {
     float fsize;
 };
 
-enum output_type {
-    ASS,
-    SRT
+/* One output file of an input */
+struct output {
+    const struct writer_ops *ops;
+    const void *opts;
+    const pchar *path;
+    bool isdir;
+    /* Appended to the name of the input, when path is a directory */
+    pchar ext[64];
 };
 
 static enum error decode(AVPacket *packet, void *arg)
 {
     struct decode_ctx *c = arg;
-    float r = ((float)packet->pos) / c->fsize;
-    log_progress(LPS_UPDATE, &r);
+    /* Streams have no size */
+    if (c->fsize > 0) {
+        float r = ((float)packet->pos) / c->fsize;
+        log_progress(LPS_UPDATE, &r);
+    }
     return subobj_parse_from_packet(c->sctx, packet);
 }
 
@@ -68,27 +78,11 @@ static void setup_output_path(pchar path[256])
     *sep = PATHSPECC;
 }
 
-static void create_output_path(enum output_type ot, const pchar *input, pchar out[256])
+static void create_output_path(const struct output *o, const pchar *input, pchar out[256])
 {
     pchar buf[512];
-    const pchar *ext[] = {
-        [ASS] = PSTR(".ass"),
-        [SRT] = PSTR(".srt"),
-    };
-
-    bool isdir;
-    const pchar *outpath;
-    if (ot == ASS) {
-        isdir = opt_ass_output_dir;
-        outpath = opt_ass_output;
-    } else if (ot == SRT) {
-        isdir = opt_srt_output_dir;
-        outpath = opt_srt_output;
-    } else {
-        assert(false);
-        exit(1);
-        return;
-    }
+    const pchar *outpath = o->path;
+    bool isdir = o->isdir;
 
 #ifdef _WIN32
     pchar norm_outpath[512];
@@ -106,6 +100,9 @@ static void create_output_path(enum output_type ot, const pchar *input, pchar ou
         goto end;
     }
 
+    if (pstrcmp(input, PSTR("-")) == 0)
+        input = PSTR("stdin");
+
     size_t ilen = pstrlen(input);
     assert(ilen < 255);
     assert(ilen > 4);
@@ -115,6 +112,13 @@ static void create_output_path(enum output_type ot, const pchar *input, pchar ou
     pchar *bn = basename(buf);
     size_t blen = pstrlen(bn);
 
+    /* x.ts.a2ac is written to x.ass */
+    const pchar *cacheext = PESCACHE_EXT;
+    const size_t cacheextclen = pstrlen(cacheext);
+    if (blen > cacheextclen && memcmp(&bn[blen - cacheextclen], cacheext, cacheextclen * sizeof(*cacheext)) == 0) {
+        blen -= cacheextclen;
+    }
+
     const pchar *tsext = PSTR(".ts");
     const size_t tsextclen = pstrlen(tsext);
     if (memcmp(&bn[blen - tsextclen], tsext, tsextclen * sizeof(*tsext)) == 0) {
@@ -122,146 +126,334 @@ static void create_output_path(enum output_type ot, const pchar *input, pchar ou
     }
 
     mkdir_p(norm_outpath);
-    psnprintf(out, 256, PSTR("%s%c%.*s%s"), norm_outpath, PATHSPECC, (int)blen, bn, ext[ot]);
+    psnprintf(out, 256, PSTR("%s%c%.*s%s"), norm_outpath, PATHSPECC, (int)blen, bn, o->ext);
 end:
     return;
 }
 
-int fnmain(int argc, pchar **argv)
+/* Every requested output, each .ass profile is a separate one */
+static struct output stb_array *get_outputs(void)
+{
+    struct output stb_array *outs = NULL;
+    struct output o;
+
+    if (opt_ass_do) {
+        o = (struct output){ &ass_writer_ops, &opt_ass, opt_ass.output, opt_ass.output_dir, PSTR(".ass") };
+        arrput(outs, o);
+    }
+    for (intptr_t i = 0; i < arrlen(opt_ass_profiles); i++) {
+        const struct ass_profile *p = &opt_ass_profiles[i];
+
+        o = (struct output){ &ass_writer_ops, p, p->output, p->output_dir };
+        psnprintf(o.ext, sizeof(o.ext), PSTR(".%s.ass"), p->name);
+        arrput(outs, o);
+    }
+    if (opt_srt_do) {
+        o = (struct output){ &srt_writer_ops, NULL, opt_srt_output, opt_srt_output_dir, PSTR(".srt") };
+        arrput(outs, o);
+    }
+    if (opt_vtt_do) {
+        o = (struct output){ &vtt_writer_ops, NULL, opt_vtt_output, opt_vtt_output_dir, PSTR(".vtt") };
+        arrput(outs, o);
+    }
+    return outs;
+}
+
+/*
+ * Open a writer for every requested output.
+ * Their names are written into msg, for the progress messages
+ */
+static enum error open_writers(struct writer_set *ws, const pchar *input, pchar *msg, size_t msg_size)
+{
+    struct output stb_array *outs = get_outputs();
+    pchar outpath[256];
+    size_t msg_len = 0;
+    enum error err = NOERR;
+
+    msg[0] = PSTR('\0');
+    for (intptr_t i = 0; i < arrlen(outs); i++) {
+        create_output_path(&outs[i], input, outpath);
+        err = writer_set_add(ws, outs[i].ops, outs[i].opts, outpath);
+        if (err != NOERR) {
+            log_error("Failed to open %s file %s: %s\n", outs[i].ops->name, outpath, error_to_string(err));
+            break;
+        }
+        if (msg_len < msg_size)
+            msg_len += psnprintf(&msg[msg_len], (msg_size - msg_len) * sizeof(pchar), PSTR("%s%s"), msg_len ? PSTR(", ") : PSTR(""), outpath);
+    }
+    arrfree(outs);
+    return err;
+}
+
+static enum error stream_caption_finished(struct subobj *s, void *arg)
+{
+    return writer_set_caption(arg, s);
+}
+
+/* Write every caption as soon as its end time is known, and don't keep them in memory */
+static enum error process_stream(const pchar *input, struct tsdecode *tsd, struct subobj_ctx *sctx)
+{
+    struct writer_set ws = {0};
+    struct decode_ctx dctx = {
+        .sctx = sctx,
+        .fsize = 0,
+    };
+    pchar outpaths[1024];
+    enum error err;
+
+    err = open_writers(&ws, input, outpaths, ARRAY_COUNT(outpaths));
+    if (err != NOERR)
+        goto end;
+    err = writer_set_begin(&ws, NULL);
+    if (err != NOERR)
+        goto end;
+    log_user("Writing captions to %s\n", outpaths);
+
+    subobj_set_finished_cb(sctx, stream_caption_finished, &ws);
+    err = tsdecode_decode_packets(tsd, decode, &dctx);
+    if (err == NOERR)
+        err = subobj_flush(sctx);
+    if (err == NOERR)
+        err = writer_set_end(&ws);
+    subobj_log_stats(sctx);
+    log_user("End of stream %s\n", input);
+
+end:
+    writer_set_close(&ws);
+    return err;
+}
+
+/* All outputs are written from a single pass over the captions */
+static enum error write_outputs(const struct subobj_ctx *sctx, const pchar *input)
+{
+    static const pchar took_ms_fmt[] = PSTR("took %") PSTR2(PRIi64) PSTR(" ms");
+    struct writer_set ws = {0};
+    pchar outpaths[1024], mbuf[ARRAY_COUNT(outpaths) + 32], measure_str[32];
+    time_t measure_ms;
+    enum error err;
+
+    err = open_writers(&ws, input, outpaths, ARRAY_COUNT(outpaths));
+    if (err != NOERR || arrlen(ws.writers) == 0)
+        goto end;
+
+    psnprintf(mbuf, sizeof(mbuf), PSTR("Writing %s"), outpaths);
+    log_progress(LPS_BEGIN, mbuf);
+    MEASURE_START(outw);
+
+    /* The cores not used by the other files write the .ass profiles in parallel,
+     * and what is left of them for each profile loads its glyph widths */
+    err = writer_set_write_all(&ws, sctx, opt_file_cpus);
+
+    MEASURE_END(outw, measure_ms);
+    psnprintf(measure_str, sizeof(measure_str), took_ms_fmt, measure_ms);
+    log_progress(LPS_END, measure_str);
+
+end:
+    writer_set_close(&ws);
+    return err;
+}
+
+static enum error process_file(const pchar *input)
 {
     enum error err;
     struct tsdecode tsd = {0};
     struct subobj_ctx sctx = {0};
     struct decode_ctx dctx;
-    pchar outpath[256], mbuf[512], measure_str[32];
+    pchar measure_str[32];
     time_t measure_ms;
-    bool had_error = false;
 
-#ifdef __linux__
-    /* For wcrtomb */
-    char *lset = setlocale(LC_CTYPE, "C.utf8");
-    assert(lset && "Can't set UTF-8 locale");
-#elif defined(_WIN32)
-    (void)_setmode(_fileno(stdout), _O_U16TEXT);
-    (void)_setmode(_fileno(stderr), _O_U16TEXT);
-    _set_printf_count_output(1);
-#endif
+    log_user("Processing input file: %s\n", input);
 
-    err = opts_parse_cmdline(argc, argv);
-    if (err != NOERR) {
-        return 1;
-    }
+    static const pchar took_ms_fmt[] = PSTR("took %") PSTR2(PRIi64) PSTR(" ms");
+    log_progress(LPS_BEGIN, PSTR("Probing .ts file"));
+    MEASURE_START(probe);
 
-    if (arrlen(opt_input_files) <= 0) {
-        log_error("No input files to process!\n");
-        opts_free();
-        return 1;
-    }
+    err = tsdecode_open_file(input, &tsd);
 
-    font_init();
+    MEASURE_END(probe, measure_ms);
+    psnprintf(measure_str, sizeof(measure_str), took_ms_fmt, measure_ms);
+    log_progress(LPS_END, measure_str);
 
-    for (intptr_t i_i = 0; i_i < arrlen(opt_input_files); i_i++) {
-        const pchar *input = opt_input_files[i_i];
-        log_user("Processing input file: %s\n", input);
+    if (err != NOERR)
+        goto end_file;
 
-        err = tsdecode_open_file(input, &tsd);
-        if (err != NOERR) {
-            had_error = true;
-            goto end_file;
-        }
+    dctx = (struct decode_ctx){
+        .sctx = &sctx,
+        .fsize = (float)tsd.file_size,
+    };
 
-        dctx = (struct decode_ctx){
-            .sctx = &sctx,
-            .fsize = (float)tsd.file_size,
-        };
+    err = subobj_create(&sctx, &tsd);
+    if (err != NOERR)
+        goto end_file;
 
-        err = subobj_create(&sctx, &tsd);
-        if (err != NOERR) {
-            had_error = true;
-            goto end;
-        }
+    if (tsd.streaming) {
+        err = process_stream(input, &tsd, &sctx);
+        goto end;
+    }
 
-        static const pchar took_ms_fmt[] = PSTR("took %") PSTR2(PRIi64) PSTR(" ms");
-        log_progress(LPS_BEGIN, PSTR("Reading .ts file"));
-        MEASURE_START(tsdec);
+    log_progress(LPS_BEGIN, PSTR("Reading .ts file"));
+    MEASURE_START(tsdec);
 
-        err = tsdecode_decode_packets(&tsd, decode, &dctx);
+    err = tsdecode_decode_packets(&tsd, decode, &dctx);
 
-        MEASURE_END(tsdec, measure_ms);
-        psnprintf(measure_str, sizeof(measure_str), took_ms_fmt, measure_ms);
-        log_progress(LPS_END, measure_str);
+    MEASURE_END(tsdec, measure_ms);
+    psnprintf(measure_str, sizeof(measure_str), took_ms_fmt, measure_ms);
+    log_progress(LPS_END, measure_str);
 
-        if (err != NOERR) {
-            had_error = true;
-            goto end;
-        }
+    if (err != NOERR)
+        goto end;
+    subobj_log_stats(&sctx);
 
-        if (opt_dump_drcs) {
-            err = drcs_dump(&sctx);
-            if (err != NOERR) {
-                had_error = true;
-                goto end;
-            }
-        }
+    err = write_outputs(&sctx, input);
+end:
+    subobj_destroy(&sctx);
+end_file:
+    tsdecode_free(&tsd);
+    return err;
+}
 
-        if (opt_srt_do) {
-            create_output_path(SRT, input, outpath);
-            psnprintf(mbuf, sizeof(mbuf), PSTR("Writing .srt file to %s"), outpath);
+struct job {
+    const pchar *input;
+    int64_t size;
+};
 
-            log_progress(LPS_BEGIN, mbuf);
-            MEASURE_START(srtw);
+/* The input files shared by the worker threads */
+struct job_queue {
+    struct platform_mutex lock;
+    struct job stb_array *jobs;
+    intptr_t next;
+    bool had_error;
+};
 
-            err = srt_write(&sctx, outpath);
+static int job_cmp_size_desc(const void *a, const void *b)
+{
+    const struct job *ja = a, *jb = b;
+    return (ja->size < jb->size) - (ja->size > jb->size);
+}
 
-            MEASURE_END(srtw, measure_ms);
-            psnprintf(measure_str, sizeof(measure_str), took_ms_fmt, measure_ms);
-            log_progress(LPS_END, measure_str);
+static void worker(void *arg)
+{
+    struct job_queue *q = arg;
+    enum error err;
+    intptr_t i;
 
-            if (err != NOERR) {
-                log_error("Failed to generate srt file: %s\n", error_to_string(err));
-            }
-        }
+    font_init();
+    log_buffer_begin();
 
-        if (opt_srt_do && opt_ass_do) {
-            log_progress(LPS_BEGIN, PSTR("Resetting subobj"));
-            MEASURE_START(srtw);
+    for (;;) {
+        platform_mutex_lock(&q->lock);
+        i = q->next++;
+        platform_mutex_unlock(&q->lock);
+        if (i >= arrlen(q->jobs))
+            break;
 
-            subobj_reset_mod(&sctx);
+        err = process_file(q->jobs[i].input);
+        log_buffer_flush();
 
-            MEASURE_END(srtw, measure_ms);
-            psnprintf(measure_str, sizeof(measure_str), took_ms_fmt, measure_ms);
-            log_progress(LPS_END, measure_str);
+        if (err != NOERR) {
+            platform_mutex_lock(&q->lock);
+            q->had_error = true;
+            platform_mutex_unlock(&q->lock);
         }
+    }
 
-        if (opt_ass_do) {
-            create_output_path(ASS, input, outpath);
-            psnprintf(mbuf, sizeof(mbuf), PSTR("Writing .ass file to %s"), outpath);
+    log_buffer_end();
+    font_dinit();
+}
 
-            log_progress(LPS_BEGIN, mbuf);
-            MEASURE_START(assw);
+/*
+ * Process the input files on nthreads threads.
+ * The largest files are started first, so that a big file
+ * picked up at the end won't leave the other threads idle
+ */
+static bool process_files_parallel(int nthreads)
+{
+    struct platform_thread *threads;
+    struct job_queue q = {0};
+    struct pstat st;
+    int started = 0;
+
+    for (intptr_t i = 0; i < arrlen(opt_input_files); i++) {
+        struct job j = {
+            .input = opt_input_files[i],
+            .size = -1,
+        };
+        /* Errors are reported by the worker */
+        if (pstatfn(j.input, &st) == 0)
+            j.size = st.st_size;
+        arrput(q.jobs, j);
+    }
+    qsort(q.jobs, arrlen(q.jobs), sizeof(*q.jobs), job_cmp_size_desc);
 
-            err = ass_write(&sctx, outpath);
+    platform_mutex_init(&q.lock);
+    threads = calloc(nthreads, sizeof(*threads));
+    assert(threads);
 
-            MEASURE_END(assw, measure_ms);
-            psnprintf(measure_str, sizeof(measure_str), took_ms_fmt, measure_ms);
-            log_progress(LPS_END, measure_str);
+    for (int i = 0; i < nthreads; i++) {
+        if (platform_thread_create(&threads[i], worker, &q) != 0)
+            break;
+        started++;
+    }
+    /* Do the work here, if no threads could be started */
+    if (started == 0)
+        worker(&q);
 
-            if (err != NOERR) {
-                log_error("Failed to generate ass file: %s\n", error_to_string(err));
-            }
-        }
+    for (int i = 0; i < started; i++) {
+        platform_thread_join(&threads[i]);
+    }
 
-end:
-        subobj_destroy(&sctx);
-end_file:
-        tsdecode_free(&tsd);
+    free(threads);
+    platform_mutex_destroy(&q.lock);
+    arrfree(q.jobs);
+    return q.had_error == false;
+}
+
+int fnmain(int argc, pchar **argv)
+{
+    enum error err;
+    bool had_error = false;
+    int jobs;
+
+#ifdef __linux__
+    /* For wcrtomb */
+    char *lset = setlocale(LC_CTYPE, "C.utf8");
+    assert(lset && "Can't set UTF-8 locale");
+#elif defined(_WIN32)
+    (void)_setmode(_fileno(stdout), _O_U16TEXT);
+    (void)_setmode(_fileno(stderr), _O_U16TEXT);
+    _set_printf_count_output(1);
+#endif
+
+    err = opts_parse_cmdline(argc, argv);
+    if (err != NOERR) {
+        return 1;
     }
 
-    font_dinit();
-    opts_free();
-    if (had_error && err == NOERR) {
-        err = ERR_UNDEF;
+    if (arrlen(opt_input_files) <= 0) {
+        log_error("No input files to process!\n");
+        opts_free();
+        return 1;
+    }
+
+    jobs = (opt_jobs == 0) ? platform_cpu_count() : opt_jobs;
+    jobs = MIN(jobs, arrlen(opt_input_files));
+    /* The files processed at the same time share the CPUs */
+    opt_file_cpus = MAX(platform_cpu_count() / MAX(jobs, 1), 1);
+
+    if (jobs > 1) {
+        had_error = !process_files_parallel(jobs);
+    } else {
+        font_init();
+        for (intptr_t i_i = 0; i_i < arrlen(opt_input_files); i_i++) {
+            err = process_file(opt_input_files[i_i]);
+            if (err != NOERR)
+                had_error = true;
+        }
+        font_dinit();
     }
 
-    return err == NOERR ? 0 : 1;
+    drcs_dump_finish();
+    font_registry_free();
+    opts_free();
+    return had_error ? 1 : 0;
 }
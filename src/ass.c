@@ -2,6 +2,7 @@
 #include "stb_ds.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 //#include <sys/param.h>
 #include <stdio.h>
@@ -13,6 +14,7 @@
 #include "tagtext.h"
 #include "opts.h"
 #include "log.h"
+#include "outbuf.h"
 
 #define ASS_RGBA(r, g, b, a) (((a) << 24) | ((b) << 16) | ((g) << 8) | (r))
 #define ARIB_TO_ASS_COLOR(aribcolor) (ASS_RGBA((uint8_t)ARIBCC_COLOR_R(aribcolor), (uint8_t)ARIBCC_COLOR_G(aribcolor), \
@@ -29,53 +31,136 @@ struct ass_style {
     bool bold, italic, underline;
 };
 
-struct ass_ctx {
-    struct fm_ctx fm;
-    struct ass_style default_style;
-    struct font font;
+/* A Dialogue line, with its text in the outbuf of the list it is in */
+struct ass_event {
+    int layer;
+    int64_t start_ms, end_ms;
+    /* Everything after the times, from the style to the end of the text */
+    size_t off, len;
+    /* With merge_events, the line is continued by the current caption */
+    bool continued;
 };
 
-static void ms_to_str(int64_t ms_time, char out[32])
-{
-    int64_t h, m, s, ms;
-    h = ms_time / H_IN_MS;
-    ms_time %= H_IN_MS;
+/* The lines of a caption that was rendered before, they are in cache_lines from first_line */
+struct caption_cache_entry {
+    size_t key;
+    struct {
+        /* The signature of the caption in cache_text, as captions can have the same hash */
+        size_t sig_off, sig_len;
+        size_t first_line, line_count;
+    } value;
+};
 
-    m = ms_time / M_IN_MS;
-    ms_time %= M_IN_MS;
+/* The cache is cleared when its text gets bigger than this */
+#define CAPTION_CACHE_MAX_SIZE (16 * 1024 * 1024)
 
-    s = ms_time / S_IN_MS;
-    ms = ms_time % S_IN_MS;
+struct ass_ctx {
+    const struct ass_profile *prof;
+    struct fm_ctx fm;
+    /* The line styles, the first one is Default */
+    struct ass_style styles[TT_MAX_LINE_STYLES];
+    int style_count;
+    char style_names[TT_MAX_LINE_STYLES][16];
+    /* For measuring the size of the output, without a file */
+    struct outbuf scratch;
+    struct font font;
 
-    snprintf(out, 32, "%"PRId64":%02"PRId64":%02"PRId64".%02"PRId64, h, m, s, ms /  10);
-}
+    /* Last font size adjusted by fm_adjust_fs(), -1 if none yet */
+    int adjust_oldfs, adjust_newfs;
+    /* The chars are processed only for counting their styles, don't log the same things twice */
+    bool quiet;
+    /* The styles of the chars of a region while they are modified */
+    struct subobj_style stb_array *region_styles;
+
+    /* The lines of the current caption */
+    struct ass_event stb_array *lines;
+    struct outbuf lines_text;
+    /* With merge_events, the lines that are still shown, and the next ones while they are collected */
+    struct ass_event stb_array *open, stb_array *next_open;
+    struct outbuf open_text, next_text;
+
+    /* Rendered captions by the hash of their signature, the regions, chars and styles
+     * after process_subobj_chars(). Repeated captions only need new times */
+    struct caption_cache_entry stb_array *cache;
+    struct ass_event stb_array *cache_lines;
+    struct outbuf cache_text;
+    /* The signature of the current caption */
+    struct outbuf sig;
+    int64_t cache_lookups, cache_hits;
+};
 
-static void write_header(FILE *f, int width, int height)
+struct ass_writer {
+    struct ass_ctx actx;
+    bool header_written;
+    /* The overlay of the current caption, reset after it is written */
+    struct arena tt_arena;
+    /* Parses the tagtext of the current caption, with the styles optimized for the whole file if enabled */
+    struct tagtext_iter *tt_iter;
+};
+
+static void write_header(struct outbuf *ob, int width, int height)
 {
-    fprintf(f, 
+    outbuf_puts(ob,
             "[Script Info]\n"
             "; Script generated by arib2ass-cstyle\n"
             "ScriptType: v4.00+\n"
             "Collisions: Normal\n"
             "ScaledBorderAndShadow: Yes\n"
-            "PlayResX: %d\n"
-            "PlayResY: %d\n"
-            "LayoutResX: %d\n"
-            "LayoutResY: %d\n"
-            "\n",
-            width, height, width, height);
+            "PlayResX: ");
+    outbuf_int(ob, width, 0);
+    outbuf_puts(ob, "\nPlayResY: ");
+    outbuf_int(ob, height, 0);
+    outbuf_puts(ob, "\nLayoutResX: ");
+    outbuf_int(ob, width, 0);
+    outbuf_puts(ob, "\nLayoutResY: ");
+    outbuf_int(ob, height, 0);
+    outbuf_puts(ob, "\n\n");
 }
 
-static void write_styles(FILE *f, const struct ass_style *s)
+static void put_style(struct outbuf *ob, const struct ass_style *s)
 {
-    sftf_init();
+    outbuf_puts(ob, "Style: ");
+    outbuf_puts(ob, s->name);
+    outbuf_putc(ob, ',');
+    outbuf_puts(ob, s->fontname);
+    outbuf_putc(ob, ',');
+    outbuf_float2(ob, s->fs);
+    outbuf_puts(ob, ",&H");
+    outbuf_hex(ob, s->primary_color, 8, false);
+    outbuf_puts(ob, ",&H00000000,&H");
+    outbuf_hex(ob, s->border_color, 8, false);
+    outbuf_puts(ob, ",&H");
+    outbuf_hex(ob, s->shadow_color, 8, false);
+    outbuf_putc(ob, ',');
+    outbuf_int(ob, s->bold, 0);
+    outbuf_putc(ob, ',');
+    outbuf_int(ob, s->italic, 0);
+    outbuf_putc(ob, ',');
+    outbuf_int(ob, s->underline, 0);
+    outbuf_puts(ob, ",0,");
+    outbuf_float2(ob, s->scale_x * 100);
+    outbuf_putc(ob, ',');
+    outbuf_float2(ob, s->scale_y * 100);
+    outbuf_putc(ob, ',');
+    outbuf_float2(ob, s->spacing_x);
+    outbuf_puts(ob, ",0,1,");
+    outbuf_float2(ob, s->border);
+    outbuf_putc(ob, ',');
+    outbuf_float2(ob, s->shadow);
+    outbuf_putc(ob, ',');
+    outbuf_int(ob, s->align, 0);
+    outbuf_puts(ob, ",0,0,0,1\n");
+}
 
-    fprintf(f,
+static void write_styles(struct outbuf *ob, const struct ass_style *styles, int count)
+{
+    outbuf_puts(ob,
             "[V4+ Styles]\n"
-            "Format: Name, Fontname, Fontsize, PrimaryColour, SecondaryColour, OutlineColour, BackColour, Bold, Italic, Underline, StrikeOut, ScaleX, ScaleY, Spacing, Angle, BorderStyle, Outline, Shadow, Alignment, MarginL, MarginR, MarginV, Encoding\n"
-            "Style: %s,%s,%s,&H%08X,&H00000000,&H%08X,&H%08X,%d,%d,%d,0,%s,%s,%s,0,1,%s,%s,%d,0,0,0,1\n"
-            "\n", s->name, s->fontname, sftf(s->fs), s->primary_color, s->border_color, s->shadow_color, s->bold, s->italic, s->underline,
-            sftf(s->scale_x * 100), sftf(s->scale_y * 100), sftf(s->spacing_x), sftf(s->border), sftf(s->shadow), s->align);
+            "Format: Name, Fontname, Fontsize, PrimaryColour, SecondaryColour, OutlineColour, BackColour, Bold, Italic, Underline, StrikeOut, ScaleX, ScaleY, Spacing, Angle, BorderStyle, Outline, Shadow, Alignment, MarginL, MarginR, MarginV, Encoding\n");
+    for (int i = 0; i < count; i++) {
+        put_style(ob, &styles[i]);
+    }
+    outbuf_putc(ob, '\n');
 }
 
 static void ass_style_update_from_tt_events(const struct tagtext_event events[TT_STYLE_COUNT_], struct ass_style *out_style)
@@ -137,77 +222,87 @@ static void ass_default_style(struct ass_style *out_style)
     };
 }
 
-#define brace_switch(to_state, curri, size, buffer) { \
-    if (*in_brace != to_state) { \
-        buffer[curri++] = "}{"[to_state]; \
-        size--; \
-        assert(curri < size); \
-        *in_brace = to_state; \
-    } \
+/* Open or close the override block */
+static void brace_switch(struct outbuf *ob, bool to_state, bool *in_brace)
+{
+    if (*in_brace != to_state) {
+        outbuf_putc(ob, "}{"[to_state]);
+        *in_brace = to_state;
+    }
+}
+
+/* Colors are BGR */
+static void put_color(struct outbuf *ob, const char *tag, const char *alpha_tag, uint32_t aribcolor)
+{
+    outbuf_puts(ob, tag);
+    outbuf_puts(ob, "&H");
+    outbuf_hex(ob, ARIBCC_COLOR_B(aribcolor), 2, false);
+    outbuf_hex(ob, ARIBCC_COLOR_G(aribcolor), 2, false);
+    outbuf_hex(ob, ARIBCC_COLOR_R(aribcolor), 2, false);
+    outbuf_putc(ob, '&');
+    outbuf_puts(ob, alpha_tag);
+    outbuf_puts(ob, "&H");
+    outbuf_hex(ob, 0xff - (uint8_t)ARIBCC_COLOR_A(aribcolor), 2, false);
 }
 
-static int render_tagtext_event_style(const struct tagtext_event *ev, const struct tagtext_event *all_events, ssize_t size, char *out_text, bool *in_brace)
+static void render_tagtext_event_style(const struct tagtext_event *ev, struct outbuf *ob, bool *in_brace)
 {
-    assert(size > 0);
     assert(ev->type == TT_EVENT_TYPE_STYLE);
 
-    int w = 0;
     bool b_switched = false;
+    size_t start;
 
     if (*in_brace == false) {
         b_switched = true;
-        brace_switch(true, w, size, out_text);
-        out_text++;
+        brace_switch(ob, true, in_brace);
     }
+    start = ob->len;
 
-    sftf_init();
     switch (ev->style) {
-        /* Colors are BGR */
         case TT_STYLE_TEXT_COLOR:
-            w += snprintf(out_text, size, "\\c&H%02X%02X%02X&\\1a&H%02X",
-                    (uint8_t)ARIBCC_COLOR_B(ev->style_value_u32), (uint8_t)ARIBCC_COLOR_G(ev->style_value_u32),
-                    (uint8_t)ARIBCC_COLOR_R(ev->style_value_u32), 0xff - (uint8_t)ARIBCC_COLOR_A(ev->style_value_u32));
+            put_color(ob, "\\c", "\\1a", ev->style_value_u32);
             break;
         case TT_STYLE_BACK_COLOR:
-            w += snprintf(out_text, size, "\\-STYLE_BACK_COLOR");
+            outbuf_puts(ob, "\\-STYLE_BACK_COLOR");
             break;
         case TT_STYLE_STROKE_COLOR:
-            w += snprintf(out_text, size, "\\3c&H%02X%02X%02X&\\3a&H%02X",
-                    (uint8_t)ARIBCC_COLOR_B(ev->style_value_u32), (uint8_t)ARIBCC_COLOR_G(ev->style_value_u32),
-                    (uint8_t)ARIBCC_COLOR_R(ev->style_value_u32), 0xff - (uint8_t)ARIBCC_COLOR_A(ev->style_value_u32));
+            put_color(ob, "\\3c", "\\3a", ev->style_value_u32);
             break;
         case TT_STYLE_SCALE_X:
-            w += snprintf(out_text, size, "\\fscx%s", sftf(ev->style_value_float * 100.0f));
+            outbuf_puts(ob, "\\fscx");
+            outbuf_float2(ob, ev->style_value_float * 100.0f);
             break;
         case TT_STYLE_SCALE_Y:
-            w += snprintf(out_text, size, "\\fscy%s", sftf(ev->style_value_float * 100.0f));
+            outbuf_puts(ob, "\\fscy");
+            outbuf_float2(ob, ev->style_value_float * 100.0f);
             break;
-        case TT_STYLE_SPACING_X: {
+        case TT_STYLE_SPACING_X:
             /* NOTE: \fsp is scaled by \fscx */
-            w += snprintf(out_text, size, "\\fsp%s", sftf(ev->style_value_float));
-        }
+            outbuf_puts(ob, "\\fsp");
+            outbuf_float2(ob, ev->style_value_float);
             break;
         case TT_STYLE_SPACING_Y:
-            w += snprintf(out_text, size, "\\-STYLE_SPACING_Y=%d", (int)ev->style_value_u32);
+            outbuf_puts(ob, "\\-STYLE_SPACING_Y=");
+            outbuf_int(ob, (int)ev->style_value_u32, 0);
             break;
         case TT_STYLE_CHAR_HEIGHT:
-            w += snprintf(out_text, size, "\\fs%u", ev->style_value_u32);
+            outbuf_puts(ob, "\\fs");
+            outbuf_int(ob, ev->style_value_u32, 0);
             break;
-        /* Bold is ignored, always set */
         case TT_STYLE_BOLD:
-            return snprintf(out_text, size, "\\b%d", ev->style_value_bool);
+            outbuf_puts(ob, ev->style_value_bool ? "\\b1" : "\\b0");
             break;
         case TT_STYLE_ITALIC:
-            w += snprintf(out_text, size, "\\i%d", ev->style_value_bool);
+            outbuf_puts(ob, ev->style_value_bool ? "\\i1" : "\\i0");
             break;
         case TT_STYLE_UNDERLINE:
-            w += snprintf(out_text, size, "\\u%d", ev->style_value_bool);
+            outbuf_puts(ob, ev->style_value_bool ? "\\u1" : "\\u0");
             break;
         case TT_STYLE_STROKE:
-            w += snprintf(out_text, size, "\\-stroke=%d", ev->style_value_bool);
+            outbuf_puts(ob, ev->style_value_bool ? "\\-stroke=1" : "\\-stroke=0");
             break;
         case TT_STYLE_RESET:
-            w += snprintf(out_text, size, "\\r");
+            outbuf_puts(ob, "\\r");
             break;
 #if 0
         case TT_STYLE_POS_XY:
@@ -218,105 +313,130 @@ static int render_tagtext_event_style(const struct tagtext_event *ev, const stru
             break;
     }
 
-    if (w == 1 && b_switched) {
+    if (ob->len == start && b_switched) {
         /* No tag was written, but the opening brace was so revert that here */
-        out_text--;
-        *out_text = '\0';
+        ob->len--;
         *in_brace = false;
-        w = 0;
     }
-
-    return w;
 }
 
-static int render_tagtext_event_char(const struct tagtext_event *ev, ssize_t size, char *out_text, bool *in_brace)
+static void render_tagtext_event_char(const struct tagtext_event *ev, struct outbuf *ob, bool *in_brace)
 {
-    assert(size > 0);
     assert(ev->type == TT_EVENT_TYPE_CHAR);
 
-    int w = 0;
-
-    brace_switch(false, w, size, out_text);
+    brace_switch(ob, false, in_brace);
 
     if (ev->ref_so_chr->ref->codepoint == '\n') {
-        w += snprintf(&out_text[w], size - w, "\\N");
+        outbuf_puts(ob, "\\N");
     } else {
-        w += snprintf(&out_text[w], size - w, "%s", ev->ref_so_chr->ref->u8str);
+        outbuf_puts(ob, ev->ref_so_chr->ref->u8str);
     }
-    return w;
 }
 
-#undef brace_switch
-
-struct ass_lines {
-    char *storage;
-    size_t storage_size;
-    size_t storage_idx;
-
-    size_t lines_idx, lines_size;
-    struct ass_line {
-        int layer;
-        char *text_ptr;
-    } lines[128];
-};
-
-static void render_tagtext_events(const struct tagtext_event *events, struct ass_lines *alines, bool in_brace)
+static void render_tagtext_events(const struct tagtext_event *events, struct outbuf *ob, bool in_brace)
 {
-
     for (const struct tagtext_event *ev = events; ev < &events[arrlen(events)]; ev++) {
-        int w = 0;
         if (ev->type == TT_EVENT_TYPE_STYLE) {
-            w = render_tagtext_event_style(ev, events, alines->storage_size - alines->storage_idx, &alines->storage[alines->storage_idx], &in_brace);
+            render_tagtext_event_style(ev, ob, &in_brace);
         } else {
-            w = render_tagtext_event_char(ev, alines->storage_size - alines->storage_idx, &alines->storage[alines->storage_idx], &in_brace);
+            render_tagtext_event_char(ev, ob, &in_brace);
         }
-        alines->storage_idx += w;
-        assert(alines->storage_idx < alines->storage_size);
     }
 }
 
-static void render_debug_boxes(struct ass_ctx *actx, struct tagtext_caption *tt_caption, struct ass_lines *alines)
+/* Start a line of the caption, the text is written into the returned outbuf until line_end() */
+static struct outbuf *line_begin(struct ass_ctx *actx, int layer, const struct subobj *s, const char *style)
 {
-    /* region and char bounding box */
-    for (uint32_t ri = 0; ri < tt_caption->ref_subobj->caption_ref.region_count; ri++) {
-        const aribcc_caption_region_t *ref_region = &tt_caption->ref_subobj->caption_ref.regions[ri];
-        struct ass_line *cur_line = &alines->lines[alines->lines_idx++];
-        assert(alines->lines_idx < alines->lines_size);
-
-        cur_line->layer = 0;
-        cur_line->text_ptr = &alines->storage[alines->storage_idx];
-        alines->storage_idx += snprintf(cur_line->text_ptr, alines->storage_size - alines->storage_idx,
-                "{\\c&H000000&\\alpha&HA0&\\an7\\bord0\\shad0\\pos(%d,%d)\\p1}m %d %d l %d %d %d %d %d %d",
-                ref_region->x, ref_region->y, 0, 0, ref_region->width, 0, ref_region->width, ref_region->height, 0, ref_region->height);
-        alines->storage_idx++;
-        assert(alines->storage_idx < alines->storage_size);
+    struct outbuf *ob = &actx->lines_text;
+    struct ass_event line = {
+        .layer = layer,
+        .start_ms = s->start_ms,
+        .end_ms = s->end_ms,
+        .off = ob->len,
+    };
 
-        for (intptr_t ref_chr_i = 0; ref_chr_i < ref_region->char_count; ref_chr_i++) {
-            const aribcc_caption_char_t *ref_chr = &ref_region->chars[ref_chr_i];
-            int cw = aribcc_caption_char_get_section_width((void*)ref_chr);
-            int ch = aribcc_caption_char_get_section_height((void*)ref_chr);
+    arrput(actx->lines, line);
+    outbuf_puts(ob, style);
+    outbuf_puts(ob, ",,0000,0000,0000,,");
+    return ob;
+}
+
+static void line_end(struct ass_ctx *actx)
+{
+    struct ass_event *line = &actx->lines[arrlen(actx->lines) - 1];
+
+    line->len = actx->lines_text.len - line->off;
+}
+
+static void put_event(struct outbuf *ob, const struct ass_event *ev, const char *text)
+{
+    outbuf_puts(ob, "Dialogue: ");
+    outbuf_int(ob, ev->layer, 0);
+    outbuf_putc(ob, ',');
+    outbuf_time(ob, ev->start_ms, 1, '.', 2);
+    outbuf_putc(ob, ',');
+    outbuf_time(ob, ev->end_ms, 1, '.', 2);
+    outbuf_putc(ob, ',');
+    outbuf_put(ob, &text[ev->off], ev->len);
+    outbuf_putc(ob, '\n');
+}
 
-            struct ass_line *cur_line = &alines->lines[alines->lines_idx++];
-            assert(alines->lines_idx < alines->lines_size);
+static void add_event(struct ass_event stb_array **events, struct outbuf *text, const struct ass_event *ev, const char *ev_text)
+{
+    struct ass_event copy = *ev;
+
+    copy.off = text->len;
+    copy.continued = false;
+    outbuf_put(text, &ev_text[ev->off], ev->len);
+    arrput(*events, copy);
+}
+
+/* A w x h box drawing at x, y after the override tags */
+static void put_box(struct outbuf *ob, const char *tags, int x, int y, int w, int h)
+{
+    outbuf_puts(ob, tags);
+    outbuf_puts(ob, "\\pos(");
+    outbuf_int(ob, x, 0);
+    outbuf_putc(ob, ',');
+    outbuf_int(ob, y, 0);
+    outbuf_puts(ob, ")\\p1}m 0 0 l ");
+    outbuf_int(ob, w, 0);
+    outbuf_puts(ob, " 0 ");
+    outbuf_int(ob, w, 0);
+    outbuf_putc(ob, ' ');
+    outbuf_int(ob, h, 0);
+    outbuf_puts(ob, " 0 ");
+    outbuf_int(ob, h, 0);
+}
+
+static void render_debug_boxes(struct ass_ctx *actx, const struct subobj *s)
+{
+    struct outbuf *ob;
+
+    /* region and char bounding box */
+    for (uint32_t ri = 0; ri < s->caption_ref.region_count; ri++) {
+        const struct subobj_ref_region *ref_region = &s->caption_ref.regions[ri];
 
-            cur_line->layer = 1;
-            cur_line->text_ptr = &alines->storage[alines->storage_idx];
+        ob = line_begin(actx, 0, s, actx->styles[0].name);
+        put_box(ob, "{\\c&H000000&\\alpha&HA0&\\an7\\bord0\\shad0",
+                ref_region->x, ref_region->y, ref_region->width, ref_region->height);
+        line_end(actx);
 
-            alines->storage_idx += snprintf(cur_line->text_ptr, alines->storage_size - alines->storage_idx,
-                    "{\\c&H000000&\\1a&HFF&\\3c&H00000000&\\3a&H00&\\an7\\bord1\\shad0\\pos(%d,%d)\\p1}m %d %d l %d %d %d %d %d %d",
-                    ref_chr->x, ref_chr->y, 0, 0, cw, 0, cw, ch, 0, ch);
-            alines->storage_idx++;
-            assert(alines->storage_idx < alines->storage_size);
+        for (intptr_t ref_chr_i = 0; ref_chr_i < ref_region->char_count; ref_chr_i++) {
+            const struct subobj_ref_char *ref_chr = &ref_region->chars[ref_chr_i];
+            int cw = subobj_ref_char_section_width(ref_chr);
+            int ch = subobj_ref_char_section_height(ref_chr);
+
+            ob = line_begin(actx, 1, s, actx->styles[0].name);
+            put_box(ob, "{\\c&H000000&\\1a&HFF&\\3c&H00000000&\\3a&H00&\\an7\\bord1\\shad0",
+                    ref_chr->x, ref_chr->y, cw, ch);
+            line_end(actx);
         }
     }
 
-
     struct chars_for_furi_result rubys[MAX_FURI_REGIONS];
-    int rubylen = util_find_chars_for_furi(tt_caption->ref_subobj, rubys);
+    int rubylen = util_find_chars_for_furi(s, rubys);
     for (int i = 0; i < rubylen; i++) {
-        struct ass_line *cur_line = &alines->lines[alines->lines_idx++];
-        assert(alines->lines_idx < alines->lines_size);
-
         assert(rubys[i].chars_region->char_count > rubys[i].chars_span_from);
         int x1 = rubys[i].chars_region->chars[rubys[i].chars_span_from].x;
         int x2 = rubys[i].chars_region->chars[rubys[i].chars_span_to].x + 
@@ -324,15 +444,9 @@ static void render_debug_boxes(struct ass_ctx *actx, struct tagtext_caption *tt_
         int y1 = rubys[i].chars_region->y;
         int y2 = y1 + rubys[i].chars_region->height;
 
-
-        cur_line->layer = 2;
-        cur_line->text_ptr = &alines->storage[alines->storage_idx];
-
-        alines->storage_idx += snprintf(cur_line->text_ptr, alines->storage_size - alines->storage_idx,
-                "{\\c&H0000FF&\\alpha&HA0&\\an7\\bord0\\shad0\\pos(%d,%d)\\p1}m %d %d l %d %d %d %d %d %d",
-                x1, y1, 0, 0, x2 - x1, 0, x2 - x1, y2 - y1, 0, y2 - y1);
-        alines->storage_idx++;
-        assert(alines->storage_idx < alines->storage_size);
+        ob = line_begin(actx, 2, s, actx->styles[0].name);
+        put_box(ob, "{\\c&H0000FF&\\alpha&HA0&\\an7\\bord0\\shad0", x1, y1, x2 - x1, y2 - y1);
+        line_end(actx);
 
 #if 0
         pprintf(PSTR("Matched furi: "));
@@ -349,7 +463,8 @@ static void render_debug_boxes(struct ass_ctx *actx, struct tagtext_caption *tt_
 
 }
 
-static void render_caption(struct ass_ctx *actx, struct tagtext_caption *tt_caption, struct ass_lines *alines)
+/* Collect the lines of a caption into actx->lines */
+static void render_caption(struct ass_ctx *actx, struct tagtext_caption *tt_caption)
 {
     assert(tt_caption);
 
@@ -368,29 +483,142 @@ static void render_caption(struct ass_ctx *actx, struct tagtext_caption *tt_capt
 
     for (intptr_t tti = 0; tti < arrlen(tt_caption->tagtexts); tti++) {
         struct tagtext *tt = &tt_caption->tagtexts[tti];
-        const struct subobj_caption_region *so_region = &tt_caption->ref_subobj->so_caption.so_regions[tti];
+        const struct subobj_caption_region *so_region = &tt_caption->so_caption->so_regions[tti];
 
+        struct outbuf *ob = line_begin(actx, (actx->prof->debug_boxes) ? 3 : 0, tt_caption->ref_subobj,
+                actx->styles[tt->line_style].name);
 
-        struct ass_line *cur_line = &alines->lines[alines->lines_idx++];
-        assert(alines->lines_idx < alines->lines_size);
-        cur_line->layer = (opt_ass_debug_boxes) ? 3 : 0;
-        cur_line->text_ptr = &alines->storage[alines->storage_idx];
-        alines->storage_idx += snprintf(cur_line->text_ptr, alines->storage_size - alines->storage_idx,
-                "{\\pos(%d,%d)", so_region->x, so_region->y + (so_region->height / 2));
-        assert(alines->storage_idx < alines->storage_size);
+        outbuf_puts(ob, "{\\pos(");
+        outbuf_int(ob, so_region->x, 0);
+        outbuf_putc(ob, ',');
+        outbuf_int(ob, so_region->y + (so_region->height / 2), 0);
+        outbuf_putc(ob, ')');
 
-        render_tagtext_events(tt->events, alines, true);
+        render_tagtext_events(tt->events, ob, true);
+        line_end(actx);
+    }
+}
+
+/* Everything render_caption() uses from the overlay, the refs only for what is not copied to it */
+static void caption_signature(const struct subobj_caption *so_caption, struct outbuf *sig)
+{
+    sig->len = 0;
+    for (const struct subobj_caption_region *so_region = so_caption->so_regions; so_region < arrendptr(so_caption->so_regions); so_region++) {
+        const int32_t region[] = {
+            so_region->x, so_region->y, so_region->width, so_region->height,
+            so_region->ref->is_ruby, arrlen(so_region->so_chars),
+        };
 
-        alines->storage_idx++;
+        outbuf_put(sig, (const char *)region, sizeof(region));
+        for (const struct subobj_caption_char *so_chr = so_region->so_chars; so_chr < arrendptr(so_region->so_chars); so_chr++) {
+            const uint32_t chr[] = { so_chr->ref->codepoint, so_chr->style_id, so_chr->ref->type };
+
+            outbuf_put(sig, (const char *)chr, sizeof(chr));
+            outbuf_put(sig, so_chr->ref->u8str, sizeof(so_chr->ref->u8str));
+        }
     }
+}
+
+static const struct caption_cache_entry *cache_find(struct ass_ctx *actx, size_t hash)
+{
+    const struct caption_cache_entry *e = hmgetp_null(actx->cache, hash);
 
+    if (e == NULL || e->value.sig_len != actx->sig.len ||
+            memcmp(&actx->cache_text.data[e->value.sig_off], actx->sig.data, actx->sig.len) != 0)
+        return NULL;
+    return e;
+}
 
-    if (opt_ass_debug_boxes) {
-        render_debug_boxes(actx, tt_caption, alines);
+/* The lines of the cached caption, with the times of s */
+static void lines_from_cache(struct ass_ctx *actx, const struct caption_cache_entry *e, const struct subobj *s)
+{
+    for (size_t i = 0; i < e->value.line_count; i++) {
+        struct ass_event line = actx->cache_lines[e->value.first_line + i];
+
+        outbuf_put(&actx->lines_text, &actx->cache_text.data[line.off], line.len);
+        line.off = actx->lines_text.len - line.len;
+        line.start_ms = s->start_ms;
+        line.end_ms = s->end_ms;
+        arrput(actx->lines, line);
     }
 }
 
-static void calculate_char_spacing(struct ass_ctx *actx, struct subobj_caption_char *so_chr)
+/* Add the lines of the caption just rendered */
+static void cache_add(struct ass_ctx *actx, size_t hash)
+{
+    struct caption_cache_entry e = { .key = hash };
+
+    if (actx->cache_text.len > CAPTION_CACHE_MAX_SIZE) {
+        hmfree(actx->cache);
+        arrsetlen(actx->cache_lines, 0);
+        actx->cache_text.len = 0;
+    }
+
+    e.value.sig_off = actx->cache_text.len;
+    e.value.sig_len = actx->sig.len;
+    outbuf_put(&actx->cache_text, actx->sig.data, actx->sig.len);
+    e.value.first_line = arrlen(actx->cache_lines);
+    e.value.line_count = arrlen(actx->lines);
+    for (const struct ass_event *line = actx->lines; line < arrendptr(actx->lines); line++)
+        add_event(&actx->cache_lines, &actx->cache_text, line, actx->lines_text.data);
+    hmputs(actx->cache, e);
+}
+
+/*
+ * A line that is the same as one of the previous caption, that ended when this one started,
+ * only makes that event longer, so a region that isn't changed by a redraw is one event for its whole lifetime.
+ * The events that are not continued are written out
+ */
+static void merge_events(struct ass_ctx *actx, struct outbuf *ob)
+{
+    for (struct ass_event *line = actx->lines; line < arrendptr(actx->lines); line++) {
+        for (struct ass_event *ev = actx->open; ev < arrendptr(actx->open); ev++) {
+            if (ev->continued || ev->end_ms != line->start_ms || ev->layer != line->layer || ev->len != line->len ||
+                    memcmp(&actx->open_text.data[ev->off], &actx->lines_text.data[line->off], line->len) != 0)
+                continue;
+            ev->continued = true;
+            ev->end_ms = line->end_ms;
+            line->continued = true;
+            break;
+        }
+    }
+
+    arrsetlen(actx->next_open, 0);
+    actx->next_text.len = 0;
+    for (struct ass_event *ev = actx->open; ev < arrendptr(actx->open); ev++) {
+        if (ev->continued)
+            add_event(&actx->next_open, &actx->next_text, ev, actx->open_text.data);
+        else
+            put_event(ob, ev, actx->open_text.data);
+    }
+    for (struct ass_event *line = actx->lines; line < arrendptr(actx->lines); line++) {
+        if (line->continued == false)
+            add_event(&actx->next_open, &actx->next_text, line, actx->lines_text.data);
+    }
+
+    struct ass_event stb_array *events = actx->open;
+    struct outbuf text = actx->open_text;
+
+    actx->open = actx->next_open;
+    actx->open_text = actx->next_text;
+    actx->next_open = events;
+    actx->next_text = text;
+}
+
+/* Write the lines of the caption, or merge them into the open events */
+static void write_lines(struct ass_ctx *actx, struct outbuf *ob)
+{
+    if (actx->prof->merge_events) {
+        merge_events(actx, ob);
+    } else {
+        for (const struct ass_event *line = actx->lines; line < arrendptr(actx->lines); line++)
+            put_event(ob, line, actx->lines_text.data);
+    }
+    arrsetlen(actx->lines, 0);
+    actx->lines_text.len = 0;
+}
+
+static void calculate_char_spacing(struct ass_ctx *actx, const struct subobj_caption_char *so_chr, struct subobj_style *st)
 {
     /* How scaling and fsp works in libass:
      * \fsp is scaled with the \fscx.
@@ -402,45 +630,45 @@ static void calculate_char_spacing(struct ass_ctx *actx, struct subobj_caption_c
     struct text_extents char_act_size = {0};
     float char_exp_width, char_act_width;
 
-    char_exp_width = (so_chr->char_width + so_chr->char_horizontal_spacing) * so_chr->char_horizontal_scale;
-    fm_get_metrics_fs_cp(&actx->fm, so_chr->ref->codepoint, so_chr->char_height, &char_act_size);
+    char_exp_width = (st->char_width + st->char_horizontal_spacing) * st->char_horizontal_scale;
+    fm_get_metrics_fs_cp(&actx->fm, so_chr->ref->codepoint, st->char_height, &char_act_size);
     char_act_width = char_act_size.width;
 
-    so_chr->char_horizontal_spacing = (char_exp_width / so_chr->char_horizontal_scale) - char_act_width;
+    st->char_horizontal_spacing = (char_exp_width / st->char_horizontal_scale) - char_act_width;
 }
 
-static void merge_captions(struct subobj_caption_region *base, struct subobj_caption_region *add)
+static void merge_captions(struct arena *arena, struct subobj_style_table *styles,
+        struct subobj_caption_region *base, struct subobj_caption_region *add)
 {
     assert(base->x == add->x);
     assert(base->y + base->height == add->y);
     char u8str[8] = { '\n' };
     struct subobj_caption_char ref_so_chr = base->so_chars[arrlen(base->so_chars) - 1]; // can't use a ptr because it will change.
-    aribcc_caption_char_t *newchar = malloc(sizeof(*newchar)), *newchar_fs = malloc(sizeof(*newchar_fs));
-    assert(newchar);
-    assert(newchar_fs);
+    struct subobj_ref_char *newchar = arena_alloc(arena, sizeof(*newchar) * 2), *newchar_fs = &newchar[1];
     *newchar    = *ref_so_chr.ref;
     *newchar_fs = *ref_so_chr.ref;
-    ref_so_chr.owned_chr = true;
 
     newchar->codepoint = newchar_fs->codepoint = '\n';
     memcpy(newchar->u8str, u8str, sizeof(u8str));
     memcpy(newchar_fs->u8str, u8str, sizeof(u8str));
 
     base->height += add->height;
-    arrsetcap(base->so_chars, arrlen(base->so_chars) + 2 + arrlen(add->so_chars));
+    arena_arrsetcap(arena, base->so_chars, arrlen(base->so_chars) + 2 + arrlen(add->so_chars));
 
     // add a newline character with the same style as the previous char
     ref_so_chr.chr = newchar;
-    arrput(base->so_chars, ref_so_chr);
+    arena_arrput(arena, base->so_chars, ref_so_chr);
 
     assert(newchar_fs->char_vertical_scale == 1);
     // add a newline character with changed character height
+    struct subobj_style st_fs = *subobj_style_get(styles, ref_so_chr.style_id);
+    st_fs.char_height = (st_fs.char_height / 2) + newchar_fs->char_vertical_spacing;
     ref_so_chr.chr = newchar_fs;
-    ref_so_chr.char_height = (ref_so_chr.char_height / 2) + ref_so_chr.chr->char_vertical_spacing;
-    arrput(base->so_chars, ref_so_chr);
+    ref_so_chr.style_id = subobj_style_intern(styles, &st_fs);
+    arena_arrput(arena, base->so_chars, ref_so_chr);
 
     for (struct subobj_caption_char *so_chr = add->so_chars; so_chr < arrendptr(add->so_chars); so_chr++) {
-        arrput(base->so_chars, *so_chr);
+        arena_arrput(arena, base->so_chars, *so_chr);
     }
 }
 
@@ -461,8 +689,11 @@ static intptr_t reorder_ruby_regions(struct subobj_caption_region stb_array *reg
     return first_ruby_insert_idx;
 }
 
-static void coalesce_sections_bef(struct ass_ctx *actx, struct subobj_caption_region *stb_array *regions)
+static void coalesce_sections_bef(struct ass_ctx *actx, struct subobj_caption *so_caption)
 {
+    struct arena *arena = so_caption->arena;
+    struct subobj_caption_region *stb_array *regions = &so_caption->so_regions;
+
     if (arrlen(*regions) <= 1)
         return;
 
@@ -484,48 +715,48 @@ static void coalesce_sections_bef(struct ass_ctx *actx, struct subobj_caption_re
     }
 
     /* Copy the ruby sections first if any */
-    struct subobj_caption_region *rubyreg = arraddnptr(new_so_regions, first_non_ruby_idx);
+    arena_arrsetcap(arena, new_so_regions, arrlen(*regions));
+    struct subobj_caption_region *rubyreg = arena_arraddnptr(arena, new_so_regions, first_non_ruby_idx);
     for (intptr_t ruby_i = 0; ruby_i < first_non_ruby_idx; ruby_i++) {
-        subobj_caption_region_copy(&rubyreg[ruby_i], &(*regions)[ruby_i]);
+        subobj_caption_region_copy(arena, &rubyreg[ruby_i], &(*regions)[ruby_i]);
     }
 
     for (intptr_t ri = first_non_ruby_idx; ri < arrlen(*regions); ri++) {
         struct subobj_caption_region *region = &(*regions)[ri];
         if (current_set == false) {
-            subobj_caption_region_copy(&current, region);
+            subobj_caption_region_copy(arena, &current, region);
             current_set = true;
             continue;
         }
 
         if (current.x == region->x && current.y + current.height == region->y) {
-            merge_captions(&current, region);
+            merge_captions(arena, so_caption->styles, &current, region);
         } else {
-            arrput(new_so_regions, current);
-            subobj_caption_region_copy(&current, region);
+            arena_arrput(arena, new_so_regions, current);
+            subobj_caption_region_copy(arena, &current, region);
             current_set = true;
         }
     }
 
     if (current_set == true)
-        arrput(new_so_regions, current);
+        arena_arrput(arena, new_so_regions, current);
 
-    if (new_so_regions) {
-        subobj_caption_regions_free(*regions);
-        *regions = new_so_regions;
-    }
+    /* The old regions stay in the arena */
+    *regions = new_so_regions;
 }
 
-static void recalc_center_spacing(struct ass_ctx *actx, struct subobj_caption_region *so_region)
+/* styles has the styles of the chars of so_region */
+static void recalc_center_spacing(struct ass_ctx *actx, struct subobj_caption_region *so_region, struct subobj_style *styles)
 {
     if (arrlen(so_region->so_chars) <= 0)
         return;
 
-    so_region->so_chars[0].char_horizontal_spacing /= 2;
-    so_region->x += (so_region->so_chars[0].char_horizontal_spacing * so_region->so_chars[0].char_horizontal_scale);
+    styles[0].char_horizontal_spacing /= 2;
+    so_region->x += (styles[0].char_horizontal_spacing * styles[0].char_horizontal_scale);
 
     for (intptr_t ci = 1; ci < arrlen(so_region->so_chars); ci++) {
-        struct subobj_caption_char *cbef = &so_region->so_chars[ci - 1];
-        struct subobj_caption_char *cnow = &so_region->so_chars[ci    ];
+        struct subobj_style *cbef = &styles[ci - 1];
+        struct subobj_style *cnow = &styles[ci    ];
 
         cnow->char_horizontal_spacing /= 2;
         cbef->char_horizontal_spacing += ((cnow->char_horizontal_spacing * cnow->char_horizontal_scale) / cbef->char_horizontal_scale);
@@ -550,9 +781,10 @@ static bool shift_ruby(struct ass_ctx *actx, struct subobj_caption *so_caption)
             struct text_extents ex;
             if (chr->ref->x >= ruby->ref->x)
                 break;
-            fm_get_metrics_fs_cp(&actx->fm, chr->ref->codepoint, chr->char_height, &ex);
-            virt_x += aribcc_caption_char_get_section_width((void*)chr->ref);
-            real_x += (ex.width + chr->char_horizontal_spacing) * chr->char_horizontal_scale;
+            const struct subobj_style *st = subobj_char_style(so_caption, chr);
+            fm_get_metrics_fs_cp(&actx->fm, chr->ref->codepoint, st->char_height, &ex);
+            virt_x += subobj_ref_char_section_width(chr->ref);
+            real_x += (ex.width + st->char_horizontal_spacing) * st->char_horizontal_scale;
         }
 
         ruby->x -= (virt_x - real_x);
@@ -560,131 +792,332 @@ static bool shift_ruby(struct ass_ctx *actx, struct subobj_caption *so_caption)
     return true;
 }
 
-static void process_chars(struct ass_ctx *actx, struct subobj *subobjs)
+/* The chars of s are changed in an overlay, allocated from arena */
+static void process_subobj_chars(struct ass_ctx *actx, const struct subobj *s, struct arena *arena, struct subobj_caption *out)
 {
-    int newfs = -1, oldfs = -1;
-
-    for (struct subobj *s = subobjs; s < arrendptr(subobjs); s++) {
-        if (s->so_caption.so_regions == NULL)
-            continue;
-        for (struct subobj_caption_region *so_region = s->so_caption.so_regions; so_region < arrendptr(s->so_caption.so_regions); so_region++) {
-            for (struct subobj_caption_char *so_chr = so_region->so_chars; so_chr < arrendptr(so_region->so_chars); so_chr++) {
-
-                if (opt_ass_fs_adjust) {
-                    if (newfs == -1 || oldfs != so_chr->char_height) {
-                        oldfs = so_chr->char_height;
-                        newfs = fm_adjust_fs(&actx->fm, so_chr->char_height);
-                        if (newfs != oldfs) {
-                            log_info("Adjusted fontsize from %d to %d\n", oldfs, newfs);
-                        }
+    subobj_caption_overlay(arena, out, &s->so_caption);
+    if (out->so_regions == NULL)
+        return;
+    for (struct subobj_caption_region *so_region = out->so_regions; so_region < arrendptr(out->so_regions); so_region++) {
+        /* Modify a copy of the styles, and intern them when they are done */
+        struct subobj_style *styles;
+
+        arrsetlen(actx->region_styles, arrlen(so_region->so_chars));
+        styles = actx->region_styles;
+        for (intptr_t ci = 0; ci < arrlen(so_region->so_chars); ci++) {
+            struct subobj_caption_char *so_chr = &so_region->so_chars[ci];
+            struct subobj_style *st = &styles[ci];
+
+            *st = *subobj_char_style(out, so_chr);
+            if (actx->prof->fs_adjust) {
+                if (actx->adjust_newfs == -1 || actx->adjust_oldfs != st->char_height) {
+                    actx->adjust_oldfs = st->char_height;
+                    actx->adjust_newfs = fm_adjust_fs(&actx->fm, st->char_height);
+                    if (actx->adjust_newfs != actx->adjust_oldfs && actx->quiet == false) {
+                        log_info("Adjusted fontsize from %d to %d\n", actx->adjust_oldfs, actx->adjust_newfs);
                     }
-
-                    so_chr->char_height = newfs;
                 }
 
-                if (opt_ass_constant_spacing == -1)
-                    calculate_char_spacing(actx, so_chr);
-                else
-                    so_chr->char_horizontal_spacing = opt_ass_constant_spacing;
-
-                if (opt_ass_force_bold)
-                    so_chr->style |= ARIBCC_CHARSTYLE_BOLD;
-                if (opt_ass_force_border) {
-                    so_chr->style |= ARIBCC_CHARSTYLE_STROKE;
-                    so_chr->stroke_color = ARIBCC_MAKE_RGBA(0u, 0u, 0u, 0xffu);
-                }
+                st->char_height = actx->adjust_newfs;
             }
 
-            if (opt_ass_center_spacing && opt_ass_constant_spacing == -1) {
-                recalc_center_spacing(actx, so_region);
+            if (actx->prof->constant_spacing == -1)
+                calculate_char_spacing(actx, so_chr, st);
+            else
+                st->char_horizontal_spacing = actx->prof->constant_spacing;
+
+            if (actx->prof->force_bold)
+                st->style |= ARIBCC_CHARSTYLE_BOLD;
+            if (actx->prof->force_border) {
+                st->style |= ARIBCC_CHARSTYLE_STROKE;
+                st->stroke_color = ARIBCC_MAKE_RGBA(0u, 0u, 0u, 0xffu);
             }
         }
 
-        if (opt_ass_shift_ruby && opt_ass_constant_spacing != -1) {
-            bool ok = shift_ruby(actx, &s->so_caption);
-            if (ok == false) {
-                pchar tm[32];
-                util_ms_to_htime(s->start_ms, tm);
-                log_warning("Failed to shift ruby at: %s\n", tm);
-            }
+        if (actx->prof->center_spacing && actx->prof->constant_spacing == -1) {
+            recalc_center_spacing(actx, so_region, styles);
         }
 
-        if (opt_ass_merge_regions) {
-            coalesce_sections_bef(actx, &s->so_caption.so_regions);
+        for (intptr_t ci = 0; ci < arrlen(so_region->so_chars); ci++)
+            so_region->so_chars[ci].style_id = subobj_style_intern(out->styles, &styles[ci]);
+    }
+
+    if (actx->prof->shift_ruby && actx->prof->constant_spacing != -1) {
+        bool ok = shift_ruby(actx, out);
+        if (ok == false && actx->quiet == false) {
+            pchar tm[32];
+            util_ms_to_htime(s->start_ms, tm);
+            log_warning("Failed to shift ruby at: %s\n", tm);
         }
     }
+
+    if (actx->prof->merge_regions) {
+        coalesce_sections_bef(actx, out);
+    }
 }
 
-enum error ass_write(const struct subobj_ctx *sctx, const pchar *filepath)
+static enum error ass_ctx_create(struct ass_ctx *actx, const struct ass_profile *prof)
 {
-    struct ass_ctx actx = { 0 };
-    struct tagtext_caption *tt_captions = NULL;
-    enum error err = NOERR;
-    struct tagtext_event default_styles[TT_STYLE_COUNT_];
-    FILE *f = NULL;
+    enum error err;
 
-    err = font_create(opt_ass_font_path, opt_ass_font_face, &actx.font);
+    *actx = (struct ass_ctx){
+        .prof = prof,
+        .adjust_oldfs = -1,
+        .adjust_newfs = -1,
+    };
+    err = font_create(actx->prof->font_path, actx->prof->font_face, &actx->font);
     if (err != NOERR)
-        goto end;
+        return err;
+
+    fm_create(&actx->font, &actx->fm);
+    if (opt_metrics_cache)
+        fm_use_cache_file(&actx->fm, opt_metrics_cache);
+    actx->scratch.fd = -1;
+    actx->lines_text.fd = -1;
+    actx->open_text.fd = -1;
+    actx->next_text.fd = -1;
+    actx->cache_text.fd = -1;
+    actx->sig.fd = -1;
+    ass_default_style(&actx->styles[0]);
+    actx->styles[0].fontname = actx->font.fontname;
+    actx->style_count = 1;
+    return NOERR;
+}
 
-    fm_create(&actx.font, &actx.fm);
-    ass_default_style(&actx.default_style);
-    actx.default_style.fontname = actx.font.fontname;
-    /* rest of style is 0 before optimization */
+static void ass_ctx_destroy(struct ass_ctx *actx)
+{
+    /* ass_ctx_create() can fail before the font is opened, then there is no fm_ctx either */
+    if (actx->font.face) {
+        fm_destroy(&actx->fm);
+        font_destroy(&actx->font);
+    }
+    arrfree(actx->region_styles);
+    outbuf_free(&actx->scratch);
+    arrfree(actx->lines);
+    arrfree(actx->open);
+    arrfree(actx->next_open);
+    outbuf_free(&actx->lines_text);
+    outbuf_free(&actx->open_text);
+    outbuf_free(&actx->next_text);
+    hmfree(actx->cache);
+    arrfree(actx->cache_lines);
+    outbuf_free(&actx->cache_text);
+    outbuf_free(&actx->sig);
+}
 
-    process_chars(&actx, sctx->subobjs);
+static void write_events_header(struct outbuf *ob)
+{
+    outbuf_puts(ob,
+        "[Events]\n"
+        "Format: Layer, Start, End, Style, Name, MarginL, MarginR, MarginV, Effect, Text\n");
+}
+
+static size_t event_size(void *arg, const struct tagtext_event *ev)
+{
+    struct ass_ctx *actx = arg;
+    bool in_brace = true;
+
+    actx->scratch.len = 0;
+    render_tagtext_event_style(ev, &actx->scratch, &in_brace);
+    return actx->scratch.len;
+}
+
+/*
+ * The captions are already known, so the styles can be optimized before the header is written.
+ * Only the style counts are kept, the overlays are made again when the captions are written
+ */
+static void optimize_styles(struct ass_writer *aw, const struct subobj_ctx *sctx)
+{
+    struct ass_ctx *actx = &aw->actx;
+    struct tagtext_event line_styles[TT_MAX_LINE_STYLES][TT_STYLE_COUNT_];
+    struct tagtext_optimize_opts topts = {
+        .max_styles = actx->prof->max_styles,
+        .event_size = event_size,
+        .event_size_arg = actx,
+    };
+    const struct ass_style base_style = actx->styles[0];
+    int count;
 
-    err = tagtext_parse_captions(sctx->subobjs, &tt_captions, opt_ass_optimize ? default_styles : NULL);
-    if (err != NOERR) {
-        goto end;
+    actx->scratch.len = 0;
+    put_style(&actx->scratch, &actx->styles[0]);
+    topts.style_size = actx->scratch.len;
+
+    aw->actx.quiet = true;
+    for (intptr_t i = 0; i < arrlen(sctx->subobjs); i++) {
+        struct subobj_caption so_caption;
+
+        process_subobj_chars(&aw->actx, &sctx->subobjs[i], &aw->tt_arena, &so_caption);
+        tagtext_iter_count(aw->tt_iter, &so_caption);
+        arena_reset(&aw->tt_arena);
     }
-    if (opt_ass_optimize) {
-        ass_style_update_from_tt_events(default_styles, &actx.default_style);
+    aw->actx.quiet = false;
+    aw->actx.adjust_newfs = -1;
+
+    /* Default is left as is without any chars */
+    count = tagtext_iter_optimize(aw->tt_iter, &topts, line_styles);
+    for (int i = 0; i < count; i++) {
+        struct ass_style *st = &actx->styles[i];
+
+        *st = base_style;
+        if (i > 0) {
+            snprintf(actx->style_names[i], sizeof(actx->style_names[i]), "Style%d", i);
+            st->name = actx->style_names[i];
+        }
+        ass_style_update_from_tt_events(line_styles[i], st);
     }
+    actx->style_count = MAX(count, 1);
+}
+
+/*
+ * Load the widths of all the chars of the file on the threads the writer set gave to this sink,
+ * the passes over the captions then find them in the cache
+ */
+static void prefill_metrics(struct ass_ctx *actx, const struct subobj_ctx *sctx, int threads)
+{
+    uint64_t stb_array *keys = NULL;
+
+    /* The spacing calculation needs the width of every char, the ruby shift only a few */
+    if (actx->prof->constant_spacing != -1)
+        return;
+
+    for (const struct subobj *s = sctx->subobjs; s < arrendptr(sctx->subobjs); s++) {
+        const struct subobj_caption *so_caption = &s->so_caption;
+
+        for (const struct subobj_caption_region *so_region = so_caption->so_regions; so_region < arrendptr(so_caption->so_regions); so_region++) {
+            for (const struct subobj_caption_char *so_chr = so_region->so_chars; so_chr < arrendptr(so_region->so_chars); so_chr++) {
+                int fs = subobj_char_style(so_caption, so_chr)->char_height;
 
-    f = pfopen(filepath, PSTR("wb"));
-    if (f == NULL) {
-        err = -errno;
-        goto end;
+                /* Same as in process_subobj_chars() */
+                if (actx->prof->fs_adjust)
+                    fs = fm_adjust_fs(&actx->fm, fs);
+                arrput(keys, FM_CHAR_KEY(fs, so_chr->ref->codepoint));
+            }
+        }
     }
 
+    fm_prefill(&actx->fm, actx->prof->font_path, actx->prof->font_face, keys, arrlenu(keys), threads);
+    arrfree(keys);
+}
+
+static enum error ass_begin_file(struct ass_writer *aw, struct outbuf *ob, const struct subobj_ctx *sctx, int threads)
+{
+    prefill_metrics(&aw->actx, sctx, threads);
+    if (aw->actx.prof->optimize)
+        optimize_styles(aw, sctx);
+
     if (arrlen(sctx->subobjs) > 0) {
         const struct subobj *s = &sctx->subobjs[0];
-        write_header(f, s[0].caption_ref.plane_width, s[0].caption_ref.plane_height);
+        write_header(ob, s[0].caption_ref.plane_width, s[0].caption_ref.plane_height);
 
-        write_styles(f, &actx.default_style);
+        write_styles(ob, aw->actx.styles, aw->actx.style_count);
     }
 
-    fputs(
-        "[Events]\n"
-        "Format: Layer, Start, End, Style, Name, MarginL, MarginR, MarginV, Effect, Text\n",
-        f);
-
-    for (intptr_t i = 0; i < arrlen(tt_captions); i++) {
-        char start_str[32], end_str[32], text_buffer[16*1024];
-        struct ass_lines alines = {
-            .storage = text_buffer,
-            .storage_size = sizeof(text_buffer),
-            .lines_size = ARRAY_COUNT(alines.lines),
-        };
-        struct tagtext_caption *ttc = &tt_captions[i];
+    write_events_header(ob);
+    aw->header_written = true;
+    return NOERR;
+}
 
-        ms_to_str(ttc->ref_subobj->start_ms, start_str);
-        ms_to_str(ttc->ref_subobj->end_ms, end_str);
+static enum error ass_begin(void *state, struct outbuf *ob, const struct subobj_ctx *sctx, const void *opts, int threads)
+{
+    struct ass_writer *aw = state;
+    enum error err;
+
+    /* When streaming, the styles are written before the captions are known, so they can't be optimized */
+    err = ass_ctx_create(&aw->actx, opts);
+    if (err != NOERR)
+        return err;
+    aw->tt_iter = tagtext_iter_create();
+
+    if (sctx)
+        return ass_begin_file(aw, ob, sctx, threads);
+    return NOERR;
+}
 
-        render_caption(&actx, ttc, &alines);
+/*
+ * The .ass output has its own overlay of the chars, so it doesn't use
+ * the shared tagtext of the caption
+ */
+static enum error ass_caption(void *state, struct outbuf *ob, const struct writer_caption *wc)
+{
+    struct ass_writer *aw = state;
+    struct ass_ctx *actx = &aw->actx;
+    const struct subobj *s = wc->s;
+    const struct caption_cache_entry *hit;
+    struct subobj_caption so_caption;
+    struct tagtext_caption ttc;
+    size_t hash;
+    enum error err;
+
+    if (aw->header_written == false) {
+        /* The plane size is only known from the first caption */
+        write_header(ob, s->caption_ref.plane_width, s->caption_ref.plane_height);
+        write_styles(ob, actx->styles, actx->style_count);
+        write_events_header(ob);
+        aw->header_written = true;
+    }
+
+    process_subobj_chars(actx, s, &aw->tt_arena, &so_caption);
 
-        for (struct ass_line *al = &alines.lines[0]; al < &alines.lines[alines.lines_idx]; al++) {
-            fprintf(f, "Dialogue: %d,%s,%s,Default,,0000,0000,0000,,%s\n", al->layer, start_str, end_str, al->text_ptr);
+    caption_signature(&so_caption, &actx->sig);
+    hash = stbds_hash_bytes(actx->sig.data, actx->sig.len, 0);
+    actx->cache_lookups++;
+    hit = cache_find(actx, hash);
+    if (hit) {
+        actx->cache_hits++;
+        lines_from_cache(actx, hit, s);
+        err = NOERR;
+    } else {
+        err = tagtext_iter_parse(aw->tt_iter, s, &so_caption, &ttc);
+        if (err == NOERR) {
+            render_caption(actx, &ttc);
+            cache_add(actx, hash);
         }
     }
 
-end:
-    if (f)
-		fclose(f);
-    fm_destroy(&actx.fm);
-    font_destroy(&actx.font);
-    if (tt_captions)
-		tagtext_captions_free(tt_captions);
+    if (err == NOERR) {
+        if (actx->prof->debug_boxes)
+            render_debug_boxes(actx, s);
+        write_lines(actx, ob);
+    }
+    arena_reset(&aw->tt_arena);
     return err;
 }
+
+/* The events still open with merge_events end with the last caption. Also logs the cache stats */
+static enum error ass_end(void *state, struct outbuf *ob)
+{
+    struct ass_writer *aw = state;
+    struct ass_ctx *actx = &aw->actx;
+
+    for (const struct ass_event *ev = actx->open; ev < arrendptr(actx->open); ev++)
+        put_event(ob, ev, actx->open_text.data);
+    arrsetlen(actx->open, 0);
+    actx->open_text.len = 0;
+
+    if (actx->cache_lookups > 0)
+        log_info("Rendered caption cache (%s): %" PRIi64 " of %" PRIi64 " captions reused (%.1f%%)\n",
+                actx->prof->name ? actx->prof->name : PSTR("default"), actx->cache_hits, actx->cache_lookups,
+                100.0 * actx->cache_hits / actx->cache_lookups);
+    fm_log_stats(&actx->fm);
+    return NOERR;
+}
+
+static void ass_destroy(void *state)
+{
+    struct ass_writer *aw = state;
+
+    ass_ctx_destroy(&aw->actx);
+    arena_free(&aw->tt_arena);
+    if (aw->tt_iter)
+        tagtext_iter_free(aw->tt_iter);
+}
+
+const struct writer_ops ass_writer_ops = {
+    .name = "ass",
+    .state_size = sizeof(struct ass_writer),
+    .independent = true,
+    .begin = ass_begin,
+    .caption_begin = ass_caption,
+    .end = ass_end,
+    .destroy = ass_destroy,
+};
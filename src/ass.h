@@ -1,9 +1,12 @@
 #ifndef A2AC_ASS_H
 #define A2AC_ASS_H
-#include "error.h"
-#include "subobj.h"
-#include "platform.h"
+#include "writer.h"
 
-enum error ass_write(const struct subobj_ctx *sctx, const pchar *filepath);
+/*
+ * In file mode, the default style is optimized for all captions before they are written.
+ * When streaming, the fixed default style is used. The subobjs are not modified.
+ * The opts of the writer is the struct ass_profile to use
+ */
+extern const struct writer_ops ass_writer_ops;
 
 #endif /* A2AC_ASS_H */
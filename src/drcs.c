@@ -17,42 +17,149 @@ struct drcs_conv {
     char *key;
     char32_t value;
 };
-/* Custom DRCS replacing on top of what libaribcaption already does */
-static const struct drcs_conv static_replace_map[] = {
-    {"063c95566807d5e7b51ab706426bedf9", 0x1F4F1},
-    {"06cb56043b9c4006bcfbe07cc831feaf", 0x1F50A},
-    {"170193c22e22a88904c34f3ec7129ddb", 0x1F5A5},
-    {"33d4c5243a45503d43fbb858a728664d", 0x1F4F1},
-    {"3830a0e0148cfb20309ed54d89472156", 0x1F4DE},
-    {"4ba716a88c003ca0a069392be3b63951", 0x27A1},
-    {"5063561406195ca45f5992e3f7ad77d2", 0xFF5F},
-    {"516a7b4eb9de2841903301997e881e9d", 0x1F50A},
-    {"56b48663ae06a5545e5b233bb006cdf0", 0x1F4F1},
-    {"5c31e7978a711d0ca0469b294cb47ca6", 0x1F50A},
-    {"68fc649b4a57a6103a25dc678fcec9f4", 0x1F4F1},
-    {"6d5aa3ff99a144bd5138562787f58590", 0x1F4F1},
-    {"74d535ca9f47d57fd78234f7019a525e", 0x269F},
-    {"7542bc0875d546542d2435daa99821bb", 0x1F4F1},
-    {"804a5bcdcbf1ba977c92d3d58a1cdfe1", 0x1F50A},
-    {"86aed3fe53ad8f629253795c87452fab", 0x1F4F2},
-    {"a368b4ce2212ef80e2bf3d68559f5151", 0x1F4FA},
-    {"a97b575907c06f39c8ac0ed26c49e328", 0x1F4F1},
-    {"c35c7e6816e10be8304f2d876426c9e7", 0x1F4F1},
-    {"c42450812c184aee2ae01cc5e39ae957", 0x1F4FB},
-    {"d84fc83615b75802ed422eda4ba39465", 0xFF60},
-    {"df055ddbbdbb84d22900081137c070b0", 0x1F5A5},
-    {"fe720d2a491d8a4441151c49cd8ab4f6", 0x1F5B3},
+
+struct drcs_static_conv {
+    struct drcs_digest digest;
+    char32_t value;
+};
+/*
+ * Custom DRCS replacing on top of what libaribcaption already does.
+ * A perfect hash of the digests: each one is at the index static_slot() gives for it.
+ * Don't add entries by hand, tools/drcs_static_map.py generates the table (searching
+ * DRCS_STATIC_MULT again if needed), and checks it with --check
+ */
+#define DRCS_STATIC_BITS 5
+#define DRCS_STATIC_MULT 0x33873u
+static const struct drcs_static_conv static_replace_map[1 << DRCS_STATIC_BITS] = {
+    [ 1] = { {{ 0xc4, 0x24, 0x50, 0x81, 0x2c, 0x18, 0x4a, 0xee, 0x2a, 0xe0, 0x1c, 0xc5, 0xe3, 0x9a, 0xe9, 0x57 }}, 0x1F4FB }, /* c42450812c184aee2ae01cc5e39ae957 */
+    [ 2] = { {{ 0x80, 0x4a, 0x5b, 0xcd, 0xcb, 0xf1, 0xba, 0x97, 0x7c, 0x92, 0xd3, 0xd5, 0x8a, 0x1c, 0xdf, 0xe1 }}, 0x1F50A }, /* 804a5bcdcbf1ba977c92d3d58a1cdfe1 */
+    [ 3] = { {{ 0x74, 0xd5, 0x35, 0xca, 0x9f, 0x47, 0xd5, 0x7f, 0xd7, 0x82, 0x34, 0xf7, 0x01, 0x9a, 0x52, 0x5e }}, 0x269F }, /* 74d535ca9f47d57fd78234f7019a525e */
+    [ 5] = { {{ 0xfe, 0x72, 0x0d, 0x2a, 0x49, 0x1d, 0x8a, 0x44, 0x41, 0x15, 0x1c, 0x49, 0xcd, 0x8a, 0xb4, 0xf6 }}, 0x1F5B3 }, /* fe720d2a491d8a4441151c49cd8ab4f6 */
+    [ 6] = { {{ 0x50, 0x63, 0x56, 0x14, 0x06, 0x19, 0x5c, 0xa4, 0x5f, 0x59, 0x92, 0xe3, 0xf7, 0xad, 0x77, 0xd2 }}, 0xFF5F }, /* 5063561406195ca45f5992e3f7ad77d2 */
+    [ 7] = { {{ 0x06, 0x3c, 0x95, 0x56, 0x68, 0x07, 0xd5, 0xe7, 0xb5, 0x1a, 0xb7, 0x06, 0x42, 0x6b, 0xed, 0xf9 }}, 0x1F4F1 }, /* 063c95566807d5e7b51ab706426bedf9 */
+    [ 8] = { {{ 0x33, 0xd4, 0xc5, 0x24, 0x3a, 0x45, 0x50, 0x3d, 0x43, 0xfb, 0xb8, 0x58, 0xa7, 0x28, 0x66, 0x4d }}, 0x1F4F1 }, /* 33d4c5243a45503d43fbb858a728664d */
+    [ 9] = { {{ 0x56, 0xb4, 0x86, 0x63, 0xae, 0x06, 0xa5, 0x54, 0x5e, 0x5b, 0x23, 0x3b, 0xb0, 0x06, 0xcd, 0xf0 }}, 0x1F4F1 }, /* 56b48663ae06a5545e5b233bb006cdf0 */
+    [10] = { {{ 0x06, 0xcb, 0x56, 0x04, 0x3b, 0x9c, 0x40, 0x06, 0xbc, 0xfb, 0xe0, 0x7c, 0xc8, 0x31, 0xfe, 0xaf }}, 0x1F50A }, /* 06cb56043b9c4006bcfbe07cc831feaf */
+    [11] = { {{ 0xd8, 0x4f, 0xc8, 0x36, 0x15, 0xb7, 0x58, 0x02, 0xed, 0x42, 0x2e, 0xda, 0x4b, 0xa3, 0x94, 0x65 }}, 0xFF60 }, /* d84fc83615b75802ed422eda4ba39465 */
+    [12] = { {{ 0x5c, 0x31, 0xe7, 0x97, 0x8a, 0x71, 0x1d, 0x0c, 0xa0, 0x46, 0x9b, 0x29, 0x4c, 0xb4, 0x7c, 0xa6 }}, 0x1F50A }, /* 5c31e7978a711d0ca0469b294cb47ca6 */
+    [13] = { {{ 0x4b, 0xa7, 0x16, 0xa8, 0x8c, 0x00, 0x3c, 0xa0, 0xa0, 0x69, 0x39, 0x2b, 0xe3, 0xb6, 0x39, 0x51 }}, 0x27A1 }, /* 4ba716a88c003ca0a069392be3b63951 */
+    [15] = { {{ 0x51, 0x6a, 0x7b, 0x4e, 0xb9, 0xde, 0x28, 0x41, 0x90, 0x33, 0x01, 0x99, 0x7e, 0x88, 0x1e, 0x9d }}, 0x1F50A }, /* 516a7b4eb9de2841903301997e881e9d */
+    [16] = { {{ 0x38, 0x30, 0xa0, 0xe0, 0x14, 0x8c, 0xfb, 0x20, 0x30, 0x9e, 0xd5, 0x4d, 0x89, 0x47, 0x21, 0x56 }}, 0x1F4DE }, /* 3830a0e0148cfb20309ed54d89472156 */
+    [17] = { {{ 0xa3, 0x68, 0xb4, 0xce, 0x22, 0x12, 0xef, 0x80, 0xe2, 0xbf, 0x3d, 0x68, 0x55, 0x9f, 0x51, 0x51 }}, 0x1F4FA }, /* a368b4ce2212ef80e2bf3d68559f5151 */
+    [18] = { {{ 0x17, 0x01, 0x93, 0xc2, 0x2e, 0x22, 0xa8, 0x89, 0x04, 0xc3, 0x4f, 0x3e, 0xc7, 0x12, 0x9d, 0xdb }}, 0x1F5A5 }, /* 170193c22e22a88904c34f3ec7129ddb */
+    [20] = { {{ 0x6d, 0x5a, 0xa3, 0xff, 0x99, 0xa1, 0x44, 0xbd, 0x51, 0x38, 0x56, 0x27, 0x87, 0xf5, 0x85, 0x90 }}, 0x1F4F1 }, /* 6d5aa3ff99a144bd5138562787f58590 */
+    [21] = { {{ 0xc3, 0x5c, 0x7e, 0x68, 0x16, 0xe1, 0x0b, 0xe8, 0x30, 0x4f, 0x2d, 0x87, 0x64, 0x26, 0xc9, 0xe7 }}, 0x1F4F1 }, /* c35c7e6816e10be8304f2d876426c9e7 */
+    [23] = { {{ 0xa9, 0x7b, 0x57, 0x59, 0x07, 0xc0, 0x6f, 0x39, 0xc8, 0xac, 0x0e, 0xd2, 0x6c, 0x49, 0xe3, 0x28 }}, 0x1F4F1 }, /* a97b575907c06f39c8ac0ed26c49e328 */
+    [26] = { {{ 0x86, 0xae, 0xd3, 0xfe, 0x53, 0xad, 0x8f, 0x62, 0x92, 0x53, 0x79, 0x5c, 0x87, 0x45, 0x2f, 0xab }}, 0x1F4F2 }, /* 86aed3fe53ad8f629253795c87452fab */
+    [27] = { {{ 0x68, 0xfc, 0x64, 0x9b, 0x4a, 0x57, 0xa6, 0x10, 0x3a, 0x25, 0xdc, 0x67, 0x8f, 0xce, 0xc9, 0xf4 }}, 0x1F4F1 }, /* 68fc649b4a57a6103a25dc678fcec9f4 */
+    [28] = { {{ 0x75, 0x42, 0xbc, 0x08, 0x75, 0xd5, 0x46, 0x54, 0x2d, 0x24, 0x35, 0xda, 0xa9, 0x98, 0x21, 0xbb }}, 0x1F4F1 }, /* 7542bc0875d546542d2435daa99821bb */
+    [30] = { {{ 0xdf, 0x05, 0x5d, 0xdb, 0xbd, 0xbb, 0x84, 0xd2, 0x29, 0x00, 0x08, 0x11, 0x37, 0xc0, 0x70, 0xb0 }}, 0x1F5A5 }, /* df055ddbbdbb84d22900081137c070b0 */
 };
 
+/* Resolved replacements by digest, for drcs_get_replacement_cached() */
+static struct drcs_memo {
+    struct drcs_digest key;
+    char32_t value;
+} stb_hmap *memo = NULL;
+static struct platform_mutex memo_lock = PLATFORM_MUTEX_INITIALIZER;
+
 /* Dynamic hash map of md5sum -> replacement codepoint for
  * drcs values. Overrides static_replace_map */
 struct drcs_conv stb_hmap *dyn_replace_map = NULL;
+/* stb_ds lookups modify the map header, so they need a lock
+ * when files are processed in parallel */
+static struct platform_mutex dyn_replace_map_lock = PLATFORM_MUTEX_INITIALIZER;
 
 /* Character to use for default replacements
  * 0 if not set */
 char32_t default_repl_char = 0;
 
-static void write_file_to_drcs_dir(const char *filename, const uint8_t *data, size_t data_size)
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+bool drcs_digest_from_md5(const char *md5, struct drcs_digest *out)
+{
+    for (int i = 0; i < 16; i++) {
+        int hi = hex_value(md5[i * 2]), lo;
+
+        if (hi < 0)
+            return false;
+        lo = hex_value(md5[i * 2 + 1]);
+        if (lo < 0)
+            return false;
+        out->b[i] = hi << 4 | lo;
+    }
+    return md5[32] == '\0';
+}
+
+static unsigned static_slot(const struct drcs_digest *digest)
+{
+    uint32_t k = digest->b[0] | digest->b[1] << 8 | digest->b[2] << 16 | (uint32_t)digest->b[3] << 24;
+
+    return (uint32_t)(k * DRCS_STATIC_MULT) >> (32 - DRCS_STATIC_BITS);
+}
+
+/* 0 if it's not in static_replace_map */
+static char32_t static_lookup(const struct drcs_digest *digest)
+{
+    const struct drcs_static_conv *e = &static_replace_map[static_slot(digest)];
+
+    if (e->value != 0 && memcmp(&e->digest, digest, sizeof(*digest)) == 0)
+        return e->value;
+    return 0;
+}
+
+/*
+ * The drcs images are written by a background thread, and every one only once per run.
+ * Programs with a drcs on every line would otherwise encode and try to write it for every caption
+ */
+enum drcs_write_kind {
+    DRCS_WRITE_UNKNOWN,         /* drcs_write_to_png() */
+    DRCS_WRITE_DUMP,            /* --dump-drcs */
+    DRCS_WRITE_DUMP_REPLACED,
+};
+
+struct drcs_written_key {
+    struct drcs_digest digest;
+    uint16_t w, h;
+    uint8_t kind;
+};
+
+/* An image waiting for the thread, the pixels are copied as the drcs map is freed after the caption */
+struct drcs_write {
+    pchar fname[64];
+    bool png;
+    int w, h, depth;
+    uint8_t *px;
+    size_t pxsize;
+};
+
+static struct {
+    struct platform_mutex lock;
+    struct platform_cond cond;
+    struct drcs_write stb_array *queue;
+    struct {
+        struct drcs_written_key key;
+        char value;
+    } stb_hmap *queued;
+    struct platform_thread thread;
+    /* The messages of the dump thread, printed by drcs_dump_finish() */
+    pchar stb_array *log;
+    bool started, stop, dir_made;
+} dumper = {
+    .lock = PLATFORM_MUTEX_INITIALIZER,
+    .cond = PLATFORM_COND_INITIALIZER,
+};
+
+static void write_file_to_drcs_dir(const pchar *filename, const uint8_t *data, size_t data_size)
 {
     const pchar *subdir = PSTR("drcs");
     pchar fpath[384];
@@ -69,10 +176,14 @@ static void write_file_to_drcs_dir(const char *filename, const uint8_t *data, si
     n = psnprintf(fpath, sizeof(fpath), PSTR("%s%c%s%n%c%s"), curr_dir, PATHSPECC, subdir, &dirend, PATHSPECC, filename);
     assert(n + 1 < ARRAY_COUNT(fpath));
 
-    assert(fpath[dirend] == PATHSPECC);
-    fpath[dirend] = '\0';
-    mkdir_p(fpath);
-    fpath[dirend] = PATHSPECC;
+    if (dumper.dir_made == false) {
+        assert(fpath[dirend] == PATHSPECC);
+        fpath[dirend] = '\0';
+        /* Tried again for the next file if it failed, the open below logs the error */
+        if (mkdir_p(fpath) == 0)
+            dumper.dir_made = true;
+        fpath[dirend] = PATHSPECC;
+    }
 
     fd = plopen(fpath, O_WRONLY | O_CREAT | O_EXCL | _O_BINARY, 0644);
     if (fd == -1) {
@@ -98,33 +209,104 @@ end:
 #endif
 }
 
-enum error drcs_write_to_png(aribcc_drcs_t *drcs)
+static void write_drcs(struct drcs_write *wr)
 {
-    pchar fname[64];
-    enum error err;
-    int d, depth, w, h, n;
-    size_t pxsize, png_data_size;
-    uint8_t *png_data, *px;
+    if (wr->png) {
+        uint8_t *png_data;
+        size_t png_data_size;
+
+        if (png_encode(wr->w, wr->h, wr->depth, wr->px, wr->pxsize, &png_data, &png_data_size) == NOERR) {
+            write_file_to_drcs_dir(wr->fname, png_data, png_data_size);
+            free(png_data);
+        }
+    } else {
+        write_file_to_drcs_dir(wr->fname, wr->px, wr->pxsize);
+    }
+    free(wr->px);
+}
+
+static void dump_thread(void *arg)
+{
+    /* It writes the images of every file, so its errors aren't
+     * mixed into the buffered log of whichever file is being processed */
+    log_buffer_begin();
+    for (;;) {
+        struct drcs_write stb_array *jobs;
+
+        platform_mutex_lock(&dumper.lock);
+        while (arrlen(dumper.queue) == 0 && dumper.stop == false)
+            platform_cond_wait(&dumper.cond, &dumper.lock);
+        jobs = dumper.queue;
+        dumper.queue = NULL;
+        platform_mutex_unlock(&dumper.lock);
+
+        /* Only empty when stopped */
+        if (arrlen(jobs) == 0)
+            break;
+        for (intptr_t i = 0; i < arrlen(jobs); i++)
+            write_drcs(&jobs[i]);
+        arrfree(jobs);
+    }
+    dumper.log = log_buffer_take();
+}
+
+/* fname is formatted from fmt with the width, height, depth and md5 of the drcs, in this order */
+static void queue_drcs(aribcc_drcs_t *dr, enum drcs_write_kind kind, bool png, const pchar *fmt, int replaced)
+{
+    struct drcs_written_key key = {0};
+    struct drcs_write wr = { .png = png };
     const char *md5;
+    uint8_t *px;
+    int d, n;
 
-    aribcc_drcs_get_size(drcs, &w, &h);
-    aribcc_drcs_get_depth(drcs, &d, &depth),
-    aribcc_drcs_get_pixels(drcs, &px, &pxsize);
-    md5 = aribcc_drcs_get_md5(drcs);
+    aribcc_drcs_get_size(dr, &wr.w, &wr.h);
+    md5 = aribcc_drcs_get_md5(dr);
 
-    err = png_encode(w, h, depth, px, pxsize, &png_data, &png_data_size);
-    if (err != NOERR)
-        return err;
+    /* Zeroed with the padding, as the key is hashed as bytes */
+    memset(&key, 0, sizeof(key));
+    key.w = wr.w;
+    key.h = wr.h;
+    key.kind = kind;
+    if (drcs_digest_from_md5(md5, &key.digest)) {
+        platform_mutex_lock(&dumper.lock);
+        bool seen = hmgeti(dumper.queued, key) != -1;
+        if (seen == false)
+            hmput(dumper.queued, key, 0);
+        platform_mutex_unlock(&dumper.lock);
+        if (seen)
+            return;
+    }
 
-    n = psnprintf(fname, sizeof(fname), PSTR("%s.png"), u8PC(md5));
-    assert(n + 1 < ARRAY_COUNT(fname));
+    aribcc_drcs_get_depth(dr, &d, &wr.depth);
+    aribcc_drcs_get_pixels(dr, &px, &wr.pxsize);
+    wr.px = malloc(wr.pxsize);
+    assert(wr.px);
+    memcpy(wr.px, px, wr.pxsize);
+    if (kind == DRCS_WRITE_UNKNOWN)
+        n = psnprintf(wr.fname, sizeof(wr.fname), fmt, u8PC(md5));
+    else
+        n = psnprintf(wr.fname, sizeof(wr.fname), fmt, replaced, wr.w, wr.h, wr.depth, u8PC(md5));
+    assert(n + 1 < ARRAY_COUNT(wr.fname));
+
+    platform_mutex_lock(&dumper.lock);
+    if (dumper.started == false && dumper.stop == false)
+        dumper.started = (platform_thread_create(&dumper.thread, dump_thread, NULL) == 0);
+    if (dumper.started) {
+        arrput(dumper.queue, wr);
+        platform_cond_signal(&dumper.cond);
+    } else {
+        /* Written here, one at a time */
+        write_drcs(&wr);
+    }
+    platform_mutex_unlock(&dumper.lock);
+}
 
-    write_file_to_drcs_dir(fname, png_data, png_data_size);
-    free(png_data);
+enum error drcs_write_to_png(aribcc_drcs_t *drcs)
+{
+    queue_drcs(drcs, DRCS_WRITE_UNKNOWN, true, PSTR("%s.png"), 0);
     return NOERR;
 }
 
-
 /* To convert the raw pixel data to an image:
  * convert -depth [depth] -size [width]x[height] gray:drcs.bin out.png
  */
@@ -132,11 +314,6 @@ static void drcs_dump_char(aribcc_drcsmap_t *map, const aribcc_caption_char_t *c
 {
     assert(chr->type == ARIBCC_CHARTYPE_DRCS || chr->type == ARIBCC_CHARTYPE_DRCS_REPLACED);
 
-    pchar fname[64];
-    int d, depth, w, h, n;
-    size_t pxsize;
-    uint8_t *px;
-    const char *md5;
     aribcc_drcs_t *dr;
     bool replaced;
 
@@ -144,59 +321,34 @@ static void drcs_dump_char(aribcc_drcsmap_t *map, const aribcc_caption_char_t *c
     assert(dr);
 
     replaced = (chr->type == ARIBCC_CHARTYPE_DRCS_REPLACED);
-    aribcc_drcs_get_size(dr, &w, &h);
-    aribcc_drcs_get_depth(dr, &d, &depth),
-    aribcc_drcs_get_pixels(dr, &px, &pxsize);
-    md5 = aribcc_drcs_get_md5(dr);
-
     if (replaced == false) {
-        for (int i = 0; i < ARRAY_COUNT(static_replace_map); i++) {
-            if (strcmp(static_replace_map[i].key, md5) == 0) {
-                replaced = true;
-                break;
-            }
-        }
+        struct drcs_digest digest;
+
+        replaced = drcs_digest_from_md5(aribcc_drcs_get_md5(dr), &digest) && static_lookup(&digest) != 0;
     }
 
     if (opt_dump_drcs_format == PNG) {
-        uint8_t *png_data;
-        size_t png_data_size;
-
-        enum error err = png_encode(w, h, depth, px, pxsize, &png_data, &png_data_size);
-        if (err != NOERR)
-            return;
-
-        n = psnprintf(fname, sizeof(fname), PSTR("%d_%d_%d_%d_%s.png"),
-                replaced, w, h, depth, u8PC(md5));
-        assert(n + 1 < ARRAY_COUNT(fname));
-
-        write_file_to_drcs_dir(fname, png_data, png_data_size);
-        free(png_data);
+        queue_drcs(dr, replaced ? DRCS_WRITE_DUMP_REPLACED : DRCS_WRITE_DUMP, true,
+                PSTR("%d_%d_%d_%d_%s.png"), replaced);
     } else if (opt_dump_drcs_format == BIN) {
         /* Filename format is
          * REPLACED_WIDTH_HEIGHT_DEPTH_MD5.bin
          */
-        n = psnprintf(fname, sizeof(fname), PSTR("%d_%d_%d_%d_%s.bin"),
-                replaced, w, h, depth, u8PC(md5));
-        assert(n + 1 < ARRAY_COUNT(fname));
-        write_file_to_drcs_dir(fname, px, pxsize);
+        queue_drcs(dr, replaced ? DRCS_WRITE_DUMP_REPLACED : DRCS_WRITE_DUMP, false,
+                PSTR("%d_%d_%d_%d_%s.bin"), replaced);
     }
 }
 
-enum error drcs_dump(const struct subobj_ctx *s)
+enum error drcs_dump_caption(const aribcc_caption_t *caption)
 {
-    for (intptr_t ai = 0; ai < arrlen(s->subobjs); ai++) {
-        const aribcc_caption_t *caption = &s->subobjs[ai].caption_ref;
-
-        for (uint32_t ri = 0; ri < caption->region_count; ri++) {
-            const aribcc_caption_region_t *region = &caption->regions[ri];
+    for (uint32_t ri = 0; ri < caption->region_count; ri++) {
+        const aribcc_caption_region_t *region = &caption->regions[ri];
 
-            for (uint32_t ci = 0; ci < region->char_count; ci++) {
-                const aribcc_caption_char_t *chr = &region->chars[ci];
+        for (uint32_t ci = 0; ci < region->char_count; ci++) {
+            const aribcc_caption_char_t *chr = &region->chars[ci];
 
-                if (chr->type == ARIBCC_CHARTYPE_DRCS || chr->type == ARIBCC_CHARTYPE_DRCS_REPLACED) {
-                    drcs_dump_char(caption->drcs_map, chr);
-                }
+            if (chr->type == ARIBCC_CHARTYPE_DRCS || chr->type == ARIBCC_CHARTYPE_DRCS_REPLACED) {
+                drcs_dump_char(caption->drcs_map, chr);
             }
         }
     }
@@ -209,15 +361,19 @@ enum error drcs_dump(const struct subobj_ctx *s)
  */
 char32_t drcs_get_replacement_ucs4_by_md5(const char *md5)
 {
+    platform_mutex_lock(&dyn_replace_map_lock);
     const struct drcs_conv *di = shgetp_null(dyn_replace_map, md5);
+    char32_t dyn_value = di ? di->value : 0;
+    platform_mutex_unlock(&dyn_replace_map_lock);
     if (di) {
-        return di->value;
+        return dyn_value;
     }
 
-    for (int i = 0; i < ARRAY_COUNT(static_replace_map); i++) {
-        if (strcmp(static_replace_map[i].key, md5) == 0) {
-            return static_replace_map[i].value;
-        }
+    struct drcs_digest digest;
+    if (drcs_digest_from_md5(md5, &digest)) {
+        char32_t static_value = static_lookup(&digest);
+        if (static_value != 0)
+            return static_value;
     }
 
     if (default_repl_char != 0) {
@@ -227,6 +383,31 @@ char32_t drcs_get_replacement_ucs4_by_md5(const char *md5)
     return 0;
 }
 
+char32_t drcs_get_replacement_cached(const char *md5, bool *first)
+{
+    struct drcs_digest digest;
+    ptrdiff_t mi;
+    char32_t rc;
+
+    if (drcs_digest_from_md5(md5, &digest) == false) {
+        *first = true;
+        return drcs_get_replacement_ucs4_by_md5(md5);
+    }
+
+    platform_mutex_lock(&memo_lock);
+    mi = hmgeti(memo, digest);
+    if (mi != -1) {
+        rc = memo[mi].value;
+        *first = false;
+    } else {
+        rc = drcs_get_replacement_ucs4_by_md5(md5);
+        hmput(memo, digest, rc);
+        *first = true;
+    }
+    platform_mutex_unlock(&memo_lock);
+    return rc;
+}
+
 enum error drcs_add_mapping(const char *md5, char32_t codepoint)
 {
     if (md5 != NULL) {
@@ -340,4 +521,21 @@ void drcs_free()
     for (size_t i = 0; i < len; i++)
         free((char*)dyn_replace_map[i].key);
     shfree(dyn_replace_map);
+    hmfree(memo);
+}
+
+void drcs_dump_finish()
+{
+    platform_mutex_lock(&dumper.lock);
+    dumper.stop = true;
+    platform_cond_signal(&dumper.cond);
+    platform_mutex_unlock(&dumper.lock);
+
+    if (dumper.started) {
+        platform_thread_join(&dumper.thread);
+        log_buffer_put(dumper.log);
+        dumper.log = NULL;
+    }
+    dumper.started = false;
+    hmfree(dumper.queued);
 }
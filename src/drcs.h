@@ -13,15 +13,31 @@
  */
 void drcs_free();
 
-enum error drcs_dump(const struct subobj_ctx *s);
-/* Default write it to ./drcs/md5hash.png */
+/* Dump the drcs of a caption as it comes from the decoder, before the drcs map is freed */
+enum error drcs_dump_caption(const aribcc_caption_t *caption);
+/* Default write it to ./drcs/md5hash.png.
+ * Every image is only written once per run, by a background thread */
 enum error drcs_write_to_png(aribcc_drcs_t *drcs);
+/* Wait for the images to be written, and stop the thread */
+void drcs_dump_finish();
+
+/* The binary MD5 of a drcs pattern */
+struct drcs_digest {
+    uint8_t b[16];
+};
+/* From the hex string of aribcc_drcs_get_md5(), false if it isn't one */
+bool drcs_digest_from_md5(const char *md5, struct drcs_digest *out);
 
 /*
  * Get a unicode codepoint for drcs replacement.
  * A return value of 0 means the replacement was not found.
  */
 char32_t drcs_get_replacement_ucs4_by_md5(const char *md5);
+/*
+ * The same, resolved only once per pattern for the whole run.
+ * first is set for the first lookup of the pattern, to log and write its image only once
+ */
+char32_t drcs_get_replacement_cached(const char *md5, bool *first);
 
 /* If md5 is NULL, add it as the default replacement char */
 enum error drcs_add_mapping(const char *md5, char32_t codepoint);
@@ -19,6 +19,8 @@
     X(ERR_FONT_FACE_NOT_FOUND) \
     X(ERR_INVALID_DRCS_REPLACEMENT) \
     X(ERR_NO_DRCS_REPLACEMENT_FOUNT) \
+    X(ERR_CACHE_INVALID) \
+    X(ERR_CACHE_STALE) \
 \
     X(ERR_UNDEF) \
 
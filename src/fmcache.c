@@ -0,0 +1,188 @@
+#include "fmcache.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "outbuf.h"
+#include "stb_ds.h"
+#include "util.h"
+
+/*
+ * The file format, all little endian, is only records until the end:
+ *   u64 font key, u32 codepoint, i32 font size, i32 value, u32 check
+ * There is no header, so processes creating the file at the same time can't write it twice.
+ * The check is a hash of the other fields and the version, a torn or old record is skipped.
+ * Records are only added with a single O_APPEND write, but if that ever leaves a partial record,
+ * the reader finds the next one byte by byte
+ */
+#define FMCACHE_VERSION 1
+#define FMCACHE_RECORD_SIZE ( 8 + 4 * 4 )
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = v >> (i * 8);
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = v >> (i * 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static uint64_t mix(uint64_t h, uint64_t v)
+{
+    h = (h ^ v) * 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 29);
+}
+
+static uint32_t record_check(uint64_t font_key, const struct fmcache_record *r)
+{
+    uint64_t h = mix(FMCACHE_VERSION, font_key);
+
+    h = mix(h, (uint64_t)r->codepoint << 32 | (uint32_t)r->fs);
+    h = mix(h, (uint32_t)r->value);
+    return (uint32_t)h;
+}
+
+uint64_t fmcache_hash_font(const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    uint64_t h = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8)
+        h = mix(h, get_le64(&p[i]));
+    for (; i < size; i++)
+        h = mix(h, p[i]);
+    return mix(h, size);
+}
+
+/* Keep the records of the font from the file data */
+static void parse_records(struct fmcache *c, const uint8_t *data, size_t size)
+{
+    size_t pos = 0, skipped = 0;
+
+    while (pos + FMCACHE_RECORD_SIZE <= size) {
+        const uint8_t *p = &data[pos];
+        uint64_t font_key = get_le64(p);
+        struct fmcache_record r = {
+            .codepoint = get_le32(&p[8]),
+            .fs = (int32_t)get_le32(&p[12]),
+            .value = (int32_t)get_le32(&p[16]),
+        };
+
+        if (get_le32(&p[20]) != record_check(font_key, &r)) {
+            pos++;
+            skipped++;
+            continue;
+        }
+        if (font_key == c->font_key)
+            arrput(c->records, r);
+        pos += FMCACHE_RECORD_SIZE;
+    }
+    if (skipped > 0)
+        log_info("Skipped %zu bytes of invalid records in the metrics cache %s\n", skipped, c->path);
+}
+
+void fmcache_init(struct fmcache *c, const pchar *cache_path, uint64_t font_hash, long face_index, int32_t load_flags)
+{
+    *c = (struct fmcache){
+        .path = pstrdup(cache_path),
+        .font_key = mix(mix(font_hash, (uint64_t)face_index), (uint32_t)load_flags),
+    };
+}
+
+enum error fmcache_read(struct fmcache *c)
+{
+    struct pstat st;
+    uint8_t *data;
+    FILE *f;
+
+    if (pstatfn(c->path, &st) != 0)
+        return errno == ENOENT ? NOERR : -errno;
+    if (st.st_size == 0)
+        return NOERR;
+
+    f = pfopen(c->path, PSTR("rb"));
+    if (f == NULL)
+        return -errno;
+    data = malloc(st.st_size);
+    assert(data);
+    /* Records added after the stat are left for the next time */
+    if (fread(data, 1, st.st_size, f) != (size_t)st.st_size) {
+        enum error err = ferror(f) ? -errno : ERR_CACHE_INVALID;
+        free(data);
+        fclose(f);
+        return err;
+    }
+    fclose(f);
+
+    parse_records(c, data, st.st_size);
+    free(data);
+    return NOERR;
+}
+
+enum error fmcache_append(struct fmcache *c, const struct fmcache_record *records, size_t count)
+{
+    struct outbuf ob = { .fd = -1 };
+    enum error err;
+    struct pstat st;
+
+    if (count == 0)
+        return NOERR;
+
+    if (pstatfn(c->path, &st) == 0 && st.st_size > FMCACHE_MAX_SIZE) {
+        log_info("The metrics cache %s is full, delete it to start a new one\n", c->path);
+        return NOERR;
+    }
+
+    ob.fd = plopen(c->path, O_WRONLY | O_APPEND | O_CREAT | _O_BINARY, 0644);
+    if (ob.fd < 0)
+        return -errno;
+    for (size_t i = 0; i < count; i++) {
+        const struct fmcache_record *r = &records[i];
+        uint8_t *p = (uint8_t *)outbuf_reserve(&ob, FMCACHE_RECORD_SIZE);
+
+        put_le64(p, c->font_key);
+        put_le32(&p[8], r->codepoint);
+        put_le32(&p[12], (uint32_t)r->fs);
+        put_le32(&p[16], (uint32_t)r->value);
+        put_le32(&p[20], record_check(c->font_key, r));
+        ob.len += FMCACHE_RECORD_SIZE;
+    }
+    /* All of it in one write, so the records of different processes are not mixed */
+    err = outbuf_flush(&ob);
+    plclose(ob.fd);
+    outbuf_free(&ob);
+    return err;
+}
+
+void fmcache_free(struct fmcache *c)
+{
+    nnfree(c->path);
+    arrfree(c->records);
+    memset(c, 0, sizeof(*c));
+}
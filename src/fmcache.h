@@ -0,0 +1,48 @@
+#ifndef ARIB2ASS_FMCACHE_H
+#define ARIB2ASS_FMCACHE_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "error.h"
+#include "platform.h"
+#include "defs.h"
+
+/*
+ * Font metrics cache: a file with the glyph widths and adjusted font sizes of the fonts used before,
+ * so the next runs don't have to load the same glyphs again.
+ * Any number of processes can use the same file, they only append their new records to it
+ */
+
+/* The codepoint of the records with an fm_adjust_fs() result */
+#define FMCACHE_ADJUST_FS UINT32_MAX
+/* Nothing is added to a file bigger than this */
+#define FMCACHE_MAX_SIZE (64 * 1024 * 1024)
+
+struct fmcache_record {
+    uint32_t codepoint;
+    int32_t fs;
+    /* The advance of the glyph in 26.6, or the adjusted size */
+    int32_t value;
+};
+
+struct fmcache {
+    pchar *path;
+    /* Hash of the font file, the face and how the glyphs are loaded */
+    uint64_t font_key;
+    /* The records of the font in the file, after fmcache_read() */
+    struct fmcache_record stb_array *records;
+};
+
+/* Hash of the contents of a font file, it can be replaced by an other version with the same name */
+uint64_t fmcache_hash_font(const void *data, size_t size);
+
+/* For the face_index face of the font with font_hash, loaded with load_flags */
+void fmcache_init(struct fmcache *c, const pchar *cache_path, uint64_t font_hash, long face_index, int32_t load_flags);
+/* A missing cache file is not an error, it is created with the first records */
+enum error fmcache_read(struct fmcache *c);
+/* Append the records to the file, in a single write */
+enum error fmcache_append(struct fmcache *c, const struct fmcache_record *records, size_t count);
+void fmcache_free(struct fmcache *c);
+
+#endif /* ARIB2ASS_FMCACHE_H */
@@ -12,16 +12,32 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <uchar.h>
+#include <errno.h>
 
 #include "util.h"
 #include "log.h"
+#include "stb_ds.h"
 
 #include FT_SFNT_NAMES_H
 #include FT_TRUETYPE_IDS_H
 
 static char *get_font_sfnt_name(FT_Face face);
 
-FT_Library ftlib = NULL;
+/* A FT_Library must not be used from multiple threads at the same time,
+ * so every thread processing files has its own */
+PLATFORM_THREAD_LOCAL FT_Library ftlib = NULL;
+
+/* The fonts of every thread, kept until font_registry_free() */
+static struct font_file stb_array **registry = NULL;
+static struct platform_mutex registry_lock = PLATFORM_MUTEX_INITIALIZER;
+
+/* The faces opened on this thread, reused by the next font_create() of the same font */
+struct thread_face {
+    struct font_file *file;
+    FT_Face face;
+    bool in_use;
+};
+static PLATFORM_THREAD_LOCAL struct thread_face stb_array *thread_faces = NULL;
 
 void font_init()
 {
@@ -35,118 +51,207 @@ void font_dinit()
 {
     assert(ftlib != NULL);
 
+    for (intptr_t i = 0; i < arrlen(thread_faces); i++) {
+        assert(thread_faces[i].in_use == false);
+        FT_Done_Face(thread_faces[i].face);
+    }
+    arrfree(thread_faces);
+
     FT_Done_FreeType(ftlib);
     ftlib = NULL;
 }
 
-static FT_Error open_font_file(struct font *ft, FT_Library ftlib, const pchar *fontpath, FT_Long face_index)
+static FT_Error open_face(const struct font_file *file, FT_Long face_index, FT_Face *out)
 {
-    FT_Open_Args oargs;
-
-#if defined(_WIN32)
-    int n = platform_memory_map_file(fontpath, &ft->font_file_memmap);
-    if (n != 0) {
-        return FT_Err_Cannot_Open_Resource;
-    }
-    oargs.flags = FT_OPEN_MEMORY;
-    oargs.memory_base = ft->font_file_memmap.addr;
-    oargs.memory_size = ft->font_file_memmap.size;
-#elif defined(__linux__)
-    oargs.flags = FT_OPEN_PATHNAME;
-    oargs.pathname = (char*)fontpath;
-#endif
-
-    return FT_Open_Face(ftlib, &oargs, face_index, &ft->face);
+    return FT_New_Memory_Face(ftlib, file->map.addr, file->map.size, face_index, out);
 }
 
-static enum error font_create_with_index(const pchar *fontpath, const pchar *fontface, struct font *out_ft)
+/* Find the face index and name of the face, called with registry_lock */
+static enum error resolve_face(struct font_file *file)
 {
-    struct font ft = { 0 };
     FT_Error err;
+    FT_Face face;
     FT_Long i, num_faces, face_idx = -1;
     char *fend;
 #ifdef _WIN32
     char u8_fontface_target_name[1024];
-    platform_pchar_to_u8(fontface, -1, u8_fontface_target_name, sizeof(u8_fontface_target_name));
+    if (file->face_name)
+        platform_pchar_to_u8(file->face_name, -1, u8_fontface_target_name, sizeof(u8_fontface_target_name));
 #else
-    const char *u8_fontface_target_name = fontface;
+    const char *u8_fontface_target_name = file->face_name;
 #endif
 
+    if (file->face_name == NULL) {
+        /* Use the default face index */
+        err = open_face(file, 0, &face);
+        if (err != FT_Err_Ok) {
+            log_error("Failed to load font at '%s': %s\n", file->path, ft_error_strings[err]);
+            return ERR_FREETYPE;
+        }
+        file->face_index = 0;
+        file->fontname = get_font_sfnt_name(face);
+        FT_Done_Face(face);
+        return NOERR;
+    }
+
     errno = 0;
     face_idx = strtol(u8_fontface_target_name, &fend, 10);
     if (errno != 0 || *fend != '\0')
         face_idx = -1;
 
-    err = open_font_file(&ft, ftlib, fontpath, face_idx);
+    err = open_face(file, MAX(face_idx, 0), &face);
     if (err != FT_Err_Ok) {
-        log_error("Failed to load font at '%s' (%s): %s\n", fontpath, fontface, ft_error_strings[err]);
-        font_destroy(&ft);
+        log_error("Failed to load font at '%s' (%s): %s\n", file->path, file->face_name, ft_error_strings[err]);
         return ERR_FREETYPE;
     }
     if (face_idx != -1) {
         /* Loaded by index */
-        ft.fontname = get_font_sfnt_name(ft.face);
-        *out_ft = ft;
+        file->face_index = face_idx;
+        file->fontname = get_font_sfnt_name(face);
+        FT_Done_Face(face);
         return NOERR;
     }
 
-    num_faces = ft.face->num_faces;
-    font_destroy(&ft);
+    num_faces = face->num_faces;
+    FT_Done_Face(face);
 
     for (i = 0; i < num_faces; i++) {
         /* Loaded by name */
         char *name;
 
-        err = open_font_file(&ft, ftlib, fontpath, i);
+        err = open_face(file, i, &face);
         if (err != FT_Err_Ok) {
-            log_error("Failed to load font at '%s' (%ld): %s\n", fontpath, i, ft_error_strings[err]);
-            font_destroy(&ft);
+            log_error("Failed to load font at '%s' (%ld): %s\n", file->path, i, ft_error_strings[err]);
             return ERR_FREETYPE;
         }
-        name = get_font_sfnt_name(ft.face);
+        name = get_font_sfnt_name(face);
+        FT_Done_Face(face);
         if (strcmp(name, u8_fontface_target_name) == 0) {
-            ft.fontname = name;
-            *out_ft = ft;
+            file->face_index = i;
+            file->fontname = name;
             return NOERR;
         }
         free(name);
-        font_destroy(&ft);
     }
 
     return ERR_FONT_FACE_NOT_FOUND;
 }
 
+static bool same_name(const pchar *a, const pchar *b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+    return pstrcmp(a, b) == 0;
+}
+
+static void font_file_free(struct font_file *file)
+{
+    free(file->path);
+    nnfree(file->face_name);
+    nnfree(file->fontname);
+    if (file->map.addr)
+        platform_memory_unmap_file(&file->map);
+    platform_mutex_destroy(&file->metrics_lock);
+    hmfree(file->widths);
+    hmfree(file->adjusted);
+    free(file);
+}
+
+/* The font in the registry, mapped and resolved on the first use */
+static enum error get_font_file(const pchar *fontpath, const pchar *fontface, struct font_file **out)
+{
+    struct font_file *file;
+    enum error err;
+
+    platform_mutex_lock(&registry_lock);
+    for (intptr_t i = 0; i < arrlen(registry); i++) {
+        if (pstrcmp(registry[i]->path, fontpath) == 0 && same_name(registry[i]->face_name, fontface)) {
+            *out = registry[i];
+            platform_mutex_unlock(&registry_lock);
+            return NOERR;
+        }
+    }
+
+    file = calloc(1, sizeof(*file));
+    assert(file);
+    file->path = pstrdup(fontpath);
+    file->face_name = fontface ? pstrdup(fontface) : NULL;
+    platform_mutex_init(&file->metrics_lock);
+
+    if (platform_memory_map_file(fontpath, &file->map) != 0) {
+        log_error("Failed to load font at '%s': %s\n", fontpath, ft_error_strings[FT_Err_Cannot_Open_Resource]);
+        err = ERR_FREETYPE;
+        goto fail;
+    }
+    err = resolve_face(file);
+    if (err != NOERR)
+        goto fail;
+
+    arrput(registry, file);
+    platform_mutex_unlock(&registry_lock);
+    *out = file;
+    return NOERR;
+
+fail:
+    /* Tried again by the next file, so that its log has the error too */
+    platform_mutex_unlock(&registry_lock);
+    font_file_free(file);
+    return err;
+}
+
 enum error font_create(const pchar *fontpath, const pchar *fontface, struct font *out_ft)
 {
-    FT_Error err;
+    struct font_file *file;
+    struct thread_face tf;
+    enum error err;
+    FT_Error ferr;
+
     assert(ftlib != NULL);
 
-    if (fontface != NULL) {
-        return font_create_with_index(fontpath, fontface, out_ft);
+    err = get_font_file(fontpath, fontface, &file);
+    if (err != NOERR)
+        return err;
+
+    for (intptr_t i = 0; i < arrlen(thread_faces); i++) {
+        if (thread_faces[i].file == file && thread_faces[i].in_use == false) {
+            thread_faces[i].in_use = true;
+            *out_ft = (struct font){ .face = thread_faces[i].face, .fontname = file->fontname, .file = file };
+            return NOERR;
+        }
     }
 
-    /* Use the default face index */
-    err = open_font_file(out_ft, ftlib, fontpath, 0);
-    if (err != FT_Err_Ok) {
-        log_error("Failed to load font at '%s': %s\n", fontpath, ft_error_strings[err]);
+    ferr = open_face(file, file->face_index, &tf.face);
+    if (ferr != FT_Err_Ok) {
+        log_error("Failed to load font at '%s' (%ld): %s\n", fontpath, file->face_index, ft_error_strings[ferr]);
         return ERR_FREETYPE;
     }
-    out_ft->fontname = get_font_sfnt_name(out_ft->face);
+    tf.file = file;
+    tf.in_use = true;
+    arrput(thread_faces, tf);
+
+    *out_ft = (struct font){ .face = tf.face, .fontname = file->fontname, .file = file };
     return NOERR;
 }
 
+/* The face stays open for the next font_create() on this thread */
 void font_destroy(struct font *ft)
 {
-    if (ft->face)
-		FT_Done_Face(ft->face);
-    if (ft->fontname)
-		free(ft->fontname);
-#ifdef _WIN32
-    platform_memory_unmap_file(&ft->font_file_memmap);
-#endif
+    for (intptr_t i = 0; i < arrlen(thread_faces); i++) {
+        if (thread_faces[i].face == ft->face && ft->face != NULL)
+            thread_faces[i].in_use = false;
+    }
     memset(ft, 0, sizeof(*ft));
 }
 
+void font_registry_free()
+{
+    platform_mutex_lock(&registry_lock);
+    for (intptr_t i = 0; i < arrlen(registry); i++)
+        font_file_free(registry[i]);
+    arrfree(registry);
+    platform_mutex_unlock(&registry_lock);
+}
+
 static const char *font_get_ps_name(FT_Face face)
 {
     return FT_Get_Postscript_Name(face);
@@ -1,24 +1,53 @@
 #ifndef _VTT2ASS_FONT_H
 #define _VTT2ASS_FONT_H
 #include <ft2build.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include FT_FREETYPE_H
 #include FT_GLYPH_H
 #include "error.h"
 #include "platform.h"
+#include "defs.h"
 
+/* Init/free the FreeType library of the calling thread, and the faces opened on it */
 void font_init();
 void font_dinit();
 
-struct font {
-    FT_Face face;
+/*
+ * A font file and face, mapped and resolved once for the whole process.
+ * Every thread opens its own FT_Face from the same mapping
+ */
+struct font_file {
+    pchar *path, *face_name;
+    struct memory_file_map map;
+    FT_Long face_index;
     char *fontname; /* utf8 */
 
-#ifdef _WIN32
-    struct memory_file_map font_file_memmap;
-#endif
+    /* Owned by fontmetrics.c: what the fm_ctx of earlier files learned about the font */
+    struct platform_mutex metrics_lock;
+    struct font_file_width {
+        uint64_t key;
+        double value;
+    } *widths;
+    struct font_file_adjust {
+        int key;
+        int value;
+    } *adjusted;
+    uint64_t hash;
+    bool hashed, disk_loaded;
 };
 
+struct font {
+    FT_Face face;
+    char *fontname; /* utf8, owned by file */
+    struct font_file *file;
+};
+
+/* The face is one of the calling thread, not used by any other struct font until font_destroy() */
 enum error font_create(const pchar *fontpath, const pchar *fontface, struct font *out_ft);
 void font_destroy(struct font *ft);
 
+/* Unmap every font, after all the threads called font_dinit() */
+void font_registry_free();
+
 #endif /* _VTT2ASS_FONT_H */
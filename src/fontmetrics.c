@@ -3,10 +3,14 @@
 #include <assert.h>
 #include <wchar.h>
 #include <math.h>
+#include <stdlib.h>
 #include FT_TRUETYPE_TABLES_H
 #include "stb_ds.h"
 #include "util.h"
 
+/* How the glyphs are loaded, part of the key of the metrics cache file */
+#define FM_LOAD_FLAGS FT_LOAD_DEFAULT
+
 // https://github.com/libass/libass/blob/ad42889c85fc61a003ad6d4cdb985f56de066f91/libass/ass_font.c#L278
 static void set_font_metrics(FT_Face ftface)
 {
@@ -33,23 +37,32 @@ static void reset_fm_char_cache(struct fm_ctx *c)
 {
 #if FM_CHAR_CACHE == 1
     hmfree(c->char_cache);
+    hmfree(c->adjust_cache);
 #endif
 }
 
-void fm_set_fs(struct fm_ctx *ctx, int fs)
+/* Set the size of the face to ctx->fs, before loading a glyph */
+static void apply_fs(struct fm_ctx *ctx)
 {
-    reset_fm_char_cache(ctx);
-
     FT_Error err;
+
+    if (ctx->face_fs == ctx->fs)
+        return;
+
     set_font_metrics(ctx->font_ref->face);
     FT_Size_RequestRec rq = {
         .type = FT_SIZE_REQUEST_TYPE_REAL_DIM,
         .width = 0,
-        .height = lrint(fs * 64),
+        .height = lrint(ctx->fs * 64),
     };
     err = FT_Request_Size(ctx->font_ref->face, &rq);
     assert(!err);
 
+    ctx->face_fs = ctx->fs;
+}
+
+void fm_set_fs(struct fm_ctx *ctx, int fs)
+{
     ctx->fs = fs;
 }
 
@@ -68,43 +81,132 @@ void fm_create(struct font *font, struct fm_ctx *out_ctx)
     *out_ctx = (struct fm_ctx){
         .font_ref = font,
     };
+
+#if FM_CHAR_CACHE == 1
+    /* Start with what the earlier files found */
+    struct font_file *file = font->file;
+
+    platform_mutex_lock(&file->metrics_lock);
+    for (intptr_t i = 0; i < hmlen(file->widths); i++)
+        hmput(out_ctx->char_cache, file->widths[i].key, file->widths[i].value);
+    for (intptr_t i = 0; i < hmlen(file->adjusted); i++)
+        hmput(out_ctx->adjust_cache, file->adjusted[i].key, file->adjusted[i].value);
+    out_ctx->char_shared = hmlen(file->widths);
+    platform_mutex_unlock(&file->metrics_lock);
+#endif
 }
 
+#if FM_CHAR_CACHE == 1
+/* A width (in 26.6) or an fm_adjust_fs() result, that is new for the font */
+static void learn(struct fm_ctx *ctx, uint32_t codepoint, int fs, int32_t value)
+{
+    struct fmcache_record r = { codepoint, fs, value };
+
+    arrput(ctx->learned, r);
+}
+
+/*
+ * Keep the learned records for the next files. Only the ones the font didn't know yet are kept
+ * in ctx->learned, the others were loaded from the cache file, or another ctx of the font
+ * running at the same time learned them too, and adds them to the file
+ */
+static void share_learned(struct fm_ctx *ctx)
+{
+    struct font_file *file = ctx->font_ref->file;
+    intptr_t kept = 0;
+
+    platform_mutex_lock(&file->metrics_lock);
+    for (intptr_t i = 0; i < arrlen(ctx->learned); i++) {
+        const struct fmcache_record *r = &ctx->learned[i];
+
+        if (r->codepoint == FMCACHE_ADJUST_FS) {
+            if (hmgeti(file->adjusted, r->fs) != -1)
+                continue;
+            hmput(file->adjusted, r->fs, r->value);
+        } else {
+            if (hmgeti(file->widths, FM_CHAR_KEY(r->fs, r->codepoint)) != -1)
+                continue;
+            hmput(file->widths, FM_CHAR_KEY(r->fs, r->codepoint), r->value / 64.f);
+        }
+        ctx->learned[kept++] = *r;
+    }
+    platform_mutex_unlock(&file->metrics_lock);
+    arrsetlen(ctx->learned, kept);
+}
+#endif
+
 void fm_destroy(struct fm_ctx *ctx)
 {
+#if FM_CHAR_CACHE == 1
+    share_learned(ctx);
+    if (ctx->disk_open) {
+        enum error err;
+
+        log_debug("Adding %td records to the metrics cache %s\n", arrlen(ctx->learned), ctx->disk.path);
+        err = fmcache_append(&ctx->disk, ctx->learned, arrlen(ctx->learned));
+        if (err != NOERR)
+            log_warning("Failed to add to the metrics cache: %s\n", error_to_string(err));
+        fmcache_free(&ctx->disk);
+    }
+    arrfree(ctx->learned);
+#endif
     reset_fm_char_cache(ctx);
+    hmfree(ctx->missing);
 
     memset(ctx, 0, sizeof(*ctx));
 }
 
-static void fm_get_metrics_cp_inter(struct fm_ctx *ctx, char32_t codepoint, FT_UInt gid, struct text_extents *out)
+/* Once for each codepoint, it is missing in every size */
+static void log_missing_char(struct fm_ctx *ctx, char32_t codepoint)
 {
-#if FM_CHAR_CACHE == 1
-    ptrdiff_t hi = hmgeti(ctx->char_cache, codepoint);
-    if (hi != -1) {
-        out->width = ctx->char_cache[hi].value;
+    pchar mt[8];
+
+    if (hmgeti(ctx->missing, codepoint) != -1)
         return;
-    }
-#endif
+    hmput(ctx->missing, codepoint, 0);
+    unicode_to_pchar(codepoint, mt);
+    log_warning("Selected font is missing character codepoint:'0x%X' (%s)\n", codepoint, mt);
+}
 
+/* The width of codepoint at ctx->fs, or ctx->fs if the font doesn't have it and false is returned */
+static bool load_width(struct fm_ctx *ctx, char32_t codepoint, FT_UInt gid, double *width)
+{
     if (gid == 0)
         gid = FT_Get_Char_Index(ctx->font_ref->face, codepoint);
     if (gid == 0) {
-        pchar mt[8];
-        unicode_to_pchar(codepoint, mt);
-        log_warning("Selected font is missing character codepoint:'0x%X' (%s)\n", codepoint, mt);
-        out->width = ctx->fs;
-        goto done;
+        *width = ctx->fs;
+        return false;
     }
 
-    FT_Error ferr = FT_Load_Glyph(ctx->font_ref->face, gid, FT_LOAD_DEFAULT);
+    apply_fs(ctx);
+    FT_Error ferr = FT_Load_Glyph(ctx->font_ref->face, gid, FM_LOAD_FLAGS);
     assert(ferr == 0);
 
-    out->width = ctx->font_ref->face->glyph->metrics.horiAdvance / 64.f;
-done:
+    *width = ctx->font_ref->face->glyph->metrics.horiAdvance / 64.f;
+    return true;
+}
+
+static void fm_get_metrics_cp_inter(struct fm_ctx *ctx, char32_t codepoint, FT_UInt gid, struct text_extents *out)
+{
+#if FM_CHAR_CACHE == 1
+    ptrdiff_t hi = hmgeti(ctx->char_cache, FM_CHAR_KEY(ctx->fs, codepoint));
+    if (hi != -1) {
+        ctx->char_hits++;
+        out->width = ctx->char_cache[hi].value;
+        return;
+    }
+#endif
+    ctx->char_misses++;
+
+    bool found = load_width(ctx, codepoint, gid, &out->width);
+    if (found == false)
+        log_missing_char(ctx, codepoint);
 
 #if FM_CHAR_CACHE == 1
-    hmput(ctx->char_cache, codepoint, out->width);
+    hmput(ctx->char_cache, FM_CHAR_KEY(ctx->fs, codepoint), out->width);
+    /* Missing chars are not kept for the next files, so they are still warned about */
+    if (found)
+        learn(ctx, codepoint, ctx->fs, (int32_t)lrint(out->width * 64));
 #endif
     return;
 }
@@ -122,7 +224,7 @@ void fm_get_metrics_fs_cp(struct fm_ctx *ctx, char32_t codepoint, int fs, struct
     fm_get_metrics_cp(ctx, codepoint, out);
 }
 
-int fm_adjust_fs(struct fm_ctx *ctx, int target_fs)
+static int adjust_fs(struct fm_ctx *ctx, int target_fs)
 {
     static const char32_t chr = 0x5B57; // 字
     int newfs = target_fs;
@@ -146,3 +248,216 @@ int fm_adjust_fs(struct fm_ctx *ctx, int target_fs)
         newfs += adj;
     }
 }
+
+int fm_adjust_fs(struct fm_ctx *ctx, int target_fs)
+{
+#if FM_CHAR_CACHE == 1
+    ptrdiff_t hi = hmgeti(ctx->adjust_cache, target_fs);
+    if (hi != -1) {
+        ctx->adjust_hits++;
+        return ctx->adjust_cache[hi].value;
+    }
+#endif
+    ctx->adjust_misses++;
+
+    int newfs = adjust_fs(ctx, target_fs);
+#if FM_CHAR_CACHE == 1
+    hmput(ctx->adjust_cache, target_fs, newfs);
+    learn(ctx, FMCACHE_ADJUST_FS, target_fs, newfs);
+#endif
+    return newfs;
+}
+
+#if FM_CHAR_CACHE == 1
+/* Loads the widths of a range of the keys, with its own face */
+struct prefill_worker {
+    const pchar *fontpath, *fontface;
+    const uint64_t *keys;
+    double *widths;
+    bool *found;
+    size_t from, to;
+    bool ok;
+    struct platform_thread thread;
+};
+
+static void prefill_range(struct fm_ctx *ctx, struct prefill_worker *pw)
+{
+    for (size_t i = pw->from; i < pw->to; i++) {
+        ctx->fs = FM_CHAR_KEY_FS(pw->keys[i]);
+        pw->found[i] = load_width(ctx, FM_CHAR_KEY_CP(pw->keys[i]), 0, &pw->widths[i]);
+    }
+}
+
+static void prefill_thread(void *arg)
+{
+    struct prefill_worker *pw = arg;
+    struct font font;
+    struct fm_ctx fm;
+
+    /* FreeType objects can't be shared between threads */
+    font_init();
+    if (font_create(pw->fontpath, pw->fontface, &font) == NOERR) {
+        /* Only loads glyphs, so it doesn't need the known widths that fm_create() copies */
+        FT_Select_Charmap(font.face, FT_ENCODING_UNICODE);
+        fm = (struct fm_ctx){ .font_ref = &font };
+        prefill_range(&fm, pw);
+        font_destroy(&font);
+        pw->ok = true;
+    }
+    font_dinit();
+}
+
+static int key_cmp(const void *a, const void *b)
+{
+    uint64_t ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+    return (ka > kb) - (ka < kb);
+}
+#endif
+
+void fm_prefill(struct fm_ctx *ctx, const pchar *fontpath, const pchar *fontface, const uint64_t *keys, size_t count, int threads)
+{
+#if FM_CHAR_CACHE == 1
+    struct { uint64_t key; char value; } *seen = NULL;
+    uint64_t stb_array *todo = NULL;
+    struct prefill_worker *workers;
+    double *widths;
+    bool *found;
+    int fs = ctx->fs;
+
+    for (size_t i = 0; i < count; i++) {
+        if (hmgeti(ctx->char_cache, keys[i]) != -1 || hmgeti(seen, keys[i]) != -1)
+            continue;
+        hmput(seen, keys[i], 0);
+        arrput(todo, keys[i]);
+    }
+    hmfree(seen);
+
+    if (arrlen(todo) == 0) {
+        arrfree(todo);
+        return;
+    }
+    /* Not worth starting a thread for a few glyphs */
+    threads = MAX(MIN(threads, (int)(arrlen(todo) / FM_PREFILL_MIN_KEYS)), 1);
+
+    /* The size of the face is then only changed a few times, even on one thread */
+    qsort(todo, arrlenu(todo), sizeof(*todo), key_cmp);
+    workers = calloc(threads, sizeof(*workers));
+    widths = calloc(arrlenu(todo), sizeof(*widths));
+    found = calloc(arrlenu(todo), sizeof(*found));
+    assert(workers && widths && found);
+
+    for (int t = 0; t < threads; t++) {
+        workers[t] = (struct prefill_worker){
+            .fontpath = fontpath,
+            .fontface = fontface,
+            .keys = todo,
+            .widths = widths,
+            .found = found,
+            .from = arrlenu(todo) * t / threads,
+            .to = arrlenu(todo) * (t + 1) / threads,
+        };
+    }
+    /* The first range is done here, with the face of ctx */
+    for (int t = 1; t < threads; t++) {
+        if (platform_thread_create(&workers[t].thread, prefill_thread, &workers[t]) != 0) {
+            for (int rest = t; rest < threads; rest++)
+                workers[rest].to = workers[rest].from;
+            threads = t;
+            break;
+        }
+    }
+    prefill_range(ctx, &workers[0]);
+    workers[0].ok = true;
+    ctx->fs = fs;
+
+    for (int t = 0; t < threads; t++) {
+        if (t > 0)
+            platform_thread_join(&workers[t].thread);
+        if (workers[t].ok == false)
+            continue;
+        for (size_t i = workers[t].from; i < workers[t].to; i++) {
+            if (found[i] == false)
+                log_missing_char(ctx, FM_CHAR_KEY_CP(todo[i]));
+            else
+                learn(ctx, FM_CHAR_KEY_CP(todo[i]), FM_CHAR_KEY_FS(todo[i]), (int32_t)lrint(widths[i] * 64));
+            hmput(ctx->char_cache, todo[i], widths[i]);
+        }
+        ctx->char_prefilled += workers[t].to - workers[t].from;
+    }
+
+    free(workers);
+    free(widths);
+    free(found);
+    arrfree(todo);
+#endif
+}
+
+void fm_use_cache_file(struct fm_ctx *ctx, const pchar *cache_path)
+{
+#if FM_CHAR_CACHE == 1
+    struct font_file *file = ctx->font_ref->file;
+    enum error err = NOERR;
+
+    platform_mutex_lock(&file->metrics_lock);
+    if (file->hashed == false) {
+        file->hash = fmcache_hash_font(file->map.addr, file->map.size);
+        file->hashed = true;
+    }
+    fmcache_init(&ctx->disk, cache_path, file->hash, file->face_index, FM_LOAD_FLAGS);
+
+    /* Only read for the first ctx of the font, the others get the records below */
+    if (file->disk_loaded == false) {
+        ptrdiff_t known = hmlen(file->widths);
+
+        err = fmcache_read(&ctx->disk);
+        for (intptr_t i = 0; i < arrlen(ctx->disk.records); i++) {
+            const struct fmcache_record *r = &ctx->disk.records[i];
+
+            if (r->codepoint == FMCACHE_ADJUST_FS) {
+                hmput(file->adjusted, r->fs, r->value);
+                hmput(ctx->adjust_cache, r->fs, r->value);
+            } else {
+                hmput(file->widths, FM_CHAR_KEY(r->fs, r->codepoint), r->value / 64.f);
+                hmput(ctx->char_cache, FM_CHAR_KEY(r->fs, r->codepoint), r->value / 64.f);
+            }
+        }
+        arrfree(ctx->disk.records);
+        /* Runs at the same time can add the same records */
+        ctx->from_disk = hmlen(file->widths) - known;
+        file->disk_loaded = (err == NOERR);
+    }
+    /*
+     * What the font got after fm_create() copied its records: the ones loaded above
+     * by another ctx created at the same time (parallel .ass profiles), or learned by one.
+     * Without them this ctx would measure the glyphs again
+     */
+    for (intptr_t i = 0; i < hmlen(file->widths); i++) {
+        if (hmgeti(ctx->char_cache, file->widths[i].key) != -1)
+            continue;
+        hmput(ctx->char_cache, file->widths[i].key, file->widths[i].value);
+        ctx->char_shared++;
+    }
+    for (intptr_t i = 0; i < hmlen(file->adjusted); i++) {
+        if (hmgeti(ctx->adjust_cache, file->adjusted[i].key) == -1)
+            hmput(ctx->adjust_cache, file->adjusted[i].key, file->adjusted[i].value);
+    }
+    platform_mutex_unlock(&file->metrics_lock);
+
+    if (err != NOERR) {
+        log_warning("Failed to read the metrics cache %s: %s\n", cache_path, error_to_string(err));
+        fmcache_free(&ctx->disk);
+        return;
+    }
+    ctx->disk_open = true;
+#endif
+}
+
+void fm_log_stats(const struct fm_ctx *ctx)
+{
+    int64_t lookups = ctx->char_hits + ctx->char_misses;
+
+    if (lookups == 0)
+        return;
+    log_info("Glyph metrics cache: %" PRIi64 " hits, %" PRIi64 " misses (%.1f%% hits), %" PRIi64 " loaded in advance, %" PRIi64 " from earlier files, %" PRIi64 " from the cache file, font size adjust: %" PRIi64 " hits, %" PRIi64 " misses\n",
+            ctx->char_hits, ctx->char_misses, 100.0 * ctx->char_hits / lookups, ctx->char_prefilled, ctx->char_shared, ctx->from_disk, ctx->adjust_hits, ctx->adjust_misses);
+}
@@ -1,6 +1,7 @@
 #ifndef ARIB2ASS_FONTMETRICS_H
 #define ARIB2ASS_FONTMETRICS_H
 #include "font.h"
+#include "fmcache.h"
 #include <stdint.h>
 #include <uchar.h>
 
@@ -16,16 +17,43 @@ struct text_extents {
 
 struct fm_ctx {
     struct font *font_ref;
-    int fs;
+    /* The size the metrics are for, and the size the face is set to.
+     * The face is only changed when a glyph has to be loaded */
+    int fs, face_fs;
 
 #if FM_CHAR_CACHE == 1
+    /* Widths by FM_CHAR_KEY(fs, codepoint), kept when the size changes */
     struct fm_char_cache {
-        uint32_t key;
+        uint64_t key;
         double value;
     } *char_cache;
+    /* fm_adjust_fs() results by target size */
+    struct fm_adjust_cache {
+        int key;
+        int value;
+    } *adjust_cache;
+    /* Widths and sizes that are new for the font, added to its struct font_file in fm_destroy(),
+     * and with fm_use_cache_file() to the cache file */
+    struct fmcache_record stb_array *learned;
+    struct fmcache disk;
+    bool disk_open;
 #endif
+    /* Codepoints already warned about, missing from the font */
+    struct fm_missing_char {
+        uint32_t key;
+        char value;
+    } *missing;
+    /* For fm_log_stats() */
+    int64_t char_hits, char_misses, char_prefilled, char_shared, from_disk, adjust_hits, adjust_misses;
 };
 
+#define FM_CHAR_KEY(fs, codepoint) ((uint64_t)(uint32_t)(fs) << 32 | (uint32_t)(codepoint))
+#define FM_CHAR_KEY_FS(key) ((int)((key) >> 32))
+#define FM_CHAR_KEY_CP(key) ((char32_t)((key) & 0xffffffff))
+
+/* fm_prefill() starts at most one thread for every this many glyphs */
+#define FM_PREFILL_MIN_KEYS 64
+
 void fm_create(struct font *font, struct fm_ctx *out_ctx);
 void fm_destroy(struct fm_ctx *ctx);
 
@@ -37,5 +65,19 @@ void fm_set_fs(struct fm_ctx *ctx, int fs);
 
 int fm_adjust_fs(struct fm_ctx *ctx, int target_fs);
 
+/* Start with the widths and sizes of the font from the metrics cache file, and add the new ones to it in fm_destroy() */
+void fm_use_cache_file(struct fm_ctx *ctx, const pchar *cache_path);
+
+/*
+ * Load the widths of keys (FM_CHAR_KEY) into the cache on up to threads threads.
+ * Every other thread opens its own face of the font, with the same arguments as font_create().
+ * Glyph loading is the slowest part of the .ass output, so this is done for all the chars of a file
+ * before they are processed one by one
+ */
+void fm_prefill(struct fm_ctx *ctx, const pchar *fontpath, const pchar *fontface, const uint64_t *keys, size_t count, int threads);
+
+/* Log the cache hits and misses */
+void fm_log_stats(const struct fm_ctx *ctx);
+
 #endif /* ARIB2ASS_FONTMETRICS_H */
 
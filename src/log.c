@@ -6,9 +6,12 @@
 #include <assert.h>
 #include <time.h>
 
+#include "stb_ds.h"
+#include "util.h"
+
 #define PROG_UPDATE_MS 100
 static const pchar prog_loop[] = PSTR("\\|/-");
-static struct prog_state {
+static PLATFORM_THREAD_LOCAL struct prog_state {
     bool started;
     float progress;
     const pchar *str;
@@ -23,21 +26,114 @@ static struct prog_state {
     .last = { 0 },
 };
 
+/* Messages of this thread, if buffering is enabled */
+static PLATFORM_THREAD_LOCAL bool log_buffered = false;
+static PLATFORM_THREAD_LOCAL pchar stb_array *log_buffer = NULL;
+/* Serializes the writes to stderr from the buffers */
+static struct platform_mutex log_lock = PLATFORM_MUTEX_INITIALIZER;
 
 static void log_progress_newline();
 
+static int log_buffer_vprintf(const pchar *fmt, va_list ap)
+{
+    pchar line[1024];
+
+    int n = pvsnprintf(line, sizeof(line), fmt, ap);
+    /* Truncated */
+    if (n < 0 || n >= ARRAY_COUNT(line))
+        n = ARRAY_COUNT(line) - 1;
+
+    memcpy(arraddnptr(log_buffer, n), line, n * sizeof(*line));
+    return n;
+}
+
+static int log_buffer_printf(const pchar *fmt, ...)
+{
+    int n;
+    va_list ap;
+    va_start(ap, fmt);
+    n = log_buffer_vprintf(fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+void log_buffer_begin()
+{
+    log_buffered = true;
+    arrsetlen(log_buffer, 0);
+}
+
+void log_buffer_flush()
+{
+    if (arrlen(log_buffer) == 0)
+        return;
+
+    platform_mutex_lock(&log_lock);
+    pfprintf(stderr, PSTR("%.*s"), (int)arrlen(log_buffer), log_buffer);
+    fflush(stderr);
+    platform_mutex_unlock(&log_lock);
+
+    arrsetlen(log_buffer, 0);
+}
+
+void log_buffer_end()
+{
+    log_buffer_flush();
+    arrfree(log_buffer);
+    log_buffered = false;
+}
+
+pchar stb_array *log_buffer_take()
+{
+    pchar stb_array *msgs = log_buffer;
+
+    log_buffer = NULL;
+    log_buffered = false;
+    return msgs;
+}
+
+void log_buffer_put(pchar stb_array *msgs)
+{
+    if (arrlen(msgs) == 0) {
+        arrfree(msgs);
+        return;
+    }
+
+    if (log_buffered) {
+        memcpy(arraddnptr(log_buffer, arrlen(msgs)), msgs, arrlen(msgs) * sizeof(*msgs));
+    } else {
+        platform_mutex_lock(&log_lock);
+        if (prog_state.started)
+            pfprintf(stderr, PSTR("\x1b[1G\x1b[2K"));
+        pfprintf(stderr, PSTR("%.*s"), (int)arrlen(msgs), msgs);
+        if (prog_state.started)
+            log_progress_newline();
+        fflush(stderr);
+        platform_mutex_unlock(&log_lock);
+    }
+    arrfree(msgs);
+}
+
 int log_disp(enum log_level level, const pchar *fmt, ...)
 {
     if (level < opt_log_level)
         return 0;
 
+    int n;
+    va_list ap;
+
+    if (log_buffered) {
+        va_start(ap, fmt);
+        n = log_buffer_vprintf(fmt, ap);
+        va_end(ap);
+        return n;
+    }
+
     if (prog_state.started) {
         /* move cursor to the beginning and erase the line */
         pfprintf(stderr, PSTR("\x1b[1G\x1b[2K"));
     }
 
-    int n;
-    va_list ap;
     va_start(ap, fmt);
     n = pvfprintf(stderr, fmt, ap);
     va_end(ap);
@@ -53,6 +149,14 @@ int log_progress(enum log_progress_state state, void *val)
     if (opt_log_level > LOG_MSG)
         return 0;
 
+    if (log_buffered) {
+        if (state == LPS_BEGIN)
+            prog_state.str = val;
+        else if (state == LPS_END)
+            return log_buffer_printf(PSTR("%s %s\n"), prog_state.str, (pchar*)val);
+        return 0;
+    }
+
     struct ptimespec now;
     if (state == LPS_BEGIN) {
         prog_state = (struct prog_state){
@@ -42,4 +42,23 @@ enum log_progress_state {
 /* The value of val depends on state */
 int log_progress(enum log_progress_state state, void *val);
 
+/*
+ * Collect the log messages of the calling thread into a buffer instead of
+ * writing them out directly. Progress updates are dropped, only the final
+ * progress line is kept.
+ * log_buffer_flush() writes the collected messages at once,
+ * so the output of threads working in parallel won't get mixed up.
+ */
+void log_buffer_begin();
+void log_buffer_flush();
+/* Flush, and go back to writing the messages directly */
+void log_buffer_end();
+/*
+ * Stop buffering, and hand the collected messages to the caller instead of
+ * writing them out. log_buffer_put() adds them to the log of another thread,
+ * into its buffer if that one is buffering too, and frees them.
+ */
+pchar *log_buffer_take();
+void log_buffer_put(pchar *msgs);
+
 #endif /* ARIB2ASS_LOG_H */
@@ -20,35 +20,40 @@ static pchar *opt_dump_config = NULL;
 enum log_level opt_log_level = LOG_MSG;
 bool opt_dump_drcs = false;
 enum dump_drcs_format opt_dump_drcs_format = BIN;
+bool opt_native_demux = false;
+bool opt_fast_probe = false;
+int opt_jobs = 1;
+int opt_threads = 1;
+int opt_file_cpus = 1;
+bool opt_input_mmap = true;
+bool opt_follow = false;
+int opt_follow_timeout = 60;
+bool opt_pes_cache = false;
+pchar *opt_metrics_cache = NULL;
 
 bool opt_ass_do = false;
-const pchar *opt_ass_font_path = NULL;
-const pchar *opt_ass_font_face = NULL;
-bool opt_ass_fs_adjust = false;
-bool opt_ass_optimize = true;
-bool opt_ass_force_bold = false;
-bool opt_ass_force_border = false;
-bool opt_ass_merge_regions = false;
-bool opt_ass_debug_boxes = false;
-// case: MS PGothic く
-bool opt_ass_center_spacing = true;
-/* -1 for no, other value for that value */
-int opt_ass_constant_spacing = -1;
-/* Only makes sense when opt_ass_constant_spacing is 1
- * If this is true, then shift ruby region positions
- * so it will still line up correctly */
-bool opt_ass_shift_ruby = false;
+struct ass_profile opt_ass = {
+    .optimize = true,
+    .max_styles = 1,
+    .center_spacing = true,
+    .constant_spacing = -1,
+};
+struct ass_profile stb_array *opt_ass_profiles = NULL;
 const bool opt_ass_only_furi = false;
 
 bool opt_srt_do = false;
 bool opt_srt_tags = false;
 bool opt_srt_furi = false;
 
+bool opt_vtt_do = false;
+bool opt_vtt_tags = false;
+bool opt_vtt_ruby = false;
+
 const pchar stb_array **opt_input_files = NULL;
-pchar *opt_ass_output = NULL;
-bool opt_ass_output_dir = false;
 pchar *opt_srt_output = NULL;
 bool opt_srt_output_dir = false;
+pchar *opt_vtt_output = NULL;
+bool opt_vtt_output_dir = false;
 
 enum short_opts {
     SOPT_HELP = 'h',
@@ -59,11 +64,21 @@ enum short_opts {
     SOPT_QUIET = 'q',
     SOPT_DUMP_DRCS = 0x102,
     SOPT_DUMP_DRCS_PNG = 0x103,
+    SOPT_NATIVE_DEMUX = 0x104,
+    SOPT_FAST_PROBE = 0x105,
+    SOPT_NO_MMAP = 0x106,
+    SOPT_FOLLOW = 0x107,
+    SOPT_FOLLOW_TIMEOUT = 0x108,
+    SOPT_CACHE = 0x109,
+    SOPT_METRICS_CACHE = 0x10A,
+    SOPT_JOBS = 'j',
+    SOPT_THREADS = 'T',
     SOPT_DRCS_CONV = 'D',
     SOPT_ASS_NO_OPTIMIZE = 'Z',
     SOPT_ASS_FORCE_BOLD = 'b',
     SOPT_ASS_FORCE_BORDER = 'B',
     SOPT_ASS_MERGE_REGIONS = 'm',
+    SOPT_ASS_MERGE_EVENTS = 'e',
     SOPT_ASS_DEBUG_BOXES = 'd',
     SOPT_ASS_NO_CENTER_SPACING = 'C',
     SOPT_ASS_CONSTANT_SPACING = 's',
@@ -71,13 +86,17 @@ enum short_opts {
     SOPT_ASS_FONT_PATH = 'f',
     SOPT_ASS_FONT_FACE = 0x101,
     SOPT_ASS_FS_ADJUST = 'a',
+    SOPT_ASS_MAX_STYLES = 'S',
 
     SOPT_SRT_TAGS = 't',
     SOPT_SRT_FURI = 'f',
+
+    SOPT_VTT_TAGS = 't',
+    SOPT_VTT_RUBY = 'r',
 };
 
 /* '+' to stop processing args at the first non-opt argument */
-static const pchar arg_string_pre[] = PSTR("+c:o:hqvD:");
+static const pchar arg_string_pre[] = PSTR("+c:o:hqvD:j:T:");
 static const struct option arg_options_pre[] = {
     { PSTR("config-file"),   required_argument, NULL, SOPT_CONFIG_FILE },
     { PSTR("dump-config"),   required_argument, NULL, SOPT_DUMP_CONFIG },
@@ -88,17 +107,28 @@ static const struct option arg_options_pre[] = {
     { PSTR("dump-drcs"),     no_argument,       NULL, SOPT_DUMP_DRCS },
     { PSTR("dump-drcs-png"), no_argument,       NULL, SOPT_DUMP_DRCS_PNG },
     { PSTR("drcs-conv"),     required_argument, NULL, SOPT_DRCS_CONV },
+    { PSTR("native-demux"),  no_argument,       NULL, SOPT_NATIVE_DEMUX },
+    { PSTR("fast-probe"),    no_argument,       NULL, SOPT_FAST_PROBE },
+    { PSTR("jobs"),          required_argument, NULL, SOPT_JOBS },
+    { PSTR("threads"),       required_argument, NULL, SOPT_THREADS },
+    { PSTR("no-mmap"),       no_argument,       NULL, SOPT_NO_MMAP },
+    { PSTR("follow"),        no_argument,       NULL, SOPT_FOLLOW },
+    { PSTR("follow-timeout"), required_argument, NULL, SOPT_FOLLOW_TIMEOUT },
+    { PSTR("cache"),         no_argument,       NULL, SOPT_CACHE },
+    { PSTR("metrics-cache"), required_argument, NULL, SOPT_METRICS_CACHE },
     { 0 },
 };
 
-static const pchar arg_string_ass[] = PSTR("+ho:ZbBmdCs:rf:a");
+static const pchar arg_string_ass[] = PSTR("+ho:ZS:bBmedCs:rf:a");
 static const struct option arg_options_ass[] = {
     { PSTR("help"),               no_argument,       NULL, SOPT_HELP },
     { PSTR("output"),             required_argument, NULL, SOPT_OUTPUT },
     { PSTR("no-optimize"),        no_argument,       NULL, SOPT_ASS_NO_OPTIMIZE },
+    { PSTR("max-styles"),         required_argument, NULL, SOPT_ASS_MAX_STYLES },
     { PSTR("force-bold"),         no_argument,       NULL, SOPT_ASS_FORCE_BOLD },
     { PSTR("force-border"),       no_argument,       NULL, SOPT_ASS_FORCE_BORDER },
     { PSTR("merge-regions"),      no_argument,       NULL, SOPT_ASS_MERGE_REGIONS },
+    { PSTR("merge-events"),       no_argument,       NULL, SOPT_ASS_MERGE_EVENTS },
     { PSTR("debug-boxes"),        no_argument,       NULL, SOPT_ASS_DEBUG_BOXES },
     { PSTR("no-center-spacing"),  no_argument,       NULL, SOPT_ASS_NO_CENTER_SPACING },
     { PSTR("constant-spacing"),   no_argument,       NULL, SOPT_ASS_CONSTANT_SPACING },
@@ -116,6 +146,14 @@ static const struct option arg_options_srt[] = {
     { PSTR("furi"),   no_argument,       NULL, SOPT_SRT_FURI },
 };
 
+static const pchar arg_string_vtt[] = PSTR("+ho:tr");
+static const struct option arg_options_vtt[] = {
+    { PSTR("help"),   no_argument,       NULL, SOPT_HELP },
+    { PSTR("output"), required_argument, NULL, SOPT_OUTPUT },
+    { PSTR("tags"),   no_argument,       NULL, SOPT_VTT_TAGS },
+    { PSTR("ruby"),   no_argument,       NULL, SOPT_VTT_RUBY },
+};
+
 
 static void print_help()
 {
@@ -125,7 +163,7 @@ static void print_help()
             PSTR(" (") PSTR2(A2AC_VERSION) PSTR(")")
 #endif
             PSTR("\n")
-            PSTR("Usage: ./a2ac [global-opts] ass [opts-for-ass] srt [opts-for-srt] input .ts files ...\n")
+            PSTR("Usage: ./a2ac [global-opts] ass [opts-for-ass] srt [opts-for-srt] vtt [opts-for-vtt] input .ts files ... (- for stdin)\n")
             PSTR("\n")
             PSTR("GLOBAL OPTIONS\n")
             PSTR("  -h   --help               Show this help text\n")
@@ -138,15 +176,29 @@ static void print_help()
             PSTR("       --dump-drcs-png      Write all drcs character images found to ./drcs/ in png format\n")
             PSTR("  -D   --drcs-conv          Accepts a toml file, which contains replacement mappings for drcs characters\n")
             PSTR("                            Can be specified multiple times\n")
+            PSTR("       --native-demux       Only read the caption stream with the built-in demuxer, instead of libavformat (%s)\n")
+            PSTR("       --fast-probe         Find the caption stream from the start of the file, without the full libavformat probe (%s)\n")
+            PSTR("  -j   --jobs               Process this many input files in parallel, 0 for the number of CPUs (%d)\n")
+            PSTR("  -T   --threads            With --native-demux, read each file in this many parts in parallel, 0 for the number of CPUs (%d)\n")
+            PSTR("       --no-mmap            Read the input files with large read() calls instead of mmap, for network filesystems (%s)\n")
+            PSTR("       --follow             Keep reading the input files while they are still being recorded, and write\n")
+            PSTR("                            each caption when it is finished (%s)\n")
+            PSTR("       --follow-timeout     With --follow, stop after the file didn't grow for this many seconds (%d)\n")
+            PSTR("       --cache              Keep the caption packets in a small .a2ac file next to each input, and read that\n")
+            PSTR("                            instead of the input next time, while the input is unchanged (%s)\n")
+            PSTR("       --metrics-cache      Keep the glyph widths of the .ass fonts in this file, and read them from it\n")
+            PSTR("                            next time, can be shared by any number of runs at the same time\n")
             PSTR("\n")
             PSTR("ASS OPTIONS:\n")
             PSTR("  -o   --output             Output resulting file into this path, or directory\n")
             PSTR("  -f   --font               The path to the font to use (%s)\n")
             PSTR("       --font-face          The font name (or index) to use if font is a .ttc file (%s)\n")
             PSTR("  -Z   --no-optimize        Do not optimize line styles (%s)\n")
+            PSTR("  -S   --max-styles         When optimizing, use up to this many named styles for the lines, at most 16 (%d)\n")
             PSTR("  -b   --force-bold         Always use bold (%s)\n")
             PSTR("  -B   --force-border       Always use a border (%s)\n")
             PSTR("  -m   --merge-regions      Combine 2 left-aligned, directly connected lines into one (%s)\n")
+            PSTR("  -e   --merge-events       Write a line, that stays the same in consecutive captions, as one event (%s)\n")
             PSTR("  -d   --debug-boxes        Include debug boxes in the resulting file (%s)\n")
             PSTR("  -C   --no-center-spacing  Do not align each character in the middle of its given bounding box (%s)\n")
             PSTR("  -s   --constant-spacing   Use this many pixels between each character. (%d)\n")
@@ -157,10 +209,17 @@ static void print_help()
             PSTR("  -o   --output             Output resulting file into this path, or directory\n")
             PSTR("  -t   --tags               Write formatting tags (%s)\n")
             PSTR("  -f   --furi               Try to write furigana in parenthesis (%s)\n")
+            PSTR("\n")
+            PSTR("WEBVTT OPTIONS:\n")
+            PSTR("  -o   --output             Output resulting file into this path, or directory\n")
+            PSTR("  -t   --tags               Write bold, italic, underline and color tags (%s)\n")
+            PSTR("  -r   --ruby               Try to write furigana as <ruby> text (%s)\n")
             PSTR("\n"),
-            opt_ass_font_path, opt_ass_font_face, B(!opt_ass_optimize), B(opt_ass_force_bold), B(opt_ass_force_border),
-            B(opt_ass_merge_regions), B(opt_ass_debug_boxes), B(!opt_ass_center_spacing), opt_ass_constant_spacing,
-            B(opt_ass_shift_ruby), B(opt_ass_fs_adjust), B(opt_srt_tags), B(opt_srt_furi)
+            B(opt_native_demux), B(opt_fast_probe), opt_jobs, opt_threads, B(!opt_input_mmap), B(opt_follow), opt_follow_timeout, B(opt_pes_cache),
+            opt_ass.font_path, opt_ass.font_face, B(!opt_ass.optimize), opt_ass.max_styles, B(opt_ass.force_bold), B(opt_ass.force_border),
+            B(opt_ass.merge_regions), B(opt_ass.merge_events), B(opt_ass.debug_boxes), B(!opt_ass.center_spacing), opt_ass.constant_spacing,
+            B(opt_ass.shift_ruby), B(opt_ass.fs_adjust), B(opt_srt_tags), B(opt_srt_furi),
+            B(opt_vtt_tags), B(opt_vtt_ruby)
             );
 }
 
@@ -183,10 +242,34 @@ static char *toml_escape_string(const char *in, char *out, size_t out_size)
     return out;
 }
 
+#define TESC(u8str) (toml_escape_string(u8str, escaped_buffer, sizeof(escaped_buffer)))
+
+static void dump_ass_profile(FILE *f, const struct ass_profile *p)
+{
+    char escaped_buffer[1024];
+
+    if (p->output)
+        fprintf(f, "output = \"%s\"\n", TESC(PCu8(p->output)));
+    if (p->font_path)
+        fprintf(f, "font = \"%s\"\n", TESC(PCu8(p->font_path)));
+    if (p->font_face)
+        fprintf(f, "font-face = \"%s\"\n", TESC(PCu8(p->font_face)));
+    fprintf(f, "optimize = %s\n", B8(p->optimize));
+    fprintf(f, "max-styles = %d\n", p->max_styles);
+    fprintf(f, "force-bold = %s\n", B8(p->force_bold));
+    fprintf(f, "force-border = %s\n", B8(p->force_border));
+    fprintf(f, "merge-regions = %s\n", B8(p->merge_regions));
+    fprintf(f, "merge-events = %s\n", B8(p->merge_events));
+    fprintf(f, "debug-boxes = %s\n", B8(p->debug_boxes));
+    fprintf(f, "center-spacing = %s\n", B8(p->center_spacing));
+    fprintf(f, "constant-spacing = %d\n", p->constant_spacing);
+    fprintf(f, "shift-ruby = %s\n", B8(p->shift_ruby));
+    fprintf(f, "fs-adjust = %s\n", B8(p->fs_adjust));
+}
+
 static enum error dump_config(const pchar *outfile)
 {
     char escaped_buffer[1024];
-#define TESC(u8str) (toml_escape_string(u8str, escaped_buffer, sizeof(escaped_buffer)))
 
     FILE *f = pfopen(outfile, PSTR("wb"));
     if (f == NULL) {
@@ -205,24 +288,24 @@ static enum error dump_config(const pchar *outfile)
 
     fprintf(f, "dump-drcs = %s\n", B8(opt_dump_drcs));
     fprintf(f, "dump-drcs-format = \"%s\"\n", (opt_dump_drcs_format == PNG) ? "png" : "bin");
+    fprintf(f, "native-demux = %s\n", B8(opt_native_demux));
+    fprintf(f, "fast-probe = %s\n", B8(opt_fast_probe));
+    fprintf(f, "jobs = %d\n", opt_jobs);
+    fprintf(f, "threads = %d\n", opt_threads);
+    fprintf(f, "mmap = %s\n", B8(opt_input_mmap));
+    fprintf(f, "follow = %s\n", B8(opt_follow));
+    fprintf(f, "follow-timeout = %d\n", opt_follow_timeout);
+    fprintf(f, "cache = %s\n", B8(opt_pes_cache));
+    if (opt_metrics_cache)
+        fprintf(f, "metrics-cache = \"%s\"\n", TESC(PCu8(opt_metrics_cache)));
 
     if (opt_ass_do) {
-
         fprintf(f, "\n[ass]\n");
-        if (opt_ass_output)
-            fprintf(f, "output = \"%s\"\n", TESC(PCu8(opt_ass_output)));
-        if (opt_ass_font_path)
-            fprintf(f, "font = \"%s\"\n", TESC(PCu8(opt_ass_font_path)));
-        if (opt_ass_font_face)
-            fprintf(f, "font-face = \"%s\"\n", TESC(PCu8(opt_ass_font_face)));
-        fprintf(f, "force-bold = %s\n", B8(opt_ass_force_bold));
-        fprintf(f, "force-border = %s\n", B8(opt_ass_force_border));
-        fprintf(f, "merge-regions = %s\n", B8(opt_ass_merge_regions));
-        fprintf(f, "debug-boxes = %s\n", B8(opt_ass_debug_boxes));
-        fprintf(f, "center-spacing = %s\n", B8(opt_ass_center_spacing));
-        fprintf(f, "constant-spacing = %d\n", opt_ass_constant_spacing);
-        fprintf(f, "shift-ruby = %s\n", B8(opt_ass_shift_ruby));
-        fprintf(f, "fs-adjust = %s\n", B8(opt_ass_fs_adjust));
+        dump_ass_profile(f, &opt_ass);
+    }
+    for (intptr_t i = 0; i < arrlen(opt_ass_profiles); i++) {
+        fprintf(f, "\n[ass.\"%s\"]\n", TESC(PCu8(opt_ass_profiles[i].name)));
+        dump_ass_profile(f, &opt_ass_profiles[i]);
     }
 
     if (opt_srt_do) {
@@ -233,12 +316,135 @@ static enum error dump_config(const pchar *outfile)
         fprintf(f, "furi = %s\n", B8(opt_srt_furi));
     }
 
+    if (opt_vtt_do) {
+        fprintf(f, "\n[vtt]\n");
+        if (opt_vtt_output)
+            fprintf(f, "output = \"%s\"\n", TESC(PCu8(opt_vtt_output)));
+        fprintf(f, "tags = %s\n", B8(opt_vtt_tags));
+        fprintf(f, "ruby = %s\n", B8(opt_vtt_ruby));
+    }
+
     fprintf(f, "\n[drcs_conv]\n");
 
     fclose(f);
     return NOERR;
 }
 
+static void parse_toml_ass(const toml_table_t *subt, struct ass_profile *p)
+{
+    toml_value_t val;
+
+    val = toml_table_string(subt, "output");
+    if (val.ok) {
+        nnfree(p->output);
+        p->output = u8PCmem(val.u.s);
+    }
+
+    val = toml_table_bool(subt, "optimize");
+    if (val.ok) {
+        p->optimize = val.u.b;
+    }
+
+    val = toml_table_int(subt, "max-styles");
+    if (val.ok) {
+        p->max_styles = val.u.i;
+    }
+
+    val = toml_table_string(subt, "font");
+    if (val.ok) {
+        nnfree(p->font_path);
+        p->font_path = u8PCmem(val.u.s);
+    }
+
+    val = toml_table_string(subt, "font-face");
+    if (val.ok) {
+        nnfree(p->font_face);
+        p->font_face = u8PCmem(val.u.s);
+    }
+
+    val = toml_table_bool(subt, "force-bold");
+    if (val.ok) {
+        p->force_bold = val.u.b;
+    }
+
+    val = toml_table_bool(subt, "force-border");
+    if (val.ok) {
+        p->force_border = val.u.b;
+    }
+
+    val = toml_table_bool(subt, "merge-regions");
+    if (val.ok) {
+        p->merge_regions = val.u.b;
+    }
+
+    val = toml_table_bool(subt, "merge-events");
+    if (val.ok) {
+        p->merge_events = val.u.b;
+    }
+
+    val = toml_table_bool(subt, "debug-boxes");
+    if (val.ok) {
+        p->debug_boxes = val.u.b;
+    }
+
+    val = toml_table_bool(subt, "center-spacing");
+    if (val.ok) {
+        p->center_spacing = val.u.b;
+    }
+
+    val = toml_table_int(subt, "constant-spacing");
+    if (val.ok) {
+        p->constant_spacing = val.u.i;
+    }
+
+    val = toml_table_bool(subt, "shift-ruby");
+    if (val.ok) {
+        p->shift_ruby = val.u.b;
+    }
+
+    val = toml_table_bool(subt, "fs-adjust");
+    if (val.ok) {
+        p->fs_adjust = val.u.b;
+    }
+}
+
+/* True if the table has keys of its own, and not only sub-tables */
+static bool toml_table_has_values(const toml_table_t *t)
+{
+    for (int i = 0; i < toml_table_len(t); i++) {
+        int keylen;
+        const char *key = toml_table_key(t, i, &keylen);
+
+        if (toml_table_table(t, key) == NULL)
+            return true;
+    }
+    return false;
+}
+
+/* The [ass.<name>] tables start from the options in [ass] */
+static void parse_toml_ass_profiles(const toml_table_t *subt)
+{
+    for (int i = 0; i < toml_table_len(subt); i++) {
+        int keylen;
+        const char *key = toml_table_key(subt, i, &keylen);
+        const toml_table_t *pt = toml_table_table(subt, key);
+        struct ass_profile p = opt_ass;
+
+        if (pt == NULL)
+            continue;
+
+        p.name = pstrdup(u8PC(key));
+        p.output = NULL;
+        p.output_dir = false;
+        if (p.font_path)
+            p.font_path = pstrdup(p.font_path);
+        if (p.font_face)
+            p.font_face = pstrdup(p.font_face);
+        parse_toml_ass(pt, &p);
+        arrput(opt_ass_profiles, p);
+    }
+}
+
 static enum error parse_toml(toml_table_t *toml)
 {
     const toml_table_t *subt;
@@ -273,88 +479,111 @@ static enum error parse_toml(toml_table_t *toml)
         free(val.u.s);
     }
 
-    subt = toml_table_table(toml, "ass");
-    if (subt) {
-        opt_ass_do = true;
+    val = toml_table_bool(toml, "native-demux");
+    if (val.ok) {
+        opt_native_demux = val.u.b;
+    }
 
-        val = toml_table_string(subt, "output");
-        if (val.ok) {
-            opt_ass_output = u8PCmem(val.u.s);
-        }
+    val = toml_table_bool(toml, "fast-probe");
+    if (val.ok) {
+        opt_fast_probe = val.u.b;
+    }
 
-        val = toml_table_string(subt, "optimize");
-        if (val.ok) {
-            opt_ass_optimize = val.u.b;
+    val = toml_table_int(toml, "jobs");
+    if (val.ok) {
+        if (val.u.i < 0) {
+            log_error("Invalid jobs value in config: %d\n", (int)val.u.i);
+            return ERR_OPT_BAD_ARG;
         }
+        opt_jobs = val.u.i;
+    }
 
-        val = toml_table_string(subt, "font");
-        if (val.ok) {
-            opt_ass_font_path = u8PCmem(val.u.s);
+    val = toml_table_int(toml, "threads");
+    if (val.ok) {
+        if (val.u.i < 0) {
+            log_error("Invalid threads value in config: %d\n", (int)val.u.i);
+            return ERR_OPT_BAD_ARG;
         }
+        opt_threads = val.u.i;
+    }
 
-        val = toml_table_string(subt, "font-face");
-        if (val.ok) {
-            opt_ass_font_face = u8PCmem(val.u.s);
-        }
+    val = toml_table_bool(toml, "mmap");
+    if (val.ok) {
+        opt_input_mmap = val.u.b;
+    }
 
-        val = toml_table_int(subt, "force-bold");
-        if (val.ok) {
-            opt_ass_force_bold = val.u.b;
-        }
+    val = toml_table_bool(toml, "follow");
+    if (val.ok) {
+        opt_follow = val.u.b;
+    }
 
-        val = toml_table_int(subt, "force-border");
-        if (val.ok) {
-            opt_ass_force_border = val.u.b;
+    val = toml_table_int(toml, "follow-timeout");
+    if (val.ok) {
+        if (val.u.i <= 0) {
+            log_error("Invalid follow-timeout value in config: %d\n", (int)val.u.i);
+            return ERR_OPT_BAD_ARG;
         }
+        opt_follow_timeout = val.u.i;
+    }
 
-        val = toml_table_int(subt, "merge-regions");
-        if (val.ok) {
-            opt_ass_merge_regions = val.u.b;
-        }
+    val = toml_table_bool(toml, "cache");
+    if (val.ok) {
+        opt_pes_cache = val.u.b;
+    }
 
-        val = toml_table_int(subt, "debug-boxes");
-        if (val.ok) {
-            opt_ass_debug_boxes = val.u.b;
-        }
+    val = toml_table_string(toml, "metrics-cache");
+    if (val.ok) {
+        nnfree(opt_metrics_cache);
+        opt_metrics_cache = u8PCmem(val.u.s);
+    }
 
-        val = toml_table_int(subt, "center-spacing");
-        if (val.ok) {
-            opt_ass_center_spacing = val.u.b;
-        }
+    subt = toml_table_table(toml, "ass");
+    if (subt) {
+        /* An [ass.<name>] table also makes an [ass] table, that only writes the default profile
+         * when it is given on its own or has options */
+        if (toml_table_len(subt) == 0 || toml_table_has_values(subt))
+            opt_ass_do = true;
+        parse_toml_ass(subt, &opt_ass);
+        parse_toml_ass_profiles(subt);
+    }
 
-        val = toml_table_int(subt, "constant-spacing");
+    subt = toml_table_table(toml, "srt");
+    if (subt) {
+        opt_srt_do = true;
+
+        val = toml_table_string(subt, "output");
         if (val.ok) {
-            opt_ass_constant_spacing = val.u.i;
+            opt_srt_output = u8PCmem(val.u.s);
         }
 
-        val = toml_table_int(subt, "shift-ruby");
+        val = toml_table_bool(subt, "tags");
         if (val.ok) {
-            opt_ass_shift_ruby = val.u.b;
+            opt_srt_tags = val.u.b;
         }
 
-        val = toml_table_int(subt, "fs-adjust");
+        val = toml_table_bool(subt, "furi");
         if (val.ok) {
-            opt_ass_fs_adjust = val.u.b;
+            opt_srt_furi = val.u.b;
         }
     }
 
-    subt = toml_table_table(toml, "srt");
+    subt = toml_table_table(toml, "vtt");
     if (subt) {
-        opt_srt_do = true;
+        opt_vtt_do = true;
 
         val = toml_table_string(subt, "output");
         if (val.ok) {
-            opt_srt_output = u8PCmem(val.u.s);
+            opt_vtt_output = u8PCmem(val.u.s);
         }
 
-        val = toml_table_int(subt, "tags");
+        val = toml_table_bool(subt, "tags");
         if (val.ok) {
-            opt_srt_tags = val.u.b;
+            opt_vtt_tags = val.u.b;
         }
 
-        val = toml_table_int(subt, "furi");
+        val = toml_table_bool(subt, "ruby");
         if (val.ok) {
-            opt_srt_furi = val.u.b;
+            opt_vtt_ruby = val.u.b;
         }
     }
 
@@ -410,7 +639,7 @@ static void advance_input_files(int argc, pchar **argv)
 {
     for (; optind < argc; optind++) {
         pchar *c = argv[optind];
-        if (pstrcmp(c, PSTR("ass")) == 0 || pstrcmp(c, PSTR("srt")) == 0 || c[0] == PSTR('-'))
+        if (pstrcmp(c, PSTR("ass")) == 0 || pstrcmp(c, PSTR("srt")) == 0 || pstrcmp(c, PSTR("vtt")) == 0 || c[0] == PSTR('-'))
             break;
         arrput(opt_input_files, c);
     }
@@ -422,6 +651,8 @@ static enum error parse_config_global_opts(int argc, pchar **argv)
 
     pchar *stb_array *drcs_conv_files = NULL;
     const pchar *config_file_path = NULL;
+    pchar *end;
+    long n;
     /* Don't print invalid option messages */
     opterr = 0;
 
@@ -459,6 +690,55 @@ static enum error parse_config_global_opts(int argc, pchar **argv)
             opt_dump_drcs = true;
             opt_dump_drcs_format = PNG;
             break;
+        case SOPT_NATIVE_DEMUX:
+            opt_native_demux = true;
+            break;
+        case SOPT_FAST_PROBE:
+            opt_fast_probe = true;
+            break;
+        case SOPT_JOBS:
+            errno = 0;
+            n = pstrtol(optarg, &end, 10);
+            if (errno != 0 || *end != PSTR('\0') || n < 0) {
+                log_error("Invalid jobs value: %s\n", optarg);
+                err = ERR_OPT_BAD_ARG;
+                goto end;
+            }
+            opt_jobs = n;
+            break;
+        case SOPT_THREADS:
+            errno = 0;
+            n = pstrtol(optarg, &end, 10);
+            if (errno != 0 || *end != PSTR('\0') || n < 0) {
+                log_error("Invalid threads value: %s\n", optarg);
+                err = ERR_OPT_BAD_ARG;
+                goto end;
+            }
+            opt_threads = n;
+            break;
+        case SOPT_NO_MMAP:
+            opt_input_mmap = false;
+            break;
+        case SOPT_FOLLOW:
+            opt_follow = true;
+            break;
+        case SOPT_CACHE:
+            opt_pes_cache = true;
+            break;
+        case SOPT_METRICS_CACHE:
+            nnfree(opt_metrics_cache);
+            opt_metrics_cache = pstrdup(optarg);
+            break;
+        case SOPT_FOLLOW_TIMEOUT:
+            errno = 0;
+            n = pstrtol(optarg, &end, 10);
+            if (errno != 0 || *end != PSTR('\0') || n <= 0) {
+                log_error("Invalid follow-timeout value: %s\n", optarg);
+                err = ERR_OPT_BAD_ARG;
+                goto end;
+            }
+            opt_follow_timeout = n;
+            break;
         case SOPT_HELP:
             print_help();
             err = ERR_OPT_SHOULD_EXIT;
@@ -503,50 +783,62 @@ static enum error parse_ass_opts(int argc, pchar **argv)
                 print_help();
                 return ERR_OPT_SHOULD_EXIT;
             case SOPT_OUTPUT:
-                nnfree(opt_ass_output);
-                opt_ass_output = pstrdup(optarg);
+                nnfree(opt_ass.output);
+                opt_ass.output = pstrdup(optarg);
                 break;
             case SOPT_ASS_NO_OPTIMIZE:
-                opt_ass_optimize = false;
+                opt_ass.optimize = false;
+                break;
+            case SOPT_ASS_MAX_STYLES:
+                errno = 0;
+                n = strtol(optarg, NULL, 10);
+                if (errno == 0) {
+                    opt_ass.max_styles = n;
+                } else {
+                    return ERR_OPT_BAD_ARG;
+                }
                 break;
             case SOPT_ASS_FONT_PATH:
-                nnfree(opt_ass_font_path);
-                opt_ass_font_path = pstrdup(optarg);
+                nnfree(opt_ass.font_path);
+                opt_ass.font_path = pstrdup(optarg);
                 break;
             case SOPT_ASS_FONT_FACE:
-                nnfree(opt_ass_font_face);
-                opt_ass_font_face = pstrdup(optarg);
+                nnfree(opt_ass.font_face);
+                opt_ass.font_face = pstrdup(optarg);
                 break;
             case SOPT_ASS_FORCE_BORDER:
-                opt_ass_force_border = true;
+                opt_ass.force_border = true;
                 break;
             case SOPT_ASS_FORCE_BOLD:
-                opt_ass_force_bold = true;
+                opt_ass.force_bold = true;
                 break;
             case SOPT_ASS_MERGE_REGIONS:
-                opt_ass_merge_regions = true;
+                opt_ass.merge_regions = true;
+                break;
+            case SOPT_ASS_MERGE_EVENTS:
+                opt_ass.merge_events = true;
                 break;
             case SOPT_ASS_DEBUG_BOXES:
-                opt_ass_debug_boxes = true;
+                opt_ass.debug_boxes = true;
                 break;
             case SOPT_ASS_NO_CENTER_SPACING:
-                opt_ass_center_spacing = false;
+                opt_ass.center_spacing = false;
                 break;
             case SOPT_ASS_CONSTANT_SPACING:
                 errno = 0;
                 n = strtol(optarg, NULL, 10);
                 if (errno == 0) {
-                    opt_ass_constant_spacing = n;
-                    opt_ass_center_spacing = false;
+                    opt_ass.constant_spacing = n;
+                    opt_ass.center_spacing = false;
                 } else {
                     return ERR_OPT_BAD_ARG;
                 }
                 break;
             case SOPT_ASS_SHIFT_RUBY:
-                opt_ass_shift_ruby = true;
+                opt_ass.shift_ruby = true;
                 break;
             case SOPT_ASS_FS_ADJUST:
-                opt_ass_fs_adjust = true;
+                opt_ass.fs_adjust = true;
                 break;
             default:
                 return ERR_OPT_UNKNOWN_OPT;
@@ -588,9 +880,115 @@ static enum error parse_srt_opts(int argc, pchar **argv)
     return NOERR;
 }
 
+static enum error parse_vtt_opts(int argc, pchar **argv)
+{
+    optind++;
+
+    opt_vtt_do = true;
+    for (;;) {
+        int c = getopt_long(argc, argv, arg_string_vtt, arg_options_vtt, NULL);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case SOPT_HELP:
+                print_help();
+                return ERR_OPT_SHOULD_EXIT;
+            case SOPT_OUTPUT:
+                nnfree(opt_vtt_output);
+                opt_vtt_output = pstrdup(optarg);
+                break;
+            case SOPT_VTT_TAGS:
+                opt_vtt_tags = true;
+                break;
+            case SOPT_VTT_RUBY:
+                opt_vtt_ruby = true;
+                break;
+            default:
+                return ERR_OPT_UNKNOWN_OPT;
+        }
+    }
+
+    return NOERR;
+}
+
+/* Decide if path is a directory, where the outputs are written with the name of the input */
+static enum error check_output_path(const pchar *path, const char *ext, bool *out_isdir)
+{
+    struct pstat s;
+    int n;
+
+    n = pstatfn(path, &s);
+    if (n != 0) {
+        if (errno == ENOENT) {
+            *out_isdir = arrlen(opt_input_files) > 1;
+        } else {
+            pperror(PSTR("Failed to check output path"));
+            return ERR_OPT_BAD_ARG;
+        }
+
+        pchar lchar = get_str_last_char(path);
+        if (lchar == PSTR('/')) {
+            *out_isdir = true;
+#ifdef _WIN32
+        } else if (lchar == PSTR('\\')) {
+            *out_isdir = true;
+#endif
+        }
+
+    } else if (!S_ISDIR(s.st_mode) && arrlen(opt_input_files) > 1) {
+        log_error("Output for .%s multi-file is not a directory\n", ext);
+        return ERR_OPT_BAD_ARG;
+    } else if (S_ISDIR(s.st_mode)) {
+        *out_isdir = true;
+    }
+    return NOERR;
+}
+
+static enum error check_ass_profile(struct ass_profile *p)
+{
+    const pchar *name = p->name ? p->name : PSTR("default");
+    enum error err;
+
+    if (p->output == NULL) {
+        p->output = pstrdup(opt_output);
+    }
+    if (p->font_path == NULL) {
+        log_error("Must give a font for .ass output (profile %s)\n", name);
+        return ERR_OPT_BAD_ARG;
+    }
+
+    err = check_output_path(p->output, "ass", &p->output_dir);
+    if (err != NOERR)
+        return err;
+
+    if (p->max_styles < 1 || p->max_styles > 16) {
+        log_error("Max styles must be between 1 and 16 (profile %s)\n", name);
+        return ERR_OPT_BAD_ARG;
+    }
+    if (p->center_spacing && p->constant_spacing != -1) {
+        log_error("Center spacing and constant spacing cannot both be set (profile %s)\n", name);
+        return ERR_OPT_BAD_ARG;
+    }
+    if (p->shift_ruby && p->constant_spacing == -1) {
+        log_error("Ruby shift does not makes sense when using calculated spacing (profile %s)\n", name);
+        return ERR_OPT_BAD_ARG;
+    }
+    return NOERR;
+}
+
+static bool is_stdout_path(const pchar *path)
+{
+    return pstrcmp(path, PSTR("-")) == 0;
+}
+
 enum error opt_check_valid()
 {
-    if ((opt_ass_do == false && opt_srt_do == false) && (opt_dump_drcs == false)) {
+    enum error err;
+    int nstdout;
+
+    if ((opt_ass_do == false && arrlen(opt_ass_profiles) == 0 && opt_srt_do == false && opt_vtt_do == false) &&
+            (opt_dump_drcs == false)) {
         log_error("At least one output format needs to be specified\n");
         return ERR_OPT_BAD_ARG;
     }
@@ -598,83 +996,55 @@ enum error opt_check_valid()
         opt_output = get_current_dir_name();
         assert(opt_output);
     }
-    if (opt_ass_do && opt_ass_output == NULL) {
-        opt_ass_output = pstrdup(opt_output);
-    }
     if (opt_srt_do && opt_srt_output == NULL) {
         opt_srt_output = pstrdup(opt_output);
     }
-
-    if (opt_ass_do && opt_ass_font_path == NULL) {
-        log_error("Must give a font for .ass output\n");
-        return ERR_OPT_BAD_ARG;
+    if (opt_vtt_do && opt_vtt_output == NULL) {
+        opt_vtt_output = pstrdup(opt_output);
     }
 
-    struct pstat s;
-    int n;
     if (opt_ass_do) {
-        n = pstatfn(opt_ass_output, &s);
-        if (n != 0) {
-            if (errno == ENOENT) {
-                opt_ass_output_dir = arrlen(opt_input_files) > 1;
-            } else {
-                pperror(PSTR("Failed to check output path"));
-                return ERR_OPT_BAD_ARG;
-            }
-
-            pchar lchar = get_str_last_char(opt_ass_output);
-            if (lchar == PSTR('/')) {
-                opt_ass_output_dir = true;
-#ifdef _WIN32
-            } else if (lchar == PSTR('\\')) {
-                opt_ass_output_dir = true;
-#endif
-            }
+        err = check_ass_profile(&opt_ass);
+        if (err != NOERR)
+            return err;
+    }
+    for (intptr_t i = 0; i < arrlen(opt_ass_profiles); i++) {
+        struct ass_profile *p = &opt_ass_profiles[i];
 
-        } else if (!S_ISDIR(s.st_mode) && arrlen(opt_input_files) > 1) {
-            log_error("Output for .ass multi-file is not a directory\n");
+        err = check_ass_profile(p);
+        if (err != NOERR)
+            return err;
+        /* In a directory, the profile name is added to the file names */
+        if (p->output_dir)
+            continue;
+        bool same = opt_ass_do && opt_ass.output_dir == false && pstrcmp(p->output, opt_ass.output) == 0;
+        for (intptr_t j = 0; j < i && same == false; j++)
+            same = opt_ass_profiles[j].output_dir == false && pstrcmp(p->output, opt_ass_profiles[j].output) == 0;
+        if (same) {
+            log_error("The .ass profile %s needs its own output path\n", p->name);
             return ERR_OPT_BAD_ARG;
-        } else if (S_ISDIR(s.st_mode)) {
-            opt_ass_output_dir = true;
         }
     }
     if (opt_srt_do) {
-
-        n = pstatfn(opt_srt_output, &s);
-        if (n != 0) {
-            if (errno == ENOENT) {
-                opt_srt_output_dir = arrlen(opt_input_files) > 1;
-            } else {
-                pperror(PSTR("Failed to check output path"));
-                return ERR_OPT_BAD_ARG;
-            }
-
-            pchar lchar = get_str_last_char(opt_srt_output);
-            if (lchar == PSTR('/')) {
-                opt_srt_output_dir = true;
-#ifdef _WIN32
-            } else if (lchar == PSTR('\\')) {
-                opt_srt_output_dir = true;
-#endif
-            }
-
-        } else if (!S_ISDIR(s.st_mode) && arrlen(opt_input_files) > 1) {
-            log_error("Output for .srt multi-file is not a directory\n");
-            return ERR_OPT_BAD_ARG;
-        } else if (S_ISDIR(s.st_mode)) {
-            opt_srt_output_dir = true;
-        }
+        err = check_output_path(opt_srt_output, "srt", &opt_srt_output_dir);
+        if (err != NOERR)
+            return err;
+    }
+    if (opt_vtt_do) {
+        err = check_output_path(opt_vtt_output, "vtt", &opt_vtt_output_dir);
+        if (err != NOERR)
+            return err;
     }
 
-    if (opt_ass_do) {
-        if (opt_ass_center_spacing && opt_ass_constant_spacing != -1) {
-            log_error("Center spacing and constant spacing cannot both be set\n");
-            return ERR_OPT_BAD_ARG;
-        }
-        if (opt_ass_shift_ruby && opt_ass_constant_spacing == -1) {
-            log_error("Ruby shift does not makes sense when using calculated spacing\n");
-            return ERR_OPT_BAD_ARG;
-        }
+    /* The outputs written to stdout would be mixed up */
+    nstdout = (opt_ass_do && is_stdout_path(opt_ass.output)) +
+        (opt_srt_do && is_stdout_path(opt_srt_output)) +
+        (opt_vtt_do && is_stdout_path(opt_vtt_output));
+    for (intptr_t i = 0; i < arrlen(opt_ass_profiles); i++)
+        nstdout += is_stdout_path(opt_ass_profiles[i].output);
+    if (nstdout > 1) {
+        log_error("Only one output can be written to stdout (-)\n");
+        return ERR_OPT_BAD_ARG;
     }
 
     return NOERR;
@@ -700,6 +1070,8 @@ enum error opts_parse_cmdline(int argc, pchar **argv)
             err = parse_ass_opts(argc, argv);
         } else if (pstrcmp(argv[optind], PSTR("srt")) == 0) {
             err = parse_srt_opts(argc, argv);
+        } else if (pstrcmp(argv[optind], PSTR("vtt")) == 0) {
+            err = parse_vtt_opts(argc, argv);
         } else {
             err = parse_config_global_opts(argc, argv);
         }
@@ -727,20 +1099,33 @@ fail:
     return err;
 }
 
+static void ass_profile_free(struct ass_profile *p)
+{
+    nnfree(p->name);
+    nnfree(p->output);
+    nnfree(p->font_path);
+    nnfree(p->font_face);
+    p->name = p->output = NULL;
+    p->font_path = p->font_face = NULL;
+}
+
 /* Free any resources allocated by config */
 void opts_free()
 {
-    if (opt_ass_font_path)
-        free((void*)opt_ass_font_path);
-    if (opt_ass_font_face)
-        free((void*)opt_ass_font_face);
+    ass_profile_free(&opt_ass);
+    for (intptr_t i = 0; i < arrlen(opt_ass_profiles); i++) {
+        ass_profile_free(&opt_ass_profiles[i]);
+    }
+    arrfree(opt_ass_profiles);
     arrfree(opt_input_files);
     if (opt_output)
         free(opt_output);
-    if (opt_ass_output)
-        free(opt_ass_output);
     if (opt_srt_output)
         free(opt_srt_output);
+    if (opt_vtt_output)
+        free(opt_vtt_output);
+    if (opt_metrics_cache)
+        free(opt_metrics_cache);
 
     /* It might make sense to free this here,
      * as it is created by opts */
@@ -11,26 +11,67 @@ enum dump_drcs_format {
     BIN, PNG,
 };
 extern enum dump_drcs_format opt_dump_drcs_format;
+/* Use the built-in caption-only demuxer instead of libavformat
+ * for reading the packets */
+extern bool opt_native_demux;
+/* Find the caption stream and the time origin from the start of the file
+ * and only fall back to the full libavformat probe if that fails */
+extern bool opt_fast_probe;
+/* Number of input files to process in parallel, 0 for the number of CPUs */
+extern int opt_jobs;
+/* Number of threads to read a single file with the native demuxer, 0 for the number of CPUs */
+extern int opt_threads;
+/* Not an option: the CPUs left for each file, when -j files are processed at the same time.
+ * Set before the files are processed */
+extern int opt_file_cpus;
+/* Map the input files into memory, instead of reading them into a buffer (Linux only) */
+extern bool opt_input_mmap;
+/* Keep reading the input files as they grow, until the writer closes them */
+extern bool opt_follow;
+/* Stop following a file, that didn't grow for this many seconds */
+extern int opt_follow_timeout;
+/* Write the caption packets into a cache next to the input, and read them from there if it is up to date */
+extern bool opt_pes_cache;
+/* File with the glyph widths of the fonts used before, NULL to not use one */
+extern pchar *opt_metrics_cache;
+
+/*
+ * The options of one .ass output. opt_ass are the ones from the ass subcommand and [ass],
+ * and every [ass.<name>] table in the config file adds a profile, that starts from those
+ */
+struct ass_profile {
+    /* NULL for opt_ass */
+    pchar *name;
+    pchar *output;
+    bool output_dir;
+
+    const pchar *font_path;
+    /* Can be queried with fc-query */
+    const pchar *font_face;
+    bool fs_adjust;
+    bool optimize;
+    /* With optimize, the most named styles the lines can use */
+    int max_styles;
+    bool force_bold;
+    bool force_border;
+    bool merge_regions;
+    /* Write a line, that stays the same in consecutive captions, as one event */
+    bool merge_events;
+    bool debug_boxes;
+    // case: MS PGothic く
+    bool center_spacing;
+    /* -1 for no, other value for that value */
+    int constant_spacing;
+    /* Only makes sense when constant_spacing is set
+     * If this is true, then shift ruby region positions
+     * so it will still line up correctly */
+    bool shift_ruby;
+};
 
 extern bool opt_ass_do;
-extern const pchar *opt_ass_font_path;
-
-/* Can be queried with fc-query */
-extern const pchar *opt_ass_font_face;
-extern bool opt_ass_fs_adjust;
-extern bool opt_ass_optimize;
-extern bool opt_ass_force_bold;
-extern bool opt_ass_force_border;
-extern bool opt_ass_merge_regions;
-extern bool opt_ass_debug_boxes;
-// case: MS PGothic く
-extern bool opt_ass_center_spacing;
-/* -1 for no, other value for that value */
-extern int opt_ass_constant_spacing;
-/* Only makes sense when opt_ass_constant_spacing is 1
- * If this is true, then shift ruby region positions
- * so it will still line up correctly */
-extern bool opt_ass_shift_ruby;
+extern struct ass_profile opt_ass;
+/* The named profiles, written next to opt_ass */
+extern struct ass_profile stb_array *opt_ass_profiles;
 extern const bool opt_ass_only_furi;
 
 
@@ -38,12 +79,17 @@ extern bool opt_srt_do;
 extern bool opt_srt_tags;
 extern bool opt_srt_furi;
 
+extern bool opt_vtt_do;
+extern bool opt_vtt_tags;
+/* Write the furigana found for the chars as <ruby> text */
+extern bool opt_vtt_ruby;
+
 extern const pchar stb_array **opt_input_files;
 
-extern pchar *opt_ass_output;
-extern bool opt_ass_output_dir;
 extern pchar *opt_srt_output;
 extern bool opt_srt_output_dir;
+extern pchar *opt_vtt_output;
+extern bool opt_vtt_output_dir;
 
 /*
  * Parse command line arguments
@@ -0,0 +1,146 @@
+#include "outbuf.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "platform.h"
+#include "util.h"
+
+char *outbuf_reserve(struct outbuf *ob, size_t n)
+{
+    if (ob->cap - ob->len < n) {
+        ob->cap = MAX(MAX(ob->cap * 2, ob->len + n), 4096);
+        ob->data = realloc(ob->data, ob->cap);
+        assert(ob->data);
+    }
+    return &ob->data[ob->len];
+}
+
+enum error outbuf_flush(struct outbuf *ob)
+{
+    size_t off = 0;
+
+    assert(ob->fd >= 0);
+    while (off < ob->len) {
+        /* _write() takes an unsigned int */
+        ssize_t w = plwrite(ob->fd, &ob->data[off], MIN(ob->len - off, (size_t)1 << 30));
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            /* Keep what wasn't written, so the error isn't hidden by a later flush */
+            memmove(ob->data, &ob->data[off], ob->len - off);
+            ob->len -= off;
+            return -errno;
+        }
+        off += w;
+    }
+    ob->len = 0;
+    return NOERR;
+}
+
+enum error outbuf_flush_if_full(struct outbuf *ob)
+{
+    if (ob->len < OUTBUF_FLUSH_SIZE)
+        return NOERR;
+    return outbuf_flush(ob);
+}
+
+void outbuf_free(struct outbuf *ob)
+{
+    free(ob->data);
+    ob->data = NULL;
+    ob->len = ob->cap = 0;
+}
+
+void outbuf_int(struct outbuf *ob, int64_t v, int width)
+{
+    char tmp[24];
+    int n = 0;
+    uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u > 0);
+    while (n < width && n < (int)sizeof(tmp))
+        tmp[n++] = '0';
+    if (v < 0)
+        outbuf_putc(ob, '-');
+
+    char *p = outbuf_reserve(ob, n);
+    for (int i = 0; i < n; i++)
+        p[i] = tmp[n - 1 - i];
+    ob->len += n;
+}
+
+void outbuf_hex(struct outbuf *ob, uint32_t v, int digits, bool lowercase)
+{
+    const char *hex = lowercase ? "0123456789abcdef" : "0123456789ABCDEF";
+    char *p = outbuf_reserve(ob, digits);
+
+    for (int i = digits - 1; i >= 0; i--) {
+        p[i] = hex[v & 0xf];
+        v >>= 4;
+    }
+    ob->len += digits;
+}
+
+void outbuf_float2(struct outbuf *ob, float f)
+{
+    /* Too big for the integer math */
+    if (isfinite(f) == false || fabsf(f) >= 1e15f) {
+        char tmp[64];
+        int n = snprintf(tmp, sizeof(tmp), "%.02f", f);
+
+        if (isfinite(f)) {
+            while (tmp[n - 1] == '0')
+                n--;
+            if (tmp[n - 1] == '.')
+                n--;
+        }
+        outbuf_put(ob, tmp, n);
+        return;
+    }
+
+    /* f * 100 is exact in a double, so rint() rounds ties to even the same way as "%.02f" */
+    int64_t hundredths = (int64_t)rint(fabs((double)f) * 100.0);
+    int64_t ip = hundredths / 100;
+    int frac = hundredths % 100;
+
+    /* "%.02f" keeps the sign of -0.001 */
+    if (signbit(f))
+        outbuf_putc(ob, '-');
+    outbuf_int(ob, ip, 0);
+    if (frac != 0) {
+        outbuf_putc(ob, '.');
+        outbuf_putc(ob, '0' + frac / 10);
+        if (frac % 10 != 0)
+            outbuf_putc(ob, '0' + frac % 10);
+    }
+}
+
+void outbuf_time(struct outbuf *ob, int64_t ms, int hour_width, char frac_sep, int frac_digits)
+{
+    int64_t h, m, s;
+
+    assert(frac_digits == 2 || frac_digits == 3);
+    h = ms / H_IN_MS;
+    ms %= H_IN_MS;
+
+    m = ms / M_IN_MS;
+    ms %= M_IN_MS;
+
+    s = ms / S_IN_MS;
+    ms %= S_IN_MS;
+
+    outbuf_int(ob, h, hour_width);
+    outbuf_putc(ob, ':');
+    outbuf_int(ob, m, 2);
+    outbuf_putc(ob, ':');
+    outbuf_int(ob, s, 2);
+    outbuf_putc(ob, frac_sep);
+    outbuf_int(ob, frac_digits == 2 ? ms / 10 : ms, frac_digits);
+}
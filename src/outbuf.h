@@ -0,0 +1,57 @@
+#ifndef ARIB2ASS_OUTBUF_H
+#define ARIB2ASS_OUTBUF_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "error.h"
+
+/*
+ * Growable output buffer with formatters for the few things the subtitle writers print,
+ * written to a file descriptor with a single write() per flush.
+ * A zeroed struct outbuf with fd set is ready to use, an fd of -1 keeps everything in memory.
+ */
+struct outbuf {
+    char *data;
+    size_t len, cap;
+    int fd;
+};
+
+/* outbuf_flush_if_full() writes the buffer out after this many bytes */
+#define OUTBUF_FLUSH_SIZE (1024 * 1024)
+
+/* Returns space for at least n more bytes at data + len, the caller adds what it used to len */
+char *outbuf_reserve(struct outbuf *ob, size_t n);
+/* Write everything buffered and empty the buffer */
+enum error outbuf_flush(struct outbuf *ob);
+enum error outbuf_flush_if_full(struct outbuf *ob);
+void outbuf_free(struct outbuf *ob);
+
+static inline void outbuf_put(struct outbuf *ob, const char *s, size_t n)
+{
+    memcpy(outbuf_reserve(ob, n), s, n);
+    ob->len += n;
+}
+
+static inline void outbuf_puts(struct outbuf *ob, const char *s)
+{
+    outbuf_put(ob, s, strlen(s));
+}
+
+static inline void outbuf_putc(struct outbuf *ob, char c)
+{
+    *outbuf_reserve(ob, 1) = c;
+    ob->len++;
+}
+
+/* Decimal, with zeros in front up to width digits */
+void outbuf_int(struct outbuf *ob, int64_t v, int width);
+/* Hex of the low digits * 4 bits of v */
+void outbuf_hex(struct outbuf *ob, uint32_t v, int digits, bool lowercase);
+/* "%.02f" without the trailing zeros, and without the '.' for whole numbers */
+void outbuf_float2(struct outbuf *ob, float f);
+/* h:mm:ss<frac_sep>fff, with hour_width digits of hours and frac_digits (2 or 3) digits of the second */
+void outbuf_time(struct outbuf *ob, int64_t ms, int hour_width, char frac_sep, int frac_digits);
+
+#endif /* ARIB2ASS_OUTBUF_H */
@@ -0,0 +1,232 @@
+#include "pescache.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "stb_ds.h"
+
+/*
+ * The file format, all little endian:
+ *   header: "A2AC", u32 version, i64 source size, i64 source mtime, i64 time origin, i64 duration ms
+ *   packets until the end: i64 pts ms, u32 size, size bytes of PES payload
+ */
+#define PESCACHE_MAGIC "A2AC"
+#define PESCACHE_VERSION 1
+#define PESCACHE_HEADER_SIZE ( 4 + 4 + 8 * 4 )
+#define PESCACHE_PACKET_HEADER_SIZE ( 8 + 4 )
+/* Caption PES are small, anything bigger is a corrupt file */
+#define PESCACHE_MAX_PACKET_SIZE ( 1024 * 1024 )
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = v >> (i * 8);
+}
+
+static void put_le64(uint8_t *p, int64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (uint64_t)v >> (i * 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static int64_t get_le64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return (int64_t)v;
+}
+
+bool pescache_is_cache_path(const pchar *fpath)
+{
+    size_t len = pstrlen(fpath), elen = pstrlen(PESCACHE_EXT);
+
+    return len > elen && pstrcmp(&fpath[len - elen], PESCACHE_EXT) == 0;
+}
+
+void pescache_path_for(const pchar *input, pchar out[PESCACHE_PATH_SIZE])
+{
+    psnprintf(out, PESCACHE_PATH_SIZE * sizeof(pchar), PSTR("%s%s"), input, PESCACHE_EXT);
+}
+
+void pescache_source_for(const pchar *cache_path, pchar out[PESCACHE_PATH_SIZE])
+{
+    int len = pstrlen(cache_path) - pstrlen(PESCACHE_EXT);
+
+    assert(pescache_is_cache_path(cache_path));
+    psnprintf(out, PESCACHE_PATH_SIZE * sizeof(pchar), PSTR("%.*s"), len, cache_path);
+}
+
+enum error pescache_reader_open(struct pescache_reader *r, const pchar *cache_path, const pchar *source_path)
+{
+    uint8_t hdr[PESCACHE_HEADER_SIZE];
+    struct pstat st;
+    enum error err;
+
+    *r = (struct pescache_reader){0};
+
+    if (pstatfn(cache_path, &st) != 0)
+        return -errno;
+    r->size = st.st_size;
+
+    r->f = pfopen(cache_path, PSTR("rb"));
+    if (r->f == NULL) {
+        err = -errno;
+        log_error("Failed to open cache %s: %s\n", cache_path, error_to_string(err));
+        return err;
+    }
+
+    if (fread(hdr, 1, sizeof(hdr), r->f) != sizeof(hdr) || memcmp(hdr, PESCACHE_MAGIC, 4) != 0) {
+        log_error("%s is not a caption cache\n", cache_path);
+        err = ERR_CACHE_INVALID;
+        goto fail;
+    }
+    if (get_le32(&hdr[4]) != PESCACHE_VERSION) {
+        log_info("Cache %s is from an other version\n", cache_path);
+        err = ERR_CACHE_STALE;
+        goto fail;
+    }
+    r->info = (struct pescache_info){
+        .source_size  = get_le64(&hdr[8]),
+        .source_mtime = get_le64(&hdr[16]),
+        .time_origin  = get_le64(&hdr[24]),
+        .duration_ms  = get_le64(&hdr[32]),
+    };
+    r->pos = sizeof(hdr);
+
+    if (pstatfn(source_path, &st) != 0) {
+        log_info("The source %s of the cache is gone, using the cache as is\n", source_path);
+    } else if (st.st_size != r->info.source_size || (int64_t)st.st_mtime != r->info.source_mtime) {
+        log_info("Cache %s was written for an other version of %s\n", cache_path, source_path);
+        err = ERR_CACHE_STALE;
+        goto fail;
+    }
+    return NOERR;
+
+fail:
+    pescache_reader_close(r);
+    return err;
+}
+
+enum error pescache_reader_next(struct pescache_reader *r, AVPacket *out)
+{
+    uint8_t hdr[PESCACHE_PACKET_HEADER_SIZE];
+    size_t n;
+    uint32_t size;
+
+    *out = (AVPacket){0};
+
+    n = fread(hdr, 1, sizeof(hdr), r->f);
+    if (n == 0 && feof(r->f))
+        return NOERR;
+    if (n != sizeof(hdr))
+        goto truncated;
+
+    size = get_le32(&hdr[8]);
+    if (size == 0 || size > PESCACHE_MAX_PACKET_SIZE)
+        goto truncated;
+    arrsetlen(r->buf, size);
+    if (fread(r->buf, 1, size, r->f) != size)
+        goto truncated;
+
+    out->data = r->buf;
+    out->size = size;
+    out->pts = out->dts = get_le64(&hdr[0]);
+    out->pos = r->pos;
+    r->pos += sizeof(hdr) + size;
+    return NOERR;
+
+truncated:
+    if (ferror(r->f))
+        return -errno;
+    log_error("Caption cache is corrupt at %" PRIi64 "\n", r->pos);
+    return ERR_CACHE_INVALID;
+}
+
+void pescache_reader_close(struct pescache_reader *r)
+{
+    if (r->f)
+        fclose(r->f);
+    arrfree(r->buf);
+    memset(r, 0, sizeof(*r));
+}
+
+enum error pescache_writer_open(struct pescache_writer *w, const pchar *source_path, const struct pescache_info *info)
+{
+    uint8_t hdr[PESCACHE_HEADER_SIZE];
+    struct pstat st;
+    enum error err;
+
+    if (pstatfn(source_path, &st) != 0)
+        return -errno;
+
+    pescache_path_for(source_path, w->path);
+    psnprintf(w->tmp_path, sizeof(w->tmp_path), PSTR("%s.tmp"), w->path);
+    w->f = pfopen(w->tmp_path, PSTR("wb"));
+    if (w->f == NULL)
+        return -errno;
+
+    memcpy(hdr, PESCACHE_MAGIC, 4);
+    put_le32(&hdr[4], PESCACHE_VERSION);
+    put_le64(&hdr[8], st.st_size);
+    put_le64(&hdr[16], st.st_mtime);
+    put_le64(&hdr[24], info->time_origin);
+    put_le64(&hdr[32], info->duration_ms);
+    if (fwrite(hdr, 1, sizeof(hdr), w->f) != sizeof(hdr)) {
+        err = -errno;
+        pescache_writer_finish(w, false);
+        return err;
+    }
+    return NOERR;
+}
+
+enum error pescache_writer_put(struct pescache_writer *w, const AVPacket *packet)
+{
+    uint8_t hdr[PESCACHE_PACKET_HEADER_SIZE];
+
+    put_le64(&hdr[0], packet->pts);
+    put_le32(&hdr[8], packet->size);
+    if (fwrite(hdr, 1, sizeof(hdr), w->f) != sizeof(hdr) ||
+            fwrite(packet->data, 1, packet->size, w->f) != (size_t)packet->size)
+        return -errno;
+    return NOERR;
+}
+
+enum error pescache_writer_finish(struct pescache_writer *w, bool ok)
+{
+    enum error err = NOERR;
+
+    if (fclose(w->f) != 0 && ok) {
+        err = -errno;
+        ok = false;
+    }
+    w->f = NULL;
+
+    if (ok == false) {
+        premove(w->tmp_path);
+        return err;
+    }
+
+#ifdef _WIN32
+    /* Doesn't replace an existing file */
+    premove(w->path);
+#endif
+    if (prename(w->tmp_path, w->path) != 0) {
+        err = -errno;
+        premove(w->tmp_path);
+        return err;
+    }
+    log_info("Wrote caption cache %s\n", w->path);
+    return NOERR;
+}
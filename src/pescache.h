@@ -0,0 +1,66 @@
+#ifndef ARIB2ASS_PESCACHE_H
+#define ARIB2ASS_PESCACHE_H
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "error.h"
+#include "platform.h"
+#include "defs.h"
+
+/*
+ * Caption cache: a sidecar file with only the caption packets of a recording,
+ * so it can be processed again without reading the whole .ts
+ */
+
+/* Appended to the input file name */
+#define PESCACHE_EXT PSTR(".a2ac")
+#define PESCACHE_PATH_SIZE 512
+
+/* What is needed from the recording besides the packets */
+struct pescache_info {
+    /* The cache is only valid for the source with this size and mtime */
+    int64_t source_size, source_mtime;
+    /* First video pts in 90kHz units, the packet pts are relative to this */
+    int64_t time_origin;
+    int64_t duration_ms;
+};
+
+struct pescache_reader {
+    FILE *f;
+    struct pescache_info info;
+    /* Size of the cache file, and the position of the next packet */
+    int64_t size, pos;
+    uint8_t stb_array *buf;
+};
+
+struct pescache_writer {
+    FILE *f;
+    pchar path[PESCACHE_PATH_SIZE], tmp_path[PESCACHE_PATH_SIZE + 8];
+};
+
+/* Is this the path of a cache file */
+bool pescache_is_cache_path(const pchar *fpath);
+/* The cache path for the input file, or the input path for a cache path */
+void pescache_path_for(const pchar *input, pchar out[PESCACHE_PATH_SIZE]);
+void pescache_source_for(const pchar *cache_path, pchar out[PESCACHE_PATH_SIZE]);
+
+/*
+ * Open a cache file, and check it against the source file.
+ * Returns -ENOENT if it doesn't exist, ERR_CACHE_STALE if the source was changed after it was written.
+ * A missing source is not an error, the cache can outlive the recording
+ */
+enum error pescache_reader_open(struct pescache_reader *r, const pchar *cache_path, const pchar *source_path);
+/* Read the next packet. The data is valid until the next call. out->size is 0 at the end */
+enum error pescache_reader_next(struct pescache_reader *r, AVPacket *out);
+void       pescache_reader_close(struct pescache_reader *r);
+
+/* The cache is written into a temporary file, and only renamed to the cache path in pescache_writer_finish() */
+enum error pescache_writer_open(struct pescache_writer *w, const pchar *source_path, const struct pescache_info *info);
+enum error pescache_writer_put(struct pescache_writer *w, const AVPacket *packet);
+/* Keep the cache if ok, otherwise delete it */
+enum error pescache_writer_finish(struct pescache_writer *w, bool ok);
+
+#endif /* ARIB2ASS_PESCACHE_H */
@@ -8,6 +8,7 @@
 #include <Windows.h>
 #include <libavutil/error.h>
 #include <io.h>
+#include <fcntl.h>
 #include <shlwapi.h>
 
 #define PATHSPECC L'\\'
@@ -20,9 +21,13 @@ typedef wchar_t pchar;
 #define psnprintf(b, s, fmt, ...) _snwprintf(b, s / sizeof(pchar), fmt, __VA_ARGS__)
 #define PLATFORM_CURRENT_TIMESPEC(otsp) ((void)_timespec64_get(otsp, TIME_UTC))
 #define S_ISDIR(m) (((m) & S_IFMT) == S_IFDIR)
+#define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
+#define S_ISFIFO(m) (((m) & S_IFMT) == _S_IFIFO)
+#define S_ISCHR(m) (((m) & S_IFMT) == S_IFCHR)
 #define fnmain wmain
 #define pstat _stati64
 #define pstatfn _wstat64
+#define pfstat _fstati64
 #define ptimespec _timespec64
 
 #define PSTR(s) L ## s
@@ -34,23 +39,34 @@ typedef wchar_t pchar;
 #define pprintf wprintf
 #define pfprintf fwprintf
 #define pfopen _wfopen
+#define pfseeko _fseeki64
 #define pperror _wperror
 #define pstrrchr wcsrchr
+#define pstrtol wcstol
 #define pvfprintf vfwprintf
+#define pvsnprintf(b, s, fmt, ap) _vsnwprintf(b, s / sizeof(pchar), fmt, ap)
 #define plopen _wopen
 #define plclose _close
 #define plwrite _write
+#define plread _read
+#define plseek _lseeki64
+#define prename _wrename
+#define premove _wremove
+/* stdin and stdout are opened in text mode */
+#define platform_set_binary(f) ((void)_setmode(_fileno(f), _O_BINARY))
 #define reallocarray(ptr, n, size) (realloc(ptr, n * size))
 
+#define PLATFORM_THREAD_LOCAL __declspec(thread)
+
 /* Convert a pchar into an utf8 text using a static buffer */
 #define PCu8_BUFFER_SIZE 1024
-extern char PCu8_buffer[PCu8_BUFFER_SIZE];
+extern PLATFORM_THREAD_LOCAL char PCu8_buffer[PCu8_BUFFER_SIZE];
 #define PCu8(pc) (platform_pchar_to_u8(pc, -1, PCu8_buffer, sizeof(PCu8_buffer)))
 
 #define u8PCmem(u8) (platform_u8_to_pchar_mem(u8))
 
 #define u8PC_BUFFER_SIZE 1024
-extern pchar u8PC_buffer[PCu8_BUFFER_SIZE];
+extern PLATFORM_THREAD_LOCAL pchar u8PC_buffer[PCu8_BUFFER_SIZE];
 #define u8PC(u8) (platform_u8_to_pchar(u8, -1, u8PC_buffer, u8PC_BUFFER_SIZE))
 
 pchar *basename(pchar *path);
@@ -65,6 +81,22 @@ struct memory_file_map {
 int  platform_memory_map_file(const pchar *file, struct memory_file_map *out);
 void platform_memory_unmap_file(struct memory_file_map *map);
 
+struct platform_thread {
+	HANDLE h;
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+struct platform_mutex {
+	SRWLOCK lock;
+};
+#define PLATFORM_MUTEX_INITIALIZER { SRWLOCK_INIT }
+
+struct platform_cond {
+	CONDITION_VARIABLE cv;
+};
+#define PLATFORM_COND_INITIALIZER { CONDITION_VARIABLE_INIT }
+
 char  *platform_pchar_to_u8(const pchar *in, int in_ccount, char *out, int out_bsize);
 pchar *platform_u8_to_pchar(const char *in, int in_bcount, pchar *out, int out_csize);
 pchar *platform_u8_to_pchar_mem(char *in);
@@ -72,6 +104,7 @@ pchar *platform_u8_to_pchar_mem(char *in);
 
 #ifdef __linux__
 #include <unistd.h>
+#include <pthread.h>
 
 #define PLATFORM_CURRENT_TIMESPEC(otsp) (clock_gettime(CLOCK_MONOTONIC_COARSE, otsp))
 #define fnmain main
@@ -87,27 +120,75 @@ typedef char pchar;
 
 #define pstat stat
 #define pstatfn stat
+#define pfstat fstat
 #define pstrlen strlen
 #define pstrerror strerror
 #define pprintf printf
 #define pstrrchr strrchr
+#define pstrtol strtol
 #define ptimespec timespec
 #define pfopen fopen
+#define pfseeko fseeko
 #define pperror perror
 #define pfprintf fprintf
 #define pvfprintf vfprintf
+#define pvsnprintf vsnprintf
 #define plopen open
 #define plclose close
 #define plwrite write
+#define plread read
+#define plseek lseek
+#define prename rename
+#define premove remove
+#define platform_set_binary(f) ((void)(f))
 #define _O_BINARY (0)
 
 #define PCu8(pc) (pc)
 #define u8PCmem(u8) (u8)
 #define u8PC(u8) (u8)
 
+#define PLATFORM_THREAD_LOCAL _Thread_local
+
+struct platform_thread {
+    pthread_t t;
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+struct platform_mutex {
+    pthread_mutex_t m;
+};
+#define PLATFORM_MUTEX_INITIALIZER { PTHREAD_MUTEX_INITIALIZER }
+
+struct platform_cond {
+    pthread_cond_t c;
+};
+#define PLATFORM_COND_INITIALIZER { PTHREAD_COND_INITIALIZER }
+
+struct memory_file_map {
+    void  *addr;
+    size_t size;
+};
+int  platform_memory_map_file(const pchar *file, struct memory_file_map *out);
+void platform_memory_unmap_file(struct memory_file_map *map);
+
 #endif
 
 int mkdir_p(const pchar *path);
+
+/* Start fn(arg) on a new thread. t must stay valid until it's joined */
+int  platform_thread_create(struct platform_thread *t, void (*fn)(void *arg), void *arg);
+void platform_thread_join(struct platform_thread *t);
+void platform_mutex_init(struct platform_mutex *m);
+void platform_mutex_destroy(struct platform_mutex *m);
+void platform_mutex_lock(struct platform_mutex *m);
+void platform_mutex_unlock(struct platform_mutex *m);
+/* Wait with m locked, until an other thread signals c */
+void platform_cond_wait(struct platform_cond *c, struct platform_mutex *m);
+void platform_cond_signal(struct platform_cond *c);
+/* Number of online logical CPUs */
+int  platform_cpu_count();
+void platform_sleep_ms(int ms);
 //void utf8_to_pchar(char *in_ascii, int in_ascii_clen, pchar *out_pchar, int out_pchar_csize);
 //void font_ucs_to_pchar(wchar_t *in_wchar, int in_wchar_clen, pchar *out_pchar, int out_pchar_csize);
 void unicode_to_pchar(char32_t cp, pchar outs[8]);
@@ -1,8 +1,13 @@
 #ifdef __linux__
 #include "platform.h"
 #include "util.h"
+#include "log.h"
 #include <assert.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 
 
 /* https://gist.github.com/JonathonReinhart/8c0d90191c38af2dcadb102c4e202950 */
@@ -103,5 +108,112 @@ void unicode_to_pchar(char32_t cp, pchar outs[8])
     unicode_to_utf8(cp, outs);
 }
 
+/* Read-only, shared by every thread that reads the file */
+int platform_memory_map_file(const pchar *file, struct memory_file_map *out)
+{
+    struct stat st;
+    void *addr;
+    int fd, e;
+
+    fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        e = errno;
+        close(fd);
+        errno = e;
+        return -1;
+    }
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    e = errno;
+    /* The mapping keeps the file */
+    close(fd);
+    if (addr == MAP_FAILED) {
+        errno = e;
+        return -1;
+    }
+
+    *out = (struct memory_file_map){
+        .addr = addr,
+        .size = st.st_size,
+    };
+    return 0;
+}
+
+void platform_memory_unmap_file(struct memory_file_map *map)
+{
+    if (map->addr)
+        munmap(map->addr, map->size);
+    memset(map, 0, sizeof(*map));
+}
+
+static void *thread_start(void *arg)
+{
+    struct platform_thread *t = arg;
+    t->fn(t->arg);
+    return NULL;
+}
+
+int platform_thread_create(struct platform_thread *t, void (*fn)(void *arg), void *arg)
+{
+    int n;
+
+    t->fn = fn;
+    t->arg = arg;
+    n = pthread_create(&t->t, NULL, thread_start, t);
+    if (n != 0) {
+        log_error("Failed to create thread: %s\n", strerror(n));
+        return -1;
+    }
+    return 0;
+}
+
+void platform_thread_join(struct platform_thread *t)
+{
+    pthread_join(t->t, NULL);
+}
+
+void platform_mutex_init(struct platform_mutex *m)
+{
+    pthread_mutex_init(&m->m, NULL);
+}
+
+void platform_mutex_destroy(struct platform_mutex *m)
+{
+    pthread_mutex_destroy(&m->m);
+}
+
+void platform_mutex_lock(struct platform_mutex *m)
+{
+    pthread_mutex_lock(&m->m);
+}
+
+void platform_mutex_unlock(struct platform_mutex *m)
+{
+    pthread_mutex_unlock(&m->m);
+}
+
+void platform_cond_wait(struct platform_cond *c, struct platform_mutex *m)
+{
+    pthread_cond_wait(&c->c, &m->m);
+}
+
+void platform_cond_signal(struct platform_cond *c)
+{
+    pthread_cond_signal(&c->c);
+}
+
+int platform_cpu_count()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+void platform_sleep_ms(int ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
 
 #endif /* __linux__ */
@@ -8,7 +8,7 @@
 #include "log.h"
 #include "util.h"
 
-wchar_t w_av_errbuf[AV_ERROR_MAX_STRING_SIZE];
+PLATFORM_THREAD_LOCAL wchar_t w_av_errbuf[AV_ERROR_MAX_STRING_SIZE];
 
 int mkdir_p(const pchar *path)
 {
@@ -120,7 +120,7 @@ void font_ucs_to_pchar(wchar_t *in_wchar, int in_wchar_clen, pchar *out_pchar, i
 }
 #endif
 
-char PCu8_buffer[PCu8_BUFFER_SIZE];
+PLATFORM_THREAD_LOCAL char PCu8_buffer[PCu8_BUFFER_SIZE];
 char *platform_pchar_to_u8(const pchar *in, int in_ccount, char *out, int out_bsize)
 {
 	int n = WideCharToMultiByte(CP_UTF8, 0, in, in_ccount, out, out_bsize, NULL, NULL);
@@ -150,7 +150,7 @@ void unicode_to_pchar(char32_t cp, pchar outs[8])
 }
 
 
-pchar u8PC_buffer[PCu8_BUFFER_SIZE];
+PLATFORM_THREAD_LOCAL pchar u8PC_buffer[PCu8_BUFFER_SIZE];
 pchar *platform_u8_to_pchar(const char *in, int in_bcount, pchar *out, int out_csize)
 {
 	int n = MultiByteToWideChar(CP_UTF8, 0, in, in_bcount, out, out_csize);
@@ -160,4 +160,73 @@ pchar *platform_u8_to_pchar(const char *in, int in_bcount, pchar *out, int out_c
 	return out;
 }
 
+static DWORD WINAPI thread_start(LPVOID param)
+{
+	struct platform_thread *t = param;
+	t->fn(t->arg);
+	return 0;
+}
+
+int platform_thread_create(struct platform_thread *t, void (*fn)(void *arg), void *arg)
+{
+	t->fn = fn;
+	t->arg = arg;
+	t->h = CreateThread(NULL, 0, thread_start, t, 0, NULL);
+	if (t->h == NULL) {
+		log_error("Failed to create thread: %d\n", GetLastError());
+		return -1;
+	}
+	return 0;
+}
+
+void platform_thread_join(struct platform_thread *t)
+{
+	WaitForSingleObject(t->h, INFINITE);
+	CloseHandle(t->h);
+	t->h = NULL;
+}
+
+void platform_mutex_init(struct platform_mutex *m)
+{
+	InitializeSRWLock(&m->lock);
+}
+
+void platform_mutex_destroy(struct platform_mutex *m)
+{
+	/* SRW locks don't need to be destroyed */
+	(void)m;
+}
+
+void platform_mutex_lock(struct platform_mutex *m)
+{
+	AcquireSRWLockExclusive(&m->lock);
+}
+
+void platform_mutex_unlock(struct platform_mutex *m)
+{
+	ReleaseSRWLockExclusive(&m->lock);
+}
+
+void platform_cond_wait(struct platform_cond *c, struct platform_mutex *m)
+{
+	SleepConditionVariableSRW(&c->cv, &m->lock, INFINITE, 0);
+}
+
+void platform_cond_signal(struct platform_cond *c)
+{
+	WakeConditionVariable(&c->cv);
+}
+
+int platform_cpu_count()
+{
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors;
+}
+
+void platform_sleep_ms(int ms)
+{
+	Sleep(ms);
+}
+
 #endif /* _WIN32 */
@@ -1,108 +1,148 @@
 #include "png.h"
 #include <assert.h>
-#include "log.h"
+#include <stdlib.h>
+#include <string.h>
+#include "outbuf.h"
+
+/*
+ * A small PNG writer for the drcs patterns, instead of a libavcodec encoder for every image.
+ * They are only a few hundred pixels, so the image data is written
+ * in stored (uncompressed) deflate blocks, as 8 bit grayscale
+ */
 
-#include <libavcodec/avcodec.h>
+/* 2 bits per pixel in the drcs pixel data, the first pixel in the high bits.
+ * The bits of each pixel are reversed, that's why the levels are in a weird order */
+#define LUM(v) ((v) == 0 ? 0x00 : (v) == 1 ? 0xAA : (v) == 2 ? 0x55 : 0xFF)
+#define PX4(b) { LUM((b) >> 6 & 3), LUM((b) >> 4 & 3), LUM((b) >> 2 & 3), LUM((b) & 3) }
+#define PX4_4(b) PX4(b), PX4((b) + 1), PX4((b) + 2), PX4((b) + 3)
+#define PX4_16(b) PX4_4(b), PX4_4((b) + 4), PX4_4((b) + 8), PX4_4((b) + 12)
+#define PX4_64(b) PX4_16(b), PX4_16((b) + 16), PX4_16((b) + 32), PX4_16((b) + 48)
 
-/* Encode using libavcodec as we already link with it
- * (We could also use stb_image_write.h)
- */
+/* The 4 grayscale pixels of every drcs byte */
+static const uint8_t unpack_table[256][4] = {
+    PX4_64(0), PX4_64(64), PX4_64(128), PX4_64(192),
+};
+
+#define DEFLATE_STORED_MAX 65535
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static uint32_t adler32(const uint8_t *data, size_t size)
+{
+    uint32_t a = 1, b = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        a = (a + data[i]) % 65521;
+        b = (b + a) % 65521;
+    }
+    return b << 16 | a;
+}
+
+static void put_be32(struct outbuf *ob, uint32_t v)
+{
+    uint8_t *p = (uint8_t *)outbuf_reserve(ob, 4);
+
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    ob->len += 4;
+}
+
+/* Starts a chunk, finished by chunk_end() with the offset it returns */
+static size_t chunk_begin(struct outbuf *ob, const char type[4])
+{
+    size_t start = ob->len;
+
+    put_be32(ob, 0);
+    outbuf_put(ob, type, 4);
+    return start;
+}
+
+static void chunk_end(struct outbuf *ob, size_t start)
+{
+    uint8_t *p = (uint8_t *)&ob->data[start];
+    uint32_t len = ob->len - start - 8;
+
+    p[0] = len >> 24;
+    p[1] = len >> 16;
+    p[2] = len >> 8;
+    p[3] = len;
+    put_be32(ob, crc32_update(0, &p[4], len + 4));
+}
+
+/* A zlib stream of stored deflate blocks */
+static void put_zlib_stored(struct outbuf *ob, const uint8_t *data, size_t size)
+{
+    size_t pos = 0;
+
+    outbuf_put(ob, "\x78\x01", 2);
+    do {
+        size_t n = size - pos < DEFLATE_STORED_MAX ? size - pos : DEFLATE_STORED_MAX;
+        uint8_t *p = (uint8_t *)outbuf_reserve(ob, 5);
+
+        p[0] = (pos + n == size);
+        p[1] = n;
+        p[2] = n >> 8;
+        p[3] = ~n;
+        p[4] = ~n >> 8;
+        ob->len += 5;
+        outbuf_put(ob, (const char *)&data[pos], n);
+        pos += n;
+    } while (pos < size);
+    put_be32(ob, adler32(data, size));
+}
 
 enum error png_encode(int w, int h, int depth, uint8_t *px, size_t pxsize,
         uint8_t **out_buf, size_t *out_buf_size)
 {
-    enum error err = ERR_LIBAV;
-    int ret;
-    AVFrame *frame = NULL;
-    AVCodecContext *ctx = NULL;
-    AVPacket *pkt = NULL;
-    const AVCodec *codec;
-    uint8_t *buf = NULL;
-    size_t buf_size = 0;
+    struct outbuf ob = { .fd = -1 };
+    size_t stride = (size_t)w + 1, chunk;
+    uint8_t *gray, *raw;
 
     assert(depth == 2);
     assert(pxsize == ((w * h) / 4));
 
-    codec = avcodec_find_encoder(AV_CODEC_ID_PNG);
-    if (codec == NULL)
-        goto end;
-
-    ctx = avcodec_alloc_context3(codec);
-    if (ctx == NULL)
-        goto end;
-
-    ctx->time_base = (AVRational){1, 1};
-    ctx->width = w;
-    ctx->height = h;
-    //ctx->pix_fmt = AV_PIX_FMT_MONOBLACK;
-    ctx->pix_fmt = AV_PIX_FMT_GRAY8;
-
-    ret = avcodec_open2(ctx, codec, NULL);
-    if (ret < 0)
-        goto end;
-
-    frame = av_frame_alloc();
-    assert(frame);
-    frame->format = ctx->pix_fmt;
-    frame->width  = ctx->width;
-    frame->height = ctx->height;
-
-    pkt = av_packet_alloc();
-    if (pkt == NULL)
-        goto end;
-
-    ret = av_frame_get_buffer(frame, 0);
-    if (ret < 0)
-        goto end;
-
-    for (int y = 0, di = 0; y < h; y++) {
-        for (int x = 0; x < w; x++, di++) {
-            /* 2 bits per pixel in the drcs pixel data, convert that to 8 bits per pixel */
-            int byte = di / 4;
-            int bit = (di % 4) * 2;
-            /* 6 - because we need to switch the bit order around,
-             * and we take 2 bits each loop */
-            uint8_t c = px[byte] >> (6 - bit);
-            /* Bits are still reversed, that's why this is in a weird order */
-            static const uint8_t lum[] = { 0, 0xAA, 0x55, 0xFF };
-            frame->data[0][y * frame->linesize[0] + x] = lum[c & 0x3];
-        }
+    /* The pixels don't start at a byte on every row, so all of them are unpacked first */
+    gray = malloc(pxsize * 4);
+    raw = malloc(stride * h);
+    assert(gray && raw);
+    for (size_t i = 0; i < pxsize; i++)
+        memcpy(&gray[i * 4], unpack_table[px[i]], 4);
+    for (int y = 0; y < h; y++) {
+        /* Filter type None */
+        raw[y * stride] = 0;
+        memcpy(&raw[y * stride + 1], &gray[(size_t)y * w], w);
     }
 
-    ret = avcodec_send_frame(ctx, frame);
-    if (ret < 0)
-        goto end;
-
-    while (ret >= 0) {
-        ret = avcodec_receive_packet(ctx, pkt);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-            break;
-        assert(ret >= 0);
+    outbuf_put(&ob, "\x89PNG\r\n\x1a\n", 8);
 
-        size_t nsize = buf_size + pkt->size;
-        uint8_t *nbuf = reallocarray(buf, nsize, 1);
-        assert(nbuf);
+    chunk = chunk_begin(&ob, "IHDR");
+    put_be32(&ob, w);
+    put_be32(&ob, h);
+    /* 8 bit grayscale, deflate, no interlace */
+    outbuf_put(&ob, "\x08\x00\x00\x00\x00", 5);
+    chunk_end(&ob, chunk);
 
-        memcpy(&nbuf[buf_size], pkt->data, pkt->size);
-        buf = nbuf;
-        buf_size = nsize;
+    chunk = chunk_begin(&ob, "IDAT");
+    put_zlib_stored(&ob, raw, stride * h);
+    chunk_end(&ob, chunk);
 
-        av_packet_unref(pkt);
-    }
+    chunk = chunk_begin(&ob, "IEND");
+    chunk_end(&ob, chunk);
 
-    *out_buf = buf;
-    *out_buf_size = buf_size;
-
-    err = NOERR;
-end:
-    if (ctx)
-        avcodec_free_context(&ctx);
-    if (frame)
-        av_frame_free(&frame);
-    if (pkt)
-        av_packet_free(&pkt);
-    if (err != NOERR)
-        free(buf);
-
-    return err;
+    free(gray);
+    free(raw);
+    *out_buf = (uint8_t *)ob.data;
+    *out_buf_size = ob.len;
+    return NOERR;
 }
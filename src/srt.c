@@ -2,47 +2,47 @@
 #include "util.h"
 #include "opts.h"
 #include "tagtext.h"
+#include "writer.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 
-struct srt_ctx {
+struct srt_writer {
     int64_t linenum;
-};
-
-static void ms_to_str(int64_t tms, char out[32])
-{
-    int64_t h, m, s, ms;
-    h = tms / H_IN_MS;
-    tms %= H_IN_MS;
-
-    m = tms / M_IN_MS;
-    tms %= M_IN_MS;
 
-    s = tms / S_IN_MS;
-    ms = tms % S_IN_MS;
+    /* The furigana of the current caption */
+    struct chars_for_furi_result rubys[MAX_FURI_REGIONS];
+    int rubylen;
 
-    snprintf(out, 32, "%02"PRId64":%02"PRId64":%02"PRId64",%03"PRId64, h, m, s, ms);
-}
+    /* The current region, NULL if it is not written */
+    const struct subobj_ref_region *region;
+    int chr_count;
+    struct tagtext_event current_styles[TT_STYLE_COUNT_];
+};
 
-static void render_line_header(struct srt_ctx *sc, const struct tagtext_caption *caption, FILE *f)
+static void render_line_header(struct srt_writer *sw, const struct subobj *s, struct outbuf *ob)
 {
-    char start_str[32], end_str[32];
-    ms_to_str(caption->ref_subobj->start_ms, start_str);
-    ms_to_str(caption->ref_subobj->end_ms, end_str);
-    sc->linenum++;
-    fprintf(f, "%"PRId64"\n%s --> %s\n", sc->linenum, start_str, end_str);
-
+    sw->linenum++;
+    outbuf_int(ob, sw->linenum, 0);
+    outbuf_putc(ob, '\n');
+    outbuf_time(ob, s->start_ms, 2, ',', 3);
+    outbuf_puts(ob, " --> ");
+    outbuf_time(ob, s->end_ms, 2, ',', 3);
+    outbuf_putc(ob, '\n');
 }
 
-static void render_tagtext_event_style(const struct tagtext_event *ev, bool first, FILE *f)
+static void render_tagtext_event_style(const struct tagtext_event *ev, bool first, struct outbuf *ob)
 {
     assert(ev->type == TT_EVENT_TYPE_STYLE);
     char tc;
 
     switch (ev->style) {
         case TT_STYLE_TEXT_COLOR:
-            fprintf(f, "<font color=\"#%02x%02x%02x\">",
-                    ARIBCC_COLOR_R(ev->style_value_u32), ARIBCC_COLOR_G(ev->style_value_u32), ARIBCC_COLOR_B(ev->style_value_u32));
+            outbuf_puts(ob, "<font color=\"#");
+            outbuf_hex(ob, ARIBCC_COLOR_R(ev->style_value_u32), 2, true);
+            outbuf_hex(ob, ARIBCC_COLOR_G(ev->style_value_u32), 2, true);
+            outbuf_hex(ob, ARIBCC_COLOR_B(ev->style_value_u32), 2, true);
+            outbuf_puts(ob, "\">");
             return;
         case TT_STYLE_BACK_COLOR:
         case TT_STYLE_STROKE_COLOR:
@@ -71,107 +71,104 @@ static void render_tagtext_event_style(const struct tagtext_event *ev, bool firs
         /* Don't start the line with a </b> for example */
         return;
     }
-    fprintf(f, "<%s%c>", ev->style_value_bool ? "" : "/", tc);
+    outbuf_puts(ob, ev->style_value_bool ? "<" : "</");
+    outbuf_putc(ob, tc);
+    outbuf_putc(ob, '>');
 }
 
-static void render_tagtext_events(const struct tagtext_event *events, const struct subobj_caption_region *region, int furi_len, const struct chars_for_furi_result *furis, FILE *f)
+static enum error srt_caption_begin(void *state, struct outbuf *ob, const struct writer_caption *wc)
 {
-    struct tagtext_event current_styles[TT_STYLE_COUNT_];
-    int chr_count = 0;
+    struct srt_writer *sw = state;
+
+    render_line_header(sw, wc->s, ob);
+
+    sw->rubylen = 0;
+    if (opt_srt_furi) {
+        sw->rubylen = util_find_chars_for_furi(wc->s, sw->rubys);
+    }
+    return NOERR;
+}
+
+static void srt_region_begin(void *state, struct outbuf *ob, const struct writer_caption *wc, intptr_t region_idx)
+{
+    struct srt_writer *sw = state;
+    const struct subobj_caption_region *region = &wc->ttc->so_caption->so_regions[region_idx];
+
+    sw->region = region->ref->is_ruby ? NULL : region->ref;
+    sw->chr_count = 0;
+}
+
+static void srt_event(void *state, struct outbuf *ob, const struct tagtext_event *event)
+{
+    struct srt_writer *sw = state;
 
-    if (region->ref->is_ruby)
+    if (sw->region == NULL)
         return;
 
-    for (const struct tagtext_event *event = events; event < arrendptr(events); event++) {
-        bool was_char = false;
-        if (event->type == TT_EVENT_TYPE_STYLE) {
-            if (opt_srt_tags) {
-                tagtext_update_current_styles(event, current_styles);
-                render_tagtext_event_style(event, !was_char, f);
-            }
-        } else if (event->type == TT_EVENT_TYPE_CHAR) {
-            was_char = true;
-            fputs(event->ref_so_chr->ref->u8str, f);
-
-            for (int fi = 0; fi < furi_len; fi++) {
-                if (furis[fi].chars_region == region->ref && furis[fi].chars_span_to == chr_count) {
-                    fputs("(", f);
-                    for (uint32_t c = 0; c < furis[fi].furi_region->char_count; c++) {
-                        fputs(furis[fi].furi_region->chars[c].u8str, f);
-                    }
-                    fputs(")", f);
+    if (event->type == TT_EVENT_TYPE_STYLE) {
+        if (opt_srt_tags) {
+            tagtext_update_current_styles(event, sw->current_styles);
+            render_tagtext_event_style(event, true, ob);
+        }
+    } else if (event->type == TT_EVENT_TYPE_CHAR) {
+        outbuf_puts(ob, event->ref_so_chr->ref->u8str);
+
+        for (int fi = 0; fi < sw->rubylen; fi++) {
+            const struct chars_for_furi_result *furi = &sw->rubys[fi];
+
+            if (furi->chars_region == sw->region && furi->chars_span_to == sw->chr_count) {
+                outbuf_putc(ob, '(');
+                for (uint32_t c = 0; c < furi->furi_region->char_count; c++) {
+                    outbuf_puts(ob, furi->furi_region->chars[c].u8str);
                 }
+                outbuf_putc(ob, ')');
             }
-
-            chr_count++;
         }
+
+        sw->chr_count++;
     }
+}
+
+static void srt_region_end(void *state, struct outbuf *ob)
+{
+    struct srt_writer *sw = state;
+
+    if (sw->region == NULL)
+        return;
 
     if (opt_srt_tags) {
         /* Close all still open tags */
         for (int i = 0; i < TT_STYLE_COUNT_; i++) {
-            switch (current_styles[i].style) {
+            switch (sw->current_styles[i].style) {
                 case TT_STYLE_BOLD:
                 case TT_STYLE_ITALIC:
                 case TT_STYLE_UNDERLINE:
-                    if (current_styles[i].style_value_bool == true) {
-                        current_styles[i].style_value_bool = false;
-                        render_tagtext_event_style(&current_styles[i], true, f);
+                    if (sw->current_styles[i].style_value_bool == true) {
+                        sw->current_styles[i].style_value_bool = false;
+                        render_tagtext_event_style(&sw->current_styles[i], true, ob);
                     }
                     break;
                 default:
                     break;
             }
         }
-        fputs("</font>", f);
+        outbuf_puts(ob, "</font>");
     }
-    fputs("\n", f);
+    outbuf_putc(ob, '\n');
 }
 
-static void render_caption(struct srt_ctx *sc, struct tagtext_caption *caption, FILE *f)
+static enum error srt_caption_end(void *state, struct outbuf *ob, const struct writer_caption *wc)
 {
-    if (arrlen(caption->tagtexts) <= 0)
-        return;
-
-    render_line_header(sc, caption, f);
-
-    struct chars_for_furi_result rubys[MAX_FURI_REGIONS];
-    int rubylen = 0;
-    if (opt_srt_furi) {
-        rubylen = util_find_chars_for_furi(caption->ref_subobj, rubys);
-    }
-
-    for (intptr_t tti = 0; tti < arrlen(caption->tagtexts); tti++) {
-        struct tagtext *tt = &caption->tagtexts[tti];
-        const struct subobj_caption_region *region = &caption->ref_subobj->so_caption.so_regions[tti];
-
-        render_tagtext_events(tt->events, region, rubylen, rubys, f);
-    }
-    fputs("\n", f);
-}
-
-enum error srt_write(const struct subobj_ctx *sctx, const pchar *filepath)
-{
-    struct srt_ctx sc = { 0 };
-    FILE *f = pfopen(filepath, PSTR("wb"));
-    if (f == NULL) {
-        return -errno;
-    }
-
-    struct tagtext_caption *tt_captions = NULL;
-    enum error err = tagtext_parse_captions(sctx->subobjs, &tt_captions, NULL);
-    if (err != NOERR) {
-        fclose(f);
-        return err;
-    }
-
-    for (intptr_t i = 0; i < arrlen(tt_captions); i++) {
-        struct tagtext_caption *ttc = &tt_captions[i];
-
-        render_caption(&sc, ttc, f);
-    }
-
-    tagtext_captions_free(tt_captions);
-    fclose(f);
+    outbuf_putc(ob, '\n');
     return NOERR;
 }
+
+const struct writer_ops srt_writer_ops = {
+    .name = "srt",
+    .state_size = sizeof(struct srt_writer),
+    .caption_begin = srt_caption_begin,
+    .region_begin = srt_region_begin,
+    .event = srt_event,
+    .region_end = srt_region_end,
+    .caption_end = srt_caption_end,
+};
@@ -1,10 +1,8 @@
 #ifndef A2AC_SRT_H
 #define A2AC_SRT_H
-#include <stdint.h>
-#include "error.h"
-#include "subobj.h"
-#include "platform.h"
+#include "writer.h"
 
-enum error srt_write(const struct subobj_ctx *sctx, const pchar *filepath);
+/* Writes the base tagtext of the captions, can be used for streaming */
+extern const struct writer_ops srt_writer_ops;
 
 #endif /* A2AC_SRT_H */
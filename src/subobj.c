@@ -11,6 +11,9 @@
 #include "util.h"
 #include "drcs.h"
 
+/* How long the last caption of a stream is shown, when the end of the video is not known */
+#define SUBOBJ_STREAM_LAST_MS 5000
+
 static void arib_log_cb(aribcc_loglevel_t level, const char* message, void* userdata)
 {
     log_info("[libaribcaption-%d] %s\n", level, u8PC(message));
@@ -47,6 +50,7 @@ enum error subobj_create(struct subobj_ctx *out_sctx, const struct tsdecode *tsd
         .arib_decoder = adec,
         .video_end_ms = tsdecode_get_video_length(tsd),
     };
+    subobj_style_table_init(&out_sctx->styles);
     return NOERR;
 
 fail:
@@ -57,54 +61,72 @@ fail:
     return err;
 }
 
-static void subobj_caption_region_free(struct subobj_caption_region *region)
+void subobj_caption_region_copy(struct arena *arena, struct subobj_caption_region *dst, const struct subobj_caption_region *src)
 {
-    for (struct subobj_caption_char *chr = region->so_chars; chr < arrendptr(region->so_chars); chr++) {
-        if (chr->owned_chr)
-            free(chr->chr);
-    }
-    arrfree(region->so_chars);
+    *dst = *src;
+    dst->so_chars = NULL;
+    arena_arrsetcap(arena, dst->so_chars, arrlen(src->so_chars));
+    memcpy(dst->so_chars, src->so_chars, arrlen(src->so_chars) * sizeof(*src->so_chars));
+    stbds_header(dst->so_chars)->length = arrlen(src->so_chars);
 }
 
-void subobj_caption_regions_free(struct subobj_caption_region stb_array *so_regions)
+void subobj_style_table_init(struct subobj_style_table *t)
 {
-    if (so_regions == NULL)
-        return;
+    memset(t, 0, sizeof(*t));
+    platform_mutex_init(&t->lock);
+}
 
-    for (struct subobj_caption_region *region = so_regions; region < arrendptr(so_regions); region++) {
-        subobj_caption_region_free(region);
-    }
-    arrfree(so_regions);
+void subobj_style_table_free(struct subobj_style_table *t)
+{
+    for (uint32_t i = 0; i < SUBOBJ_STYLE_MAX_CHUNKS && t->chunks[i]; i++)
+        free(t->chunks[i]);
+    hmfree(t->map);
+    platform_mutex_destroy(&t->lock);
+    memset(t, 0, sizeof(*t));
 }
 
-static void subobj_caption_free(struct subobj_caption *so_caption)
+uint32_t subobj_style_intern(struct subobj_style_table *t, const struct subobj_style *st)
 {
-    subobj_caption_regions_free(so_caption->so_regions);
+    ptrdiff_t idx;
+    uint32_t id;
+
+    platform_mutex_lock(&t->lock);
+    idx = hmgeti(t->map, *st);
+    if (idx != -1) {
+        id = t->map[idx].value;
+        goto end;
+    }
+
+    id = t->count;
+    if (id % SUBOBJ_STYLE_CHUNK_SIZE == 0) {
+        assert(id / SUBOBJ_STYLE_CHUNK_SIZE < SUBOBJ_STYLE_MAX_CHUNKS);
+        t->chunks[id / SUBOBJ_STYLE_CHUNK_SIZE] = malloc(SUBOBJ_STYLE_CHUNK_SIZE * sizeof(struct subobj_style));
+        assert(t->chunks[id / SUBOBJ_STYLE_CHUNK_SIZE]);
+    }
+    t->chunks[id / SUBOBJ_STYLE_CHUNK_SIZE][id % SUBOBJ_STYLE_CHUNK_SIZE] = *st;
+    t->count++;
+    hmput(t->map, *st, id);
+end:
+    platform_mutex_unlock(&t->lock);
+    return id;
 }
 
-void subobj_caption_region_copy(struct subobj_caption_region *dst, const struct subobj_caption_region *src)
+void subobj_caption_overlay(struct arena *arena, struct subobj_caption *dst, const struct subobj_caption *src)
 {
     *dst = *src;
-    dst->so_chars = NULL;
-    arrsetcap(dst->so_chars, arrlen(src->so_chars));
-    for (const struct subobj_caption_char *chr = src->so_chars; chr < arrendptr(src->so_chars); chr++) {
-        arrput(dst->so_chars, *chr);
+    dst->arena = arena;
+    dst->so_regions = NULL;
+    arena_arrsetcap(arena, dst->so_regions, arrlen(src->so_regions));
+    for (intptr_t ri = 0; ri < arrlen(src->so_regions); ri++) {
+        subobj_caption_region_copy(arena, arena_arraddnptr(arena, dst->so_regions, 1), &src->so_regions[ri]);
     }
 }
 
-static void aribcc_caption_char_copy_to_so(struct subobj_caption_char *dst, const aribcc_caption_char_t *src)
+static void aribcc_caption_char_copy_to_so(struct subobj_caption_char *dst, const struct subobj_ref_char *src)
 {
     *dst = (struct subobj_caption_char){
         .ref = src,
-        .owned_chr = false,
-        .text_color = src->text_color,
-        .back_color = src->back_color,
-        .stroke_color = src->stroke_color,
-        .style = src->style,
-        .char_width = src->char_width,
-        .char_height = src->char_height,
-        .char_horizontal_scale = src->char_horizontal_scale,
-        .char_horizontal_spacing = src->char_horizontal_spacing,
+        .style_id = src->style_id,
     };
 }
 
@@ -119,13 +141,15 @@ static void replace_drcs(aribcc_drcsmap_t *drmap, aribcc_caption_char_t *chr)
     assert(md5);
 
     chr->type = ARIBCC_CHARTYPE_DRCS_REPLACED;
-    char32_t rc = drcs_get_replacement_ucs4_by_md5(md5);
+    /* Programs can have a drcs on every line, so it is only logged and written the first time */
+    bool first;
+    char32_t rc = drcs_get_replacement_cached(md5, &first);
     /* Found */
     if (rc != 0) {
         chr->codepoint = rc;
         unicode_to_utf8(rc, chr->u8str);
 
-        if (opt_log_level <= LOG_INFO) {
+        if (first && opt_log_level <= LOG_INFO) {
 #ifdef _WIN32
             pchar replstr[8];
             _snwprintf(replstr, ARRAY_COUNT(replstr), L"%s", u8PC(chr->u8str));
@@ -137,14 +161,11 @@ static void replace_drcs(aribcc_drcsmap_t *drmap, aribcc_caption_char_t *chr)
         return;
     }
 
-    if (opt_dump_drcs == true && (opt_srt_do == false && opt_ass_do == false)) {
+    if (opt_dump_drcs == true && (opt_srt_do == false && opt_ass_do == false && arrlen(opt_ass_profiles) == 0)) {
         /* If we are already dumping all of the drcs, don't output the warning */
         return;
     }
 
-    /* Not found */
-    log_warning("Found no drcs replacement char for %s. Writing image to file.\n", u8PC(md5));
-
     /* full width space character, as normal space won't get
      * rendered at the beginning of the line */
     chr->codepoint = 0x3000;
@@ -153,10 +174,15 @@ static void replace_drcs(aribcc_drcsmap_t *drmap, aribcc_caption_char_t *chr)
     chr->u8str[2] = 0x80;
     chr->u8str[3] = '\0';
 
+    if (first == false)
+        return;
+
+    /* Not found */
+    log_warning("Found no drcs replacement char for %s. Writing image to file.\n", u8PC(md5));
     drcs_write_to_png(drcs);
 }
 
-static void aribcc_caption_region_copy_to_so_drcs_replace(struct subobj_caption_region *dst, aribcc_caption_region_t *src, aribcc_drcsmap_t *drmap)
+static void aribcc_caption_region_copy_to_so(struct arena *arena, struct subobj_caption_region *dst, const struct subobj_ref_region *src)
 {
     *dst = (struct subobj_caption_region){
         .ref = src,
@@ -166,16 +192,12 @@ static void aribcc_caption_region_copy_to_so_drcs_replace(struct subobj_caption_
         .width = src->width,
         .so_chars = NULL,
     };
-    arrsetcap(dst->so_chars, src->char_count);
+    arena_arrsetcap(arena, dst->so_chars, src->char_count);
 
     for (uint32_t j = 0; j < src->char_count; j++) {
-        struct subobj_caption_char  *dst_char = arraddnptr(dst->so_chars, 1);
-        aribcc_caption_char_t *src_char = &src->chars[j];
+        struct subobj_caption_char *dst_char = arena_arraddnptr(arena, dst->so_chars, 1);
 
-        if (src_char->type == ARIBCC_CHARTYPE_DRCS)
-            replace_drcs(drmap, src_char);
-
-        aribcc_caption_char_copy_to_so(dst_char, src_char);
+        aribcc_caption_char_copy_to_so(dst_char, &src->chars[j]);
     }
 }
 
@@ -193,34 +215,44 @@ static bool is_region_only_whitespace(const aribcc_caption_region_t *region)
     return true;
 }
 
-static void aribcc_caption_copy_to_so(struct subobj_caption *dst, aribcc_caption_t *src)
+static void aribcc_caption_copy_to_so(struct arena *arena, struct subobj_style_table *styles,
+        struct subobj_caption *dst, const struct subobj_ref_caption *src)
 {
     dst->so_regions = NULL;
-    arrsetcap(dst->so_regions, src->region_count);
+    dst->arena = arena;
+    dst->styles = styles;
+    arena_arrsetcap(arena, dst->so_regions, src->region_count);
 
     for (uint32_t i = 0; i < src->region_count; i++) {
-        aribcc_caption_region_t *src_region = &src->regions[i];
+        const struct subobj_ref_region *src_region = &src->regions[i];
         struct subobj_caption_region  *dst_region;
 
         /* Skip regions that only has whitespace */
-        if (is_region_only_whitespace(src_region))
+        if (src_region->only_whitespace)
             continue;
-        dst_region = arraddnptr(dst->so_regions, 1);
+        dst_region = arena_arraddnptr(arena, dst->so_regions, 1);
 
-        aribcc_caption_region_copy_to_so_drcs_replace(dst_region, src_region, src->drcs_map);
+        aribcc_caption_region_copy_to_so(arena, dst_region, src_region);
     }
 }
 
+/* Only needed in stream mode, everything else is in the arenas */
+static void subobj_free(struct subobj *s)
+{
+    free(s->caption_store);
+}
+
 void subobj_destroy(struct subobj_ctx *sctx)
 {
-    if (sctx->subobjs) {
+    if (sctx->finished_cb) {
         for (intptr_t i = 0; i < arrlen(sctx->subobjs); i++) {
-            //text_section_free(sctx->subobjs[i].sections);
-            subobj_caption_free(&sctx->subobjs[i].so_caption);
-            aribcc_caption_cleanup((aribcc_caption_t*)&sctx->subobjs[i].caption_ref);
+            subobj_free(&sctx->subobjs[i]);
         }
-        arrfree(sctx->subobjs);
     }
+    arrfree(sctx->subobjs);
+    arena_free(&sctx->store);
+    arena_free(&sctx->so_arena);
+    subobj_style_table_free(&sctx->styles);
 
     if (sctx->arib_decoder)
         aribcc_decoder_free(sctx->arib_decoder);
@@ -230,48 +262,200 @@ void subobj_destroy(struct subobj_ctx *sctx)
     memset(sctx, 0, sizeof(*sctx));
 }
 
-void subobj_reset_mod(struct subobj_ctx *sctx)
+void subobj_set_finished_cb(struct subobj_ctx *sctx, subobj_finished_cb cb, void *arg)
+{
+    /* The subobjs already parsed have their caption_ref in the store */
+    assert(arrlen(sctx->subobjs) == 0);
+    sctx->finished_cb = cb;
+    sctx->finished_arg = arg;
+}
+
+/* Give the subobjs with a known end time to the finished callback, and free them */
+static enum error subobj_emit_finished(struct subobj_ctx *sctx)
+{
+    enum error err = NOERR;
+    intptr_t count = arrlen(sctx->subobjs);
+    intptr_t i;
+
+    if (sctx->finished_cb == NULL)
+        return NOERR;
+
+    if (sctx->last_end_time_delayed)
+        count--;
+    for (i = 0; i < count; i++) {
+        /* Only the subobj given to the callback has a so_caption */
+        aribcc_caption_copy_to_so(&sctx->so_arena, &sctx->styles, &sctx->subobjs[i].so_caption, &sctx->subobjs[i].caption_ref);
+        err = sctx->finished_cb(&sctx->subobjs[i], sctx->finished_arg);
+        subobj_free(&sctx->subobjs[i]);
+        arena_reset(&sctx->so_arena);
+        if (err != NOERR) {
+            i++;
+            break;
+        }
+    }
+    arrdeln(sctx->subobjs, 0, i);
+    return err;
+}
+
+enum error subobj_flush(struct subobj_ctx *sctx)
 {
-    for (intptr_t i = 0; i < arrlen(sctx->subobjs); i++) {
-        subobj_caption_free(&sctx->subobjs[i].so_caption);
+    /* The collected subobjs keep the end time of the last one as it is */
+    if (sctx->finished_cb == NULL)
+        return NOERR;
+
+    if (sctx->last_end_time_delayed) {
+        struct subobj *last = &sctx->subobjs[arrlen(sctx->subobjs) - 1];
 
-        aribcc_caption_copy_to_so(&sctx->subobjs[i].so_caption, &sctx->subobjs[i].caption_ref);
+        /* The length of a stream is usually not known */
+        if (sctx->video_end_ms > last->start_ms)
+            last->end_ms = sctx->video_end_ms;
+        else
+            last->end_ms = last->start_ms + SUBOBJ_STREAM_LAST_MS;
+        sctx->last_end_time_delayed = false;
     }
+    return subobj_emit_finished(sctx);
+}
+
+static void ref_char_from_aribcc(struct subobj_style_table *styles, struct subobj_ref_char *dst, const aribcc_caption_char_t *src)
+{
+    struct subobj_style st = {
+        .text_color = src->text_color,
+        .back_color = src->back_color,
+        .stroke_color = src->stroke_color,
+        .char_horizontal_scale = src->char_horizontal_scale,
+        .char_vertical_scale = src->char_vertical_scale,
+        .char_horizontal_spacing = src->char_horizontal_spacing,
+        .char_vertical_spacing = src->char_vertical_spacing,
+        .char_width = src->char_width,
+        .char_height = src->char_height,
+        .style = src->style,
+    };
+
+    *dst = (struct subobj_ref_char){
+        .codepoint = src->codepoint,
+        .style_id = subobj_style_intern(styles, &st),
+        .char_horizontal_scale = src->char_horizontal_scale,
+        .char_vertical_scale = src->char_vertical_scale,
+        .x = src->x,
+        .y = src->y,
+        .char_width = src->char_width,
+        .char_height = src->char_height,
+        .char_horizontal_spacing = src->char_horizontal_spacing,
+        .char_vertical_spacing = src->char_vertical_spacing,
+        .type = src->type,
+    };
+    memcpy(dst->u8str, src->u8str, sizeof(dst->u8str));
+}
+
+/*
+ * Copy the decoded caption to the caption store. The regions and chars are in one block,
+ * from the store arena, or from malloc in stream mode where subobjs are freed one by one
+ */
+static void ref_caption_from_aribcc(struct subobj_ctx *sctx, struct subobj *dst, aribcc_caption_t *src)
+{
+    struct subobj_ref_region *regions;
+    struct subobj_ref_char *chars;
+    size_t char_count = 0, size;
+
+    for (uint32_t ri = 0; ri < src->region_count; ri++)
+        char_count += src->regions[ri].char_count;
+
+    size = src->region_count * sizeof(*regions) + char_count * sizeof(*chars);
+    if (sctx->finished_cb) {
+        dst->caption_store = malloc(MAX(size, 1));
+        assert(dst->caption_store);
+        regions = dst->caption_store;
+    } else {
+        regions = arena_alloc(&sctx->store, size);
+    }
+    chars = (struct subobj_ref_char*)&regions[src->region_count];
+
+    for (uint32_t ri = 0; ri < src->region_count; ri++) {
+        aribcc_caption_region_t *src_region = &src->regions[ri];
+        /* Checked before the drcs are replaced, a drcs without a replacement is not whitespace */
+        bool only_whitespace = is_region_only_whitespace(src_region);
+
+        /* The drcs map is not kept, so the drcs chars are replaced now */
+        for (uint32_t ci = 0; ci < src_region->char_count && only_whitespace == false; ci++) {
+            if (src_region->chars[ci].type == ARIBCC_CHARTYPE_DRCS)
+                replace_drcs(src->drcs_map, &src_region->chars[ci]);
+        }
+
+        regions[ri] = (struct subobj_ref_region){
+            .chars = chars,
+            .char_count = src_region->char_count,
+            .x = src_region->x,
+            .y = src_region->y,
+            .width = src_region->width,
+            .height = src_region->height,
+            .is_ruby = src_region->is_ruby,
+            .only_whitespace = only_whitespace,
+        };
+        for (uint32_t ci = 0; ci < src_region->char_count; ci++)
+            ref_char_from_aribcc(&sctx->styles, chars++, &src_region->chars[ci]);
+    }
+
+    dst->caption_ref = (struct subobj_ref_caption){
+        .regions = regions,
+        .region_count = src->region_count,
+        .plane_width = src->plane_width,
+        .plane_height = src->plane_height,
+    };
+
+    sctx->store_captions++;
+    sctx->store_bytes += size;
+    sctx->decoded_bytes += src->region_count * sizeof(aribcc_caption_region_t) + char_count * sizeof(aribcc_caption_char_t);
+}
+
+void subobj_log_stats(const struct subobj_ctx *sctx)
+{
+    if (sctx->store_captions == 0)
+        return;
+    log_info("Caption store: %" PRIi64 " captions, %" PRIi64 " bytes, %" PRIi64 " bytes per caption (%" PRIi64 " as decoded)\n",
+            sctx->store_captions, sctx->store_bytes,
+            sctx->store_bytes / sctx->store_captions, sctx->decoded_bytes / sctx->store_captions);
 }
 
 enum error subobj_parse_from_packet(struct subobj_ctx *sctx, AVPacket *packet)
 {
     struct subobj new = {0};
+    aribcc_caption_t caption = {0};
 
     aribcc_decode_status_t  decode_result;
 
-    decode_result = aribcc_decoder_decode(sctx->arib_decoder, packet->data, packet->size, packet->pts, &new.caption_ref);
+    decode_result = aribcc_decoder_decode(sctx->arib_decoder, packet->data, packet->size, packet->pts, &caption);
     if (decode_result == ARIBCC_DECODE_STATUS_ERROR) {
         log_debug("Error while decoding packet\n");
         return ERR_LIBAV;
     } else if (decode_result == ARIBCC_DECODE_STATUS_NO_CAPTION) {
         return NOERR;
     }
-    assert(new.caption_ref.flags & ARIBCC_CAPTIONFLAGS_CLEARSCREEN);
-    assert(new.caption_ref.type & ARIBCC_CAPTIONTYPE_SUPERIMPOSE);
+    assert(caption.flags & ARIBCC_CAPTIONFLAGS_CLEARSCREEN);
+    assert(caption.type & ARIBCC_CAPTIONTYPE_SUPERIMPOSE);
 
-    aribcc_caption_copy_to_so(&new.so_caption, &new.caption_ref);
+    ref_caption_from_aribcc(sctx, &new, &caption);
+    /* The drcs map is not kept, so dump the drcs chars now */
+    if (opt_dump_drcs)
+        drcs_dump_caption(&caption);
+    if (sctx->finished_cb == NULL)
+        aribcc_caption_copy_to_so(&sctx->so_arena, &sctx->styles, &new.so_caption, &new.caption_ref);
 
     if (sctx->last_end_time_delayed) {
-        sctx->subobjs[arrlen(sctx->subobjs) - 1].end_ms = new.caption_ref.pts;
+        sctx->subobjs[arrlen(sctx->subobjs) - 1].end_ms = caption.pts;
 
         sctx->last_end_time_delayed = false;
     }
 
-    new.start_ms = new.caption_ref.pts;
-    if (new.caption_ref.flags & ARIBCC_CAPTIONFLAGS_WAITDURATION) {
-        new.end_ms = new.start_ms + new.caption_ref.wait_duration;
+    new.start_ms = caption.pts;
+    if (caption.flags & ARIBCC_CAPTIONFLAGS_WAITDURATION) {
+        new.end_ms = new.start_ms + caption.wait_duration;
     } else {
         /* Always set the end time to the end of the video, as
          * this might be the last subtitle line */
         sctx->last_end_time_delayed = true;
     }
+    aribcc_caption_cleanup(&caption);
 
     arrput(sctx->subobjs, new);
-    return NOERR;
+    return subobj_emit_finished(sctx);
 }
@@ -1,6 +1,8 @@
 #ifndef ARIB2ASS_SUBOBJ_H
 #define ARIB2ASS_SUBOBJ_H
 #include <time.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 #include <libavformat/avformat.h>
@@ -8,50 +10,154 @@
 #include <aribcaption/aribcaption.h>
 
 #include "error.h"
+#include "arena.h"
 #include "tsdecode.h"
 #include "stb_ds.h"
 #include "defs.h"
+#include "platform.h"
+
+/*
+ * Compact copy of the decoded aribcc caption, with only the fields that are used.
+ * The aribcc caption is released right after it is decoded, and all the regions and chars
+ * of a caption are stored in one block. Field names are the same as in aribcc.
+ */
+struct subobj_ref_char {
+    uint32_t codepoint;
+    /* Index in the style table, colors and the other styles are only there */
+    uint32_t style_id;
+    float char_horizontal_scale, char_vertical_scale;
+    int16_t x, y;
+    int16_t char_width, char_height;
+    int16_t char_horizontal_spacing, char_vertical_spacing;
+    /* aribcc_chartype_t */
+    uint8_t type;
+    char u8str[8];
+};
 
-struct subobj_caption_char {
-    union {
-        /* This can have both a ref owned by the aribcc decoder, or
-         * a new char that is owned by subobj */
-        const aribcc_caption_char_t *ref;
-        aribcc_caption_char_t *chr;
-    };
-    bool owned_chr;
+struct subobj_ref_region {
+    const struct subobj_ref_char *chars;
+    uint32_t char_count;
+    int16_t x, y, width, height;
+    bool is_ruby;
+    /* Left out of so_regions */
+    bool only_whitespace;
+};
 
+struct subobj_ref_caption {
+    const struct subobj_ref_region *regions;
+    uint32_t region_count;
+    int16_t plane_width, plane_height;
+};
+
+/* Same as aribcc_caption_char_get_section_width/height */
+static inline int subobj_ref_char_section_width(const struct subobj_ref_char *chr)
+{
+    return (int)floorf((chr->char_width + chr->char_horizontal_spacing) * chr->char_horizontal_scale);
+}
+
+static inline int subobj_ref_char_section_height(const struct subobj_ref_char *chr)
+{
+    return (int)floorf((chr->char_height + chr->char_vertical_spacing) * chr->char_vertical_scale);
+}
+
+/*
+ * Everything that can be set with a style event in tagtext.
+ * All the different styles of a file are interned in a style table, and chars only have an index to it.
+ * No padding, so it can be hashed as bytes.
+ */
+struct subobj_style {
     aribcc_color_t text_color;    ///< Color of the text (foreground)
     aribcc_color_t back_color;    ///< Color of the background
     aribcc_color_t stroke_color;  ///< Color of the storke text
 
-    aribcc_charstyle_t style;
-    int char_width, char_height;
-    float char_horizontal_spacing, char_horizontal_scale;
+    float char_horizontal_scale, char_vertical_scale;
+    float char_horizontal_spacing;
+    int32_t char_vertical_spacing;
+    int32_t char_width, char_height;
+    /* aribcc_charstyle_t */
+    uint32_t style;
+};
+
+#define SUBOBJ_STYLE_CHUNK_SIZE 256
+#define SUBOBJ_STYLE_MAX_CHUNKS 1024
+
+/*
+ * Styles are only added, and never move, so the output writers can read them
+ * while an other writer adds new ones from an other thread
+ */
+struct subobj_style_table {
+    struct subobj_style *chunks[SUBOBJ_STYLE_MAX_CHUNKS];
+    uint32_t count;
+    /* style -> index */
+    struct subobj_style_idx {
+        struct subobj_style key;
+        uint32_t value;
+    } stb_array *map;
+    struct platform_mutex lock;
+};
+
+void     subobj_style_table_init(struct subobj_style_table *t);
+void     subobj_style_table_free(struct subobj_style_table *t);
+/* Return the index of st in the table, and add it if it is new. Thread safe */
+uint32_t subobj_style_intern(struct subobj_style_table *t, const struct subobj_style *st);
+
+static inline const struct subobj_style *subobj_style_get(const struct subobj_style_table *t, uint32_t id)
+{
+    return &t->chunks[id / SUBOBJ_STYLE_CHUNK_SIZE][id % SUBOBJ_STYLE_CHUNK_SIZE];
+}
+
+struct subobj_caption_char {
+    union {
+        /* This can have both a ref to the read only caption store, or
+         * a new char in the arena of the subobj_caption */
+        const struct subobj_ref_char *ref;
+        struct subobj_ref_char *chr;
+    };
+    /* Index in the style table of the subobj_caption. Can be different from
+     * the style_id of ref after modifications */
+    uint32_t style_id;
 };
 
 struct subobj_caption_region {
-    const aribcc_caption_region_t *ref;
+    const struct subobj_ref_region *ref;
 
     int x, y, height, width;
     struct subobj_caption_char stb_array *so_chars;
 };
 
+/*
+ * The arrays and new chars are in an arena, and are only freed all at once.
+ * The so_caption of a subobj is read only. A writer that needs to change it
+ * makes an overlay with subobj_caption_overlay() in its own arena.
+ */
 struct subobj_caption {
     struct subobj_caption_region stb_array *so_regions;
+    struct arena *arena;
+    /* Shared by all subobjs of the file */
+    struct subobj_style_table *styles;
 };
 
+static inline const struct subobj_style *subobj_char_style(const struct subobj_caption *c, const struct subobj_caption_char *chr)
+{
+    return subobj_style_get(c->styles, chr->style_id);
+}
+
 struct subobj {
     /* Start and end times for this subtitle object relative to video begin */
     time_t start_ms, end_ms;
 
     /* received from the arib decoder, read only */
-    aribcc_caption_t caption_ref;
+    struct subobj_ref_caption caption_ref;
+    /* Allocation of caption_ref in stream mode, NULL when it is in the ctx store */
+    void *caption_store;
     /* copy of caption from the decoder in a different struct, to allow different
      * fields and modifications. */
     struct subobj_caption so_caption;
 };
 
+/* Called for every subobj as soon as its end time is known. The subobj is freed after this returns */
+typedef enum error (*subobj_finished_cb)(struct subobj *s, void *arg);
+
 struct subobj_ctx {
     /* Array of parsed subtitle objects */
     struct subobj stb_array *subobjs;
@@ -64,19 +170,38 @@ struct subobj_ctx {
      * Used when the last subtitle is with undefinied end time */
     time_t video_end_ms;
 
-    /* Last decoded caption which we need if the current
-     * caption has an indefinite wait duration */
-    aribcc_caption_t last_caption;
+    /* The end time of the last subobj is only known with the next caption */
     bool             last_end_time_delayed;
+
+    /* The caption_ref of all subobjs, freed in subobj_destroy() */
+    struct arena store;
+    /* The so_caption of all subobjs, or only the one given to finished_cb in stream mode.
+     * Read only for the writers */
+    struct arena so_arena;
+    struct subobj_style_table styles;
+    /* For the stats, also counts the captions already given to finished_cb */
+    int64_t store_captions, store_bytes, decoded_bytes;
+
+    /* When set, finished subobjs are not kept in subobjs */
+    subobj_finished_cb finished_cb;
+    void              *finished_arg;
 };
 
 enum error subobj_create(struct subobj_ctx *out_sctx, const struct tsdecode *tsd);
 void       subobj_destroy(struct subobj_ctx *sctx);
-void       subobj_reset_mod(struct subobj_ctx *sctx);
 
 enum error subobj_parse_from_packet(struct subobj_ctx *sctx, AVPacket *packet);
-
-void subobj_caption_region_copy(struct subobj_caption_region *dst, const struct subobj_caption_region *src);
-void subobj_caption_regions_free(struct subobj_caption_region *regions);
+/* Stream mode, hand out finished subobjs instead of collecting them all */
+void       subobj_set_finished_cb(struct subobj_ctx *sctx, subobj_finished_cb cb, void *arg);
+/* Stream mode, end the last subobj and hand it out, call after all packets are parsed */
+enum error subobj_flush(struct subobj_ctx *sctx);
+/* Log the memory used by the caption store */
+void       subobj_log_stats(const struct subobj_ctx *sctx);
+
+/* The chars of dst are allocated from arena */
+void subobj_caption_region_copy(struct arena *arena, struct subobj_caption_region *dst, const struct subobj_caption_region *src);
+/* Copy the regions and chars of src into arena, to be changed by a writer.
+ * The refs and the style table are shared with src */
+void subobj_caption_overlay(struct arena *arena, struct subobj_caption *dst, const struct subobj_caption *src);
 
 #endif /* ARIB2ASS_SUBOBJ_H */
@@ -1,30 +1,42 @@
 #include "tagtext.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include "stb_ds.h"
 #include "util.h"
 
 struct tagtext_ctx {
+    /* All the arrays of the tagtext are allocated from this */
+    struct arena *arena;
 
     bool optimize;
-    struct tagtext_event most_common_styles[TT_STYLE_COUNT_];
+    /* The styles the lines can use, the first one has the most common value of each style */
+    struct tagtext_event line_styles[TT_MAX_LINE_STYLES][TT_STYLE_COUNT_];
+    int line_style_count;
+    /* The output size of a style event, to choose the line style of a region */
+    size_t (*event_size)(void *arg, const struct tagtext_event *ev);
+    void *event_size_arg;
+    /* The style table of the captions */
+    const struct subobj_style_table *styles;
+    /* For each style id: 0 not checked yet, 1 not the same as any line style, or the line style index + 2.
+     * Only with optimize, and kept for all captions, so not in the arena */
+    uint8_t stb_array *style_match;
+    /* For each style id: 0 not chosen yet, or the index + 1 of the line style that needs the fewest events for it */
+    uint8_t stb_array *style_best;
 };
 
-static void tagtext_events_free(struct tagtext_event stb_array *events)
-{
-    arrfree(events);
-}
+struct tagtext_iter {
+    struct tagtext_ctx ctx;
+    /* The tagtext of the current caption */
+    struct arena arena;
 
-static void tagtexts_free(struct tagtext stb_array *tagtexts)
-{
-    if (tagtexts == NULL)
-        return;
-    for (struct tagtext *tt = tagtexts; tt < &tagtexts[arrlen(tagtexts)]; tt++) {
-        tagtext_events_free(tt->events);
-    }
-    arrfree(tagtexts);
-}
+    /* Char count for each style id, and the style ids in the order they are first used */
+    uint64_t stb_array *id_counts;
+    uint32_t stb_array *id_order;
+    /* Number of regions starting with each style id */
+    uint64_t stb_array *id_line_counts;
+};
 
 #if 0
 static enum error parse_chars_as_sections(const aribcc_caption_region_t *region, struct text_section **out_sec_arr)
@@ -96,7 +108,7 @@ struct tagtext_event *tagtext_search_style_for_char(const struct tagtext_event *
     return NULL;
 }
 
-static void all_styles_from_char(const struct subobj_caption_char *chr, struct tagtext_event out_events[TT_STYLE_COUNT_])
+static void all_styles_from_style(const struct subobj_style *st, struct tagtext_event out_events[TT_STYLE_COUNT_])
 {
     memset(out_events, 0, sizeof(*out_events) * TT_STYLE_COUNT_);
 
@@ -106,20 +118,20 @@ static void all_styles_from_char(const struct subobj_caption_char *chr, struct t
         out_events[styl].style_val_member = (val); \
     }
 
-    evs(TT_STYLE_TEXT_COLOR, style_value_u32, chr->text_color);
-    evs(TT_STYLE_BACK_COLOR, style_value_u32, chr->back_color);
-    evs(TT_STYLE_STROKE_COLOR, style_value_u32, chr->stroke_color);
-    evs(TT_STYLE_SCALE_X, style_value_float, chr->char_horizontal_scale);
-    evs(TT_STYLE_SCALE_Y, style_value_float, chr->ref->char_vertical_scale);
-    evs(TT_STYLE_SPACING_X, style_value_float, chr->char_horizontal_spacing);
-    evs(TT_STYLE_SPACING_Y, style_value_u32, chr->ref->char_vertical_spacing);
-    evs(TT_STYLE_CHAR_HEIGHT, style_value_u32, chr->char_height);
-    evs(TT_STYLE_CHAR_WIDTH, style_value_u32, chr->ref->char_width);
-
-    evs(TT_STYLE_BOLD, style_value_bool, !!(chr->style & ARIBCC_CHARSTYLE_BOLD));
-    evs(TT_STYLE_ITALIC, style_value_bool, !!(chr->style & ARIBCC_CHARSTYLE_ITALIC));
-    evs(TT_STYLE_UNDERLINE, style_value_bool, !!(chr->style & ARIBCC_CHARSTYLE_UNDERLINE));
-    evs(TT_STYLE_STROKE, style_value_bool, !!(chr->style & ARIBCC_CHARSTYLE_STROKE));
+    evs(TT_STYLE_TEXT_COLOR, style_value_u32, st->text_color);
+    evs(TT_STYLE_BACK_COLOR, style_value_u32, st->back_color);
+    evs(TT_STYLE_STROKE_COLOR, style_value_u32, st->stroke_color);
+    evs(TT_STYLE_SCALE_X, style_value_float, st->char_horizontal_scale);
+    evs(TT_STYLE_SCALE_Y, style_value_float, st->char_vertical_scale);
+    evs(TT_STYLE_SPACING_X, style_value_float, st->char_horizontal_spacing);
+    evs(TT_STYLE_SPACING_Y, style_value_u32, st->char_vertical_spacing);
+    evs(TT_STYLE_CHAR_HEIGHT, style_value_u32, st->char_height);
+    evs(TT_STYLE_CHAR_WIDTH, style_value_u32, st->char_width);
+
+    evs(TT_STYLE_BOLD, style_value_bool, !!(st->style & ARIBCC_CHARSTYLE_BOLD));
+    evs(TT_STYLE_ITALIC, style_value_bool, !!(st->style & ARIBCC_CHARSTYLE_ITALIC));
+    evs(TT_STYLE_UNDERLINE, style_value_bool, !!(st->style & ARIBCC_CHARSTYLE_UNDERLINE));
+    evs(TT_STYLE_STROKE, style_value_bool, !!(st->style & ARIBCC_CHARSTYLE_STROKE));
 
     //evs(TT_STYLE_POS_XY, style_value_u32, (chr->x << 16) | (chr->y & 0xffff));
 
@@ -127,7 +139,7 @@ static void all_styles_from_char(const struct subobj_caption_char *chr, struct t
 }
 
 /* Returns the number of different events put in changed_styles */
-static int changed_styles_from_char(const struct subobj_caption_char *chr,
+static int changed_styles_from_style(const struct subobj_style *st,
         struct tagtext_event current_styles[TT_STYLE_COUNT_], struct tagtext_event changed_styles[TT_STYLE_COUNT_])
 {
     int newi = 0;
@@ -142,20 +154,20 @@ static int changed_styles_from_char(const struct subobj_caption_char *chr,
         } \
     }
 
-    evs(TT_STYLE_TEXT_COLOR, style_value_u32, chr->text_color);
-    evs(TT_STYLE_BACK_COLOR, style_value_u32, chr->back_color);
-    evs(TT_STYLE_STROKE_COLOR, style_value_u32, chr->stroke_color);
-    evs(TT_STYLE_SCALE_X, style_value_float, chr->char_horizontal_scale);
-    evs(TT_STYLE_SCALE_Y, style_value_float, chr->ref->char_vertical_scale);
-    evs(TT_STYLE_SPACING_X, style_value_float, chr->char_horizontal_spacing);
-    evs(TT_STYLE_SPACING_Y, style_value_u32, chr->ref->char_vertical_spacing);
-    evs(TT_STYLE_CHAR_HEIGHT, style_value_u32, chr->char_height);
-    evs(TT_STYLE_CHAR_WIDTH, style_value_u32, chr->ref->char_width);
-
-    evs(TT_STYLE_BOLD, style_value_bool, !!(chr->style & ARIBCC_CHARSTYLE_BOLD));
-    evs(TT_STYLE_ITALIC, style_value_bool, !!(chr->style & ARIBCC_CHARSTYLE_ITALIC));
-    evs(TT_STYLE_UNDERLINE, style_value_bool, !!(chr->style & ARIBCC_CHARSTYLE_UNDERLINE));
-    evs(TT_STYLE_STROKE, style_value_bool, !!(chr->style & ARIBCC_CHARSTYLE_STROKE));
+    evs(TT_STYLE_TEXT_COLOR, style_value_u32, st->text_color);
+    evs(TT_STYLE_BACK_COLOR, style_value_u32, st->back_color);
+    evs(TT_STYLE_STROKE_COLOR, style_value_u32, st->stroke_color);
+    evs(TT_STYLE_SCALE_X, style_value_float, st->char_horizontal_scale);
+    evs(TT_STYLE_SCALE_Y, style_value_float, st->char_vertical_scale);
+    evs(TT_STYLE_SPACING_X, style_value_float, st->char_horizontal_spacing);
+    evs(TT_STYLE_SPACING_Y, style_value_u32, st->char_vertical_spacing);
+    evs(TT_STYLE_CHAR_HEIGHT, style_value_u32, st->char_height);
+    evs(TT_STYLE_CHAR_WIDTH, style_value_u32, st->char_width);
+
+    evs(TT_STYLE_BOLD, style_value_bool, !!(st->style & ARIBCC_CHARSTYLE_BOLD));
+    evs(TT_STYLE_ITALIC, style_value_bool, !!(st->style & ARIBCC_CHARSTYLE_ITALIC));
+    evs(TT_STYLE_UNDERLINE, style_value_bool, !!(st->style & ARIBCC_CHARSTYLE_UNDERLINE));
+    evs(TT_STYLE_STROKE, style_value_bool, !!(st->style & ARIBCC_CHARSTYLE_STROKE));
 
     //evs(TT_STYLE_POS_XY, style_value_u32, (chr->x << 16) | (chr->y & 0xffff));
 
@@ -198,31 +210,117 @@ static bool textevent_style_cmp(const struct tagtext_event *a, const struct tagt
 
 
 
-static enum error parse_so_chars_to_events(struct tagtext_ctx *ctx, const struct subobj_caption_char stb_array *chrs, struct tagtext_event *stb_array *out_events)
+/* Make the per style id array at least style_id + 1 long, the new elements are zeroed */
+#define grow_id_array(arr, style_id) { \
+        if ((style_id) >= arrlenu(arr)) { \
+            size_t old_len = arrlenu(arr); \
+            arrsetlen(arr, MAX((style_id) + 1, old_len * 2)); \
+            memset(&(arr)[old_len], 0, (arrlenu(arr) - old_len) * sizeof(*(arr))); \
+        } \
+    }
+
+static void style_sizes(const struct tagtext_ctx *ctx, const struct tagtext_event styles[TT_STYLE_COUNT_], size_t out_sizes[TT_STYLE_COUNT_])
+{
+    for (int i = 0; i < TT_STYLE_COUNT_; i++)
+        out_sizes[i] = ctx->event_size(ctx->event_size_arg, &styles[i]);
+}
+
+/* The size of the events that are needed for the styles of a char, when the line uses line_style */
+static size_t style_cost(const struct tagtext_event styles[TT_STYLE_COUNT_], const size_t sizes[TT_STYLE_COUNT_],
+        const struct tagtext_event line_style[TT_STYLE_COUNT_])
+{
+    size_t cost = 0;
+
+    for (int i = 0; i < TT_STYLE_COUNT_; i++) {
+        if (textevent_style_cmp(&styles[i], &line_style[i]) == false)
+            cost += sizes[i];
+    }
+    return cost;
+}
+
+/* The line style for a region starting with the style id */
+static int line_style_for(struct tagtext_ctx *ctx, uint32_t style_id)
+{
+    struct tagtext_event styles[TT_STYLE_COUNT_];
+    size_t sizes[TT_STYLE_COUNT_];
+
+    if (ctx->optimize == false || ctx->line_style_count == 1)
+        return 0;
+
+    grow_id_array(ctx->style_best, style_id);
+    if (ctx->style_best[style_id] == 0) {
+        size_t best_cost = SIZE_MAX;
+
+        all_styles_from_style(subobj_style_get(ctx->styles, style_id), styles);
+        style_sizes(ctx, styles, sizes);
+        for (int k = 0; k < ctx->line_style_count; k++) {
+            size_t cost = style_cost(styles, sizes, ctx->line_styles[k]);
+            if (cost < best_cost) {
+                best_cost = cost;
+                ctx->style_best[style_id] = k + 1;
+            }
+        }
+    }
+    return ctx->style_best[style_id] - 1;
+}
+
+/* Is every style of the style id the same as in the line style */
+static bool style_is_line_style(struct tagtext_ctx *ctx, uint32_t style_id, int line_style)
+{
+    struct tagtext_event styles[TT_STYLE_COUNT_];
+
+    /* Nothing is left out of the events without optimization */
+    if (ctx->optimize == false)
+        return false;
+
+    grow_id_array(ctx->style_match, style_id);
+    if (ctx->style_match[style_id] == 0) {
+        all_styles_from_style(subobj_style_get(ctx->styles, style_id), styles);
+        ctx->style_match[style_id] = 1;
+        /* The line styles are all different, so at most one can match */
+        for (int k = 0; k < ctx->line_style_count; k++) {
+            int i = 0;
+            while (i < TT_STYLE_COUNT_ && textevent_style_cmp(&styles[i], &ctx->line_styles[k][i]))
+                i++;
+            if (i == TT_STYLE_COUNT_) {
+                ctx->style_match[style_id] = k + 2;
+                break;
+            }
+        }
+    }
+    return ctx->style_match[style_id] == line_style + 2;
+}
+
+static enum error parse_so_chars_to_events(struct tagtext_ctx *ctx, const struct subobj_caption_char stb_array *chrs,
+        int line_style, struct tagtext_event *stb_array *out_events)
 {
     struct tagtext_event current_styles[TT_STYLE_COUNT_];
     struct tagtext_event new_text_event;
     const struct subobj_caption_char *chr = &chrs[0];
+    uint32_t current_style_id = chr->style_id;
 
     assert(arrlen(chrs) > 0);
 
     assert(chr->ref->type != ARIBCC_CHARTYPE_DRCS);
 
-    all_styles_from_char(chr, current_styles);
+    /* A char and a few style changes per char is the usual */
+    arena_arrsetcap(ctx->arena, *out_events, TT_STYLE_COUNT_ + arrlen(chrs) * 2);
+
+    all_styles_from_style(subobj_style_get(ctx->styles, current_style_id), current_styles);
     for (int i = 0; i < ARRAY_COUNT(current_styles); i++) {
         if (ctx->optimize) {
-            if (textevent_style_cmp(&ctx->most_common_styles[current_styles[i].style], &current_styles[i]) == true)
-                /* The style for this char is in the default style, so don't output a style event for it */
+            if (textevent_style_cmp(&ctx->line_styles[line_style][current_styles[i].style], &current_styles[i]) == true)
+                /* The style for this char is in the line style, so don't output a style event for it */
                 continue;
         }
-        arrput(*out_events, current_styles[i]);
+        arena_arrput(ctx->arena, *out_events, current_styles[i]);
     }
 
     new_text_event = (struct tagtext_event){
         .type = TT_EVENT_TYPE_CHAR,
         .ref_so_chr = chr,
     };
-    arrput(*out_events, new_text_event);
+    arena_arrput(ctx->arena, *out_events, new_text_event);
 
     for (chr = &chrs[1]; chr < arrendptr(chrs); chr++) {
         struct tagtext_event changed_styles[TT_STYLE_COUNT_];
@@ -230,55 +328,52 @@ static enum error parse_so_chars_to_events(struct tagtext_ctx *ctx, const struct
 
         assert(chr->ref->type != ARIBCC_CHARTYPE_DRCS);
 
-        /* Check for new styles */
-        changed_styles_count = changed_styles_from_char(chr, current_styles, changed_styles);
+        /* Check for new styles, the same style id has no changes */
+        if (chr->style_id != current_style_id) {
+            changed_styles_count = changed_styles_from_style(subobj_style_get(ctx->styles, chr->style_id), current_styles, changed_styles);
+            current_style_id = chr->style_id;
 
-        for (int i = 0; i < changed_styles_count; i++) {
-            current_styles[changed_styles[i].style].style_value = changed_styles[i].style_value;
-        }
-        bool reset_style = true;
-        for (int i = 0; i < TT_STYLE_COUNT_; i++) {
-            if (textevent_style_cmp(&current_styles[i], &ctx->most_common_styles[i]) == false) {
-                reset_style = false;
-                break;
-            }
-        }
-        if (reset_style == false) {
             for (int i = 0; i < changed_styles_count; i++) {
-                arrput(*out_events, changed_styles[i]);
+                current_styles[changed_styles[i].style].style_value = changed_styles[i].style_value;
+            }
+            if (style_is_line_style(ctx, current_style_id, line_style) == false) {
+                for (int i = 0; i < changed_styles_count; i++) {
+                    arena_arrput(ctx->arena, *out_events, changed_styles[i]);
+                }
+            } else if (changed_styles_count > 0) {
+                struct tagtext_event reset_event = {
+                    .type = TT_EVENT_TYPE_STYLE,
+                    .style = TT_STYLE_RESET,
+                };
+                arena_arrput(ctx->arena, *out_events, reset_event);
             }
-        } else if (changed_styles_count > 0) {
-            struct tagtext_event reset_event = {
-                .type = TT_EVENT_TYPE_STYLE,
-                .style = TT_STYLE_RESET,
-            };
-            arrput(*out_events, reset_event);
         }
 
         new_text_event = (struct tagtext_event){
             .type = TT_EVENT_TYPE_CHAR,
             .ref_so_chr = chr,
         };
-        arrput(*out_events, new_text_event);
+        arena_arrput(ctx->arena, *out_events, new_text_event);
 
     }
 
-    /* if in case of error, this should free *out_events, but it cannot fail, so w/e */
+    /* The events are in the arena, so nothing to free in case of an error */
     return NOERR;
 }
 
-
 static enum error parse_so_region(struct tagtext_ctx *ctx, const struct subobj_caption_region *region, struct tagtext *out_tagtext)
 {
     struct tagtext_event *new_events = NULL;
+    int line_style = line_style_for(ctx, region->so_chars[0].style_id);
     enum error err;
 
-    err = parse_so_chars_to_events(ctx, region->so_chars, &new_events);
+    err = parse_so_chars_to_events(ctx, region->so_chars, line_style, &new_events);
     if (err != NOERR) {
         return err;
     }
 
     out_tagtext->events = new_events;
+    out_tagtext->line_style = line_style;
 
     return err;
 }
@@ -288,31 +383,47 @@ struct style_freq {
     uint64_t value;
 };
 
-static void tagtext_optimize_styles(struct tagtext_ctx *ctx, const struct subobj stb_array *subobjs)
+static void count_styles(struct tagtext_iter *it, const struct subobj_caption *so_caption)
+{
+    for (intptr_t regi = 0; regi < arrlen(so_caption->so_regions); regi++) {
+        const struct subobj_caption_region *region = &so_caption->so_regions[regi];
+
+        for (intptr_t ci = 0; ci < arrlen(region->so_chars); ci++) {
+            uint32_t id = region->so_chars[ci].style_id;
+
+            /* The writers can intern new styles while the captions are counted */
+            grow_id_array(it->id_counts, id);
+            grow_id_array(it->id_line_counts, id);
+            if (it->id_counts[id]++ == 0)
+                arrput(it->id_order, id);
+            if (ci == 0)
+                it->id_line_counts[id]++;
+        }
+    }
+}
+
+/* The first line style has the most common value of each style, from all chars */
+static void most_common_styles(struct tagtext_iter *it)
 {
+    struct tagtext_ctx *ctx = &it->ctx;
     /* an array of hashmaps for each style with the style value as key,
      * and style value count as value */
     struct style_freq* freqs[TT_STYLE_COUNT_] = {0};
 
-    for (const struct subobj *s = subobjs; s < &subobjs[arrlen(subobjs)]; s++) {
-        for (intptr_t regi = 0; regi < arrlen(s->so_caption.so_regions); regi++) {
-            const struct subobj_caption_region *region = &s->so_caption.so_regions[regi];
-
-            for (intptr_t ci = 0; ci < arrlen(region->so_chars); ci++) {
-                const struct subobj_caption_char *chr = &region->so_chars[ci];
-                struct tagtext_event char_styles[TT_STYLE_COUNT_];
+    /* Only the different styles are expanded */
+    for (intptr_t oi = 0; oi < arrlen(it->id_order); oi++) {
+        uint32_t id = it->id_order[oi];
+        struct tagtext_event char_styles[TT_STYLE_COUNT_];
 
-                all_styles_from_char(chr, char_styles);
-                for (int si = 0; si < TT_STYLE_COUNT_; si++) {
-                    struct style_freq **cf = &freqs[char_styles[si].style];
+        all_styles_from_style(subobj_style_get(ctx->styles, id), char_styles);
+        for (int si = 0; si < TT_STYLE_COUNT_; si++) {
+            struct style_freq **cf = &freqs[char_styles[si].style];
 
-                    ptrdiff_t idx = hmgeti(*cf, char_styles[si].style_value);
-                    if (idx != -1) {
-                        (*cf)[idx].value++;
-                    } else {
-                        hmput(*cf, char_styles[si].style_value, 1);
-                    }
-                }
+            ptrdiff_t idx = hmgeti(*cf, char_styles[si].style_value);
+            if (idx != -1) {
+                (*cf)[idx].value += it->id_counts[id];
+            } else {
+                hmput(*cf, char_styles[si].style_value, it->id_counts[id]);
             }
         }
     }
@@ -330,68 +441,193 @@ static void tagtext_optimize_styles(struct tagtext_ctx *ctx, const struct subobj
             }
         }
 
-        ctx->most_common_styles[styleidx] = (struct tagtext_event){
+        ctx->line_styles[0][styleidx] = (struct tagtext_event){
             .type = TT_EVENT_TYPE_STYLE,
             .style = (enum tagtext_style)styleidx,
             .style_value = max_style_value,
         };
     }
-    ctx->optimize = true;
 
     for (int i = 0; i < TT_STYLE_COUNT_; i++) {
         shfree(freqs[i]);
     }
 }
 
-enum error tagtext_parse_captions(const struct subobj *subobjs, struct tagtext_caption **out_tt_captions,
-        struct tagtext_event out_default_styles[TT_STYLE_COUNT_])
+/* The styles a region starts with, and how many regions do */
+struct line_start {
+    struct tagtext_event styles[TT_STYLE_COUNT_];
+    size_t sizes[TT_STYLE_COUNT_];
+    uint64_t count;
+    /* Size of the events with the best line style so far */
+    size_t cost;
+};
+
+static int line_start_count_cmp(const void *a, const void *b)
 {
-    enum error err = NOERR;
-    struct tagtext_ctx ctx = {0};
-    assert(*out_tt_captions == NULL);
+    const struct line_start *la = a, *lb = b;
+    return (la->count < lb->count) - (la->count > lb->count);
+}
 
-    if (out_default_styles) {
-        tagtext_optimize_styles(&ctx, subobjs);
-        memcpy(out_default_styles, ctx.most_common_styles, sizeof(struct tagtext_event) * TT_STYLE_COUNT_);
+/*
+ * Every region starts with all styles of its first char that are not in its line style,
+ * later chars only add the changed styles, or a reset if they are back to the line style.
+ * Greedily add the line start that saves the most event bytes over all regions as the next line style,
+ * while that saves more than declaring the style costs
+ */
+static void choose_line_styles(struct tagtext_iter *it, const struct tagtext_optimize_opts *opts)
+{
+    struct tagtext_ctx *ctx = &it->ctx;
+    struct line_start stb_array *starts = NULL;
+    /* Only the most common line starts are tried as line styles */
+    intptr_t candidate_count;
+
+    for (intptr_t oi = 0; oi < arrlen(it->id_order); oi++) {
+        uint32_t id = it->id_order[oi];
+        struct line_start *ls;
+
+        if (it->id_line_counts[id] == 0)
+            continue;
+        ls = arraddnptr(starts, 1);
+        all_styles_from_style(subobj_style_get(ctx->styles, id), ls->styles);
+        ls->count = it->id_line_counts[id];
+        style_sizes(ctx, ls->styles, ls->sizes);
+        ls->cost = style_cost(ls->styles, ls->sizes, ctx->line_styles[0]);
     }
+    qsort(starts, arrlenu(starts), sizeof(*starts), line_start_count_cmp);
+    candidate_count = MIN(arrlen(starts), 64);
 
-    arrsetcap(*out_tt_captions, arrlen(subobjs));
-
-    for (const struct subobj *s = subobjs; s < &subobjs[arrlen(subobjs)]; s++) {
-        struct tagtext_caption new_tt_caption = {0};
+    while (ctx->line_style_count < MIN(opts->max_styles, TT_MAX_LINE_STYLES)) {
+        intptr_t best = -1;
+        uint64_t best_saving = opts->style_size;
 
-        new_tt_caption.ref_subobj = s;
-        if (arrlen(s->so_caption.so_regions) > 0)
-            arrsetcap(new_tt_caption.tagtexts, arrlen(s->so_caption.so_regions));
+        for (intptr_t ci = 0; ci < candidate_count; ci++) {
+            uint64_t saving = 0;
 
-        for (intptr_t regi = 0; regi < arrlen(s->so_caption.so_regions); regi++) {
-            const struct subobj_caption_region *region = &s->so_caption.so_regions[regi];
-            struct tagtext *result_tagtext = arraddnptr(new_tt_caption.tagtexts, 1);
-
-            err = parse_so_region(&ctx, region, result_tagtext);
-            if (err != NOERR) {
-                (void)arrpop(new_tt_caption.tagtexts);
-                tagtexts_free(new_tt_caption.tagtexts);
-                break;
+            if (starts[ci].cost == 0)
+                continue;
+            for (intptr_t si = 0; si < arrlen(starts); si++) {
+                size_t cost = style_cost(starts[si].styles, starts[si].sizes, starts[ci].styles);
+                if (cost < starts[si].cost)
+                    saving += (starts[si].cost - cost) * starts[si].count;
+            }
+            if (saving > best_saving) {
+                best_saving = saving;
+                best = ci;
             }
         }
-        if (err != NOERR) {
+        if (best == -1)
             break;
-        }
 
-        arrput(*out_tt_captions, new_tt_caption);
-    }
-    if (err != NOERR) {
-        tagtext_captions_free(*out_tt_captions);
+        memcpy(ctx->line_styles[ctx->line_style_count++], starts[best].styles, sizeof(starts[best].styles));
+        for (intptr_t si = 0; si < arrlen(starts); si++)
+            starts[si].cost = MIN(starts[si].cost, style_cost(starts[si].styles, starts[si].sizes, starts[best].styles));
     }
 
-    return err;
+    arrfree(starts);
+}
+
+static void optimize_styles(struct tagtext_iter *it, const struct tagtext_optimize_opts *opts)
+{
+    struct tagtext_ctx *ctx = &it->ctx;
+
+    most_common_styles(it);
+    ctx->line_style_count = 1;
+    ctx->event_size = opts->event_size;
+    ctx->event_size_arg = opts->event_size_arg;
+    if (opts->max_styles > 1)
+        choose_line_styles(it, opts);
+    ctx->optimize = true;
+
+    arrfree(it->id_counts);
+    arrfree(it->id_order);
+    arrfree(it->id_line_counts);
 }
 
-void tagtext_captions_free(struct tagtext_caption stb_array *tt_captions)
+static enum error parse_caption(struct tagtext_ctx *ctx, const struct subobj *s, const struct subobj_caption *so_caption,
+        struct tagtext_caption *out_tt_caption)
 {
-    for (struct tagtext_caption *tt = tt_captions; tt < &tt_captions[arrlen(tt_captions)]; tt++) {
-        tagtexts_free(tt->tagtexts);
+    enum error err = NOERR;
+    struct tagtext_caption new_tt_caption = {0};
+
+    new_tt_caption.ref_subobj = s;
+    new_tt_caption.so_caption = so_caption;
+    if (arrlen(so_caption->so_regions) > 0)
+        arena_arrsetcap(ctx->arena, new_tt_caption.tagtexts, arrlen(so_caption->so_regions));
+
+    for (intptr_t regi = 0; regi < arrlen(so_caption->so_regions); regi++) {
+        const struct subobj_caption_region *region = &so_caption->so_regions[regi];
+        struct tagtext *result_tagtext = arena_arraddnptr(ctx->arena, new_tt_caption.tagtexts, 1);
+
+        err = parse_so_region(ctx, region, result_tagtext);
+        if (err != NOERR)
+            return err;
     }
-    arrfree(tt_captions);
+
+    *out_tt_caption = new_tt_caption;
+    return NOERR;
+}
+
+struct tagtext_iter *tagtext_iter_create(void)
+{
+    struct tagtext_iter *it = calloc(1, sizeof(*it));
+    assert(it);
+
+    it->ctx.arena = &it->arena;
+    return it;
+}
+
+void tagtext_iter_count(struct tagtext_iter *it, const struct subobj_caption *so_caption)
+{
+    assert(it->ctx.optimize == false);
+    /* All captions of a file share the same style table */
+    it->ctx.styles = so_caption->styles;
+    count_styles(it, so_caption);
+}
+
+int tagtext_iter_optimize(struct tagtext_iter *it, const struct tagtext_optimize_opts *opts,
+        struct tagtext_event out_line_styles[TT_MAX_LINE_STYLES][TT_STYLE_COUNT_])
+{
+    /* A file without any chars has nothing to optimize */
+    if (arrlen(it->id_order) == 0)
+        return 0;
+
+    optimize_styles(it, opts);
+    memcpy(out_line_styles, it->ctx.line_styles, sizeof(it->ctx.line_styles[0]) * it->ctx.line_style_count);
+    return it->ctx.line_style_count;
+}
+
+enum error tagtext_iter_parse(struct tagtext_iter *it, const struct subobj *s, const struct subobj_caption *so_caption,
+        struct tagtext_caption *out_tt_caption)
+{
+    if (so_caption == NULL)
+        so_caption = &s->so_caption;
+
+    it->ctx.styles = so_caption->styles;
+    arena_reset(&it->arena);
+    return parse_caption(&it->ctx, s, so_caption, out_tt_caption);
+}
+
+void tagtext_iter_free(struct tagtext_iter *it)
+{
+    arena_free(&it->arena);
+    arrfree(it->ctx.style_match);
+    arrfree(it->ctx.style_best);
+    arrfree(it->id_counts);
+    arrfree(it->id_order);
+    arrfree(it->id_line_counts);
+    free(it);
+}
+
+enum error tagtext_parse_caption(const struct subobj *s, const struct subobj_caption *so_caption, struct arena *arena,
+        struct tagtext_caption *out_tt_caption)
+{
+    if (so_caption == NULL)
+        so_caption = &s->so_caption;
+
+    struct tagtext_ctx ctx = {
+        .arena = arena,
+        .styles = so_caption->styles,
+    };
+
+    return parse_caption(&ctx, s, so_caption, out_tt_caption);
 }
@@ -3,6 +3,7 @@
 #include <aribcaption/aribcaption.h>
 
 #include "error.h"
+#include "arena.h"
 #include "subobj.h"
 #include "defs.h"
 
@@ -34,6 +35,9 @@ enum tagtext_style {
 };
 
 
+/* Most line styles the style optimization can choose */
+#define TT_MAX_LINE_STYLES 16
+
 /* A stream of tags and text. Handles all inline style changes in the
  * same way .ass does. That is, you have style changes, that
  * apply to all of the text after it.
@@ -62,18 +66,52 @@ struct tagtext {
             };
         };
     } stb_array *events;
+
+    /* The events only change what is different from this line style of tagtext_iter_optimize(), 0 without it */
+    int line_style;
 };
 
 struct tagtext_caption {
-    /* stb_ds array with element count of ref_subobj->caption.region_count */
+    /* stb_ds array in the arena, with element count of ref_subobj->caption.region_count */
     struct tagtext stb_array *tagtexts;
     /* a reference to the subobj that it was parsed from */
     const struct subobj *ref_subobj;
+    /* The caption of ref_subobj that was parsed, its so_caption or an overlay of it */
+    const struct subobj_caption *so_caption;
+};
+
+/*
+ * Parses the tagtext of one caption at a time into a reused buffer.
+ * For the style optimization, the styles of all chars must be known first:
+ * give every caption to tagtext_iter_count(), then call tagtext_iter_optimize().
+ * Without it, all styles are written for every caption.
+ */
+struct tagtext_iter;
+struct tagtext_iter *tagtext_iter_create(void);
+void tagtext_iter_count(struct tagtext_iter *it, const struct subobj_caption *so_caption);
+struct tagtext_optimize_opts {
+    /* The first line style has the most common value of each style, the others are chosen
+     * from the styles the regions start with, to make the events smaller */
+    int max_styles;
+    /* The output size of a style event, and of declaring a line style */
+    size_t (*event_size)(void *arg, const struct tagtext_event *ev);
+    void *event_size_arg;
+    size_t style_size;
 };
+/*
+ * The styles of its line style are left out of the events of a region.
+ * Returns the number of line styles put in out_line_styles, 0 if there were no chars
+ */
+int tagtext_iter_optimize(struct tagtext_iter *it, const struct tagtext_optimize_opts *opts,
+        struct tagtext_event out_line_styles[TT_MAX_LINE_STYLES][TT_STYLE_COUNT_]);
+/* so_caption is an overlay of s, or NULL for its so_caption. The result is valid until the next call */
+enum error tagtext_iter_parse(struct tagtext_iter *it, const struct subobj *s, const struct subobj_caption *so_caption,
+        struct tagtext_caption *out_tt_caption);
+void tagtext_iter_free(struct tagtext_iter *it);
 
-enum error tagtext_parse_captions(const struct subobj *subobjs,
-        struct tagtext_caption **out_tt_captions, struct tagtext_event out_default_styles[TT_STYLE_COUNT_]);
-void tagtext_captions_free(struct tagtext_caption *tt_captions);
+/* Parse a single caption without style optimization, everything is allocated from arena */
+enum error tagtext_parse_caption(const struct subobj *s, const struct subobj_caption *so_caption, struct arena *arena,
+        struct tagtext_caption *out_tt_caption);
 
 void tagtext_update_current_styles(const struct tagtext_event *event, struct tagtext_event out_styles[TT_STYLE_COUNT_]);
 struct tagtext_event *tagtext_search_style_for_char(const struct tagtext_event *events, intptr_t event_idx, enum tagtext_style style);
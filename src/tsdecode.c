@@ -3,6 +3,9 @@
 #include <assert.h>
 #include <sys/stat.h>
 #include <libavutil/opt.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "log.h"
 #include "opts.h"
@@ -11,6 +14,24 @@
 /* Can be increased if the subtitle stream is not found */
 #define PROBESIZE ( 64*1024*1024 )
 
+#define TS_SYNC_BYTE   0x47
+#define TS_PID_PAT     0x0000
+/* Timestamps in the transport stream are in 90kHz units */
+#define TS_TIME_BASE   ((AVRational){1, 90000})
+/* Buffer size of the AVIOContext used by libavformat */
+#define TS_AVIO_BUFFER_SIZE ( TS_PACKET_SIZE * 4096 )
+/* Max number of programs followed from the PAT */
+#define TS_MAX_PROGRAMS 8
+/* The fast probe reads this much from the start and end of the file */
+#define FAST_PROBE_SIZE ( TS_PACKET_SIZE * 2048 )
+/*
+ * Don't split the file into smaller parts than this for the parallel demuxing,
+ * so files under 192 MB keep using the serial path. Not tied to the read size
+ */
+#define TS_MIN_RANGE_SIZE ( 96 * 1024 * 1024 )
+
+static bool fast_probe(struct tsdecode *tsd);
+
 static void find_stream_infos(AVFormatContext *avformat_context, int *out_sub_idx, int *out_video_idx)
 {
     int  ret;
@@ -37,106 +58,200 @@ static void find_stream_infos(AVFormatContext *avformat_context, int *out_sub_id
     }
 }
 
-#ifdef _WIN32
-
-static int read_ts_file_packet(void *opaque, uint8_t *buf, int buf_size)
+static int avio_read_packet(void *opaque, uint8_t *buf, int buf_size)
 {
-    struct tsdecode *tsd = opaque;
+    struct ts_input *in = opaque;
+    enum error err;
+    size_t r;
 
-    //log_debug("In read ts packet\n");
-    size_t r = fread(buf, 1, buf_size, tsd->fh);
-    if (r == 0) {
-        if (feof(tsd->fh)) {
-            return AVERROR_EOF;
-        }
+    err = ts_input_read(in, buf, buf_size, &r);
+    if (err != NOERR)
         return AVERROR_EXTERNAL;
-    }
-
+    if (r == 0)
+        return AVERROR_EOF;
     return r;
 }
 
-static enum error open_ts_file(const pchar *fpath, struct tsdecode *tsd)
+static int64_t avio_seek(void *opaque, int64_t offset, int whence)
 {
-    FILE *f = pfopen(fpath, PSTR("rb"));
-    if (f == NULL)
-        return -errno;
-    tsd->fh = f;
-    return NOERR;
-}
+    struct ts_input *in = opaque;
 
-#endif
+    if (whence == AVSEEK_SIZE)
+        return in->size;
+
+    whence &= ~AVSEEK_FORCE;
+    if (whence == SEEK_CUR)
+        offset += in->pos;
+    else if (whence == SEEK_END)
+        offset += in->size;
+    else if (whence != SEEK_SET)
+        return AVERROR(EINVAL);
+
+    if (ts_input_seek(in, offset) != NOERR)
+        return AVERROR(EINVAL);
+    return offset;
+}
 
-static int open_av_file(const pchar *fpath, AVFormatContext **out_avc, struct tsdecode *tsd)
+/* libavformat reads the file through ts_input, instead of its own small buffered reads */
+static int open_av_file(const pchar *fpath, struct tsdecode *tsd)
 {
-#ifdef _WIN32
     AVFormatContext *avc = NULL;
-    AVIOContext *ioc = NULL;
-    const size_t buffer_size = 4096;
     uint8_t *avio_buffer = NULL;
     enum error err;
 
+    err = ts_input_open(&tsd->in, fpath, 0);
+    if (err != NOERR)
+        return AVERROR(ENOENT);
+
     avc = avformat_alloc_context();
     assert(avc);
 
-    avio_buffer = av_malloc(buffer_size);
+    avio_buffer = av_malloc(TS_AVIO_BUFFER_SIZE);
     assert(avio_buffer);
 
-    ioc = avio_alloc_context(avio_buffer, buffer_size, 0, tsd, &read_ts_file_packet, NULL, NULL);
-    assert(ioc);
+    tsd->ioc = avio_alloc_context(avio_buffer, TS_AVIO_BUFFER_SIZE, 0, &tsd->in, &avio_read_packet, NULL, &avio_seek);
+    assert(tsd->ioc);
+
+    avc->pb = tsd->ioc;
+    tsd->avformat_context = avc;
+    return avformat_open_input(&tsd->avformat_context, NULL, NULL, NULL);
+}
 
-    err = open_ts_file(fpath, tsd);
+static int find_stream_by_pid(AVFormatContext *avformat_context, int pid)
+{
+    /* The mpegts demuxer uses the PID as the stream id */
+    for (size_t i = 0; i < avformat_context->nb_streams; i++) {
+        if (avformat_context->streams[i]->id == pid)
+            return avformat_context->streams[i]->index;
+    }
+    return -1;
+}
+
+/* Use the caption cache instead of the .ts file, if there is a valid one */
+static enum error open_cache(const pchar *fpath, struct tsdecode *tsd)
+{
+    pchar cache_path[PESCACHE_PATH_SIZE], source_path[PESCACHE_PATH_SIZE];
+    bool explicit = pescache_is_cache_path(fpath);
+    struct pescache_reader *r;
+    enum error err;
+
+    if (explicit) {
+        psnprintf(cache_path, sizeof(cache_path), PSTR("%s"), fpath);
+        pescache_source_for(fpath, source_path);
+    } else if (opt_pes_cache) {
+        pescache_path_for(fpath, cache_path);
+        psnprintf(source_path, sizeof(source_path), PSTR("%s"), fpath);
+    } else {
+        return NOERR;
+    }
+
+    r = malloc(sizeof(*r));
+    assert(r);
+    err = pescache_reader_open(r, cache_path, source_path);
     if (err != NOERR) {
-        avformat_free_context(avc);
-        av_free(avio_buffer);
-        avio_context_free(&ioc);
-        //log_error("Failed to open input file: %s\n", error_to_string(err));
-        return AVERROR(ENOENT);
+        free(r);
+        if (explicit) {
+            log_error("Can't use the caption cache %s: %s\n", cache_path, error_to_string(err));
+            return err;
+        }
+        if (err != -ENOENT)
+            log_info("Rewriting the caption cache %s\n", cache_path);
+        return NOERR;
     }
 
-    tsd->ioc = ioc;
-    avc->pb = ioc;
-    *out_avc = avc;
-    return avformat_open_input(out_avc, NULL, NULL, NULL);
-#else
-    return avformat_open_input(out_avc, fpath, NULL, NULL);
-#endif
+    log_info("Reading the captions from the cache %s\n", cache_path);
+    tsd->cache = r;
+    tsd->file_size = r->size;
+    tsd->time_origin = r->info.time_origin;
+    tsd->duration_ms = r->info.duration_ms;
+    tsd->caption_stream_idx = 0;
+    return NOERR;
 }
 
 enum error tsdecode_open_file(const pchar *fpath, struct tsdecode *out)
 {
-    AVFormatContext * avformat_context = NULL;
-    struct pstat st;
-    int               ret, caption_stream_idx = -1, video_stream_idx = -1;
+    struct pstat st = {0};
+    int          ret, caption_stream_idx = -1, video_stream_idx = -1;
+    bool         fast = false, streaming;
 
     if (opt_log_level > LOG_DEBUG)
         av_log_set_level(AV_LOG_QUIET);
 
-    ret = open_av_file(fpath, &avformat_context, out);
+    streaming = (pstrcmp(fpath, PSTR("-")) == 0);
+    if (streaming == false) {
+        ret = pstatfn(fpath, &st);
+        if (ret != 0) {
+            enum error err = -errno;
+            log_error("Failed to open file %s: %s\n", fpath, error_to_string(err));
+            return err;
+        }
+        /* A followed file is still growing, so its size and end are not known yet */
+        streaming = S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode) || opt_follow;
+    }
+
+    *out = (struct tsdecode){
+        .caption_stream_idx = -1,
+        .video_stream_idx   = -1,
+        .file_size          = streaming ? 0 : st.st_size,
+        .fpath              = fpath,
+        .caption_pid        = -1,
+        .streaming          = streaming,
+    };
+
+    if (streaming) {
+        /* Nothing can be probed without consuming the stream,
+         * the native demuxer finds everything while decoding */
+        log_info("Reading %s as a stream%s\n", fpath, opt_follow ? PSTR(", following it as it grows") : PSTR(""));
+        out->time_origin = AV_NOPTS_VALUE;
+        out->caption_stream_idx = 0;
+        return NOERR;
+    }
+
+    enum error err = open_cache(fpath, out);
+    if (err != NOERR || out->cache)
+        return err;
+
+    if (opt_fast_probe)
+        fast = fast_probe(out);
+    if (fast && opt_native_demux) {
+        /* libavformat is not needed at all */
+        out->caption_stream_idx = 0;
+        return NOERR;
+    }
+
+    ret = open_av_file(fpath, out);
     if (ret < 0) {
         log_error("Failed to open file %s: %s\n", fpath, u8PC(av_err2str(ret)));
+        tsdecode_free(out);
         return ERR_LIBAV;
     }
-    ret = pstatfn(fpath, &st);
-    assert(ret == 0);
 
-    find_stream_infos(avformat_context, &caption_stream_idx, &video_stream_idx);
-    if (caption_stream_idx == -1 || video_stream_idx == -1) {
-        log_error("caption stream not found in file\n");
-        tsdecode_free(out);
-        return ERR_NO_CAPTION_STREAM;
+    if (fast) {
+        caption_stream_idx = find_stream_by_pid(out->avformat_context, out->caption_pid);
+        if (caption_stream_idx == -1) {
+            log_info("Caption PID 0x%X is not known by libavformat, using the full probe\n", out->caption_pid);
+            fast = false;
+        }
+    }
+
+    if (fast == false) {
+        find_stream_infos(out->avformat_context, &caption_stream_idx, &video_stream_idx);
+        if (caption_stream_idx == -1 || video_stream_idx == -1) {
+            log_error("caption stream not found in file\n");
+            tsdecode_free(out);
+            return ERR_NO_CAPTION_STREAM;
+        }
+        /* The native demuxer follows the stream chosen here, and doesn't pick one from the PMT */
+        out->caption_pid = out->avformat_context->streams[caption_stream_idx]->id;
+
+        const AVStream *vid_stream = out->avformat_context->streams[video_stream_idx];
+        out->time_origin = av_rescale_q(vid_stream->start_time, vid_stream->time_base, TS_TIME_BASE);
+        out->duration_ms = av_rescale_q(vid_stream->duration, vid_stream->time_base, (AVRational){1, 1000});
     }
     log_info("ARIB Caption stream was found at index: %d\n", caption_stream_idx);
 
-    *out = (struct tsdecode){
-        .avformat_context   = avformat_context,
-        .caption_stream_idx = caption_stream_idx,
-        .video_stream_idx   = video_stream_idx,
-        .file_size          = st.st_size,
-#ifdef _WIN32
-        .ioc                = out->ioc,
-        .fh                 = out->fh,
-#endif
-    };
+    out->caption_stream_idx = caption_stream_idx;
+    out->video_stream_idx = video_stream_idx;
     return NOERR;
 }
 
@@ -145,31 +260,884 @@ void tsdecode_free(struct tsdecode *tsd)
     if (tsd->avformat_context)
         avformat_close_input(&tsd->avformat_context);
 
-#ifdef _WIN32
     if (tsd->ioc) {
         av_freep(&tsd->ioc->buffer);
-	}
-	avio_context_free(&tsd->ioc);
-    if (tsd->fh)
-		fclose(tsd->fh);
-#endif
+    }
+    avio_context_free(&tsd->ioc);
+    if (tsd->in.fpath)
+        ts_input_close(&tsd->in);
+    if (tsd->cache) {
+        pescache_reader_close(tsd->cache);
+        free(tsd->cache);
+    }
 
     memset(tsd, 0, sizeof(*tsd));
 }
 
-enum error tsdecode_decode_packets(struct tsdecode *tsd, tsdecode_decode_packets_cb cb, void *arg)
+/*
+ * Native caption-only demuxer
+ *
+ * libavformat assembles every audio and video PES in the file, only for us to
+ * throw them away. This one only looks at the PAT/PMT to find the ARIB caption
+ * PID, then rejects every other packet after checking the 4 byte TS header.
+ */
+
+struct ts_psi {
+    int pid;
+    /* program_number of the PMT from the PAT, unused for the PAT */
+    int program;
+    bool active;
+    int len;
+    /* A PSI section is max 1024 bytes */
+    uint8_t buf[1024];
+};
+
+struct ts_demux {
+    /* PSI assemblers, 0 is the PAT, rest are PMTs */
+    struct ts_psi psi[TS_MAX_PROGRAMS + 1];
+    int psi_count;
+
+    int caption_pid, caption_component_tag;
+    /* program_number of the PMT the caption PID was taken from */
+    int caption_program;
+    int video_pid, pcr_pid;
+
+    /* The caption PES being reassembled */
+    struct ts_pes {
+        bool active;
+        int cc;
+        int64_t pos;
+        /* Full size of the PES with the header, or 0 if unbounded */
+        int total;
+        uint8_t stb_array *buf;
+    } pes;
+    int64_t last_pts;
+    /* Copy of tsd->time_origin. When streaming, it is taken from the first video pts */
+    int64_t time_origin;
+
+    /* If set, the PES are collected into the range instead of passed to cb,
+     * and the demuxing stops after the range */
+    struct ts_range *range;
+    bool done;
+
+    const struct tsdecode *tsd;
+    tsdecode_decode_packets_cb cb;
+    void *cb_arg;
+};
+
+/* A caption PES payload, in ts_range.data */
+struct ts_pes_unit {
+    int64_t pos, pts;
+    size_t off;
+    int size;
+};
+
+/*
+ * A part of the file demuxed by a separate thread.
+ * It has all of the PES, that start in [start, end)
+ */
+struct ts_range {
+    struct platform_thread thread;
+    bool started;
+
+    const struct tsdecode *tsd;
+    int64_t start, end;
+
+    struct ts_pes_unit stb_array *units;
+    uint8_t stb_array *data;
+    /* Messages of the worker thread, passed on to the log of the calling thread */
+    pchar stb_array *log;
+    enum error err;
+};
+
+static inline int ts_pid(const uint8_t *p)
+{
+    return ((p[1] & 0x1F) << 8) | p[2];
+}
+
+/* Sync byte and PID of a header as loaded in little endian */
+#define TS_HDR_SYNC_MASK 0x000000FFu
+#define TS_HDR_PID_MASK  0x00FF1F00u
+static inline uint32_t ts_hdr_pid_le(int pid)
+{
+    return (((uint32_t)pid >> 8) & 0x1F) << 8 | ((uint32_t)pid & 0xFF) << 16;
+}
+
+static inline uint32_t ts_hdr_load(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+ * Return the offset of the first packet in buf that is either
+ * for the given pid, or is out of sync.
+ * The headers are 188 bytes apart, so they are still loaded one by one,
+ * with SSE2 only the checks of 4 headers are done at once.
+ */
+static size_t ts_skip_packets(const uint8_t *buf, size_t len, int pid)
+{
+    const uint32_t want = ts_hdr_pid_le(pid);
+    size_t off = 0;
+
+#if defined(__SSE2__)
+    const __m128i sync_mask = _mm_set1_epi32(TS_HDR_SYNC_MASK);
+    const __m128i sync_want = _mm_set1_epi32(TS_SYNC_BYTE);
+    const __m128i pid_mask  = _mm_set1_epi32(TS_HDR_PID_MASK);
+    const __m128i pid_want  = _mm_set1_epi32(want);
+
+    for (; off + 4 * TS_PACKET_SIZE <= len; off += 4 * TS_PACKET_SIZE) {
+        const uint8_t *p = &buf[off];
+        __m128i h = _mm_set_epi32(ts_hdr_load(p + 3 * TS_PACKET_SIZE), ts_hdr_load(p + 2 * TS_PACKET_SIZE),
+                ts_hdr_load(p + TS_PACKET_SIZE), ts_hdr_load(p));
+        __m128i sync_ok = _mm_cmpeq_epi32(_mm_and_si128(h, sync_mask), sync_want);
+        __m128i pid_hit = _mm_cmpeq_epi32(_mm_and_si128(h, pid_mask), pid_want);
+
+        /* Either not in sync, or the pid we want */
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_andnot_si128(sync_ok, _mm_set1_epi32(-1)), pid_hit)) != 0)
+            break;
+    }
+#endif
+
+    for (; off + TS_PACKET_SIZE <= len; off += TS_PACKET_SIZE) {
+        uint32_t h = ts_hdr_load(&buf[off]);
+        if ((h & TS_HDR_SYNC_MASK) != TS_SYNC_BYTE || (h & TS_HDR_PID_MASK) == want)
+            break;
+    }
+    return off;
+}
+
+/* Returns the offset of the payload in the packet, or -1 if it has none */
+static int ts_payload_offset(const uint8_t *p)
+{
+    int afc = (p[3] >> 4) & 0x3;
+    int off = 4;
+
+    if ((afc & 0x1) == 0)
+        return -1;
+    if (afc & 0x2)
+        off += 1 + p[4];
+    if (off >= TS_PACKET_SIZE)
+        return -1;
+    return off;
+}
+
+static bool pmt_es_is_arib_caption(int stream_type, const uint8_t *desc, int desc_len, int *out_component_tag)
+{
+    if (stream_type != 0x06)
+        return false;
+
+    for (int i = 0; i + 2 <= desc_len; i += 2 + desc[i + 1]) {
+        int tag = desc[i], len = desc[i + 1];
+        if (i + 2 + len > desc_len)
+            break;
+
+        /* stream_identifier_descriptor, with the component tags for captions */
+        if (tag == 0x52 && len >= 1) {
+            int ctag = desc[i + 2];
+            if ((ctag >= 0x30 && ctag <= 0x37) || ctag == 0x87) {
+                *out_component_tag = ctag;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool pmt_es_is_video(int stream_type)
+{
+    /* MPEG-2, H.264, HEVC */
+    return stream_type == 0x01 || stream_type == 0x02 || stream_type == 0x1B || stream_type == 0x24;
+}
+
+static void parse_pat(struct ts_demux *d, const uint8_t *sec, int len)
+{
+    if (sec[0] != 0x00)
+        return;
+
+    for (int i = 8; i + 4 <= len - 4; i += 4) {
+        int prog = (sec[i] << 8) | sec[i + 1];
+        int pid = ((sec[i + 2] & 0x1F) << 8) | sec[i + 3];
+
+        /* 0 is the network PID */
+        if (prog == 0)
+            continue;
+        bool known = false;
+        for (int pi = 1; pi < d->psi_count; pi++)
+            known |= (d->psi[pi].pid == pid);
+        if (known || d->psi_count >= ARRAY_COUNT(d->psi))
+            continue;
+
+        d->psi[d->psi_count++] = (struct ts_psi){ .pid = pid, .program = prog };
+    }
+}
+
+static void parse_pmt(struct ts_demux *d, const struct ts_psi *psi, const uint8_t *sec, int len)
+{
+    int video_pid = -1;
+
+    if (sec[0] != 0x02 || len < 16)
+        return;
+
+    /* Only the program the PAT listed for this PID */
+    int program = (sec[3] << 8) | sec[4];
+    if (program != psi->program)
+        return;
+    int pcr_pid = ((sec[8] & 0x1F) << 8) | sec[9];
+
+    int pil = ((sec[10] & 0x0F) << 8) | sec[11];
+    for (int i = 12 + pil; i + 5 <= len - 4;) {
+        int stream_type = sec[i];
+        int pid = ((sec[i + 1] & 0x1F) << 8) | sec[i + 2];
+        int eil = ((sec[i + 3] & 0x0F) << 8) | sec[i + 4];
+        int ctag;
+
+        if (i + 5 + eil > len - 4)
+            break;
+
+        if (video_pid == -1 && pmt_es_is_video(stream_type))
+            video_pid = pid;
+
+        /* Prefer the lowest component tag (main caption) of the first program that has one */
+        if (pmt_es_is_arib_caption(stream_type, &sec[i + 5], eil, &ctag)) {
+            if (d->caption_pid == -1 || (program == d->caption_program && ctag < d->caption_component_tag)) {
+                d->caption_pid = pid;
+                d->caption_component_tag = ctag;
+                d->caption_program = program;
+                d->pcr_pid = pcr_pid;
+            }
+        }
+
+        i += 5 + eil;
+    }
+
+    /* The video stream can be listed before or after the caption */
+    if (d->caption_pid != -1 && program == d->caption_program)
+        d->video_pid = video_pid;
+}
+
+static void psi_feed(struct ts_demux *d, struct ts_psi *psi, const uint8_t *pl, int plen, bool pusi)
+{
+    if (pusi) {
+        int ptr = pl[0];
+        if (1 + ptr >= plen)
+            return;
+        pl += 1 + ptr;
+        plen -= 1 + ptr;
+        psi->len = 0;
+        psi->active = true;
+    } else if (psi->active == false) {
+        return;
+    }
+
+    int cp = MIN(plen, (int)sizeof(psi->buf) - psi->len);
+    memcpy(&psi->buf[psi->len], pl, cp);
+    psi->len += cp;
+
+    if (psi->len < 3)
+        return;
+    int want = 3 + (((psi->buf[1] & 0x0F) << 8) | psi->buf[2]);
+    if (want > sizeof(psi->buf)) {
+        psi->active = false;
+        return;
+    }
+    if (psi->len < want)
+        return;
+
+    if (psi->pid == TS_PID_PAT)
+        parse_pat(d, psi->buf, want);
+    else
+        parse_pmt(d, psi, psi->buf, want);
+    psi->active = false;
+}
+
+static inline int64_t ts_read_pts(const uint8_t *p)
+{
+    return ((int64_t)((p[0] >> 1) & 0x07) << 30) | (p[1] << 22) | ((p[2] >> 1) << 15) | (p[3] << 7) | (p[4] >> 1);
+}
+
+/*
+ * Parse the PES header. Returns the offset of the PES data,
+ * or -1 if it is not a valid (or not yet complete) header
+ */
+static int pes_parse_header(const uint8_t *pes, int len, int64_t *out_pts, int *out_total)
+{
+    if (len < 6 || pes[0] != 0x00 || pes[1] != 0x00 || pes[2] != 0x01)
+        return -1;
+
+    int sid = pes[3];
+    int plen = (pes[4] << 8) | pes[5];
+    *out_total = plen ? 6 + plen : 0;
+    *out_pts = AV_NOPTS_VALUE;
+
+    /* private_stream_2, no optional header */
+    if (sid == 0xBF)
+        return 6;
+
+    if (len < 9 || len < 9 + pes[8])
+        return -1;
+    if ((pes[7] & 0x80) && pes[8] >= 5)
+        *out_pts = ts_read_pts(&pes[9]);
+    return 9 + pes[8];
+}
+
+static int64_t ts_unwrap(int64_t ts, int64_t origin)
+{
+    if (ts < origin && origin - ts > (1LL << 32))
+        ts += (1LL << 33);
+    return ts;
+}
+
+/* Pass a caption PES payload to the callback */
+static enum error pes_deliver(struct ts_demux *d, const uint8_t *data, int size, int64_t pts, int64_t pos)
+{
+    /* Asynchronous captions have no pts, they are shown when received */
+    if (pts == AV_NOPTS_VALUE)
+        pts = d->last_pts;
+    if (d->time_origin == AV_NOPTS_VALUE) {
+        /* Stream without video, or the caption came first */
+        if (pts == AV_NOPTS_VALUE) {
+            log_debug("Dropping caption without a time reference at %" PRId64 "\n", pos);
+            return NOERR;
+        }
+        d->time_origin = pts;
+    }
+    d->last_pts = pts;
+
+    /* Handle a pts wraparound after the first video frame */
+    pts = ts_unwrap(pts, d->time_origin);
+
+    AVPacket packet = {
+        .data = (uint8_t*)data,
+        .size = size,
+        .pos = pos,
+        .stream_index = d->tsd->caption_stream_idx,
+    };
+    packet.pts = packet.dts = av_rescale_q(MAX(pts - d->time_origin, 0), TS_TIME_BASE, (AVRational){1, 1000});
+
+    return d->cb(&packet, d->cb_arg);
+}
+
+static enum error pes_emit(struct ts_demux *d, const uint8_t *pes, int len, int64_t pos)
+{
+    int64_t pts;
+    int total, hdr;
+
+    hdr = pes_parse_header(pes, len, &pts, &total);
+    if (hdr < 0 || hdr > len) {
+        log_debug("Dropping caption PES with an invalid header at %" PRId64 "\n", pos);
+        return NOERR;
+    }
+    if (total != 0 && total < len)
+        len = total;
+
+    if (d->range) {
+        struct ts_range *r = d->range;
+        struct ts_pes_unit u = {
+            .pos = pos,
+            .pts = pts,
+            .off = arrlen(r->data),
+            .size = len - hdr,
+        };
+        memcpy(arraddnptr(r->data, u.size), &pes[hdr], u.size);
+        arrput(r->units, u);
+        return NOERR;
+    }
+
+    return pes_deliver(d, &pes[hdr], len - hdr, pts, pos);
+}
+
+static enum error pes_flush(struct ts_demux *d)
+{
+    enum error err = NOERR;
+
+    if (d->pes.active && arrlen(d->pes.buf) > 0)
+        err = pes_emit(d, d->pes.buf, arrlen(d->pes.buf), d->pes.pos);
+    d->pes.active = false;
+    arrsetlen(d->pes.buf, 0);
+    return err;
+}
+
+static enum error pes_feed(struct ts_demux *d, const uint8_t *p, int64_t pos)
+{
+    enum error err = NOERR;
+    bool pusi = (p[1] & 0x40) != 0;
+    int cc = p[3] & 0x0F;
+    int off = ts_payload_offset(p);
+
+    if (off < 0)
+        return NOERR;
+    const uint8_t *pl = &p[off];
+    int plen = TS_PACKET_SIZE - off;
+
+    if (d->pes.active && pusi == false) {
+        if (cc == d->pes.cc)
+            return NOERR; /* Duplicate packet */
+        if (cc != ((d->pes.cc + 1) & 0x0F)) {
+            log_debug("Caption PES discontinuity at %" PRId64 "\n", pos);
+            d->pes.active = false;
+            arrsetlen(d->pes.buf, 0);
+            return NOERR;
+        }
+    }
+    d->pes.cc = cc;
+
+    if (pusi) {
+        int64_t pts;
+        int total;
+
+        /* Unbounded PES ends when the next one starts */
+        err = pes_flush(d);
+        if (err != NOERR)
+            return err;
+
+        /* Most captions fit into a single packet, emit those without copying */
+        if (pes_parse_header(pl, plen, &pts, &total) >= 0 && total != 0 && total <= plen)
+            return pes_emit(d, pl, total, pos);
+
+        d->pes.active = true;
+        d->pes.pos = pos;
+        d->pes.total = 0;
+    } else if (d->pes.active == false) {
+        return NOERR;
+    }
+
+    memcpy(arraddnptr(d->pes.buf, plen), pl, plen);
+
+    if (d->pes.total == 0) {
+        int64_t pts;
+        if (pes_parse_header(d->pes.buf, arrlen(d->pes.buf), &pts, &d->pes.total) < 0)
+            d->pes.total = 0;
+    }
+    if (d->pes.total != 0 && arrlen(d->pes.buf) >= d->pes.total)
+        err = pes_flush(d);
+
+    return err;
+}
+
+static void ts_demux_init(struct ts_demux *d, const struct tsdecode *tsd, tsdecode_decode_packets_cb cb, void *arg)
+{
+    *d = (struct ts_demux){
+        .psi = { { .pid = TS_PID_PAT } },
+        .psi_count = 1,
+        .caption_pid = tsd->caption_pid,
+        .video_pid = -1,
+        .pcr_pid = -1,
+        .last_pts = tsd->time_origin,
+        .time_origin = tsd->time_origin,
+        .tsd = tsd,
+        .cb = cb,
+        .cb_arg = arg,
+    };
+}
+
+static void ts_demux_free(struct ts_demux *d)
+{
+    arrfree(d->pes.buf);
+}
+
+/* Feed a packet to the PAT/PMT parsers, until the caption PID is found */
+static void ts_demux_psi(struct ts_demux *d, const uint8_t *p)
+{
+    int pid = ts_pid(p);
+
+    for (int i = 0; i < d->psi_count; i++) {
+        if (d->psi[i].pid == pid) {
+            int po = ts_payload_offset(p);
+            if (po >= 0)
+                psi_feed(d, &d->psi[i], &p[po], TS_PACKET_SIZE - po, (p[1] & 0x40) != 0);
+            break;
+        }
+    }
+}
+
+/* Take the time origin from the first video pts, when it wasn't known before demuxing */
+static void ts_demux_video_origin(struct ts_demux *d, const uint8_t *p)
+{
+    int po = ts_payload_offset(p);
+    int64_t pts;
+    int total;
+
+    if ((p[1] & 0x40) == 0 || po < 0)
+        return;
+    if (pes_parse_header(&p[po], TS_PACKET_SIZE - po, &pts, &total) < 0 || pts == AV_NOPTS_VALUE)
+        return;
+    d->time_origin = d->last_pts = pts;
+    log_debug("Time origin from the first video pts: %" PRId64 "\n", pts);
+}
+
+/* Find the next sync byte that is followed by another one a packet later */
+static size_t ts_resync(const uint8_t *buf, size_t len)
+{
+    size_t off;
+    for (off = 1; off + TS_PACKET_SIZE < len; off++) {
+        if (buf[off] == TS_SYNC_BYTE && buf[off + TS_PACKET_SIZE] == TS_SYNC_BYTE)
+            return off;
+    }
+    return off;
+}
+
+/*
+ * Process all whole packets in buf, that starts at file position pos.
+ * Returns the number of bytes consumed in out_used
+ */
+static enum error ts_demux_feed(struct ts_demux *d, const uint8_t *buf, size_t len, int64_t pos, size_t *out_used)
+{
+    enum error err = NOERR;
+    size_t off = 0;
+
+    while (off + TS_PACKET_SIZE <= len) {
+        if (d->caption_pid != -1 && d->time_origin != AV_NOPTS_VALUE) {
+            off += ts_skip_packets(&buf[off], len - off, d->caption_pid);
+            if (off + TS_PACKET_SIZE > len)
+                break;
+        }
+
+        const uint8_t *p = &buf[off];
+        if (p[0] != TS_SYNC_BYTE) {
+            log_debug("Lost TS sync at %" PRId64 "\n", pos + (int64_t)off);
+            off += ts_resync(p, len - off);
+            continue;
+        }
+
+        int pid = ts_pid(p);
+        if (d->range && pos + (int64_t)off >= d->range->end) {
+            /* Past the range, only finish the PES that was started in it */
+            if (d->pes.active == false || (pid == d->caption_pid && (p[1] & 0x40))) {
+                err = pes_flush(d);
+                d->done = true;
+                break;
+            }
+        }
+
+        if (pid == d->caption_pid) {
+            err = pes_feed(d, p, pos + off);
+            if (err != NOERR)
+                break;
+        } else if (d->caption_pid == -1) {
+            ts_demux_psi(d, p);
+            if (d->caption_pid != -1)
+                log_debug("Native demuxer following caption PID 0x%X\n", d->caption_pid);
+        } else if (pid == d->video_pid && d->time_origin == AV_NOPTS_VALUE) {
+            ts_demux_video_origin(d, p);
+        }
+        off += TS_PACKET_SIZE;
+    }
+
+    *out_used = off;
+    return err;
+}
+
+/* Demux the input until the end of the file, or the end of the range */
+static enum error ts_demux_read(struct ts_demux *d, struct ts_input *in)
+{
+    const uint8_t *buf;
+    size_t len, used;
+    enum error err;
+
+    for (;;) {
+        err = ts_input_next(in, &buf, &len);
+        if (err != NOERR)
+            return err;
+        if (len < TS_PACKET_SIZE)
+            break;
+
+        /* The PES that fit in one packet are passed on as pointers into buf */
+        err = ts_demux_feed(d, buf, len, in->pos, &used);
+        ts_input_consume(in, used);
+        if (err != NOERR || d->done)
+            return err;
+    }
+
+    return pes_flush(d);
+}
+
+static enum error decode_packets_native(struct tsdecode *tsd, tsdecode_decode_packets_cb cb, void *arg)
+{
+    struct ts_input in;
+    struct ts_demux d;
+    enum error err;
+
+    err = ts_input_open(&in, tsd->fpath, 0);
+    if (err != NOERR)
+        return err;
+    ts_demux_init(&d, tsd, cb, arg);
+
+    err = ts_demux_read(&d, &in);
+    if (err == NOERR && d.caption_pid == -1) {
+        log_error("No caption PID was found in the PMT\n");
+        err = ERR_NO_CAPTION_STREAM;
+    }
+
+    ts_demux_free(&d);
+    ts_input_close(&in);
+    return err;
+}
+
+static void range_demux(struct ts_range *r)
+{
+    struct ts_input in;
+    struct ts_demux d;
+
+    r->err = ts_input_open(&in, r->tsd->fpath, r->start);
+    if (r->err == NOERR) {
+        ts_demux_init(&d, r->tsd, NULL, NULL);
+        d.range = r;
+        r->err = ts_demux_read(&d, &in);
+        ts_demux_free(&d);
+        ts_input_close(&in);
+    }
+}
+
+static void range_worker(void *arg)
+{
+    struct ts_range *r = arg;
+
+    log_buffer_begin();
+    range_demux(r);
+    r->log = log_buffer_take();
+}
+
+static enum error find_caption_pid(struct tsdecode *tsd);
+
+/*
+ * Collect the caption PES from nranges parts of the file in parallel,
+ * then pass them to cb in order from this thread
+ */
+static enum error decode_packets_native_parallel(struct tsdecode *tsd, int nranges, tsdecode_decode_packets_cb cb, void *arg)
+{
+    struct ts_range *ranges;
+    struct ts_demux d;
+    enum error err = NOERR;
+    int64_t range_size;
+
+    /* The ranges after the first one won't see the PMT */
+    if (tsd->caption_pid == -1) {
+        err = find_caption_pid(tsd);
+        if (err != NOERR)
+            return err;
+    }
+
+    ranges = calloc(nranges, sizeof(*ranges));
+    assert(ranges);
+    range_size = tsd->file_size / nranges / TS_PACKET_SIZE * TS_PACKET_SIZE;
+
+    for (int i = 0; i < nranges; i++) {
+        struct ts_range *r = &ranges[i];
+        *r = (struct ts_range){
+            .tsd = tsd,
+            .start = i * range_size,
+            .end = (i == nranges - 1) ? INT64_MAX : (i + 1) * range_size,
+        };
+        r->started = (platform_thread_create(&r->thread, range_worker, r) == 0);
+    }
+
+    for (int i = 0; i < nranges; i++) {
+        struct ts_range *r = &ranges[i];
+        if (r->started) {
+            platform_thread_join(&r->thread);
+            /* Into the buffer of the file, if -j is buffering this thread */
+            log_buffer_put(r->log);
+        } else {
+            range_demux(r);
+        }
+    }
+
+    /* The decoder needs the PES in order */
+    ts_demux_init(&d, tsd, cb, arg);
+    for (int i = 0; i < nranges && err == NOERR; i++) {
+        struct ts_range *r = &ranges[i];
+        err = r->err;
+        for (intptr_t ui = 0; ui < arrlen(r->units) && err == NOERR; ui++) {
+            const struct ts_pes_unit *u = &r->units[ui];
+            err = pes_deliver(&d, &r->data[u->off], u->size, u->pts, u->pos);
+        }
+    }
+    ts_demux_free(&d);
+
+    for (int i = 0; i < nranges; i++) {
+        arrfree(ranges[i].units);
+        arrfree(ranges[i].data);
+    }
+    free(ranges);
+    return err;
+}
+
+/*
+ * Fast probe
+ *
+ * avformat_find_stream_info() decodes video frames just to find the caption
+ * stream and the start time. Instead, look at the PMT for the caption stream,
+ * and use the first video pts (or PCR) from the start of the file as the time
+ * origin, and the last one from the end of the file for the length.
+ */
+
+struct ts_probe {
+    /* Min and max video pts, and first and last PCR. AV_NOPTS_VALUE if not found */
+    int64_t first_pts, last_pts;
+    int64_t first_pcr, last_pcr;
+};
+
+static inline int64_t ts_read_pcr_base(const uint8_t *p)
+{
+    return ((int64_t)p[0] << 25) | (p[1] << 17) | (p[2] << 9) | (p[3] << 1) | (p[4] >> 7);
+}
+
+static void probe_scan(struct ts_demux *d, const uint8_t *buf, size_t len, struct ts_probe *pr)
+{
+    size_t off = 0;
+
+    while (off + TS_PACKET_SIZE <= len) {
+        const uint8_t *p = &buf[off];
+        if (p[0] != TS_SYNC_BYTE) {
+            off += ts_resync(p, len - off);
+            continue;
+        }
+        off += TS_PACKET_SIZE;
+
+        int pid = ts_pid(p);
+        if (d->caption_pid == -1) {
+            ts_demux_psi(d, p);
+            continue;
+        }
+
+        /* Adaptation field with a PCR */
+        if (pid == d->pcr_pid && (p[3] & 0x20) && p[4] >= 7 && (p[5] & 0x10)) {
+            int64_t pcr = ts_read_pcr_base(&p[6]);
+            if (pr->first_pcr == AV_NOPTS_VALUE)
+                pr->first_pcr = pcr;
+            pr->last_pcr = pcr;
+        }
+
+        int po = ts_payload_offset(p);
+        if (pid == d->video_pid && (p[1] & 0x40) && po >= 0) {
+            int64_t pts;
+            int total;
+            if (pes_parse_header(&p[po], TS_PACKET_SIZE - po, &pts, &total) < 0 || pts == AV_NOPTS_VALUE)
+                continue;
+            /* B-frames are not in pts order */
+            if (pr->first_pts == AV_NOPTS_VALUE || pts < pr->first_pts)
+                pr->first_pts = pts;
+            if (pr->last_pts == AV_NOPTS_VALUE || pts > pr->last_pts)
+                pr->last_pts = pts;
+        }
+    }
+}
+
+static bool fast_probe(struct tsdecode *tsd)
+{
+    struct ts_probe head = { AV_NOPTS_VALUE, AV_NOPTS_VALUE, AV_NOPTS_VALUE, AV_NOPTS_VALUE }, tail = head;
+    struct ts_demux d;
+    int64_t origin, end;
+    bool ok = false;
+    uint8_t *buf;
+    size_t n;
+    FILE *f;
+
+    f = pfopen(tsd->fpath, PSTR("rb"));
+    if (f == NULL)
+        return false;
+    buf = malloc(FAST_PROBE_SIZE);
+    assert(buf);
+    ts_demux_init(&d, tsd, NULL, NULL);
+
+    n = fread(buf, 1, FAST_PROBE_SIZE, f);
+    probe_scan(&d, buf, n, &head);
+    if (d.caption_pid == -1) {
+        log_info("Fast probe found no caption stream in the PMT\n");
+        goto end;
+    }
+
+    if (tsd->file_size > FAST_PROBE_SIZE && pfseeko(f, tsd->file_size - FAST_PROBE_SIZE, SEEK_SET) == 0) {
+        n = fread(buf, 1, FAST_PROBE_SIZE, f);
+        probe_scan(&d, buf, n, &tail);
+    } else {
+        tail = head;
+    }
+
+    if (head.first_pts != AV_NOPTS_VALUE && tail.last_pts != AV_NOPTS_VALUE) {
+        origin = head.first_pts;
+        end = tail.last_pts;
+    } else if (head.first_pcr != AV_NOPTS_VALUE && tail.last_pcr != AV_NOPTS_VALUE) {
+        log_info("Fast probe found no video pts, using the PCR\n");
+        origin = head.first_pcr;
+        end = tail.last_pcr;
+    } else {
+        log_info("Fast probe found no time origin\n");
+        goto end;
+    }
+
+    tsd->caption_pid = d.caption_pid;
+    tsd->time_origin = origin;
+    tsd->duration_ms = av_rescale_q(ts_unwrap(end, origin) - origin, TS_TIME_BASE, (AVRational){1, 1000});
+    log_info("Fast probe found caption PID 0x%X, video PID 0x%X\n", d.caption_pid, d.video_pid);
+    ok = true;
+end:
+    ts_demux_free(&d);
+    free(buf);
+    fclose(f);
+    return ok;
+}
+
+/* Read the file from the start until the caption PID is found in the PMT */
+static enum error find_caption_pid(struct tsdecode *tsd)
+{
+    struct ts_probe pr = { AV_NOPTS_VALUE, AV_NOPTS_VALUE, AV_NOPTS_VALUE, AV_NOPTS_VALUE };
+    struct ts_demux d;
+    enum error err = NOERR;
+    uint8_t *buf;
+    size_t n;
+    FILE *f;
+
+    f = pfopen(tsd->fpath, PSTR("rb"));
+    if (f == NULL) {
+        err = -errno;
+        log_error("Failed to open file %s: %s\n", tsd->fpath, error_to_string(err));
+        return err;
+    }
+    buf = malloc(FAST_PROBE_SIZE);
+    assert(buf);
+    ts_demux_init(&d, tsd, NULL, NULL);
+
+    /* Packets split between the reads are lost, but the PAT and PMT repeat */
+    while (d.caption_pid == -1 && (n = fread(buf, 1, FAST_PROBE_SIZE, f)) > 0)
+        probe_scan(&d, buf, n, &pr);
+
+    if (d.caption_pid == -1) {
+        log_error("No caption PID was found in the PMT\n");
+        err = ERR_NO_CAPTION_STREAM;
+    } else {
+        tsd->caption_pid = d.caption_pid;
+    }
+
+    ts_demux_free(&d);
+    free(buf);
+    fclose(f);
+    return err;
+}
+
+static enum error decode_packets(struct tsdecode *tsd, tsdecode_decode_packets_cb cb, void *arg)
 {
     AVPacket   packet = {0};
     int        ret = 0;
     enum error err = NOERR;
 
+    if (tsd->streaming)
+        return decode_packets_native(tsd, cb, arg);
+    if (opt_native_demux) {
+        int64_t nranges = (opt_threads == 0) ? platform_cpu_count() : opt_threads;
+        nranges = MIN(nranges, tsd->file_size / TS_MIN_RANGE_SIZE);
+        if (nranges > 1)
+            return decode_packets_native_parallel(tsd, nranges, cb, arg);
+        return decode_packets_native(tsd, cb, arg);
+    }
+
     while ((ret = av_read_frame(tsd->avformat_context, &packet)) == 0) {
         if (packet.stream_index == tsd->caption_stream_idx) {
             AVStream* cap_stream = tsd->avformat_context->streams[tsd->caption_stream_idx];
-            AVStream* vid_stream = tsd->avformat_context->streams[tsd->video_stream_idx];
+            int64_t origin = av_rescale_q(tsd->time_origin, TS_TIME_BASE, cap_stream->time_base);
 
-            packet.pts = MAX(packet.pts - vid_stream->start_time, 0);
-            packet.dts = MAX(packet.dts - vid_stream->start_time, 0);
+            packet.pts = MAX(packet.pts - origin, 0);
+            packet.dts = MAX(packet.dts - origin, 0);
             av_packet_rescale_ts(&packet, cap_stream->time_base, (AVRational){1, 1000});
 
             err = cb(&packet, arg);
@@ -191,9 +1159,75 @@ enum error tsdecode_decode_packets(struct tsdecode *tsd, tsdecode_decode_packets
     return ERR_LIBAV;
 }
 
+static enum error decode_packets_cache(struct tsdecode *tsd, tsdecode_decode_packets_cb cb, void *arg)
+{
+    AVPacket packet;
+    enum error err;
+
+    while ((err = pescache_reader_next(tsd->cache, &packet)) == NOERR && packet.size > 0) {
+        err = cb(&packet, arg);
+        if (err != NOERR)
+            break;
+    }
+    return err;
+}
+
+struct cache_write_ctx {
+    struct pescache_writer w;
+    enum error err;
+    tsdecode_decode_packets_cb cb;
+    void *arg;
+};
+
+static enum error cache_write_packet(AVPacket *packet, void *arg)
+{
+    struct cache_write_ctx *c = arg;
+
+    /* A failed cache write shouldn't fail the decoding */
+    if (c->err == NOERR)
+        c->err = pescache_writer_put(&c->w, packet);
+    return c->cb(packet, c->arg);
+}
+
+/* Decode the .ts file, and write the caption packets into the cache next to it */
+static enum error decode_packets_write_cache(struct tsdecode *tsd, tsdecode_decode_packets_cb cb, void *arg)
+{
+    struct pescache_info info = {
+        .time_origin = tsd->time_origin,
+        .duration_ms = tsd->duration_ms,
+    };
+    struct cache_write_ctx c = {
+        .cb = cb,
+        .arg = arg,
+    };
+    enum error err;
+
+    err = pescache_writer_open(&c.w, tsd->fpath, &info);
+    if (err != NOERR) {
+        log_warning("Failed to create the caption cache for %s: %s\n", tsd->fpath, error_to_string(err));
+        return decode_packets(tsd, cb, arg);
+    }
+
+    err = decode_packets(tsd, cache_write_packet, &c);
+    if (c.err != NOERR)
+        log_warning("Failed to write the caption cache %s: %s\n", c.w.path, error_to_string(c.err));
+    c.err = pescache_writer_finish(&c.w, err == NOERR && c.err == NOERR);
+    if (c.err != NOERR)
+        log_warning("Failed to write the caption cache %s: %s\n", c.w.path, error_to_string(c.err));
+    return err;
+}
+
+enum error tsdecode_decode_packets(struct tsdecode *tsd, tsdecode_decode_packets_cb cb, void *arg)
+{
+    if (tsd->cache)
+        return decode_packets_cache(tsd, cb, arg);
+    /* A stream can't be read again, so a cache would be of no use */
+    if (opt_pes_cache && tsd->streaming == false)
+        return decode_packets_write_cache(tsd, cb, arg);
+    return decode_packets(tsd, cb, arg);
+}
+
 time_t tsdecode_get_video_length(const struct tsdecode *tsd)
 {
-    const AVStream *stream = tsd->avformat_context->streams[tsd->video_stream_idx];
-    time_t d = stream->duration;
-    return av_rescale_q(d, stream->time_base, (AVRational){1, 1000});
+    return tsd->duration_ms;
 }
@@ -6,6 +6,8 @@
 #include <libavcodec/avcodec.h>
 
 #include "error.h"
+#include "tsinput.h"
+#include "pescache.h"
 
 struct tsdecode {
     /* The opened file by avformat */
@@ -13,15 +15,29 @@ struct tsdecode {
     /* The index of the ARIB caption stream in the file */
     int               caption_stream_idx, video_stream_idx;
     int64_t           file_size;
+    /* Path of the opened file. Used by the native demuxer */
+    const pchar      *fpath;
+    /* First video pts in 90kHz units. Caption times are relative to this */
+    int64_t           time_origin;
+    time_t            duration_ms;
+    /* PID of the caption stream if it was found by the fast probe or libavformat, or -1 */
+    int               caption_pid;
+    /* Reading stdin, a FIFO or a file with --follow, which has no size and can't be probed.
+     * time_origin is AV_NOPTS_VALUE, and found by the native demuxer */
+    bool              streaming;
 
-#ifdef _WIN32
+    /* The caption packets are read from this cache instead of the .ts, or NULL */
+    struct pescache_reader *cache;
+
+    /* The input read by libavformat */
     AVIOContext *ioc;
-    FILE *fh;
-#endif
+    struct ts_input in;
 };
 
 /*
- * Opens a .ts file for decoding.
+ * Opens a .ts file for decoding. A fpath of "-" reads stdin.
+ * A caption cache (.a2ac) can be opened in place of the .ts file, and with --cache
+ * the cache next to the .ts file is used, if it is up to date.
  * Returns a tsdecode struct if successfull
  * You need to call tsdecode_free()
  */
@@ -0,0 +1,388 @@
+#include "tsinput.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdalign.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
+#include "log.h"
+#include "opts.h"
+#include "util.h"
+
+/* The read backend reads this much at once */
+#define TS_INPUT_READ_SIZE ( TS_PACKET_SIZE * 32768 )
+/* The mmap backend gives out this much at once, so the consumed parts can be dropped while reading */
+#define TS_INPUT_MAP_WINDOW ( 64 * 1024 * 1024 )
+/* Drop the consumed parts from the page cache in steps this big */
+#define TS_INPUT_DROP_SIZE ( 64 * 1024 * 1024 )
+/* --follow without inotify, the polling interval doubles from min to max while the file doesn't grow */
+#define TS_INPUT_POLL_MIN_MS 10
+#define TS_INPUT_POLL_MAX_MS 1000
+/* --follow: after a writer closed the file, it ends if it doesn't grow for this long (or --follow-timeout if shorter) */
+#define TS_INPUT_CLOSED_IDLE_MS 5000
+
+static const pchar *backend_names[] = {
+    [TS_INPUT_MMAP] = PSTR("mmap"),
+    [TS_INPUT_READ] = PSTR("read"),
+};
+
+#ifdef __linux__
+static bool ts_input_map(struct ts_input *in)
+{
+    void *map;
+
+    /* Can't map an empty file */
+    if (in->size == 0)
+        return false;
+
+    map = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+    if (map == MAP_FAILED) {
+        log_debug("Failed to mmap %s, falling back to read(): %s\n", in->fpath, strerror(errno));
+        return false;
+    }
+    madvise(map, in->size, MADV_SEQUENTIAL);
+    in->map = map;
+    return true;
+}
+#endif
+
+/* madvise() needs a page aligned address, so the dropped part always ends at a page boundary */
+static int64_t page_floor(int64_t pos)
+{
+#ifdef __linux__
+    const int64_t page_size = sysconf(_SC_PAGESIZE);
+
+    return pos / page_size * page_size;
+#else
+    return pos;
+#endif
+}
+
+static int64_t ms_since(const struct ptimespec *t)
+{
+    struct ptimespec now;
+
+    PLATFORM_CURRENT_TIMESPEC(&now);
+    return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+static void ts_input_follow_start(struct ts_input *in)
+{
+    in->follow = true;
+    in->poll_ms = TS_INPUT_POLL_MIN_MS;
+    PLATFORM_CURRENT_TIMESPEC(&in->last_growth);
+
+#ifdef __linux__
+    in->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (in->notify_fd == -1) {
+        log_debug("Failed to init inotify, polling %s instead: %s\n", in->fpath, strerror(errno));
+        return;
+    }
+    if (inotify_add_watch(in->notify_fd, in->fpath, IN_MODIFY | IN_CLOSE_WRITE) == -1) {
+        log_debug("Failed to watch %s with inotify, polling instead: %s\n", in->fpath, strerror(errno));
+        close(in->notify_fd);
+        in->notify_fd = -1;
+    }
+#endif
+}
+
+#ifdef __linux__
+/* Wait for an inotify event. Returns false on a timeout */
+static bool ts_input_notify_wait(struct ts_input *in, int timeout_ms)
+{
+    alignas(struct inotify_event) char evbuf[4096];
+    struct pollfd pfd = { .fd = in->notify_fd, .events = POLLIN };
+    ssize_t n;
+
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+        return false;
+
+    while ((n = read(in->notify_fd, evbuf, sizeof(evbuf))) > 0) {
+        for (char *p = evbuf; p < evbuf + n; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct pstat st;
+
+            if ((((struct inotify_event*)p)->mask & IN_CLOSE_WRITE) && pfstat(in->fd, &st) == 0) {
+                in->writer_closed = true;
+                in->closed_size = st.st_size;
+                PLATFORM_CURRENT_TIMESPEC(&in->closed_time);
+            }
+        }
+    }
+    return true;
+}
+#endif
+
+/*
+ * --follow: called at the end of the file, wait until it grows.
+ * Returns false when it won't grow anymore: a writer closed it and it didn't grow after that,
+ * or it was idle for too long
+ */
+static bool ts_input_follow_wait(struct ts_input *in)
+{
+    int64_t idle_ms, timeout_ms = (int64_t)opt_follow_timeout * 1000;
+
+    idle_ms = ms_since(&in->last_growth);
+    if (idle_ms >= timeout_ms) {
+        log_info("%s didn't grow for %d seconds, stopping\n", in->fpath, opt_follow_timeout);
+        return false;
+    }
+
+    /*
+     * The close can be from another program that only opened it for a moment,
+     * or the recorder reopens the file, so it only ends if nothing is added for a while.
+     * What was read after the close event can still be from before it, so only
+     * a file bigger than at the close means that it is still written
+     */
+    if (in->writer_closed) {
+        struct pstat st;
+
+        if (pfstat(in->fd, &st) == 0 && st.st_size > in->closed_size)
+            in->writer_closed = false;
+    }
+    if (in->writer_closed) {
+        int64_t closed_ms = ms_since(&in->closed_time), closed_timeout_ms = MIN(TS_INPUT_CLOSED_IDLE_MS, timeout_ms);
+
+        if (closed_ms >= closed_timeout_ms) {
+            log_info("The writer closed %s\n", in->fpath);
+            return false;
+        }
+        timeout_ms = idle_ms + closed_timeout_ms - closed_ms;
+    }
+
+#ifdef __linux__
+    if (in->notify_fd != -1) {
+        /* Even on a timeout, the next call checks the idle time */
+        ts_input_notify_wait(in, timeout_ms - idle_ms);
+        return true;
+    }
+#endif
+    platform_sleep_ms(MIN(in->poll_ms, timeout_ms - idle_ms));
+    in->poll_ms = MIN(in->poll_ms * 2, TS_INPUT_POLL_MAX_MS);
+    return true;
+}
+
+enum error ts_input_open(struct ts_input *in, const pchar *fpath, int64_t pos)
+{
+    enum error err;
+    struct pstat st;
+    bool is_stdin = (pstrcmp(fpath, PSTR("-")) == 0);
+    int fd;
+
+    if (is_stdin) {
+        fd = fileno(stdin);
+        platform_set_binary(stdin);
+    } else {
+        fd = plopen(fpath, O_RDONLY | _O_BINARY);
+    }
+    if (fd == -1) {
+        err = -errno;
+        log_error("Failed to open file %s: %s\n", fpath, error_to_string(err));
+        return err;
+    }
+    if (pfstat(fd, &st) != 0) {
+        err = -errno;
+        log_error("Failed to stat file %s: %s\n", fpath, error_to_string(err));
+        if (is_stdin == false)
+            plclose(fd);
+        return err;
+    }
+
+    *in = (struct ts_input){
+        .backend = TS_INPUT_READ,
+        .fpath = fpath,
+        .fd = fd,
+        .owns_fd = (is_stdin == false),
+        .regular = S_ISREG(st.st_mode),
+        /* A pipe has no size, it ends when the writer closes it */
+        .size = S_ISREG(st.st_mode) ? st.st_size : 0,
+        .pos = pos,
+        .dropped = page_floor(pos),
+        .start_pos = pos,
+        .notify_fd = -1,
+    };
+    PLATFORM_CURRENT_TIMESPEC(&in->start_time);
+    if (opt_follow && in->regular)
+        ts_input_follow_start(in);
+
+    in->buf = malloc(TS_INPUT_READ_SIZE);
+    assert(in->buf);
+    if (in->regular == false) {
+        /* Can't seek, so only the start is supported */
+        if (pos == 0)
+            return NOERR;
+        ts_input_close(in);
+        return -ESPIPE;
+    }
+
+#ifdef __linux__
+    /* A growing file can't be mapped */
+    if (opt_input_mmap && in->follow == false && ts_input_map(in)) {
+        free(in->buf);
+        in->buf = NULL;
+        in->backend = TS_INPUT_MMAP;
+        return NOERR;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    err = ts_input_seek(in, pos);
+    if (err != NOERR)
+        ts_input_close(in);
+    return err;
+}
+
+void ts_input_close(struct ts_input *in)
+{
+    struct ptimespec now;
+    int64_t ms, bytes = in->pos - in->start_pos;
+
+    PLATFORM_CURRENT_TIMESPEC(&now);
+    ms = (now.tv_sec - in->start_time.tv_sec) * 1000 + (now.tv_nsec - in->start_time.tv_nsec) / 1000000;
+    if (bytes > 0)
+        log_info("Read %.1f MiB with %s in %" PRIi64 " ms (%.1f MiB/s)\n", bytes / (1024.0 * 1024.0),
+                backend_names[in->backend], ms, (bytes / (1024.0 * 1024.0)) / (MAX(ms, 1) / 1000.0));
+
+#ifdef __linux__
+    if (in->map)
+        munmap(in->map, in->size);
+#endif
+    free(in->buf);
+    if (in->fd != -1 && in->owns_fd)
+        plclose(in->fd);
+#ifdef __linux__
+    if (in->notify_fd != -1)
+        close(in->notify_fd);
+#endif
+    memset(in, 0, sizeof(*in));
+    in->fd = -1;
+    in->notify_fd = -1;
+}
+
+/* Tell the kernel, that the already consumed part of the file won't be needed again */
+static void ts_input_drop_consumed(struct ts_input *in)
+{
+#ifdef __linux__
+    int64_t end = page_floor(in->pos);
+
+    if (in->regular == false || end - in->dropped < TS_INPUT_DROP_SIZE)
+        return;
+    if (in->map)
+        madvise(in->map + in->dropped, end - in->dropped, MADV_DONTNEED);
+    posix_fadvise(in->fd, in->dropped, end - in->dropped, POSIX_FADV_DONTNEED);
+    in->dropped = end;
+#endif
+}
+
+static enum error ts_input_fill(struct ts_input *in)
+{
+    size_t have = in->buf_end - in->buf_start;
+
+    memmove(in->buf, &in->buf[in->buf_start], have);
+    in->buf_start = 0;
+    in->buf_end = have;
+
+    /* Network filesystems can return less than asked for */
+    while (in->buf_end < TS_INPUT_READ_SIZE) {
+        ssize_t r = plread(in->fd, &in->buf[in->buf_end], TS_INPUT_READ_SIZE - in->buf_end);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            enum error err = -errno;
+            log_error("Failed to read file %s: %s\n", in->fpath, error_to_string(err));
+            return err;
+        }
+        if (r == 0) {
+            if (in->follow) {
+                /* Hand out what is there, and only wait when it isn't a whole packet */
+                if (in->buf_end >= TS_PACKET_SIZE)
+                    break;
+                if (ts_input_follow_wait(in))
+                    continue;
+            }
+            in->eof = true;
+            break;
+        }
+        if (in->follow) {
+            PLATFORM_CURRENT_TIMESPEC(&in->last_growth);
+            in->poll_ms = TS_INPUT_POLL_MIN_MS;
+        }
+        in->buf_end += r;
+        /* Don't wait for a full buffer on a live stream */
+        if (in->regular == false && in->buf_end >= TS_PACKET_SIZE)
+            break;
+    }
+    return NOERR;
+}
+
+enum error ts_input_next(struct ts_input *in, const uint8_t **out_data, size_t *out_len)
+{
+    if (in->backend == TS_INPUT_MMAP) {
+        *out_data = &in->map[in->pos];
+        *out_len = MIN(in->size - in->pos, TS_INPUT_MAP_WINDOW);
+        return NOERR;
+    }
+
+    if (in->buf_end - in->buf_start < TS_PACKET_SIZE && in->eof == false) {
+        enum error err = ts_input_fill(in);
+        if (err != NOERR)
+            return err;
+    }
+    *out_data = &in->buf[in->buf_start];
+    *out_len = in->buf_end - in->buf_start;
+    return NOERR;
+}
+
+void ts_input_consume(struct ts_input *in, size_t n)
+{
+    in->pos += n;
+    if (in->backend == TS_INPUT_READ)
+        in->buf_start += n;
+    ts_input_drop_consumed(in);
+}
+
+enum error ts_input_seek(struct ts_input *in, int64_t pos)
+{
+    if (in->regular == false)
+        return pos == in->pos ? NOERR : -ESPIPE;
+    if (pos < 0 || pos > in->size)
+        return -EINVAL;
+
+    if (in->backend == TS_INPUT_READ) {
+        if (plseek(in->fd, pos, SEEK_SET) == -1) {
+            enum error err = -errno;
+            log_error("Failed to seek in file %s: %s\n", in->fpath, error_to_string(err));
+            return err;
+        }
+        in->buf_start = in->buf_end = 0;
+        in->eof = false;
+    }
+    in->pos = pos;
+    in->dropped = MIN(in->dropped, page_floor(pos));
+    return NOERR;
+}
+
+enum error ts_input_read(struct ts_input *in, uint8_t *out, size_t size, size_t *out_read)
+{
+    const uint8_t *data;
+    size_t len;
+    enum error err;
+
+    err = ts_input_next(in, &data, &len);
+    if (err != NOERR)
+        return err;
+
+    len = MIN(len, size);
+    memcpy(out, data, len);
+    ts_input_consume(in, len);
+    *out_read = len;
+    return NOERR;
+}
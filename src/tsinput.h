@@ -0,0 +1,86 @@
+#ifndef ARIB2ASS_TSINPUT_H
+#define ARIB2ASS_TSINPUT_H
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "error.h"
+#include "platform.h"
+
+#define TS_PACKET_SIZE 188
+
+enum ts_input_backend {
+    /* Map the whole file, and give out pointers into the mapping. Linux only */
+    TS_INPUT_MMAP,
+    /* read() big chunks into a buffer. Better for network filesystems */
+    TS_INPUT_READ,
+};
+
+/*
+ * Sequential reader for the input .ts file.
+ * Consumed parts of the file are dropped from the page cache on Linux,
+ * so reading big recordings doesn't evict everything else from it.
+ */
+struct ts_input {
+    enum ts_input_backend backend;
+    const pchar *fpath;
+    int fd;
+    /* Not set for stdin */
+    bool owns_fd;
+    /* Not a pipe or a device, so it can be seeked and mapped */
+    bool regular;
+    /* 0 if not regular */
+    int64_t size;
+    /* File position of the data returned by ts_input_next() */
+    int64_t pos;
+    /* Everything before this was already dropped from the page cache */
+    int64_t dropped;
+
+    /* TS_INPUT_MMAP */
+    uint8_t *map;
+
+    /* TS_INPUT_READ, the data at pos is at buf[buf_start] */
+    uint8_t *buf;
+    size_t buf_start, buf_end;
+    bool eof;
+
+    /* --follow, wait at the end of the file for it to grow */
+    bool follow;
+    /* A writer closed the file at closed_time, when it was closed_size big */
+    bool writer_closed;
+    int64_t closed_size;
+    struct ptimespec closed_time;
+    /* inotify watch of the file, or -1 when polling */
+    int notify_fd;
+    int poll_ms;
+    struct ptimespec last_growth;
+
+    /* For the throughput report */
+    int64_t start_pos;
+    struct ptimespec start_time;
+};
+
+/*
+ * Open fpath, and start reading it at pos. Uses the mmap backend unless --no-mmap was given.
+ * A fpath of "-" reads stdin, pipes can only be read from the start.
+ * With --follow, the end of a regular file is only reached when a writer closed it and it didn't grow
+ * for a few seconds after that, or it didn't grow for --follow-timeout seconds.
+ */
+enum error ts_input_open(struct ts_input *in, const pchar *fpath, int64_t pos);
+/* Close, and report the throughput in verbose mode */
+void ts_input_close(struct ts_input *in);
+
+/*
+ * Get the unconsumed data from the file position in->pos.
+ * The data is valid until the next ts_input_* call.
+ * *out_len is less than a TS packet only at the end of the file.
+ */
+enum error ts_input_next(struct ts_input *in, const uint8_t **out_data, size_t *out_len);
+/* Mark n bytes from the data returned by ts_input_next() as used */
+void ts_input_consume(struct ts_input *in, size_t n);
+enum error ts_input_seek(struct ts_input *in, int64_t pos);
+
+/* Copy at most size bytes to out. Returns the number of bytes copied, or 0 at the end of the file */
+enum error ts_input_read(struct ts_input *in, uint8_t *out, size_t size, size_t *out_read);
+
+#endif /* ARIB2ASS_TSINPUT_H */
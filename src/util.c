@@ -102,29 +102,6 @@ void arrmovelem(void *arr, intptr_t elem_idx, intptr_t to_idx, size_t elem_size)
     memcpy(to_ptr, tmp, elem_size);
 }
 
-const char *sftext_format(struct sftext *sf, float f)
-{
-    int w;
-    char *start, *end;
-
-    start = &sf->buf[sf->idx];
-    w = snprintf(start, sizeof(sf->buf) - sf->idx, "%.02f", f);
-    sf->idx += w;
-    assert(sf->idx < sizeof(sf->buf));
-
-    end = &sf->buf[sf->idx - 1];
-    while (*end == '0') {
-        end--;
-        sf->idx--;
-    }
-    if (*end != '.') {
-        end++;
-        sf->idx++;
-    }
-    *end = '\0';
-    return start;
-}
-
 struct rect {
     int x, y, w, h;
 };
@@ -171,7 +148,7 @@ const struct subobj_caption_region *util_main_so_region_for_ruby(const struct su
     return NULL;
 }
 
-const aribcc_caption_region_t *util_main_region_for_ruby(const aribcc_caption_t *caption, const aribcc_caption_region_t *ruby)
+const struct subobj_ref_region *util_main_region_for_ruby(const struct subobj_ref_caption *caption, const struct subobj_ref_region *ruby)
 {
     assert(ruby->is_ruby);
     struct rect r_region, r_ruby;
@@ -181,7 +158,7 @@ const aribcc_caption_region_t *util_main_region_for_ruby(const aribcc_caption_t
         .w = ruby->width, .h = ruby->height,
     };
     for (int i = 0; i < caption->region_count; i++) {
-        const aribcc_caption_region_t *region = &caption->regions[i];
+        const struct subobj_ref_region *region = &caption->regions[i];
 
         if (region->is_ruby == true)
             continue;
@@ -249,7 +226,7 @@ int util_find_chars_for_furi(const struct subobj *so, struct chars_for_furi_resu
     int out_idx = 0, ruby_count = 0;
 
     for (int i = 0; i < so->caption_ref.region_count; i++) {
-        const aribcc_caption_region_t *ruby, *region;
+        const struct subobj_ref_region *ruby, *region;
         int span_start = -1, span_end = -1;
 
         ruby = &so->caption_ref.regions[i]; 
@@ -260,7 +237,7 @@ int util_find_chars_for_furi(const struct subobj *so, struct chars_for_furi_resu
         region = util_main_region_for_ruby(&so->caption_ref, ruby);
         assert(region);
         for (int c = 0; c < region->char_count; c++) {
-            const aribcc_caption_char_t *chr = &region->chars[c];
+            const struct subobj_ref_char *chr = &region->chars[c];
 
             int cw = (chr->char_width + chr->char_horizontal_spacing) * chr->char_horizontal_scale;
             if (ruby->x >= chr->x && ruby->x < chr->x + cw) {
@@ -22,6 +22,7 @@
 #define H_IN_MS (M_IN_MS * 60)
 #define nnfree(x) if (x != NULL) free((void*)x)
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 #define arrendptr(ds_arr) (&ds_arr[arrlen(ds_arr)])
 
@@ -38,20 +39,8 @@ char32_t utf8_to_unicode(const char *u8);
 
 void arrmovelem(void *arr, intptr_t elem_idx, intptr_t to_idx, size_t elem_size);
 
-/* Short Float Text Format
- * Format a float value into text by 
- * only giving at most 2 decimal places of
- * precision, and stripping extra 0s */
-struct sftext {
-    size_t idx;
-    char buf[4096];
-};
-const char *sftext_format(struct sftext *sf, float f);
-#define sftf_init() struct sftext __sft; __sft.idx = 0
-#define sftf(f) sftext_format(&__sft, f)
-
 const struct subobj_caption_region *util_main_so_region_for_ruby(const struct subobj_caption *caption, const struct subobj_caption_region *ruby);
-const aribcc_caption_region_t *util_main_region_for_ruby(const aribcc_caption_t *caption, const aribcc_caption_region_t *ruby);
+const struct subobj_ref_region *util_main_region_for_ruby(const struct subobj_ref_caption *caption, const struct subobj_ref_region *ruby);
 
 /* Find the corresponding chars for all furigana text in a caption
  * Return results in a chars_for_furi_result array,
@@ -59,7 +48,7 @@ const aribcc_caption_region_t *util_main_region_for_ruby(const aribcc_caption_t
  * Return the number of out results array filled in */
 #define MAX_FURI_REGIONS 16
 struct chars_for_furi_result {
-    const aribcc_caption_region_t *furi_region, *chars_region;
+    const struct subobj_ref_region *furi_region, *chars_region;
     int chars_span_from, chars_span_to;
 };
 int util_find_chars_for_furi(const struct subobj *so, struct chars_for_furi_result out_res[MAX_FURI_REGIONS]);
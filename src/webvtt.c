@@ -0,0 +1,253 @@
+#include "webvtt.h"
+#include "util.h"
+#include "opts.h"
+#include "tagtext.h"
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+/* The color classes every WebVTT renderer knows. White is the default, so it is not written */
+static const struct {
+    const char *name;
+    uint8_t r, g, b;
+} vtt_colors[] = {
+    { "lime",    0x00, 0xff, 0x00 },
+    { "cyan",    0x00, 0xff, 0xff },
+    { "red",     0xff, 0x00, 0x00 },
+    { "yellow",  0xff, 0xff, 0x00 },
+    { "magenta", 0xff, 0x00, 0xff },
+    { "blue",    0x00, 0x00, 0xff },
+    { "black",   0x00, 0x00, 0x00 },
+};
+
+/* The inline tags, in the order they are opened */
+enum vtt_tag {
+    VTT_TAG_COLOR,
+    VTT_TAG_BOLD,
+    VTT_TAG_ITALIC,
+    VTT_TAG_UNDERLINE,
+    VTT_TAG_COUNT_,
+};
+
+struct vtt_writer {
+    /* The furigana of the current caption */
+    struct chars_for_furi_result rubys[MAX_FURI_REGIONS];
+    int rubylen;
+    /* Lines written in the current cue */
+    int line_count;
+
+    /* The current region, NULL if it is not written */
+    const struct subobj_ref_region *region;
+    int chr_count;
+    bool line_started;
+
+    /* What the styles of the next char want, and what is open in the output.
+     * For VTT_TAG_COLOR the index of vtt_colors + 1, or 0 for none */
+    int want_tags[VTT_TAG_COUNT_], open_tags[VTT_TAG_COUNT_];
+};
+
+static int color_class(uint32_t color)
+{
+    for (int i = 0; i < ARRAY_COUNT(vtt_colors); i++) {
+        if (vtt_colors[i].r == ARIBCC_COLOR_R(color) && vtt_colors[i].g == ARIBCC_COLOR_G(color) &&
+                vtt_colors[i].b == ARIBCC_COLOR_B(color))
+            return i + 1;
+    }
+    return 0;
+}
+
+static void put_escaped(const char *str, struct outbuf *ob)
+{
+    for (; *str; str++) {
+        switch (*str) {
+            case '&':
+                outbuf_puts(ob, "&amp;");
+                break;
+            case '<':
+                outbuf_puts(ob, "&lt;");
+                break;
+            case '>':
+                outbuf_puts(ob, "&gt;");
+                break;
+            default:
+                outbuf_putc(ob, *str);
+                break;
+        }
+    }
+}
+
+/* Tags are closed from the last opened one down to from, so they stay properly nested */
+static void close_tags(struct vtt_writer *vw, int from, struct outbuf *ob)
+{
+    static const char *close[] = {
+        [VTT_TAG_COLOR] = "</c>",
+        [VTT_TAG_BOLD] = "</b>",
+        [VTT_TAG_ITALIC] = "</i>",
+        [VTT_TAG_UNDERLINE] = "</u>",
+    };
+
+    for (int i = VTT_TAG_COUNT_ - 1; i >= from; i--) {
+        if (vw->open_tags[i]) {
+            outbuf_puts(ob, close[i]);
+            vw->open_tags[i] = 0;
+        }
+    }
+}
+
+/* Only the tags after the first changed one are reopened */
+static void sync_tags(struct vtt_writer *vw, struct outbuf *ob)
+{
+    static const char *open[] = {
+        [VTT_TAG_BOLD] = "<b>",
+        [VTT_TAG_ITALIC] = "<i>",
+        [VTT_TAG_UNDERLINE] = "<u>",
+    };
+    int first = 0;
+
+    while (first < VTT_TAG_COUNT_ && vw->want_tags[first] == vw->open_tags[first])
+        first++;
+    if (first == VTT_TAG_COUNT_)
+        return;
+
+    close_tags(vw, first, ob);
+    for (int i = first; i < VTT_TAG_COUNT_; i++) {
+        if (vw->want_tags[i] == 0)
+            continue;
+        if (i == VTT_TAG_COLOR) {
+            outbuf_puts(ob, "<c.");
+            outbuf_puts(ob, vtt_colors[vw->want_tags[i] - 1].name);
+            outbuf_putc(ob, '>');
+        } else {
+            outbuf_puts(ob, open[i]);
+        }
+        vw->open_tags[i] = vw->want_tags[i];
+    }
+}
+
+static enum error vtt_begin(void *state, struct outbuf *ob, const struct subobj_ctx *sctx, const void *opts, int threads)
+{
+    outbuf_puts(ob, "WEBVTT\n\n");
+    return NOERR;
+}
+
+static enum error vtt_caption_begin(void *state, struct outbuf *ob, const struct writer_caption *wc)
+{
+    struct vtt_writer *vw = state;
+
+    outbuf_time(ob, wc->s->start_ms, 2, '.', 3);
+    outbuf_puts(ob, " --> ");
+    outbuf_time(ob, wc->s->end_ms, 2, '.', 3);
+    outbuf_putc(ob, '\n');
+
+    vw->line_count = 0;
+    vw->rubylen = 0;
+    if (opt_vtt_ruby) {
+        vw->rubylen = util_find_chars_for_furi(wc->s, vw->rubys);
+    }
+    return NOERR;
+}
+
+static void vtt_region_begin(void *state, struct outbuf *ob, const struct writer_caption *wc, intptr_t region_idx)
+{
+    struct vtt_writer *vw = state;
+    const struct subobj_caption_region *region = &wc->ttc->so_caption->so_regions[region_idx];
+
+    vw->region = region->ref->is_ruby ? NULL : region->ref;
+    vw->chr_count = 0;
+    vw->line_started = false;
+    memset(vw->want_tags, 0, sizeof(vw->want_tags));
+}
+
+static void update_want_tags(struct vtt_writer *vw, const struct tagtext_event *ev)
+{
+    switch (ev->style) {
+        case TT_STYLE_TEXT_COLOR:
+            vw->want_tags[VTT_TAG_COLOR] = color_class(ev->style_value_u32);
+            break;
+        case TT_STYLE_BOLD:
+            vw->want_tags[VTT_TAG_BOLD] = ev->style_value_bool;
+            break;
+        case TT_STYLE_ITALIC:
+            vw->want_tags[VTT_TAG_ITALIC] = ev->style_value_bool;
+            break;
+        case TT_STYLE_UNDERLINE:
+            vw->want_tags[VTT_TAG_UNDERLINE] = ev->style_value_bool;
+            break;
+        default:
+            break;
+    }
+}
+
+static void vtt_event(void *state, struct outbuf *ob, const struct tagtext_event *event)
+{
+    struct vtt_writer *vw = state;
+
+    if (vw->region == NULL)
+        return;
+
+    if (event->type == TT_EVENT_TYPE_STYLE) {
+        if (opt_vtt_tags)
+            update_want_tags(vw, event);
+        return;
+    }
+
+    if (vw->line_started == false) {
+        /* Empty lines would end the cue, so lines are only started with a char */
+        if (vw->line_count > 0)
+            outbuf_putc(ob, '\n');
+        vw->line_count++;
+        vw->line_started = true;
+    }
+
+    for (int fi = 0; fi < vw->rubylen; fi++) {
+        if (vw->rubys[fi].chars_region == vw->region && vw->rubys[fi].chars_span_from == vw->chr_count) {
+            close_tags(vw, 0, ob);
+            outbuf_puts(ob, "<ruby>");
+        }
+    }
+
+    sync_tags(vw, ob);
+    put_escaped(event->ref_so_chr->ref->u8str, ob);
+
+    for (int fi = 0; fi < vw->rubylen; fi++) {
+        const struct chars_for_furi_result *furi = &vw->rubys[fi];
+
+        if (furi->chars_region == vw->region && furi->chars_span_to == vw->chr_count) {
+            close_tags(vw, 0, ob);
+            outbuf_puts(ob, "<rt>");
+            for (uint32_t c = 0; c < furi->furi_region->char_count; c++) {
+                put_escaped(furi->furi_region->chars[c].u8str, ob);
+            }
+            outbuf_puts(ob, "</rt></ruby>");
+        }
+    }
+
+    vw->chr_count++;
+}
+
+static void vtt_region_end(void *state, struct outbuf *ob)
+{
+    struct vtt_writer *vw = state;
+
+    if (vw->line_started)
+        close_tags(vw, 0, ob);
+}
+
+static enum error vtt_caption_end(void *state, struct outbuf *ob, const struct writer_caption *wc)
+{
+    struct vtt_writer *vw = state;
+
+    outbuf_puts(ob, vw->line_count > 0 ? "\n\n" : "\n");
+    return NOERR;
+}
+
+const struct writer_ops vtt_writer_ops = {
+    .name = "vtt",
+    .state_size = sizeof(struct vtt_writer),
+    .begin = vtt_begin,
+    .caption_begin = vtt_caption_begin,
+    .region_begin = vtt_region_begin,
+    .event = vtt_event,
+    .region_end = vtt_region_end,
+    .caption_end = vtt_caption_end,
+};
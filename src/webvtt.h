@@ -0,0 +1,11 @@
+#ifndef A2AC_WEBVTT_H
+#define A2AC_WEBVTT_H
+#include "writer.h"
+
+/*
+ * Writes the base tagtext of the captions as WebVTT cues, one line for each region.
+ * Can be used for streaming
+ */
+extern const struct writer_ops vtt_writer_ops;
+
+#endif /* A2AC_WEBVTT_H */
@@ -0,0 +1,312 @@
+#include "writer.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stb_ds.h"
+#include "log.h"
+#include "util.h"
+#include "font.h"
+
+enum error writer_set_add(struct writer_set *ws, const struct writer_ops *ops, const void *opts, const pchar *filepath)
+{
+    struct writer w = {
+        .ops = ops,
+        .opts = opts,
+        .threads = 1,
+    };
+    int fd;
+
+    if (pstrcmp(filepath, PSTR("-")) == 0) {
+        /* Nothing else is written to stdout through its FILE, so it needs no flushing */
+        platform_set_binary(stdout);
+        fd = fileno(stdout);
+    } else {
+        fd = plopen(filepath, O_WRONLY | O_CREAT | O_TRUNC | _O_BINARY, 0644);
+        if (fd < 0)
+            return -errno;
+    }
+
+    w.ob.fd = fd;
+    psnprintf(w.path, ARRAY_COUNT(w.path) * sizeof(pchar), PSTR("%s"), filepath);
+    w.state = calloc(1, MAX(ops->state_size, 1));
+    assert(w.state);
+    arrput(ws->writers, w);
+    return NOERR;
+}
+
+/* Written from this thread, and had no error yet */
+static bool writer_active(const struct writer *w)
+{
+    return w->threaded == false && w->err == NOERR;
+}
+
+/* NOERR while a sink of this thread is still written, otherwise the error of one of them */
+static enum error writer_set_status(const struct writer_set *ws)
+{
+    enum error err = NOERR;
+
+    for (intptr_t i = 0; i < arrlen(ws->writers); i++) {
+        const struct writer *w = &ws->writers[i];
+
+        if (w->threaded)
+            continue;
+        if (w->err == NOERR)
+            return NOERR;
+        err = w->err;
+    }
+    return err;
+}
+
+enum error writer_set_begin(struct writer_set *ws, const struct subobj_ctx *sctx)
+{
+    ws->streaming = sctx == NULL;
+    for (intptr_t i = 0; i < arrlen(ws->writers); i++) {
+        struct writer *w = &ws->writers[i];
+
+        if (writer_active(w) == false || w->ops->begin == NULL)
+            continue;
+        w->err = w->ops->begin(w->state, &w->ob, sctx, w->opts, w->threads);
+        if (w->err != NOERR)
+            log_error("Failed to start %s file: %s\n", w->ops->name, error_to_string(w->err));
+    }
+    return writer_set_status(ws);
+}
+
+static enum error write_caption(struct writer *w, const struct writer_caption *wc, bool flush)
+{
+    const struct writer_ops *ops = w->ops;
+    enum error err;
+
+    if (ops->caption_begin) {
+        err = ops->caption_begin(w->state, &w->ob, wc);
+        if (err != NOERR)
+            return err;
+    }
+
+    if (ops->region_begin || ops->event || ops->region_end) {
+        for (intptr_t ri = 0; ri < arrlen(wc->ttc->tagtexts); ri++) {
+            const struct tagtext *tt = &wc->ttc->tagtexts[ri];
+
+            if (ops->region_begin)
+                ops->region_begin(w->state, &w->ob, wc, ri);
+            if (ops->event) {
+                for (const struct tagtext_event *ev = tt->events; ev < arrendptr(tt->events); ev++)
+                    ops->event(w->state, &w->ob, ev);
+            }
+            if (ops->region_end)
+                ops->region_end(w->state, &w->ob);
+        }
+    }
+
+    if (ops->caption_end) {
+        err = ops->caption_end(w->state, &w->ob, wc);
+        if (err != NOERR)
+            return err;
+    }
+
+    /* Whoever reads the output wants the caption now */
+    if (flush)
+        return outbuf_flush(&w->ob);
+    return outbuf_flush_if_full(&w->ob);
+}
+
+enum error writer_set_caption(struct writer_set *ws, const struct subobj *s)
+{
+    struct tagtext_caption ttc;
+    struct writer_caption wc = {
+        .s = s,
+        .index = ws->caption_count++,
+        .ttc = &ttc,
+    };
+    enum error err = NOERR;
+    bool shared = false;
+
+    if (arrlen(s->so_caption.so_regions) == 0)
+        return NOERR;
+
+    /* Only parsed when a sink uses the shared tagtext */
+    for (intptr_t i = 0; i < arrlen(ws->writers); i++)
+        shared |= writer_active(&ws->writers[i]) && ws->writers[i].ops->independent == false;
+    if (shared) {
+        err = tagtext_parse_caption(s, NULL, &ws->tt_arena, &ttc);
+        if (err != NOERR)
+            log_error("Failed to parse caption: %s\n", error_to_string(err));
+    }
+    if (shared == false || err != NOERR)
+        wc.ttc = NULL;
+
+    for (intptr_t i = 0; i < arrlen(ws->writers); i++) {
+        struct writer *w = &ws->writers[i];
+
+        if (writer_active(w) == false)
+            continue;
+        if (w->ops->independent == false && wc.ttc == NULL) {
+            w->err = err;
+            continue;
+        }
+        w->err = write_caption(w, &wc, ws->streaming);
+        if (w->err != NOERR)
+            log_error("Failed to write %s caption: %s\n", w->ops->name, error_to_string(w->err));
+    }
+
+    arena_reset(&ws->tt_arena);
+    return writer_set_status(ws);
+}
+
+enum error writer_set_end(struct writer_set *ws)
+{
+    enum error err, ret = NOERR;
+
+    for (intptr_t i = 0; i < arrlen(ws->writers); i++) {
+        struct writer *w = &ws->writers[i];
+
+        if (w->threaded)
+            continue;
+        if (w->err != NOERR) {
+            ret = w->err;
+            continue;
+        }
+        err = w->ops->end ? w->ops->end(w->state, &w->ob) : NOERR;
+        if (err == NOERR)
+            err = outbuf_flush(&w->ob);
+        if (err != NOERR) {
+            log_error("Failed to finish %s file: %s\n", w->ops->name, error_to_string(err));
+            w->err = ret = err;
+        }
+    }
+    return ret;
+}
+
+void writer_set_close(struct writer_set *ws)
+{
+    for (intptr_t i = 0; i < arrlen(ws->writers); i++) {
+        struct writer *w = &ws->writers[i];
+
+        if (w->threaded == false && w->ops->destroy)
+            w->ops->destroy(w->state);
+        free(w->state);
+        if (w->ob.fd != fileno(stdout))
+            plclose(w->ob.fd);
+        outbuf_free(&w->ob);
+    }
+    arrfree(ws->writers);
+    arena_free(&ws->tt_arena);
+}
+
+/* An independent sink, written with its own pass over the captions */
+struct writer_thread {
+    struct writer *w;
+    const struct subobj_ctx *sctx;
+    struct platform_thread thread;
+    /* Messages of the thread, passed on to the log of the calling thread */
+    pchar stb_array *log;
+    enum error err;
+};
+
+static enum error write_all_alone(struct writer *w, const struct subobj_ctx *sctx)
+{
+    const struct writer_ops *ops = w->ops;
+    enum error err;
+
+    if (ops->begin) {
+        err = ops->begin(w->state, &w->ob, sctx, w->opts, w->threads);
+        if (err != NOERR) {
+            log_error("Failed to start %s file: %s\n", ops->name, error_to_string(err));
+            return err;
+        }
+    }
+
+    for (intptr_t i = 0; i < arrlen(sctx->subobjs); i++) {
+        const struct writer_caption wc = {
+            .s = &sctx->subobjs[i],
+            .index = i,
+        };
+
+        if (arrlen(wc.s->so_caption.so_regions) == 0)
+            continue;
+        err = write_caption(w, &wc, false);
+        if (err != NOERR) {
+            log_error("Failed to write %s caption: %s\n", ops->name, error_to_string(err));
+            return err;
+        }
+    }
+
+    err = ops->end ? ops->end(w->state, &w->ob) : NOERR;
+    if (err == NOERR)
+        err = outbuf_flush(&w->ob);
+    if (err != NOERR)
+        log_error("Failed to finish %s file: %s\n", ops->name, error_to_string(err));
+    return err;
+}
+
+static void writer_thread(void *arg)
+{
+    struct writer_thread *wt = arg;
+    struct writer *w = wt->w;
+
+    /* The sink may open fonts, that need a FreeType library on this thread,
+     * and must be freed before it */
+    log_buffer_begin();
+    font_init();
+    wt->err = write_all_alone(w, wt->sctx);
+    if (w->ops->destroy)
+        w->ops->destroy(w->state);
+    font_dinit();
+    wt->log = log_buffer_take();
+}
+
+enum error writer_set_write_all(struct writer_set *ws, const struct subobj_ctx *sctx, int cpus)
+{
+    struct writer_thread stb_array *threads = NULL;
+    bool first = true;
+    enum error err;
+
+    /*
+     * The first independent sink is written from this thread next to the others,
+     * only the ones after it (the extra .ass profiles) get their own threads
+     */
+    for (intptr_t i = 0; i < arrlen(ws->writers) && arrlen(threads) < cpus - 1; i++) {
+        struct writer *w = &ws->writers[i];
+
+        if (w->ops->independent == false)
+            continue;
+        if (first) {
+            first = false;
+            continue;
+        }
+        arrput(threads, ((struct writer_thread){ .w = w, .sctx = sctx }));
+    }
+    /* Each thread writing sinks, this one too, gets its share of the cpus for them.
+     * Set before the threads start, as they read it in begin */
+    for (intptr_t i = 0; i < arrlen(ws->writers); i++)
+        ws->writers[i].threads = MAX(cpus / (int)(arrlen(threads) + 1), 1);
+    for (intptr_t i = 0; i < arrlen(threads); i++) {
+        if (platform_thread_create(&threads[i].thread, writer_thread, &threads[i]) != 0) {
+            /* The rest is written here */
+            arrsetlen(threads, i);
+            break;
+        }
+        threads[i].w->threaded = true;
+    }
+
+    err = writer_set_begin(ws, sctx);
+    for (intptr_t i = 0; i < arrlen(sctx->subobjs) && err == NOERR; i++) {
+        err = writer_set_caption(ws, &sctx->subobjs[i]);
+    }
+    /* Finishes the sinks without errors, and returns the error of the others */
+    err = writer_set_end(ws);
+
+    for (intptr_t i = 0; i < arrlen(threads); i++) {
+        platform_thread_join(&threads[i].thread);
+        /* Into the buffer of the file, if -j is buffering this thread */
+        log_buffer_put(threads[i].log);
+        if (threads[i].err != NOERR && err == NOERR)
+            err = threads[i].err;
+    }
+    arrfree(threads);
+    return err;
+}
@@ -0,0 +1,107 @@
+#ifndef ARIB2ASS_WRITER_H
+#define ARIB2ASS_WRITER_H
+#include <stdint.h>
+
+#include "error.h"
+#include "arena.h"
+#include "subobj.h"
+#include "tagtext.h"
+#include "platform.h"
+#include "outbuf.h"
+
+/*
+ * Output formats are sinks, that are driven by a single traversal of the captions.
+ * The tagtext of every caption is parsed once, and the same events are given to all sinks.
+ * File mode: begin with all of the subobjs, every caption in order, then end.
+ * Stream mode: begin without subobjs, then each caption as soon as it is finished.
+ * The sinks write into an output buffer, that is written to the file after a caption
+ * when it is big enough, after every caption when streaming, and at the end.
+ */
+
+/* The caption currently being written */
+struct writer_caption {
+    const struct subobj *s;
+    /* Index of s in the subobjs given to begin, or the number of captions before it when streaming */
+    intptr_t index;
+    /* The tagtext of s->so_caption, shared by all sinks. NULL for independent sinks */
+    const struct tagtext_caption *ttc;
+};
+
+struct writer_ops {
+    /* For messages */
+    const char *name;
+    /* Size of the zeroed state given to the callbacks */
+    size_t state_size;
+    /*
+     * Only uses the subobjs and not the shared tagtext, so in file mode it can do
+     * its own pass over the captions on an other thread, next to the other sinks
+     */
+    bool independent;
+
+    /*
+     * All of them are optional.
+     * sctx has all captions of the file, or is NULL when streaming,
+     * opts is what was given to writer_set_add(). threads is how many
+     * threads the sink may use for its own work, the others are busy
+     * with the other sinks and files.
+     * Captions without any region are not given to the sinks.
+     */
+    enum error (*begin)(void *state, struct outbuf *ob, const struct subobj_ctx *sctx, const void *opts, int threads);
+    enum error (*caption_begin)(void *state, struct outbuf *ob, const struct writer_caption *wc);
+    /* Called for every region of wc->ttc, and every event of its tagtext */
+    void       (*region_begin)(void *state, struct outbuf *ob, const struct writer_caption *wc, intptr_t region_idx);
+    void       (*event)(void *state, struct outbuf *ob, const struct tagtext_event *ev);
+    void       (*region_end)(void *state, struct outbuf *ob);
+    enum error (*caption_end)(void *state, struct outbuf *ob, const struct writer_caption *wc);
+    enum error (*end)(void *state, struct outbuf *ob);
+    /* Free what is in the state, also after errors */
+    void       (*destroy)(void *state);
+};
+
+struct writer {
+    const struct writer_ops *ops;
+    const void *opts;
+    void *state;
+    /* Writes to the output file */
+    struct outbuf ob;
+    pchar path[256];
+    /* Written on its own thread by writer_set_write_all(), and already destroyed there */
+    bool threaded;
+    /* Given to begin, 1 unless writer_set_write_all() has more for it */
+    int threads;
+    /* The first error of the sink, nothing more is written to it after that */
+    enum error err;
+};
+
+struct writer_set {
+    struct writer stb_array *writers;
+    /* The shared tagtext of the current caption, reset after it is written */
+    struct arena tt_arena;
+    /* Flush the files after every caption */
+    bool streaming;
+    /* Captions given to writer_set_caption() so far */
+    intptr_t caption_count;
+};
+
+/* Open filepath for a sink, with the sink specific opts. A filepath of "-" writes to stdout */
+enum error writer_set_add(struct writer_set *ws, const struct writer_ops *ops, const void *opts, const pchar *filepath);
+
+/*
+ * A sink that fails is left out from then on, the others are still written.
+ * These return an error only when no sink is left, writer_set_end()
+ * returns the error of any sink that failed.
+ */
+enum error writer_set_begin(struct writer_set *ws, const struct subobj_ctx *sctx);
+enum error writer_set_caption(struct writer_set *ws, const struct subobj *s);
+enum error writer_set_end(struct writer_set *ws);
+/* Close the files and free the sinks */
+void       writer_set_close(struct writer_set *ws);
+
+/*
+ * File mode: begin, write all captions of sctx, end, using at most cpus threads.
+ * The independent sinks after the first one are written on their own threads,
+ * and the cpus are split between the threads writing the sinks
+ */
+enum error writer_set_write_all(struct writer_set *ws, const struct subobj_ctx *sctx, int cpus);
+
+#endif /* ARIB2ASS_WRITER_H */
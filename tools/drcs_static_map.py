@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""
+Check or regenerate static_replace_map in src/drcs.c.
+
+The map is a perfect hash: every entry has to be at the index static_slot()
+gives for its digest. This reads the entries from src/drcs.c, and
+
+    tools/drcs_static_map.py --check
+        verifies that each one is at its own slot, and that the digest
+        matches the md5 in its comment
+
+    tools/drcs_static_map.py [MD5=CODEPOINT ...]
+        adds the given entries (CODEPOINT as hex, like 1F4F1), searches for
+        a DRCS_STATIC_MULT without collisions if the current one has any,
+        and prints the defines and the table to paste into src/drcs.c
+"""
+import os
+import re
+import sys
+
+DRCS_C = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'src', 'drcs.c')
+MULT_SEARCH_LIMIT = 1 << 24
+
+ENTRY_RE = re.compile(r'^\s*\[\s*(\d+)\] = \{ \{\{ ([0-9a-fx, ]+) \}\}, 0x([0-9A-Fa-f]+) \}, /\* ([0-9a-f]{32}) \*/$')
+DEFINE_RE = re.compile(r'^#define (DRCS_STATIC_BITS|DRCS_STATIC_MULT) (\w+)$')
+
+
+def static_slot(digest, bits, mult):
+    # Same as static_slot() in src/drcs.c
+    k = int.from_bytes(digest[:4], 'little')
+    return ((k * mult) & 0xFFFFFFFF) >> (32 - bits)
+
+
+def read_map(path):
+    defines, entries = {}, []
+    with open(path) as f:
+        for line in f:
+            m = DEFINE_RE.match(line.rstrip())
+            if m:
+                defines[m.group(1)] = int(m.group(2).rstrip('u'), 0)
+                continue
+            m = ENTRY_RE.match(line.rstrip())
+            if m:
+                digest = bytes(int(b, 16) for b in m.group(2).split(','))
+                entries.append((int(m.group(1)), digest, int(m.group(3), 16), m.group(4)))
+    return defines['DRCS_STATIC_BITS'], defines['DRCS_STATIC_MULT'], entries
+
+
+def check(bits, mult, entries):
+    ok = True
+    for index, digest, _, md5 in entries:
+        if digest.hex() != md5:
+            print(f'[{index}] digest does not match its comment {md5}')
+            ok = False
+        slot = static_slot(digest, bits, mult)
+        if slot != index:
+            print(f'{md5} is at [{index}], but static_slot() gives [{slot}]')
+            ok = False
+    return ok
+
+
+def collision_free(digests, bits, mult):
+    return len({static_slot(d, bits, mult) for d in digests}) == len(digests)
+
+
+def generate(bits, mult, entries, extra):
+    values = {digest: value for _, digest, value, _ in entries}
+    for arg in extra:
+        md5, cp = arg.split('=')
+        values[bytes.fromhex(md5)] = int(cp, 16)
+
+    # Keep the current multiplier if it still works, else the smallest odd one that does,
+    # with one more bit if none below the limit does
+    digests = list(values)
+    while len(digests) > 1 << bits:
+        bits += 1
+    while collision_free(digests, bits, mult) is False:
+        mult = next((m for m in range(1, MULT_SEARCH_LIMIT, 2) if collision_free(digests, bits, m)), None)
+        if mult is None:
+            bits += 1
+            mult = 1
+
+    print(f'#define DRCS_STATIC_BITS {bits}')
+    print(f'#define DRCS_STATIC_MULT 0x{mult:X}u')
+    print('static const struct drcs_static_conv static_replace_map[1 << DRCS_STATIC_BITS] = {')
+    for digest in sorted(digests, key=lambda d: static_slot(d, bits, mult)):
+        index = static_slot(digest, bits, mult)
+        data = ', '.join(f'0x{b:02x}' for b in digest)
+        print(f'    [{index:2}] = {{ {{{{ {data} }}}}, 0x{values[digest]:X} }}, /* {digest.hex()} */')
+    print('};')
+
+
+def main():
+    bits, mult, entries = read_map(DRCS_C)
+    if len(sys.argv) > 1 and sys.argv[1] == '--check':
+        if check(bits, mult, entries) is False:
+            sys.exit(1)
+        print(f'{len(entries)} entries, all at their own slot')
+        return
+    generate(bits, mult, entries, sys.argv[1:])
+
+
+if __name__ == '__main__':
+    main()